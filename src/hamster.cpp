@@ -10,6 +10,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#include <pthread.h>
 #endif
 
 #include <x86intrin.h>
@@ -28,15 +29,29 @@
 
 #include "hamster_math.h"
 #include "hamster_util.h"
+#include "hamster_jobs.h"
+#include "hamster_transform.h"
 #include "hamster_graphics.h"
 #include "hamster_scene.h"
+#include "hamster_cull.h"
+#include "hamster_occlusion.h"
+#include "hamster_bvh.h"
+#include "hamster_broadphase.h"
+#include "hamster_bake.h"
 #include "hamster_render.h"
 #include "hamster.h"
 
 #include "hamster_math.cpp"
 #include "hamster_util.cpp"
+#include "hamster_jobs.cpp"
+#include "hamster_transform.cpp"
 #include "hamster_graphics.cpp"
 #include "hamster_scene.cpp"
+#include "hamster_cull.cpp"
+#include "hamster_occlusion.cpp"
+#include "hamster_bvh.cpp"
+#include "hamster_broadphase.cpp"
+#include "hamster_bake.cpp"
 #include "hamster_render.cpp"
 
 void
@@ -148,48 +163,49 @@ state_push_entity(ProgramState *state)
 {
     Entity *result = 0x0;
 
+    assert(state->entities_len < ENTITIES_MAX);
     result = &state->entities[state->entities_len++];
+    *result = {};
+    result->flags = ENTITY_FLAGS_TRANSFORM_DIRTY;
 
     return result;
 }
 
 static void
-sponge_divide(EntityInstanced *sponge)
+state_queue_entities(ProgramState *state, RenderQueue *rqueue, u32 *indices, u32 count)
 {
-    u32 old_instances_count = sponge->instances_count;
-    sponge->instances_count = old_instances_count * 20;
-
-    sponge->positions = (Vec3 *)realloc(sponge->positions, sponge->instances_count * sizeof(sponge->positions[0]));
-    sponge->sizes = (Vec3 *)realloc(sponge->sizes, sponge->instances_count * sizeof(sponge->sizes[0]));
-    sponge->rotations = (Quat *)realloc(sponge->rotations, sponge->instances_count * sizeof(sponge->rotations[0]));
-
-    for(u32 i = 0; i < old_instances_count; i++)
+    for(u32 i = 0; i < count; i++)
     {
-        u32 j = old_instances_count + (19 * i);
-        for (int x = -1; x < 2; x++)
-		{
-			for (int y = -1; y < 2; y++)
-			{
-				for (int z = -1; z < 2; z++)
-				{
-					int check = abs(x) + abs(y) + abs(z);
-					if (check > 1)
-					{
-                        u32 index = (x == 1 && y == 1 && z == 1) ? i : j;
-                        j+= 1;
-                        sponge->sizes[index] = divs(sponge->sizes[i], 3.0f);
-                        sponge->rotations[index] = Quat();
-
-                        sponge->positions[index].x = sponge->positions[i].x + x * sponge->sizes[index].x;
-                        sponge->positions[index].y = sponge->positions[i].y + y * sponge->sizes[index].y;
-                        sponge->positions[index].z = sponge->positions[i].z + z * sponge->sizes[index].z;
-					}
-				}
-			}
-		}
+        Entity *entity = state->entities + indices[i];
+        if(FLAG_IS_SET(entity->flags, ENTITY_FLAGS_MAPPED_NORMALS))
+        {
+            render_push_model_newest(rqueue, entity, indices[i] + 1);
+        }
+        else
+        {
+            render_push_model(rqueue, entity, indices[i] + 1);
+        }
     }
 }
 
+// NOTE: Drops every subdivision and goes back to the single root cube
+static void
+sponge_reset(EntityInstanced *sponge, Vec3 position, Vec3 size, Quat rotate)
+{
+    sponge->instances_count = 1;
+    sponge->positions = (Vec3 *)realloc(sponge->positions, sizeof(sponge->positions[0]));
+    sponge->sizes = (Vec3 *)realloc(sponge->sizes, sizeof(sponge->sizes[0]));
+    sponge->rotations = (Quat *)realloc(sponge->rotations, sizeof(sponge->rotations[0]));
+    sponge->positions[0] = position;
+    sponge->sizes[0] = size;
+    sponge->rotations[0] = rotate;
+    
+    // NOTE: Zero capacity makes the next update reallocate and rebuild everything
+    sponge->gpu_generated = false;
+    sponge->instances_capacity = 0;
+    entity_instanced_mark_dirty(sponge, 0, sponge->instances_count);
+}
+
 static void
 imgui_start_frame(ProgramState *state)
 {
@@ -252,8 +268,132 @@ imgui_start_frame(ProgramState *state)
         
         ImGui::TreePop();
     }
-
-    if(ImGui::Button("Menger sponge: divide"))
+    
+    TransientBuffer *transient = &ctx->transient;
+    ImGui::Text("Transient: %.1f KB/frame (peak %.1f KB, region %u KB)",
+                transient->last_frame_bytes / 1024.0f, transient->peak_frame_bytes / 1024.0f,
+                transient->region_size / 1024);
+    
+    CullSet *cull = &ctx->cull;
+    ImGui::Text("Culling: %u bounds, %u visible, %u in shadow, %.3f ms",
+                cull->count, cull->visible_counts[CullView_Main],
+                cull->visible_counts[CullView_Shadow], cull->last_run_time * 1000.0);
+    ImGui::Text("Culled only by the boxes: %u in view, %u in shadow",
+                cull->box_culled_counts[CullView_Main], cull->box_culled_counts[CullView_Shadow]);
+    
+    OcclusionBuffer *occlusion = &ctx->occlusion;
+    ImGui::Text("Occlusion: %u triangles, %u of %u bounds occluded, %.3f ms",
+                occlusion->triangles_len, occlusion->occluded_count, occlusion->tested_count,
+                occlusion->last_run_time * 1000.0);
+    
+    bool occlusion_cull = FLAG_IS_SET(ctx->flags, RENDER_OCCLUSION_CULL);
+    ImGui::Checkbox("Software occlusion culling", &occlusion_cull);
+    if(occlusion_cull != FLAG_IS_SET(ctx->flags, RENDER_OCCLUSION_CULL))
+        FLAG_NEGATE(ctx->flags, RENDER_OCCLUSION_CULL);
+    
+    bool occlusion_queries = FLAG_IS_SET(ctx->flags, RENDER_OCCLUSION_QUERIES);
+    ImGui::Checkbox("Hardware occlusion queries", &occlusion_queries);
+    if(occlusion_queries != FLAG_IS_SET(ctx->flags, RENDER_OCCLUSION_QUERIES))
+        FLAG_NEGATE(ctx->flags, RENDER_OCCLUSION_QUERIES);
+    
+    bool id_buffer = FLAG_IS_SET(ctx->flags, RENDER_ID_BUFFER);
+    ImGui::Checkbox("Pick through the ID buffer", &id_buffer);
+    if(id_buffer != FLAG_IS_SET(ctx->flags, RENDER_ID_BUFFER))
+        FLAG_NEGATE(ctx->flags, RENDER_ID_BUFFER);
+    if(id_buffer)
+    {
+        ImGui::Text("ID buffer: hovering 0x%08x, %u readbacks dropped",
+                    ctx->pick.hovered_id, ctx->pick.readbacks_dropped);
+    }
+    
+    bool baked_light = FLAG_IS_SET(ctx->flags, RENDER_BAKED_LIGHT);
+    ImGui::Checkbox("Baked ambient occlusion and bounce light", &baked_light);
+    if(baked_light != FLAG_IS_SET(ctx->flags, RENDER_BAKED_LIGHT))
+        FLAG_NEGATE(ctx->flags, RENDER_BAKED_LIGHT);
+    if(baked_light)
+    {
+        BakeStats *bake = &state->bake_stats;
+        ImGui::Text("Bake: %u meshes, %u points, %llu rays in %.3f s%s", bake->targets, bake->points,
+                    (unsigned long long)bake->rays, bake->time, bake->from_cache ? " (from " BAKE_CACHE_FILENAME ")" : "");
+        if(bake->rejected)
+        {
+            ImGui::Text("Bake: %u static entities skipped, their model is shared", bake->rejected);
+        }
+        if(ImGui::Button("Rebake static lighting"))
+        {
+            state->rebake = true;
+        }
+    }
+    
+    bool gpu_cull = FLAG_IS_SET(ctx->flags, RENDER_GPU_CULL_INSTANCES);
+    ImGui::Checkbox(ctx->instance_cull_compute ? "GPU instance culling (compute)" :
+                    "GPU instance culling (transform feedback)", &gpu_cull);
+    if(gpu_cull != FLAG_IS_SET(ctx->flags, RENDER_GPU_CULL_INSTANCES))
+        FLAG_NEGATE(ctx->flags, RENDER_GPU_CULL_INSTANCES);
+    
+    if(!state->sponge_division.active)
+    {
+        ImGui::Checkbox("Menger sponge: generate on the GPU", &state->sponge_on_gpu);
+    }
+    
+    if(!state->sponge_on_gpu)
+    {
+        bool half_instances = state->sponge.format == InstanceFormat_Half;
+        ImGui::Checkbox("Menger sponge: half precision instances", &half_instances);
+        entity_instanced_set_format(&state->sponge, half_instances ? InstanceFormat_Half : InstanceFormat_Float);
+    }
+    
+    ImGui::Checkbox("Menger sponge: merged chunk meshes", &state->draw_sponge_merged);
+    
+    EntityTree *tree = &state->entity_tree;
+    ImGui::Text("Entity tree: %u entities, %u nodes, %u visible (+%u casters), SAH %.2f (built at %.2f)",
+                tree->count, tree->nodes_len, state->entities_visible_len, state->entities_casters_len,
+                entity_tree_quality(tree), tree->build_cost);
+    ImGui::Text("Entity tree: %u builds, last one %.3f ms", tree->builds_count, tree->last_build_time * 1000.0);
+    ImGui::Text("Marquee: %u selected in %.3f ms", state->selected_len, state->marquee_time * 1000.0);
+    ImGui::Text("Pick: entity %d, mesh %u triangle %u in %.3f ms", state->pick_entity, state->pick_hit.mesh,
+                state->pick_hit.triangle, state->pick_time * 1000.0);
+    TransformTree *transforms = &state->transforms;
+    ImGui::Text("Transform tree: %u nodes, %u levels, %u visited in %.3f ms", transforms->count,
+                transforms->levels_len, transforms->last_visited, transforms->last_update_time * 1000.0);
+    
+    Broadphase *bp = &state->broadphase;
+    ImGui::Checkbox("Collision broadphase", &state->broadphase_enabled);
+    if(state->broadphase_enabled)
+    {
+        bool spatial_hash = bp->backend == BroadphaseBackend_SpatialHash;
+        ImGui::SameLine();
+        ImGui::Checkbox("Spatial hash", &spatial_hash);
+        bp->backend = spatial_hash ? BroadphaseBackend_SpatialHash : BroadphaseBackend_SortAndSweep;
+        if(spatial_hash)
+        {
+            ImGui::SliderFloat("Broadphase: cell size", &bp->cell_size, 0.5f, 32.0f);
+            ImGui::Text("Broadphase: %u proxies, %u pairs in %.3f ms, %u cells, %u large",
+                        bp->proxies_len, bp->pairs_len, bp->last_update_time * 1000.0, bp->cells_used, bp->large_len);
+        }
+        else
+        {
+            ImGui::Text("Broadphase: %u proxies, %u pairs in %.3f ms, %u swaps",
+                        bp->proxies_len, bp->pairs_len, bp->last_update_time * 1000.0, bp->swaps);
+        }
+    }
+    if(state->entities_len < ENTITIES_MAX && ImGui::Button("Scatter cubes"))
+    {
+        state->scatter_entities = true;
+    }
+    
+    ImGui::Checkbox("Batch raycast from the camera", &state->batch_rays);
+    if(state->batch_rays)
+    {
+        ImGui::Text("Batch raycast: %u rays, %u hit, %.3f ms", BATCH_RAYS_COUNT, state->batch_rays_hits_count,
+                    state->batch_rays_time * 1000.0);
+    }
+    
+    if(state->sponge_division.active)
+    {
+        ImGui::Text("Menger sponge: dividing %u cubes...", state->sponge_division.parents_count);
+    }
+    else if(ImGui::Button("Menger sponge: divide"))
     {
         state->divide_sponge = true;
     }
@@ -275,6 +415,19 @@ int main()
     ProgramState *state = (ProgramState *)malloc(sizeof(ProgramState)); *state = {};
 	state->window = create_opengl_window();
 	glfwSetWindowUserPointer(state->window.ptr, state);
+    state->entities = (Entity *)calloc(ENTITIES_MAX, sizeof(Entity));
+    state->entities_visible = (u32 *)malloc(ENTITIES_MAX * sizeof(u32));
+    state->entities_casters = (u32 *)malloc(ENTITIES_MAX * sizeof(u32));
+    state->entities_queued = (u8 *)calloc(ENTITIES_MAX, sizeof(u8));
+    state->selected = (u32 *)malloc(ENTITIES_MAX * sizeof(u32));
+    state->pick_entity = -1;
+    state->entity_tree = entity_tree_create(1024);
+    state->broadphase = broadphase_create(1024);
+    state->transforms = transform_tree_create(1024);
+    state->batch_rays_origins = (Vec3 *)malloc(BATCH_RAYS_COUNT * sizeof(Vec3));
+    state->batch_rays_directions = (Vec3 *)malloc(BATCH_RAYS_COUNT * sizeof(Vec3));
+    state->batch_rays_hits = (RayHit *)malloc(BATCH_RAYS_COUNT * sizeof(RayHit));
+    state->batch_rays_entities = (i32 *)malloc(BATCH_RAYS_COUNT * sizeof(i32));
 	glfwSetKeyCallback(state->window.ptr, keyboard_button_callback);
 	glfwSetMouseButtonCallback(state->window.ptr, mouse_button_callback);
     glfwSetWindowSizeCallback(state->window.ptr, window_resize_callback);
@@ -352,34 +505,47 @@ int main()
     obj_model_destory(&obj);
     
 	Model floor_model = model_create_debug_floor();
+    FLAG_SET(floor_model.flags, MODEL_FLAGS_OCCLUDER);
+    FLAG_SET(floor_model.flags, MODEL_FLAGS_LIGHTMAPPED);
 	UIElement crosshair = ui_element_create(Vec2(0.0f, 0.0f), Vec2(0.1f, 0.1f),
                                             "data/crosshair.png");
 	Cubemap skybox = cubemap_create_skybox();
     
-    Entity *monkey = &state->entities[state->entities_len++];
+    Entity *monkey = state_push_entity(state);
     monkey->position = Vec3(5.0f, 0.0f, 0.0f);
 	monkey->size = Vec3(1.0f, 1.0f, 1.0f);
 	monkey->model = &monkey_model;
     
-    Entity *backpack = &state->entities[state->entities_len++];
+    Entity *backpack = state_push_entity(state);
     backpack->position = Vec3(0.0f, 1.0f, -1.0f);
     backpack->size = Vec3(1.0f, 1.0f, 1.0f);
     backpack->model = &backpack_model;
+    backpack->flags = ENTITY_FLAGS_MAPPED_NORMALS;
     
-    Entity *crysis_guy = &state->entities[state->entities_len++];
+    Entity *crysis_guy = state_push_entity(state);
     crysis_guy->position = Vec3(-5.0f, -1.0f, 0.0f);
     crysis_guy->size = Vec3(0.25f, 0.25f, 0.25f);
     crysis_guy->model = &crysis_model;
+    crysis_guy->flags = ENTITY_FLAGS_MAPPED_NORMALS | ENTITY_FLAGS_STATIC;
     
-    Entity *cyborg = &state->entities[state->entities_len++];
+    Entity *cyborg = state_push_entity(state);
     cyborg->position = Vec3(-5.0f, 1.0f, 2.0f);
     cyborg->size = Vec3(1.0f, 1.0f, 1.0f);
     cyborg->model = &cyborg_model;
+    cyborg->flags = ENTITY_FLAGS_MAPPED_NORMALS | ENTITY_FLAGS_STATIC;
     
-    Entity *floor = &state->entities[state->entities_len++];
+    Entity *floor = state_push_entity(state);
 	floor->position = Vec3(0.0f, -2.0f, 0.0f);
 	floor->size = Vec3(10.0f, 1.0f, 10.0f);
 	floor->model = &floor_model;
+    floor->flags = ENTITY_FLAGS_STATIC;
+    
+    // NOTE: Relative to the monkey, so it circles around it as the monkey spins
+    Entity *moon = state_push_entity(state);
+    moon->position = Vec3(0.0f, 2.5f, 0.0f);
+    moon->size = Vec3(0.3f, 0.3f, 0.3f);
+    moon->model = &monkey_model;
+    entity_attach(&state->transforms, moon, monkey);
 
     EntityInstanced *sponge = &state->sponge;
     sponge->instances_count = 1;
@@ -396,9 +562,31 @@ int main()
     // sponge->rotations[1] = create_qrot(to_radians(45.0f), Vec3(1.0f, 1.0f, 1.0f));
 
     sponge->model = model_create_sponge();
+    entity_instanced_mark_dirty(sponge, 0, sponge->instances_count);
+    
+    state->sponge_root_position = sponge->positions[0];
+    state->sponge_root_size = sponge->sizes[0];
+    state->sponge_root_rotate = sponge->rotations[0];
+    
+    state->sponge_merged.position = state->sponge_root_position;
+    state->sponge_merged.size = state->sponge_root_size;
+    state->sponge_merged.rotate = state->sponge_root_rotate;
+    entity_transform_update(&state->sponge_merged);
+    
+    // NOTE: Set up by hand above, nothing marked them dirty
+    for(u32 i = 0; i < state->entities_len; i++)
+    {
+        entity_transform_update(state->entities + i);
+    }
+    
+    jobs_init(&state->jobs);
+    // NOTE: The attached ones got skipped above
+    entity_update_hierarchy(&state->transforms, state->entities, state->entities_len, &state->jobs);
 
     RenderContext *ctx = &state->ctx;
+    ctx->jobs = &state->jobs;
     render_load_programs(ctx);
+    render_create_buffers(ctx);
     
     ctx->white_texture = texture_create_solid(1.0f, 1.0f, 1.0f, 1.0f);
     ctx->black_texture = texture_create_solid(0.0f, 0.0f, 0.0f, 1.0f);
@@ -424,6 +612,18 @@ int main()
     Vec3 sun_direction = noz(Vec3(2.0f, -4.0f, 1.0f));
     ctx->sun = create_sun(sun_direction, 0.01f, 0.4f, 0.7f);
     
+    BakeSettings bake_settings = {};
+    bake_settings.sun_direction = ctx->sun.direction;
+    bake_settings.sun_color = ctx->sun.diffuse_part;
+    bake_settings.ao_radius = BAKE_AO_RADIUS;
+    bake_settings.samples = BAKE_SAMPLES;
+    state->bake_stats = bake_static_lighting(state->entities, state->entities_len, bake_settings, &state->jobs,
+                                             BAKE_CACHE_FILENAME);
+    printf("[bake] %u meshes, %u points in %f%s, %u entities skipped for a shared model\n\n",
+           state->bake_stats.targets, state->bake_stats.points, state->bake_stats.time,
+           state->bake_stats.from_cache ? " (cached)" : "", state->bake_stats.rejected);
+    FLAG_SET(ctx->flags, RENDER_BAKED_LIGHT);
+    
     ctx->point_light.ambient_part = Vec3(0.05f, 0.05f, 0.05f);
     ctx->point_light.diffuse_part = Vec3(0.9f, 0.9f, 0.9f);
     ctx->point_light.specular_part = Vec3(1.0f, 1.0f, 1.0f);
@@ -441,8 +641,10 @@ int main()
                                    ctx->perspective_near, ctx->perspective_far);
     ctx->ortho = create_orthographic(ctx->aspect_ratio, 0.01f, 100.0f);
     
-    RenderQueue rqueue_ = render_create_queue();
+    // NOTE: Big enough for every scattered entity to be on screen at once
+    RenderQueue rqueue_ = render_create_queue(MB(16));
     RenderQueue *rqueue = &rqueue_;
+    RandomSeries scatter_series = { 0x9e3779b9 };
     
     assert(monkey_model.materials_len == 1);
     monkey_model.materials[0].diffuse_map = ctx->white_texture;
@@ -460,8 +662,11 @@ int main()
     glBindRenderbuffer(GL_RENDERBUFFER, ctx->rbo_depth);
     glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT, (f32)state->window.width, (f32)state->window.height);
     
+    ctx->pick = pick_create(state->window.width, state->window.height);
+    
     glBindFramebuffer(GL_FRAMEBUFFER, ctx->hdr_fbo);
     glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, ctx->color_buffer, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, ctx->pick.id_buffer, 0);
     glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, ctx->rbo_depth);
     assert(glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
@@ -551,6 +756,24 @@ int main()
             FLAG_NEGATE(ctx->flags, RENDER_DRAW_HITBOXES);
         }
         
+        if(state->scatter_entities)
+        {
+            state->scatter_entities = false;
+            u32 count = MIN(ENTITIES_SCATTER_COUNT, ENTITIES_MAX - state->entities_len);
+            for(u32 i = 0; i < count; i++)
+            {
+                Entity *entity = state_push_entity(state);
+                entity->position = Vec3(random_bilateral(&scatter_series) * 90.0f, -1.5f,
+                                        random_bilateral(&scatter_series) * 90.0f);
+                entity->size = Vec3(0.5f, 0.5f, 0.5f);
+                entity->rotate = create_qrot(random_unilateral(&scatter_series) * (f32)PI, Vec3(0.0f, 1.0f, 0.0f));
+                entity->model = sponge->model;
+            }
+        }
+        
+        entity_update_transforms(state->entities, state->entities_len);
+        entity_tree_update(&state->entity_tree, state->entities, state->entities_len);
+        
         if(state->in_editor && state->mbuttons[GLFW_MOUSE_BUTTON_LEFT].pressed)
         {
             Vec2 ndc = screen_to_ndc(cursor->x, cursor->y,
@@ -570,12 +793,27 @@ int main()
                 AxisClickResult yaxis = {};
                 AxisClickResult zaxis = {};
                 
-                xaxis.clicked = ray_intersect_hitbox(editor_ray_origin, editor_ray_dir,
-                                                     &picked->x_line_hbox, &xaxis.distance);
-                yaxis.clicked = ray_intersect_hitbox(editor_ray_origin, editor_ray_dir,
-                                                     &picked->y_line_hbox, &yaxis.distance);
-                zaxis.clicked = ray_intersect_hitbox(editor_ray_origin, editor_ray_dir,
-                                                     &picked->z_line_hbox, &zaxis.distance);
+                // NOTE: All three handles in one slab test, the fourth lane is unused
+                Hitbox *handles[3] = { &picked->x_line_hbox, &picked->y_line_hbox, &picked->z_line_hbox };
+                RayBoxes4 handle_boxes = {};
+                for(u32 i = 0; i < ARRAY_LEN(handles); i++)
+                {
+                    Vec3 min = {};
+                    Vec3 max = {};
+                    hitbox_bounds(handles[i], &min, &max);
+                    ray_boxes4_set(&handle_boxes, i, min, max);
+                }
+                
+                f32 t_enter[4];
+                f32 t_exit[4];
+                u32 handles_hit = ray_intersect_boxes4(editor_ray_origin, ray_inverse_direction(editor_ray_dir),
+                                                       &handle_boxes, F32MAX, t_enter, t_exit);
+                xaxis.clicked = handles_hit & 0x1;
+                yaxis.clicked = handles_hit & 0x2;
+                zaxis.clicked = handles_hit & 0x4;
+                xaxis.distance = t_enter[0];
+                yaxis.distance = t_enter[1];
+                zaxis.distance = t_enter[2];
                 
                 axis_hit = xaxis.clicked || yaxis.clicked || zaxis.clicked;
                 
@@ -593,24 +831,108 @@ int main()
                 }
             }
             
-            if(!axis_hit)
+            if(!axis_hit && FLAG_IS_SET(ctx->flags, RENDER_ID_BUFFER))
+            {
+                pick_request(&ctx->pick, (i32)cursor->x, (i32)cursor->y, true);
+            }
+            else if(!axis_hit)
             {
-                u64 start = rdtsc();
-                bool entity_hit = false;
-                for(u32 i = 0; i < state->entities_len; i++)
+                f64 start = glfwGetTime();
+                state->pick_hit = {};
+                state->pick_entity = entity_tree_raycast(&state->entity_tree, state->entities,
+                                                         editor_ray_origin, editor_ray_dir, &state->pick_hit);
+                if(state->pick_entity >= 0)
                 {
-                    if(ray_intersect_entity(editor_ray_origin, editor_ray_dir, state->entities + i))
-                    {
-                        entity_hit = true;
-                        state->edit_picked.entity = state->entities + i;
-                        break;
-                    }
+                    state->edit_picked.entity = state->entities + state->pick_entity;
+                    state->selected_len = 0;
                 }
+                state->pick_time = glfwGetTime() - start;
+            }
+        }
+        
+        if(state->in_editor && FLAG_IS_SET(ctx->flags, RENDER_ID_BUFFER))
+        {
+            // NOTE: Whatever got read back came from last frame's pixels
+            PickBuffer *pick = &ctx->pick;
+            if(pick->click_ready)
+            {
+                pick->click_ready = false;
+                // NOTE: The id can be older than the last scatter or reset, check it's still around
+                u32 entity = pick->clicked_id & PICK_ENTITY_MASK;
+                if(entity && entity <= state->entities_len)
+                {
+                    state->edit_picked.entity = state->entities + (entity - 1);
+                    state->selected_len = 0;
+                }
+            }
+            pick_request(pick, (i32)cursor->x, (i32)cursor->y, false);
+        }
+        
+        Button *marquee_button = &state->mbuttons[GLFW_MOUSE_BUTTON_RIGHT];
+        if(state->in_editor && marquee_button->pressed)
+        {
+            state->marquee_active = true;
+            state->marquee_x = cursor->x;
+            state->marquee_y = cursor->y;
+        }
+        else if(state->marquee_active && (!state->in_editor || !marquee_button->down))
+        {
+            state->marquee_active = false;
+            
+            // NOTE: Anything thinner than this is a stray click, not a drag
+            f64 marquee_min_pixels = 3.0;
+            if(state->in_editor && fabs(cursor->x - state->marquee_x) >= marquee_min_pixels &&
+               fabs(cursor->y - state->marquee_y) >= marquee_min_pixels)
+            {
+                f64 start = glfwGetTime();
+                Vec2 corner0 = screen_to_ndc(state->marquee_x, state->marquee_y,
+                                             state->window.width, state->window.height);
+                Vec2 corner1 = screen_to_ndc(cursor->x, cursor->y, state->window.width, state->window.height);
+                Vec2 ndc_min = Vec2(MIN(corner0.x, corner1.x), MIN(corner0.y, corner1.y));
+                Vec2 ndc_max = Vec2(MAX(corner0.x, corner1.x), MAX(corner0.y, corner1.y));
                 
-                u64 end = rdtsc();
+                Plane marquee_planes[FrustumPlane_ElementCount];
+                frustum_planes_from_ndc_rect(ndc_min, ndc_max, ctx->cam.position, ctx->proj, ctx->view,
+                                             marquee_planes);
+                state->selected_len = entity_tree_query_frustum(&state->entity_tree, marquee_planes,
+                                                                state->selected, ENTITIES_MAX);
+                state->marquee_time = glfwGetTime() - start;
                 
-                u64 hit_clocks = end - start;
-                printf("EntityHit = %d | %lu clocks/call\n", entity_hit, hit_clocks);
+                if(state->selected_len)
+                {
+                    state->edit_picked.entity = NULL;
+                }
+            }
+        }
+        
+        if(state->batch_rays)
+        {
+            Mat4 proj_inversed = inverse(ctx->proj);
+            Mat4 view_inversed = inverse(ctx->view);
+            for(u32 y = 0; y < BATCH_RAYS_SIDE; y++)
+            {
+                for(u32 x = 0; x < BATCH_RAYS_SIDE; x++)
+                {
+                    u32 i = y * BATCH_RAYS_SIDE + x;
+                    Vec2 ndc = Vec2((x + 0.5f) / BATCH_RAYS_SIDE * 2.0f - 1.0f,
+                                    (y + 0.5f) / BATCH_RAYS_SIDE * 2.0f - 1.0f);
+                    state->batch_rays_origins[i] = ctx->cam.position;
+                    state->batch_rays_directions[i] = ndc_to_ray_direction(ndc, proj_inversed, view_inversed);
+                    state->batch_rays_hits[i] = {};
+                    state->batch_rays_hits[i].t = F32MAX;
+                }
+            }
+            
+            f64 start = glfwGetTime();
+            entity_tree_raycast_batch(&state->entity_tree, state->entities, &state->jobs,
+                                      state->batch_rays_origins, state->batch_rays_directions, BATCH_RAYS_COUNT,
+                                      state->batch_rays_hits, state->batch_rays_entities);
+            state->batch_rays_time = glfwGetTime() - start;
+            
+            state->batch_rays_hits_count = 0;
+            for(u32 i = 0; i < BATCH_RAYS_COUNT; i++)
+            {
+                state->batch_rays_hits_count += state->batch_rays_entities[i] >= 0 ? 1 : 0;
             }
         }
         
@@ -620,6 +942,8 @@ int main()
             float movement_scalar = 0.1f;
             Vec3 *pos;
             Vec3 straight, right, up;
+            bool move_selected = state->in_editor && !state->edit_picked.entity && state->selected_len;
+            Vec3 selected_delta = {};
             if(state->in_editor && state->edit_picked.entity)
             {
                 pos = &state->edit_picked.entity->position;
@@ -627,6 +951,13 @@ int main()
                 right = Vec3(-1.0f, 0.0f, 0.0f);
                 straight = Vec3(0.0f, 0.0f, 1.0f);
             }
+            else if(move_selected)
+            {
+                pos = &selected_delta;
+                up = Vec3(0.0f, 1.0f, 0.0f);
+                right = Vec3(-1.0f, 0.0f, 0.0f);
+                straight = Vec3(0.0f, 0.0f, 1.0f);
+            }
             else
             {
                 pos = &ctx->cam.position;
@@ -648,6 +979,27 @@ int main()
             } if(state->kbuttons[GLFW_KEY_LEFT_SHIFT].down) {
                 *pos = sub(*pos, scale(up, movement_scalar));
             }
+            
+            if(state->in_editor && state->edit_picked.entity)
+            {
+                FLAG_SET(state->edit_picked.entity->flags, ENTITY_FLAGS_TRANSFORM_DIRTY);
+                entity_tree_move(&state->entity_tree, state->entities,
+                                 (u32)(state->edit_picked.entity - state->entities));
+                broadphase_move(&state->broadphase, state->entities,
+                                (u32)(state->edit_picked.entity - state->entities));
+            }
+            
+            if(move_selected && (selected_delta.x != 0.0f || selected_delta.y != 0.0f || selected_delta.z != 0.0f))
+            {
+                for(u32 i = 0; i < state->selected_len; i++)
+                {
+                    Entity *entity = state->entities + state->selected[i];
+                    entity->position = add(entity->position, selected_delta);
+                    FLAG_SET(entity->flags, ENTITY_FLAGS_TRANSFORM_DIRTY);
+                    entity_tree_move(&state->entity_tree, state->entities, state->selected[i]);
+                    broadphase_move(&state->broadphase, state->entities, state->selected[i]);
+                }
+            }
         }
         
         if(state->in_editor)
@@ -657,19 +1009,116 @@ int main()
         
         monkey->rotate = create_qrot(to_radians(glfwGetTime() * 14.0f) * 8.0f, Vec3(1.0f, 0.0f, 0.0f));
         backpack->rotate = create_qrot(to_radians(glfwGetTime() * 8.0f) * 13.0f, Vec3(1.0f, 0.4f, 0.2f));
+        FLAG_SET(monkey->flags, ENTITY_FLAGS_TRANSFORM_DIRTY);
+        FLAG_SET(backpack->flags, ENTITY_FLAGS_TRANSFORM_DIRTY);
+        entity_tree_move(&state->entity_tree, state->entities, (u32)(monkey - state->entities));
+        entity_tree_move(&state->entity_tree, state->entities, (u32)(backpack - state->entities));
+        broadphase_move(&state->broadphase, state->entities, (u32)(monkey - state->entities));
+        broadphase_move(&state->broadphase, state->entities, (u32)(backpack - state->entities));
+        
+        // NOTE: After everything that moves entities, whatever is attached to one
+        // of them follows it here
+        if(entity_update_hierarchy(&state->transforms, state->entities, state->entities_len, &state->jobs))
+        {
+            for(u32 i = 0; i < state->entities_len; i++)
+            {
+                Entity *entity = state->entities + i;
+                if(entity->node != TRANSFORM_TREE_ROOT && transform_tree_changed(&state->transforms, entity->node))
+                {
+                    entity_tree_move(&state->entity_tree, state->entities, i);
+                    broadphase_move(&state->broadphase, state->entities, i);
+                }
+            }
+        }
+        
+        if(state->broadphase_enabled)
+        {
+            broadphase_update(&state->broadphase, state->entities, state->entities_len, &state->jobs);
+        }
         
         ctx->point_light.position = Vec3(5.0f * cosf(glfwGetTime()), 0.0f, 5.0f * sinf(glfwGetTime()));
         
         to_point_light.point0 = sub(ctx->cam.position, Vec3(0.1f, 0.1f, 0.1f));
         to_point_light.point1 = ctx->point_light.position;
 
+        // NOTE: Asked for explicitly, so the cache only gets written. The sun could
+        // have been changed in the editor since the last bake.
+        if(state->rebake)
+        {
+            state->rebake = false;
+            bake_settings.sun_direction = ctx->sun.direction;
+            bake_settings.sun_color = ctx->sun.diffuse_part;
+            state->bake_stats = bake_static_lighting(state->entities, state->entities_len, bake_settings,
+                                                     &state->jobs, BAKE_CACHE_FILENAME, false);
+        }
+        
         if(state->divide_sponge)
         {
             state->divide_sponge = false;
-            EntityInstanced *sponge = &state->sponge;
-            printf("Dividing...\n");
-            sponge_divide(sponge);
-            printf("Done with %d instances.\n", sponge->instances_count);
+            u32 max_level = state->sponge_on_gpu ? SPONGE_MAX_LEVEL : SPONGE_CPU_MAX_LEVEL;
+            if(state->sponge_level >= max_level)
+            {
+                printf("Menger sponge is already at the deepest level (%u)%s.\n", max_level,
+                       state->sponge_on_gpu ? "" : ", generate it on the GPU to go further");
+            }
+            else if(state->sponge_on_gpu)
+            {
+                state->sponge_level++;
+            }
+            else if(!state->sponge_division.active)
+            {
+                sponge_division_start(&state->sponge_division, sponge, &state->jobs);
+            }
+        }
+        
+        if(state->sponge_on_gpu != sponge->gpu_generated ||
+           (state->sponge_on_gpu && state->sponge_gpu_level != state->sponge_level))
+        {
+            // NOTE: Either way the CPU copy goes back to the root cube, the GPU one
+            // doesn't need it and coming back to the CPU starts over from level 0.
+            if(state->sponge_on_gpu != sponge->gpu_generated)
+            {
+                sponge_reset(sponge, state->sponge_root_position, state->sponge_root_size,
+                             state->sponge_root_rotate);
+                if(!state->sponge_on_gpu)
+                {
+                    state->sponge_level = 0;
+                }
+            }
+            
+            if(state->sponge_on_gpu)
+            {
+                f64 start = glfwGetTime();
+                state->sponge_on_gpu = render_generate_sponge(ctx, sponge, state->sponge_root_position,
+                                                              state->sponge_root_size,
+                                                              state->sponge_root_rotate, state->sponge_level);
+                state->sponge_gpu_level = state->sponge_level;
+                printf("Generated %u instances on the GPU in %.1f ms.\n", sponge->instances_count,
+                       (glfwGetTime() - start) * 1000.0);
+            }
+        }
+        
+        if(sponge_division_finish(&state->sponge_division, sponge, &state->jobs))
+        {
+            state->sponge_level++;
+            printf("Divided into %d instances in %.1f ms.\n", sponge->instances_count,
+                   (glfwGetTime() - state->sponge_division.start_time) * 1000.0);
+        }
+        
+        if(state->draw_sponge_merged &&
+           (!state->sponge_merged.model || state->sponge_merged_level != state->sponge_level))
+        {
+            if(state->sponge_merged.model)
+            {
+                model_destory(*state->sponge_merged.model);
+                free(state->sponge_merged.model);
+            }
+            
+            f64 start = glfwGetTime();
+            state->sponge_merged.model = model_create_sponge_merged(state->sponge_level, &state->jobs);
+            state->sponge_merged_level = state->sponge_level;
+            printf("Merged sponge level %u into %u chunks in %.1f ms.\n", state->sponge_level,
+                   state->sponge_merged.model->meshes_len, (glfwGetTime() - start) * 1000.0);
         }
         
         render_push_line(rqueue, ray_line);
@@ -707,21 +1156,111 @@ int main()
         
         render_push_skybox(rqueue, skybox);
         
-        render_push_model_newest(rqueue, *backpack);
-        render_push_model_newest(rqueue, *crysis_guy);
-        render_push_model_newest(rqueue, *cyborg);
+        // NOTE: Only what the entity tree finds inside of the camera frustum or the sun's
+        // gets queued. The shadow pass draws from the same queue, so casters outside of
+        // the view still have to be in it, render_cull_queue sorts out who goes where.
+        Plane view_planes[FrustumPlane_ElementCount];
+        frustum_planes_from_matrix(mul(ctx->proj, ctx->view), view_planes);
+        state->entities_visible_len = entity_tree_query_frustum(&state->entity_tree, view_planes,
+                                                                state->entities_visible, ENTITIES_MAX);
         
-        render_push_model(rqueue, *monkey);
-        render_push_model(rqueue, *floor);
-        render_push_instanced_model(rqueue, sponge);
+        render_compute_light_proj_view(ctx);
+        Plane sun_planes[FrustumPlane_ElementCount];
+        frustum_planes_from_matrix(ctx->light_proj_view, sun_planes);
+        u32 sun_len = entity_tree_query_frustum(&state->entity_tree, sun_planes,
+                                                state->entities_casters, ENTITIES_MAX);
+        
+        for(u32 i = 0; i < state->entities_visible_len; i++)
+        {
+            state->entities_queued[state->entities_visible[i]] = 1;
+        }
+        state->entities_casters_len = 0;
+        for(u32 i = 0; i < sun_len; i++)
+        {
+            u32 index = state->entities_casters[i];
+            if(!state->entities_queued[index])
+            {
+                state->entities_casters[state->entities_casters_len++] = index;
+            }
+        }
+        for(u32 i = 0; i < state->entities_visible_len; i++)
+        {
+            state->entities_queued[state->entities_visible[i]] = 0;
+        }
+        
+        state_queue_entities(state, rqueue, state->entities_visible, state->entities_visible_len);
+        state_queue_entities(state, rqueue, state->entities_casters, state->entities_casters_len);
+        if(state->draw_sponge_merged)
+        {
+            render_push_model(rqueue, &state->sponge_merged);
+        }
+        else
+        {
+            render_push_instanced_model(rqueue, sponge);
+        }
 
         if(FLAG_IS_SET(ctx->flags, RENDER_DRAW_HITBOXES))
         {
-            for(u32 i = 0; i < state->entities_len; i++)
+            for(u32 i = 0; i < state->entities_visible_len; i++)
             {
-                render_push_hitbox(rqueue, state->entities[i]);
+                render_push_hitbox(rqueue, state->entities + state->entities_visible[i]);
             }
         }
+        if(state->in_editor)
+        {
+            for(u32 i = 0; i < state->selected_len; i++)
+            {
+                render_push_hitbox(rqueue, state->entities + state->selected[i], Vec3(0.0f, 1.0f, 1.0f));
+            }
+        }
+        if(state->in_editor && state->broadphase_enabled && state->edit_picked.entity)
+        {
+            // NOTE: Whatever the picked entity is touching goes red
+            Broadphase *bp = &state->broadphase;
+            u32 picked = (u32)(state->edit_picked.entity - state->entities);
+            for(u32 i = 0; i < bp->pairs_len; i++)
+            {
+                BroadphasePair *pair = bp->pairs + i;
+                if(pair->entity_a == picked || pair->entity_b == picked)
+                {
+                    u32 other = pair->entity_a == picked ? pair->entity_b : pair->entity_a;
+                    render_push_hitbox(rqueue, state->entities + other, Vec3(1.0f, 0.0f, 0.0f));
+                }
+            }
+        }
+        
+        if(state->marquee_active)
+        {
+            // NOTE: Drawn a unit in front of the camera, past the near plane
+            Mat4 proj_inversed = inverse(ctx->proj);
+            Mat4 view_inversed = inverse(ctx->view);
+            Vec2 corners[4] = {
+                screen_to_ndc(state->marquee_x, state->marquee_y, state->window.width, state->window.height),
+                screen_to_ndc(cursor->x, state->marquee_y, state->window.width, state->window.height),
+                screen_to_ndc(cursor->x, cursor->y, state->window.width, state->window.height),
+                screen_to_ndc(state->marquee_x, cursor->y, state->window.width, state->window.height),
+            };
+            Vec3 points[4];
+            for(u32 i = 0; i < ARRAY_LEN(corners); i++)
+            {
+                Vec3 direction = ndc_to_ray_direction(corners[i], proj_inversed, view_inversed);
+                points[i] = add(ctx->cam.position, scale(direction, 1.0f / inner(direction, ctx->cam.front)));
+            }
+            for(u32 i = 0; i < ARRAY_LEN(points); i++)
+            {
+                Line edge = {};
+                edge.point0 = points[i];
+                edge.point1 = points[(i + 1) % ARRAY_LEN(points)];
+                render_push_line(rqueue, edge, Vec3(0.0f, 1.0f, 1.0f));
+            }
+        }
+        
+        u32 hovered = ctx->pick.hovered_id & PICK_ENTITY_MASK;
+        if(state->in_editor && FLAG_IS_SET(ctx->flags, RENDER_ID_BUFFER) && hovered &&
+           hovered <= state->entities_len)
+        {
+            render_push_hitbox(rqueue, state->entities + (hovered - 1), Vec3(1.0f, 1.0f, 0.0f));
+        }
         render_push_ui(rqueue, crosshair);
         
         render_end(rqueue, ctx, state->window.width, state->window.height);
@@ -745,12 +1284,37 @@ int main()
     }
     
     render_destory_queue(rqueue);
+    cull_destroy(&ctx->cull);
+    entity_tree_destroy(&state->entity_tree);
+    broadphase_destroy(&state->broadphase);
+    transform_tree_destroy(&state->transforms);
+    for(u32 i = 0; i < state->entities_len; i++)
+    {
+        entity_destroy_queries(state->entities + i);
+    }
+    entity_destroy_queries(&state->sponge_merged);
+    free(state->entities);
+    free(state->entities_visible);
+    free(state->entities_casters);
+    free(state->entities_queued);
+    free(state->selected);
+    free(state->batch_rays_origins);
+    free(state->batch_rays_directions);
+    free(state->batch_rays_hits);
+    free(state->batch_rays_entities);
+    occlusion_destroy(&ctx->occlusion);
+    jobs_shutdown(&state->jobs);
     
     model_destory(monkey_model);
     model_destory(backpack_model);
     model_destory(crysis_model);
     model_destory(cyborg_model);
     model_destory(floor_model);
+    if(state->sponge_merged.model)
+    {
+        model_destory(*state->sponge_merged.model);
+        free(state->sponge_merged.model);
+    }
     glfwTerminate();
     
     return 0;
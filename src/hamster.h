@@ -29,6 +29,11 @@ struct CursorPosition
     f64 yold;
 };
 
+#define ENTITIES_MAX 131072
+#define ENTITIES_SCATTER_COUNT 10000
+#define BATCH_RAYS_SIDE 64
+#define BATCH_RAYS_COUNT (BATCH_RAYS_SIDE * BATCH_RAYS_SIDE)
+
 struct ProgramState
 {
 	Window window;
@@ -39,11 +44,67 @@ struct ProgramState
 	Button mbuttons[GLFW_MOUSE_BUTTON_LAST];
     CursorPosition cursor_position;
     RenderContext ctx;
+    JobQueue jobs;
     
-    Entity entities[8];
+    // NOTE: Fixed capacity so Entity pointers (edit_picked) stay valid
+    Entity *entities;
     u32 entities_len;
+    u32 *entities_visible;
+    u32 entities_visible_len;
+    // NOTE: Inside of the sun's frustum but not the camera's, queued for their shadows
+    u32 *entities_casters;
+    u32 entities_casters_len;
+    u8 *entities_queued;
+    EntityTree entity_tree;
+    bool scatter_entities;
+    
+    // NOTE: Only holds the attached entities and whatever they hang off of
+    TransformTree transforms;
+    
+    // NOTE: Kept up to date next to entity_tree, only searched for pairs while enabled
+    Broadphase broadphase;
+    bool broadphase_enabled;
+    
+    BakeStats bake_stats;
+    bool rebake;
+    
+    // NOTE: Marquee selection, dragged with the right mouse button in the editor.
+    // Holds entity indices, every drag replaces the whole set.
+    u32 *selected;
+    u32 selected_len;
+    bool marquee_active;
+    f64 marquee_x;
+    f64 marquee_y;
+    f64 marquee_time;
+    
+    // NOTE: Last click that went through entity_tree_raycast, -1 when it missed
+    i32 pick_entity;
+    RayHit pick_hit;
+    f64 pick_time;
+    
+    // NOTE: Debug load for the batch raycaster, a grid of rays out of the camera every frame
+    bool batch_rays;
+    Vec3 *batch_rays_origins;
+    Vec3 *batch_rays_directions;
+    RayHit *batch_rays_hits;
+    i32 *batch_rays_entities;
+    u32 batch_rays_hits_count;
+    f64 batch_rays_time;
 	EntityInstanced sponge;
 	bool divide_sponge;
+    SpongeDivision sponge_division;
+    u32 sponge_level;
+    bool sponge_on_gpu;
+    u32 sponge_gpu_level;
+    // NOTE: Both instanced paths start over from this cube, whatever happens to sponge_merged
+    Vec3 sponge_root_position;
+    Vec3 sponge_root_size;
+    Quat sponge_root_rotate;
+    
+    // NOTE: Same sponge built as merged chunk meshes, rebuilt whenever the level changes
+    Entity sponge_merged;
+    u32 sponge_merged_level;
+    bool draw_sponge_merged;
     EditorPickedEntity edit_picked;
 };
 
@@ -0,0 +1,569 @@
+// NOTE: Multiplies by the transpose of the inversed transform, which is what keeps
+// normals perpendicular under non uniform scale.
+static Vec3
+bake_transform_normal(Mat4 inversed, Vec3 normal)
+{
+    Vec3 result = {};
+    result.x = inversed.a[0][0] * normal.x + inversed.a[0][1] * normal.y + inversed.a[0][2] * normal.z;
+    result.y = inversed.a[1][0] * normal.x + inversed.a[1][1] * normal.y + inversed.a[1][2] * normal.z;
+    result.z = inversed.a[2][0] * normal.x + inversed.a[2][1] * normal.y + inversed.a[2][2] * normal.z;
+    
+    return noz(result);
+}
+
+// NOTE: The transpose of the inverse, bake_transform_normal as a matrix for
+// transform_directions (which leaves the normalizing to the caller)
+static Mat4
+bake_normal_matrix(Mat4 inversed)
+{
+    Mat4 result = Mat4(1.0f);
+    for(u32 column = 0; column < 3; column++)
+    {
+        for(u32 row = 0; row < 3; row++)
+        {
+            result.a[column][row] = inversed.a[row][column];
+        }
+    }
+    
+    return result;
+}
+
+// NOTE: Only the material's color, the diffuse map isn't sampled
+static Vec3
+bake_mesh_albedo(Model *model, Mesh *mesh)
+{
+    for(u32 i = 0; i < model->materials_len; i++)
+    {
+        if(strings_match(mesh->material_name, model->materials[i].name))
+        {
+            return model->materials[i].diffuse_component;
+        }
+    }
+    
+    return Vec3(1.0f, 1.0f, 1.0f);
+}
+
+static u32
+bake_push_point(Baker *baker, u32 *capacity, Vec3 position, Vec3 normal)
+{
+    if(baker->points_len == *capacity)
+    {
+        *capacity = MAX(*capacity * 2, 1024);
+        baker->points = (BakePoint *)realloc(baker->points, *capacity * sizeof(BakePoint));
+    }
+    
+    BakePoint *point = baker->points + baker->points_len;
+    point->position = position;
+    point->normal = normal;
+    
+    return baker->points_len++;
+}
+
+static f32
+bake_cross2(Vec2 a, Vec2 b)
+{
+    return a.x * b.y - a.y * b.x;
+}
+
+// NOTE: Every texel whose center some triangle covers in uv space becomes a point,
+// the first triangle to reach a texel keeps it.
+static void
+bake_rasterize_lightmap(Baker *baker, u32 *capacity, BakeTarget *target, Mat4 transform, Mat4 inversed)
+{
+    Mesh *mesh = target->mesh;
+    f32 size = (f32)BAKE_LIGHTMAP_SIZE;
+    for(u32 i = 0; i < BAKE_LIGHTMAP_SIZE * BAKE_LIGHTMAP_SIZE; i++)
+    {
+        target->texel_point[i] = -1;
+    }
+    
+    for(u32 i = 0; i + 2 < mesh->indices_len; i += 3)
+    {
+        u32 *tri = mesh->indices + i;
+        Vec2 uv0 = scale(mesh->vertices.texture_uvs[tri[0]], size);
+        Vec2 uv1 = scale(mesh->vertices.texture_uvs[tri[1]], size);
+        Vec2 uv2 = scale(mesh->vertices.texture_uvs[tri[2]], size);
+        Vec2 edge1 = sub(uv1, uv0);
+        Vec2 edge2 = sub(uv2, uv0);
+        f32 area = bake_cross2(edge1, edge2);
+        if(fabsf(area) < 1e-8f)
+        {
+            continue;
+        }
+        f32 inverse_area = 1.0f / area;
+        
+        i32 min_x = MAX((i32)floorf(MIN(uv0.x, MIN(uv1.x, uv2.x))), 0);
+        i32 min_y = MAX((i32)floorf(MIN(uv0.y, MIN(uv1.y, uv2.y))), 0);
+        i32 max_x = MIN((i32)ceilf(MAX(uv0.x, MAX(uv1.x, uv2.x))), BAKE_LIGHTMAP_SIZE - 1);
+        i32 max_y = MIN((i32)ceilf(MAX(uv0.y, MAX(uv1.y, uv2.y))), BAKE_LIGHTMAP_SIZE - 1);
+        for(i32 y = min_y; y <= max_y; y++)
+        {
+            for(i32 x = min_x; x <= max_x; x++)
+            {
+                i32 *texel = target->texel_point + y * BAKE_LIGHTMAP_SIZE + x;
+                if(*texel >= 0)
+                {
+                    continue;
+                }
+                
+                Vec2 center = sub(Vec2((f32)x + 0.5f, (f32)y + 0.5f), uv0);
+                f32 b1 = bake_cross2(center, edge2) * inverse_area;
+                f32 b2 = bake_cross2(edge1, center) * inverse_area;
+                f32 b0 = 1.0f - b1 - b2;
+                if(b0 < 0.0f || b1 < 0.0f || b2 < 0.0f)
+                {
+                    continue;
+                }
+                
+                Vec3 *p = mesh->vertices.positions;
+                Vec3 *n = mesh->vertices.normals;
+                Vec3 position = add(add(scale(p[tri[0]], b0), scale(p[tri[1]], b1)), scale(p[tri[2]], b2));
+                Vec3 normal = add(add(scale(n[tri[0]], b0), scale(n[tri[1]], b1)), scale(n[tri[2]], b2));
+                *texel = (i32)bake_push_point(baker, capacity, mul(transform, position),
+                                              bake_transform_normal(inversed, normal));
+                target->points_len++;
+            }
+        }
+    }
+}
+
+// NOTE: A model's bake lives in its meshes, so a model that any other entity draws
+// too can't hold one entity's light. Those are left out of the bake (they still
+// occlude) and counted in rejected.
+static void
+bake_collect(Baker *baker, Entity *entities, u32 count, JobQueue *jobs)
+{
+    u32 targets_capacity = 0;
+    u32 points_capacity = 0;
+    baker->occluders = (Entity *)malloc(MAX(count, 1) * sizeof(Entity));
+    
+    for(u32 e = 0; e < count; e++)
+    {
+        Entity *entity = entities + e;
+        if(!FLAG_IS_SET(entity->flags, ENTITY_FLAGS_STATIC))
+        {
+            continue;
+        }
+        
+        // NOTE: Brought up to date before the copy, the workers only read the
+        // occluders' cached matrices
+        Mat4 transform = entity_world(entity);
+        Mat4 inversed = entity->inversed;
+        Mat4 normal_matrix = bake_normal_matrix(inversed);
+        baker->occluders[baker->occluders_len++] = *entity;
+        
+        Model *model = entity->model;
+        bool shared = false;
+        for(u32 other = 0; other < count && !shared; other++)
+        {
+            shared = other != e && entities[other].model == model;
+        }
+        if(shared)
+        {
+            baker->rejected++;
+            continue;
+        }
+        
+        for(u32 i = 0; i < model->meshes_len; i++)
+        {
+            Mesh *mesh = model->meshes + i;
+            if(!mesh->vertices.normals)
+            {
+                continue;
+            }
+            
+            if(baker->targets_len == targets_capacity)
+            {
+                targets_capacity = MAX(targets_capacity * 2, 16);
+                baker->targets = (BakeTarget *)realloc(baker->targets, targets_capacity * sizeof(BakeTarget));
+            }
+            BakeTarget *target = baker->targets + baker->targets_len++;
+            *target = {};
+            target->entity = entity;
+            target->mesh = mesh;
+            target->first_point = baker->points_len;
+            
+            if(FLAG_IS_SET(model->flags, MODEL_FLAGS_LIGHTMAPPED) && mesh->vertices.texture_uvs)
+            {
+                target->type = BakeTargetType_Lightmap;
+                target->texel_point = (i32 *)malloc(BAKE_LIGHTMAP_SIZE * BAKE_LIGHTMAP_SIZE * sizeof(i32));
+                target->result = (Vec4 *)calloc(BAKE_LIGHTMAP_SIZE * BAKE_LIGHTMAP_SIZE, sizeof(Vec4));
+                bake_rasterize_lightmap(baker, &points_capacity, target, transform, inversed);
+            }
+            else
+            {
+                target->type = BakeTargetType_Vertices;
+                target->result = (Vec4 *)calloc(mesh->vertices_len, sizeof(Vec4));
+                
+                Vec3Array positions = vec3_array_create(mesh->vertices_len);
+                Vec3Array normals = vec3_array_create(mesh->vertices_len);
+                transform_points_batch(jobs, transform, mesh->vertices.positions, mesh->vertices_len, positions);
+                transform_directions_batch(jobs, normal_matrix, mesh->vertices.normals, mesh->vertices_len, normals);
+                for(u32 v = 0; v < mesh->vertices_len; v++)
+                {
+                    bake_push_point(baker, &points_capacity, vec3_array_get(positions, v),
+                                    noz(vec3_array_get(normals, v)));
+                }
+                target->points_len = mesh->vertices_len;
+                vec3_array_destroy(&positions);
+                vec3_array_destroy(&normals);
+            }
+        }
+    }
+}
+
+static u32
+bake_target_size(BakeTarget *target)
+{
+    return target->type == BakeTargetType_Lightmap ?
+        BAKE_LIGHTMAP_SIZE * BAKE_LIGHTMAP_SIZE : target->mesh->vertices_len;
+}
+
+static u64
+bake_hash_bytes(u64 hash, void *data, u32 size)
+{
+    u8 *bytes = (u8 *)data;
+    for(u32 i = 0; i < size; i++)
+    {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+    }
+    
+    return hash;
+}
+
+// NOTE: Covers what the bake depends on short of the vertex data itself, a model
+// that changed but kept its vertex and index counts needs the cache deleted.
+static u64
+bake_hash(Baker *baker)
+{
+    u64 hash = 14695981039346656037ull;
+    u32 version = BAKE_CACHE_VERSION;
+    hash = bake_hash_bytes(hash, &version, sizeof(version));
+    hash = bake_hash_bytes(hash, &baker->settings.sun_direction, sizeof(Vec3));
+    hash = bake_hash_bytes(hash, &baker->settings.sun_color, sizeof(Vec3));
+    hash = bake_hash_bytes(hash, &baker->settings.ao_radius, sizeof(f32));
+    hash = bake_hash_bytes(hash, &baker->settings.samples, sizeof(u32));
+    
+    for(u32 i = 0; i < baker->occluders_len; i++)
+    {
+        Entity *entity = baker->occluders + i;
+        hash = bake_hash_bytes(hash, &entity->position, sizeof(Vec3));
+        hash = bake_hash_bytes(hash, &entity->size, sizeof(Vec3));
+        hash = bake_hash_bytes(hash, &entity->rotate, sizeof(Quat));
+        for(u32 m = 0; m < entity->model->meshes_len; m++)
+        {
+            hash = bake_hash_bytes(hash, &entity->model->meshes[m].vertices_len, sizeof(u32));
+            hash = bake_hash_bytes(hash, &entity->model->meshes[m].indices_len, sizeof(u32));
+        }
+    }
+    
+    for(u32 i = 0; i < baker->targets_len; i++)
+    {
+        hash = bake_hash_bytes(hash, &baker->targets[i].type, sizeof(BakeTargetType));
+        hash = bake_hash_bytes(hash, &baker->targets[i].points_len, sizeof(u32));
+    }
+    
+    return hash;
+}
+
+static bool
+bake_cache_load(Baker *baker, const char *filename, u64 hash)
+{
+    FILE *f = fopen(filename, "rb");
+    if(!f)
+    {
+        return false;
+    }
+    
+    u32 magic = 0;
+    u32 version = 0;
+    u64 file_hash = 0;
+    u32 targets_len = 0;
+    bool result = fread(&magic, sizeof(magic), 1, f) == 1 && magic == BAKE_CACHE_MAGIC &&
+        fread(&version, sizeof(version), 1, f) == 1 && version == BAKE_CACHE_VERSION &&
+        fread(&file_hash, sizeof(file_hash), 1, f) == 1 && file_hash == hash &&
+        fread(&targets_len, sizeof(targets_len), 1, f) == 1 && targets_len == baker->targets_len;
+    
+    for(u32 i = 0; result && i < baker->targets_len; i++)
+    {
+        BakeTarget *target = baker->targets + i;
+        u32 size = 0;
+        result = fread(&size, sizeof(size), 1, f) == 1 && size == bake_target_size(target) &&
+            fread(target->result, sizeof(Vec4), size, f) == size;
+    }
+    
+    fclose(f);
+    
+    return result;
+}
+
+static void
+bake_cache_save(Baker *baker, const char *filename, u64 hash)
+{
+    FILE *f = fopen(filename, "wb");
+    if(!f)
+    {
+        printf("[bake] Couldn't write the cache to %s\n", filename);
+        return;
+    }
+    
+    u32 magic = BAKE_CACHE_MAGIC;
+    u32 version = BAKE_CACHE_VERSION;
+    fwrite(&magic, sizeof(magic), 1, f);
+    fwrite(&version, sizeof(version), 1, f);
+    fwrite(&hash, sizeof(hash), 1, f);
+    fwrite(&baker->targets_len, sizeof(baker->targets_len), 1, f);
+    for(u32 i = 0; i < baker->targets_len; i++)
+    {
+        u32 size = bake_target_size(baker->targets + i);
+        fwrite(&size, sizeof(size), 1, f);
+        fwrite(baker->targets[i].result, sizeof(Vec4), size, f);
+    }
+    
+    fclose(f);
+}
+
+static Vec4
+bake_point(Baker *baker, BakePoint *point, u32 index, u64 *rays)
+{
+    BakeSettings *settings = &baker->settings;
+    
+    // NOTE: Seeded by the point so every bake of the same scene comes out the same
+    RandomSeries series = { (index * 2654435761u) | 1 };
+    Vec3 normal = point->normal;
+    Vec3 helper = fabsf(normal.x) > 0.9f ? Vec3(0.0f, 1.0f, 0.0f) : Vec3(1.0f, 0.0f, 0.0f);
+    Vec3 tangent = noz(cross(helper, normal));
+    Vec3 bitangent = cross(normal, tangent);
+    Vec3 origin = add(point->position, scale(normal, BAKE_RAY_OFFSET));
+    Vec3 to_sun = negate(settings->sun_direction);
+    
+    u32 occluded = 0;
+    Vec3 bounced = Vec3(0.0f, 0.0f, 0.0f);
+    for(u32 s = 0; s < settings->samples; s++)
+    {
+        // NOTE: Cosine weighted, the irradiance is then just the average of what the rays see
+        f32 radius = sqrtf(random_unilateral(&series));
+        f32 phi = 2.0f * (f32)PI * random_unilateral(&series);
+        Vec3 direction = add(add(scale(tangent, radius * cosf(phi)), scale(bitangent, radius * sinf(phi))),
+                             scale(normal, sqrtf(MAX(0.0f, 1.0f - radius * radius))));
+        
+        RayHit hit = {};
+        i32 e = entity_tree_raycast(&baker->tree, baker->occluders, origin, direction, &hit);
+        (*rays)++;
+        if(e < 0)
+        {
+            continue;
+        }
+        occluded += hit.t < settings->ao_radius;
+        
+        Entity *entity = baker->occluders + e;
+        Mesh *mesh = entity->model->meshes + hit.mesh;
+        u32 *tri = mesh->indices + hit.triangle * 3;
+        Vec3 *p = mesh->vertices.positions;
+        Vec3 hit_normal = bake_transform_normal(entity->inversed,
+                                                triangle_normal(p[tri[0]], p[tri[1]], p[tri[2]]));
+        if(inner(hit_normal, direction) > 0.0f)
+        {
+            hit_normal = negate(hit_normal);
+        }
+        
+        f32 lit = inner(hit_normal, to_sun);
+        if(lit <= 0.0f)
+        {
+            continue;
+        }
+        
+        Vec3 hit_point = add(origin, scale(direction, hit.t));
+        Vec3 shadow_origin = add(hit_point, scale(hit_normal, BAKE_RAY_OFFSET));
+        (*rays)++;
+        if(entity_tree_raycast(&baker->tree, baker->occluders, shadow_origin, to_sun) >= 0)
+        {
+            continue;
+        }
+        
+        Vec3 albedo = bake_mesh_albedo(entity->model, mesh);
+        bounced = add(bounced, scale(hadamard(albedo, settings->sun_color), lit));
+    }
+    
+    f32 inverse_samples = 1.0f / (f32)MAX(settings->samples, 1);
+    return Vec4(scale(bounced, inverse_samples), 1.0f - (f32)occluded * inverse_samples);
+}
+
+// NOTE: Every job keeps taking chunks until the points run out, first and
+// one_past_last only say how many workers there are.
+static void
+bake_job(void *data, u32 first, u32 one_past_last)
+{
+    NOT_USED(first);
+    NOT_USED(one_past_last);
+    Baker *baker = (Baker *)data;
+    
+    u64 rays = 0;
+    for(;;)
+    {
+        u32 start = __atomic_fetch_add(&baker->next_point, BAKE_CHUNK, __ATOMIC_RELAXED);
+        if(start >= baker->points_len)
+        {
+            break;
+        }
+        
+        u32 end = MIN(start + BAKE_CHUNK, baker->points_len);
+        for(u32 i = start; i < end; i++)
+        {
+            baker->results[i] = bake_point(baker, baker->points + i, i, &rays);
+        }
+    }
+    
+    __atomic_fetch_add(&baker->rays, rays, __ATOMIC_RELAXED);
+}
+
+// NOTE: Texels no triangle covered take the average of their covered neighbours,
+// otherwise bilinear filtering pulls black in along the uv seams.
+static void
+bake_dilate_lightmap(BakeTarget *target)
+{
+    i32 size = BAKE_LIGHTMAP_SIZE;
+    for(i32 y = 0; y < size; y++)
+    {
+        for(i32 x = 0; x < size; x++)
+        {
+            if(target->texel_point[y * size + x] >= 0)
+            {
+                continue;
+            }
+            
+            Vec4 sum = Vec4(0.0f, 0.0f, 0.0f, 0.0f);
+            f32 covered = 0.0f;
+            for(i32 dy = -1; dy <= 1; dy++)
+            {
+                for(i32 dx = -1; dx <= 1; dx++)
+                {
+                    i32 nx = x + dx;
+                    i32 ny = y + dy;
+                    if(nx >= 0 && ny >= 0 && nx < size && ny < size && target->texel_point[ny * size + nx] >= 0)
+                    {
+                        sum = add(sum, target->result[ny * size + nx]);
+                        covered += 1.0f;
+                    }
+                }
+            }
+            
+            target->result[y * size + x] = covered > 0.0f ? scale(sum, 1.0f / covered) : Vec4(0.0f, 0.0f, 0.0f, 1.0f);
+        }
+    }
+}
+
+static void
+bake_resolve(Baker *baker)
+{
+    for(u32 i = 0; i < baker->targets_len; i++)
+    {
+        BakeTarget *target = baker->targets + i;
+        if(target->type == BakeTargetType_Vertices)
+        {
+            memcpy(target->result, baker->results + target->first_point, target->points_len * sizeof(Vec4));
+        }
+        else
+        {
+            for(u32 t = 0; t < BAKE_LIGHTMAP_SIZE * BAKE_LIGHTMAP_SIZE; t++)
+            {
+                if(target->texel_point[t] >= 0)
+                {
+                    target->result[t] = baker->results[target->texel_point[t]];
+                }
+            }
+            bake_dilate_lightmap(target);
+        }
+    }
+}
+
+// NOTE: Vertex bakes are handed over to the mesh and end up in its vbo,
+// lightmaps go to a float texture.
+static void
+bake_apply(Baker *baker)
+{
+    for(u32 i = 0; i < baker->targets_len; i++)
+    {
+        BakeTarget *target = baker->targets + i;
+        Mesh *mesh = target->mesh;
+        if(target->type == BakeTargetType_Vertices)
+        {
+            free(mesh->vertices.baked_light);
+            mesh->vertices.baked_light = target->result;
+            target->result = NULL;
+            model_finalize_mesh(mesh);
+        }
+        else
+        {
+            if(mesh->lightmap == 0)
+            {
+                glGenTextures(1, &mesh->lightmap);
+            }
+            glBindTexture(GL_TEXTURE_2D, mesh->lightmap);
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA16F, BAKE_LIGHTMAP_SIZE, BAKE_LIGHTMAP_SIZE, 0,
+                         GL_RGBA, GL_FLOAT, target->result);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glBindTexture(GL_TEXTURE_2D, 0);
+        }
+    }
+}
+
+// NOTE: Bakes ambient occlusion and one bounce of sun light for every entity flagged
+// ENTITY_FLAGS_STATIC, against the other static entities only. With a cache_filename
+// the result is read from there when it matches the scene (unless load_cache is false)
+// and written there otherwise.
+static BakeStats
+bake_static_lighting(Entity *entities, u32 count, BakeSettings settings, JobQueue *jobs,
+                     const char *cache_filename, bool load_cache)
+{
+    f64 start = glfwGetTime();
+    BakeStats stats = {};
+    
+    Baker baker = {};
+    baker.settings = settings;
+    bake_collect(&baker, entities, count, jobs);
+    stats.targets = baker.targets_len;
+    stats.points = baker.points_len;
+    stats.rejected = baker.rejected;
+    
+    u64 hash = bake_hash(&baker);
+    if(baker.targets_len && cache_filename && load_cache && bake_cache_load(&baker, cache_filename, hash))
+    {
+        stats.from_cache = true;
+    }
+    else if(baker.targets_len)
+    {
+        baker.tree = entity_tree_create(baker.occluders_len);
+        entity_tree_build(&baker.tree, baker.occluders, baker.occluders_len);
+        baker.results = (Vec4 *)malloc(baker.points_len * sizeof(Vec4));
+        
+        jobs_parallel_for(jobs, jobs->threads_count + 1, 1, bake_job, &baker);
+        bake_resolve(&baker);
+        if(cache_filename)
+        {
+            bake_cache_save(&baker, cache_filename, hash);
+        }
+        
+        entity_tree_destroy(&baker.tree);
+        stats.rays = baker.rays;
+    }
+    
+    bake_apply(&baker);
+    
+    for(u32 i = 0; i < baker.targets_len; i++)
+    {
+        free(baker.targets[i].texel_point);
+        free(baker.targets[i].result);
+    }
+    free(baker.targets);
+    free(baker.points);
+    free(baker.results);
+    free(baker.occluders);
+    
+    stats.time = glfwGetTime() - start;
+    
+    return stats;
+}
@@ -0,0 +1,89 @@
+/* date = October 19th 2026 10:35 pm */
+
+#ifndef HAMSTER_BAKE_H
+#define HAMSTER_BAKE_H
+
+#define BAKE_SAMPLES 64
+#define BAKE_AO_RADIUS 2.0f
+#define BAKE_RAY_OFFSET 0.001f
+#define BAKE_LIGHTMAP_SIZE 128
+// NOTE: Points a worker grabs at once, small enough that a thread stuck on
+// an expensive patch doesn't hold up the rest of the bake.
+#define BAKE_CHUNK 32
+#define BAKE_CACHE_MAGIC 0x454b4148 // NOTE: "HAKE"
+#define BAKE_CACHE_VERSION 1
+#define BAKE_CACHE_FILENAME "data/bake.cache"
+
+// NOTE: The ambient occlusion goes into w, xyz is the light bounced off the
+// static geometry from the sun (the sky is already the ambient term). Meshes
+// without any bake read the default attribute, (0, 0, 0, 1).
+struct BakeSettings
+{
+    Vec3 sun_direction;
+    Vec3 sun_color;
+    f32 ao_radius;
+    u32 samples;
+};
+
+enum BakeTargetType
+{
+    BakeTargetType_Vertices,
+    BakeTargetType_Lightmap,
+};
+
+// NOTE: One mesh of one static entity. Vertex targets get a point per vertex,
+// lightmap ones a point per texel some triangle covers in uv space.
+struct BakeTarget
+{
+    BakeTargetType type;
+    Entity *entity;
+    Mesh *mesh;
+    u32 first_point;
+    u32 points_len;
+    i32 *texel_point; // NOTE: BAKE_LIGHTMAP_SIZE^2, -1 where nothing got rasterized
+    Vec4 *result; // NOTE: vertices_len or BAKE_LIGHTMAP_SIZE^2 entries
+};
+
+struct BakePoint
+{
+    Vec3 position;
+    Vec3 normal;
+};
+
+// NOTE: The static entities are the only occluders, they get their own tree so
+// nothing that moves ends up in the bake. Workers keep grabbing BAKE_CHUNK points
+// off next_point until they run out, so the uneven cost of the points (open floor
+// against the inside of a model) evens out across threads.
+struct Baker
+{
+    BakeSettings settings;
+    
+    Entity *occluders; // NOTE: Copies, their cached inverse gives the normals at hit points
+    u32 occluders_len;
+    EntityTree tree;
+    
+    BakeTarget *targets;
+    u32 targets_len;
+    BakePoint *points;
+    Vec4 *results;
+    u32 points_len;
+    u32 next_point;
+    
+    u32 rejected; // NOTE: Static entities left out because their model is shared
+    u64 rays;
+};
+
+struct BakeStats
+{
+    u32 targets;
+    u32 points;
+    u32 rejected;
+    u64 rays;
+    f64 time;
+    bool from_cache;
+};
+
+static BakeStats bake_static_lighting(Entity *entities, u32 count, BakeSettings settings, JobQueue *jobs,
+                                      const char *cache_filename, bool load_cache = true);
+                                      
+#endif //HAMSTER_BAKE_H
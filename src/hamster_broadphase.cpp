@@ -0,0 +1,803 @@
+static void
+broadphase_boxes_resize(BroadphaseBoxes *boxes, u32 capacity)
+{
+    u32 size = (capacity + BROADPHASE_LANES) * sizeof(f32);
+    boxes->min_x = (f32 *)realloc(boxes->min_x, size);
+    boxes->min_y = (f32 *)realloc(boxes->min_y, size);
+    boxes->min_z = (f32 *)realloc(boxes->min_z, size);
+    boxes->max_x = (f32 *)realloc(boxes->max_x, size);
+    boxes->max_y = (f32 *)realloc(boxes->max_y, size);
+    boxes->max_z = (f32 *)realloc(boxes->max_z, size);
+    assert(boxes->min_x && boxes->min_y && boxes->min_z && boxes->max_x && boxes->max_y && boxes->max_z);
+}
+
+static void
+broadphase_boxes_free(BroadphaseBoxes *boxes)
+{
+    free(boxes->min_x);
+    free(boxes->min_y);
+    free(boxes->min_z);
+    free(boxes->max_x);
+    free(boxes->max_y);
+    free(boxes->max_z);
+    memset(boxes, 0, sizeof(*boxes));
+}
+
+static void
+broadphase_boxes_set(BroadphaseBoxes *boxes, u32 index, Vec3 min, Vec3 max)
+{
+    boxes->min_x[index] = min.x;
+    boxes->min_y[index] = min.y;
+    boxes->min_z[index] = min.z;
+    boxes->max_x[index] = max.x;
+    boxes->max_y[index] = max.y;
+    boxes->max_z[index] = max.z;
+}
+
+static void
+broadphase_boxes_get(BroadphaseBoxes *boxes, u32 index, Vec3 *min, Vec3 *max)
+{
+    *min = Vec3(boxes->min_x[index], boxes->min_y[index], boxes->min_z[index]);
+    *max = Vec3(boxes->max_x[index], boxes->max_y[index], boxes->max_z[index]);
+}
+
+// NOTE: Inverted boxes, min > max on every axis so they fail every overlap test
+static void
+broadphase_boxes_pad(BroadphaseBoxes *boxes, u32 count)
+{
+    for(u32 i = count; i < count + BROADPHASE_LANES; i++)
+    {
+        broadphase_boxes_set(boxes, i, Vec3(F32MAX, F32MAX, F32MAX), Vec3(-F32MAX, -F32MAX, -F32MAX));
+    }
+}
+
+static void
+broadphase_reserve_proxies(Broadphase *bp, u32 capacity)
+{
+    if(capacity <= bp->proxies_capacity)
+    {
+        return;
+    }
+    
+    capacity = MAX(capacity, bp->proxies_capacity * 2);
+    broadphase_boxes_resize(&bp->bounds, capacity);
+    broadphase_boxes_resize(&bp->sweep, capacity);
+    bp->proxy_entity = (u32 *)realloc(bp->proxy_entity, capacity * sizeof(u32));
+    bp->proxy_mesh = (u32 *)realloc(bp->proxy_mesh, capacity * sizeof(u32));
+    bp->proxy_flags = (BroadphaseProxyFlags *)realloc(bp->proxy_flags, capacity * sizeof(BroadphaseProxyFlags));
+    bp->proxy_cells = (i32 *)realloc(bp->proxy_cells, 6 * capacity * sizeof(i32));
+    bp->moved = (u32 *)realloc(bp->moved, capacity * sizeof(u32));
+    bp->sorted = (BroadphaseSortEntry *)realloc(bp->sorted, capacity * sizeof(BroadphaseSortEntry));
+    bp->sweep_proxy = (u32 *)realloc(bp->sweep_proxy, capacity * sizeof(u32));
+    bp->large = (u32 *)realloc(bp->large, capacity * sizeof(u32));
+    bp->proxies_capacity = capacity;
+    
+    broadphase_boxes_pad(&bp->bounds, bp->proxies_len);
+}
+
+static void
+broadphase_reserve_entities(Broadphase *bp, u32 capacity)
+{
+    if(capacity <= bp->entities_capacity)
+    {
+        return;
+    }
+    
+    capacity = MAX(capacity, bp->entities_capacity * 2);
+    // NOTE: One past the last entity holds proxies_len, so every entity's count is a difference
+    bp->entity_first_proxy = (u32 *)realloc(bp->entity_first_proxy, (capacity + 1) * sizeof(u32));
+    bp->entities_capacity = capacity;
+}
+
+static Broadphase
+broadphase_create(u32 capacity)
+{
+    Broadphase result = {};
+    
+    result.cell_size = BROADPHASE_DEFAULT_CELL_SIZE;
+    broadphase_reserve_proxies(&result, MAX(capacity, 1));
+    broadphase_reserve_entities(&result, MAX(capacity, 1));
+    result.entity_first_proxy[0] = 0;
+    
+    result.cells_capacity = 1024;
+    result.cells = (BroadphaseCell *)calloc(result.cells_capacity, sizeof(BroadphaseCell));
+    result.occupied = (u32 *)malloc(result.cells_capacity * sizeof(u32));
+    
+    result.pairs_capacity = 1024;
+    result.pairs = (BroadphasePair *)malloc(result.pairs_capacity * sizeof(BroadphasePair));
+    
+    return result;
+}
+
+static void
+broadphase_destroy(Broadphase *bp)
+{
+    broadphase_boxes_free(&bp->bounds);
+    broadphase_boxes_free(&bp->sweep);
+    free(bp->proxy_entity);
+    free(bp->proxy_mesh);
+    free(bp->proxy_flags);
+    free(bp->proxy_cells);
+    free(bp->moved);
+    free(bp->sorted);
+    free(bp->sweep_proxy);
+    free(bp->large);
+    free(bp->entity_first_proxy);
+    for(u32 i = 0; i < bp->cells_capacity; i++)
+    {
+        free(bp->cells[i].items);
+    }
+    free(bp->cells);
+    free(bp->occupied);
+    free(bp->pairs);
+    memset(bp, 0, sizeof(*bp));
+}
+
+static void
+broadphase_entity_bounds(Broadphase *bp, Entity *entity, u32 index)
+{
+    u32 first = bp->entity_first_proxy[index];
+    Model *model = entity->model;
+    if(model->hitboxes_len == 0)
+    {
+        Vec3 min = {};
+        Vec3 max = {};
+        entity_bounds(entity, &min, &max);
+        broadphase_boxes_set(&bp->bounds, first, min, max);
+        return;
+    }
+    
+    Mat4 transform = entity_world(entity);
+    
+    // NOTE: The hitboxes go through transform_boxes in chunks, written straight into
+    // the entity's proxies
+    f32 local[6][BROADPHASE_HITBOX_CHUNK];
+    Vec3Array local_min = { local[0], local[1], local[2] };
+    Vec3Array local_max = { local[3], local[4], local[5] };
+    for(u32 chunk = 0; chunk < model->hitboxes_len; chunk += BROADPHASE_HITBOX_CHUNK)
+    {
+        u32 chunk_len = MIN(model->hitboxes_len - chunk, BROADPHASE_HITBOX_CHUNK);
+        for(u32 i = 0; i < chunk_len; i++)
+        {
+            Vec3 min = {};
+            Vec3 max = {};
+            hitbox_bounds(model->hitboxes + chunk + i, &min, &max);
+            local_min.x[i] = min.x;
+            local_min.y[i] = min.y;
+            local_min.z[i] = min.z;
+            local_max.x[i] = max.x;
+            local_max.y[i] = max.y;
+            local_max.z[i] = max.z;
+        }
+        
+        u32 proxy = first + chunk;
+        BroadphaseBoxes *bounds = &bp->bounds;
+        Vec3Array min = { bounds->min_x + proxy, bounds->min_y + proxy, bounds->min_z + proxy };
+        Vec3Array max = { bounds->max_x + proxy, bounds->max_y + proxy, bounds->max_z + proxy };
+        transform_boxes(transform, local_min, local_max, chunk_len, min, max);
+    }
+}
+
+static void
+broadphase_mark_moved(Broadphase *bp, u32 proxy)
+{
+    if(!FLAG_IS_SET(bp->proxy_flags[proxy], BROADPHASE_PROXY_MOVED))
+    {
+        FLAG_SET(bp->proxy_flags[proxy], BROADPHASE_PROXY_MOVED);
+        bp->moved[bp->moved_len++] = proxy;
+    }
+}
+
+static void
+broadphase_add_entities(Broadphase *bp, Entity *entities, u32 count)
+{
+    if(count <= bp->entities_len)
+    {
+        return;
+    }
+    
+    broadphase_reserve_entities(bp, count);
+    for(u32 e = bp->entities_len; e < count; e++)
+    {
+        Model *model = entities[e].model;
+        u32 proxies = MAX(model->hitboxes_len, 1);
+        broadphase_reserve_proxies(bp, bp->proxies_len + proxies);
+        
+        bp->entity_first_proxy[e] = bp->proxies_len;
+        for(u32 i = 0; i < proxies; i++)
+        {
+            u32 p = bp->proxies_len + i;
+            bp->proxy_entity[p] = e;
+            bp->proxy_mesh[p] = model->hitboxes_len ? i : BROADPHASE_NO_MESH;
+            bp->proxy_flags[p] = 0;
+        }
+        bp->proxies_len += proxies;
+        bp->entity_first_proxy[e + 1] = bp->proxies_len;
+        
+        broadphase_entity_bounds(bp, entities + e, e);
+        for(u32 p = bp->entity_first_proxy[e]; p < bp->proxies_len; p++)
+        {
+            broadphase_mark_moved(bp, p);
+        }
+    }
+    
+    bp->entities_len = count;
+    broadphase_boxes_pad(&bp->bounds, bp->proxies_len);
+}
+
+static void
+broadphase_move(Broadphase *bp, Entity *entities, u32 index)
+{
+    if(index >= bp->entities_len)
+    {
+        return;
+    }
+    
+    broadphase_entity_bounds(bp, entities + index, index);
+    for(u32 p = bp->entity_first_proxy[index]; p < bp->entity_first_proxy[index + 1]; p++)
+    {
+        broadphase_mark_moved(bp, p);
+    }
+}
+
+// NOTE: Bit per lane of the BROADPHASE_LANES boxes from first on that overlap min/max,
+// touching counts as overlapping.
+static u32
+broadphase_overlap8(BroadphaseBoxes *boxes, u32 first, Vec3 min, Vec3 max)
+{
+#ifdef __AVX__
+    __m256 overlap = _mm256_and_ps(_mm256_cmp_ps(_mm256_loadu_ps(boxes->min_x + first), _mm256_set1_ps(max.x), _CMP_LE_OQ),
+                                   _mm256_cmp_ps(_mm256_loadu_ps(boxes->max_x + first), _mm256_set1_ps(min.x), _CMP_GE_OQ));
+    overlap = _mm256_and_ps(overlap, _mm256_cmp_ps(_mm256_loadu_ps(boxes->min_y + first), _mm256_set1_ps(max.y), _CMP_LE_OQ));
+    overlap = _mm256_and_ps(overlap, _mm256_cmp_ps(_mm256_loadu_ps(boxes->max_y + first), _mm256_set1_ps(min.y), _CMP_GE_OQ));
+    overlap = _mm256_and_ps(overlap, _mm256_cmp_ps(_mm256_loadu_ps(boxes->min_z + first), _mm256_set1_ps(max.z), _CMP_LE_OQ));
+    overlap = _mm256_and_ps(overlap, _mm256_cmp_ps(_mm256_loadu_ps(boxes->max_z + first), _mm256_set1_ps(min.z), _CMP_GE_OQ));
+    
+    return (u32)_mm256_movemask_ps(overlap);
+#elif defined(__SSE2__)
+    u32 result = 0;
+    for(u32 half = 0; half < BROADPHASE_LANES; half += 4)
+    {
+        u32 i = first + half;
+        __m128 overlap = _mm_and_ps(_mm_cmple_ps(_mm_loadu_ps(boxes->min_x + i), _mm_set1_ps(max.x)),
+                                    _mm_cmpge_ps(_mm_loadu_ps(boxes->max_x + i), _mm_set1_ps(min.x)));
+        overlap = _mm_and_ps(overlap, _mm_cmple_ps(_mm_loadu_ps(boxes->min_y + i), _mm_set1_ps(max.y)));
+        overlap = _mm_and_ps(overlap, _mm_cmpge_ps(_mm_loadu_ps(boxes->max_y + i), _mm_set1_ps(min.y)));
+        overlap = _mm_and_ps(overlap, _mm_cmple_ps(_mm_loadu_ps(boxes->min_z + i), _mm_set1_ps(max.z)));
+        overlap = _mm_and_ps(overlap, _mm_cmpge_ps(_mm_loadu_ps(boxes->max_z + i), _mm_set1_ps(min.z)));
+        result |= (u32)_mm_movemask_ps(overlap) << half;
+    }
+    
+    return result;
+#else
+    u32 result = 0;
+    for(u32 lane = 0; lane < BROADPHASE_LANES; lane++)
+    {
+        u32 i = first + lane;
+        bool overlap = boxes->min_x[i] <= max.x && boxes->max_x[i] >= min.x &&
+            boxes->min_y[i] <= max.y && boxes->max_y[i] >= min.y &&
+            boxes->min_z[i] <= max.z && boxes->max_z[i] >= min.z;
+        result |= (u32)overlap << lane;
+    }
+    
+    return result;
+#endif
+}
+
+static void
+broadphase_pairs_flush(Broadphase *bp, BroadphasePairsBuffer *buffer)
+{
+    // NOTE: Past the capacity the pairs are only counted, the update grows the array and runs again
+    u32 first = __atomic_fetch_add(&bp->pairs_len, buffer->len, __ATOMIC_RELAXED);
+    if(first < bp->pairs_capacity)
+    {
+        u32 count = MIN(buffer->len, bp->pairs_capacity - first);
+        memcpy(bp->pairs + first, buffer->pairs, count * sizeof(BroadphasePair));
+    }
+    buffer->len = 0;
+}
+
+static void
+broadphase_pairs_push(Broadphase *bp, BroadphasePairsBuffer *buffer, u32 proxy_a, u32 proxy_b)
+{
+    u32 entity_a = bp->proxy_entity[proxy_a];
+    u32 entity_b = bp->proxy_entity[proxy_b];
+    if(entity_a == entity_b)
+    {
+        return;
+    }
+    if(entity_a > entity_b)
+    {
+        u32 temp = proxy_a;
+        proxy_a = proxy_b;
+        proxy_b = temp;
+    }
+    
+    BroadphasePair *pair = buffer->pairs + buffer->len++;
+    pair->entity_a = bp->proxy_entity[proxy_a];
+    pair->mesh_a = bp->proxy_mesh[proxy_a];
+    pair->entity_b = bp->proxy_entity[proxy_b];
+    pair->mesh_b = bp->proxy_mesh[proxy_b];
+    if(buffer->len == BROADPHASE_PAIRS_FLUSH)
+    {
+        broadphase_pairs_flush(bp, buffer);
+    }
+}
+
+static int
+broadphase_sort_compare(const void *a, const void *b)
+{
+    f32 key_a = ((BroadphaseSortEntry *)a)->key;
+    f32 key_b = ((BroadphaseSortEntry *)b)->key;
+    return (key_a > key_b) - (key_a < key_b);
+}
+
+// NOTE: Between frames things barely move, so the order from the last frame is almost
+// right and the insertion sort does close to a single pass over it.
+static void
+broadphase_sort(Broadphase *bp)
+{
+    BroadphaseSortEntry *sorted = bp->sorted;
+    u32 old_len = bp->sorted_len;
+    u32 count = bp->proxies_len;
+    for(u32 i = 0; i < old_len; i++)
+    {
+        sorted[i].key = bp->bounds.min_x[sorted[i].proxy];
+    }
+    for(u32 p = old_len; p < count; p++)
+    {
+        sorted[p].key = bp->bounds.min_x[p];
+        sorted[p].proxy = p;
+    }
+    
+    u32 added = count - old_len;
+    bool merge = added > BROADPHASE_MERGE_THRESHOLD;
+    u32 insertion_len = merge ? old_len : count;
+    
+    bp->swaps = 0;
+    for(u32 i = 1; i < insertion_len; i++)
+    {
+        BroadphaseSortEntry entry = sorted[i];
+        u32 j = i;
+        while(j > 0 && sorted[j - 1].key > entry.key)
+        {
+            sorted[j] = sorted[j - 1];
+            j--;
+        }
+        sorted[j] = entry;
+        bp->swaps += i - j;
+    }
+    
+    if(merge)
+    {
+        qsort(sorted + old_len, added, sizeof(BroadphaseSortEntry), broadphase_sort_compare);
+        
+        BroadphaseSortEntry *merged = (BroadphaseSortEntry *)malloc(count * sizeof(BroadphaseSortEntry));
+        u32 a = 0;
+        u32 b = old_len;
+        for(u32 i = 0; i < count; i++)
+        {
+            bool take_a = b == count || (a < old_len && sorted[a].key <= sorted[b].key);
+            merged[i] = take_a ? sorted[a++] : sorted[b++];
+        }
+        memcpy(sorted, merged, count * sizeof(BroadphaseSortEntry));
+        free(merged);
+    }
+    bp->sorted_len = count;
+    
+    for(u32 i = 0; i < count; i++)
+    {
+        u32 p = sorted[i].proxy;
+        Vec3 min = {};
+        Vec3 max = {};
+        broadphase_boxes_get(&bp->bounds, p, &min, &max);
+        broadphase_boxes_set(&bp->sweep, i, min, max);
+        bp->sweep_proxy[i] = p;
+    }
+    broadphase_boxes_pad(&bp->sweep, count);
+}
+
+// NOTE: [first, one_past_last) are positions in the sorted order, every proxy only
+// looks forward until the boxes start past its max x.
+static void
+broadphase_sweep_job(void *data, u32 first, u32 one_past_last)
+{
+    Broadphase *bp = (Broadphase *)data;
+    BroadphaseBoxes *sweep = &bp->sweep;
+    u32 count = bp->proxies_len;
+    BroadphasePairsBuffer buffer;
+    buffer.len = 0;
+    
+    for(u32 i = first; i < one_past_last; i++)
+    {
+        Vec3 min = {};
+        Vec3 max = {};
+        broadphase_boxes_get(sweep, i, &min, &max);
+        for(u32 j = i + 1; j < count && sweep->min_x[j] <= max.x; j += BROADPHASE_LANES)
+        {
+            u32 mask = broadphase_overlap8(sweep, j, min, max);
+            while(mask)
+            {
+                u32 lane = find_first_set_bit(mask);
+                mask &= mask - 1;
+                broadphase_pairs_push(bp, &buffer, bp->sweep_proxy[i], bp->sweep_proxy[j + lane]);
+            }
+        }
+    }
+    
+    broadphase_pairs_flush(bp, &buffer);
+}
+
+static i32
+broadphase_cell_coord(f32 v, f32 inverse_size)
+{
+    f32 cell = floorf(v * inverse_size);
+    cell = MIN(MAX(cell, -(f32)BROADPHASE_CELL_LIMIT), (f32)BROADPHASE_CELL_LIMIT);
+    return (i32)cell;
+}
+
+static u32
+broadphase_cell_hash(i32 x, i32 y, i32 z)
+{
+    return ((u32)x * 73856093u) ^ ((u32)y * 19349663u) ^ ((u32)z * 83492791u);
+}
+
+static void
+broadphase_grow_cells(Broadphase *bp)
+{
+    BroadphaseCell *old_cells = bp->cells;
+    u32 old_capacity = bp->cells_capacity;
+    
+    bp->cells_capacity *= 2;
+    bp->cells = (BroadphaseCell *)calloc(bp->cells_capacity, sizeof(BroadphaseCell));
+    bp->occupied = (u32 *)realloc(bp->occupied, bp->cells_capacity * sizeof(u32));
+    u32 mask = bp->cells_capacity - 1;
+    for(u32 i = 0; i < old_capacity; i++)
+    {
+        BroadphaseCell *cell = old_cells + i;
+        if(!cell->used)
+        {
+            continue;
+        }
+        
+        u32 slot = broadphase_cell_hash(cell->x, cell->y, cell->z) & mask;
+        while(bp->cells[slot].used)
+        {
+            slot = (slot + 1) & mask;
+        }
+        bp->cells[slot] = *cell;
+    }
+    
+    free(old_cells);
+}
+
+// NOTE: Linear probing, cells stay in the table once created even when they empty out
+static BroadphaseCell *
+broadphase_find_cell(Broadphase *bp, i32 x, i32 y, i32 z, bool create)
+{
+    if(create && (bp->cells_used + 1) * 2 > bp->cells_capacity)
+    {
+        broadphase_grow_cells(bp);
+    }
+    
+    u32 mask = bp->cells_capacity - 1;
+    for(u32 slot = broadphase_cell_hash(x, y, z) & mask;; slot = (slot + 1) & mask)
+    {
+        BroadphaseCell *cell = bp->cells + slot;
+        if(!cell->used)
+        {
+            if(!create)
+            {
+                return NULL;
+            }
+            
+            cell->used = true;
+            cell->x = x;
+            cell->y = y;
+            cell->z = z;
+            bp->cells_used++;
+            return cell;
+        }
+        
+        if(cell->x == x && cell->y == y && cell->z == z)
+        {
+            return cell;
+        }
+    }
+}
+
+static void
+broadphase_cell_range(Broadphase *bp, u32 proxy, i32 *range)
+{
+    f32 inverse_size = 1.0f / bp->cell_size;
+    range[0] = broadphase_cell_coord(bp->bounds.min_x[proxy], inverse_size);
+    range[1] = broadphase_cell_coord(bp->bounds.min_y[proxy], inverse_size);
+    range[2] = broadphase_cell_coord(bp->bounds.min_z[proxy], inverse_size);
+    range[3] = broadphase_cell_coord(bp->bounds.max_x[proxy], inverse_size);
+    range[4] = broadphase_cell_coord(bp->bounds.max_y[proxy], inverse_size);
+    range[5] = broadphase_cell_coord(bp->bounds.max_z[proxy], inverse_size);
+}
+
+static void
+broadphase_hash_remove(Broadphase *bp, u32 proxy)
+{
+    if(FLAG_IS_SET(bp->proxy_flags[proxy], BROADPHASE_PROXY_LARGE))
+    {
+        for(u32 i = 0; i < bp->large_len; i++)
+        {
+            if(bp->large[i] == proxy)
+            {
+                bp->large[i] = bp->large[--bp->large_len];
+                break;
+            }
+        }
+    }
+    else
+    {
+        i32 *range = bp->proxy_cells + 6 * proxy;
+        for(i32 z = range[2]; z <= range[5]; z++)
+        {
+            for(i32 y = range[1]; y <= range[4]; y++)
+            {
+                for(i32 x = range[0]; x <= range[3]; x++)
+                {
+                    BroadphaseCell *cell = broadphase_find_cell(bp, x, y, z, false);
+                    assert(cell);
+                    for(u32 i = 0; i < cell->len; i++)
+                    {
+                        if(cell->items[i] == proxy)
+                        {
+                            cell->items[i] = cell->items[--cell->len];
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    
+    FLAG_UNSET(bp->proxy_flags[proxy], BROADPHASE_PROXY_HASHED | BROADPHASE_PROXY_LARGE);
+}
+
+static void
+broadphase_hash_insert(Broadphase *bp, u32 proxy, i32 *range)
+{
+    memcpy(bp->proxy_cells + 6 * proxy, range, 6 * sizeof(i32));
+    FLAG_SET(bp->proxy_flags[proxy], BROADPHASE_PROXY_HASHED);
+    
+    u64 cells = (u64)(range[3] - range[0] + 1) * (u64)(range[4] - range[1] + 1) * (u64)(range[5] - range[2] + 1);
+    if(cells > BROADPHASE_MAX_PROXY_CELLS)
+    {
+        FLAG_SET(bp->proxy_flags[proxy], BROADPHASE_PROXY_LARGE);
+        bp->large[bp->large_len++] = proxy;
+        return;
+    }
+    
+    for(i32 z = range[2]; z <= range[5]; z++)
+    {
+        for(i32 y = range[1]; y <= range[4]; y++)
+        {
+            for(i32 x = range[0]; x <= range[3]; x++)
+            {
+                BroadphaseCell *cell = broadphase_find_cell(bp, x, y, z, true);
+                if(cell->len == cell->capacity)
+                {
+                    cell->capacity = cell->capacity ? cell->capacity * 2 : 8;
+                    cell->items = (u32 *)realloc(cell->items, cell->capacity * sizeof(u32));
+                }
+                cell->items[cell->len++] = proxy;
+            }
+        }
+    }
+}
+
+// NOTE: Only touches the table when the proxy crossed into a different set of cells
+static void
+broadphase_hash_move(Broadphase *bp, u32 proxy)
+{
+    i32 range[6];
+    broadphase_cell_range(bp, proxy, range);
+    if(FLAG_IS_SET(bp->proxy_flags[proxy], BROADPHASE_PROXY_HASHED))
+    {
+        if(memcmp(range, bp->proxy_cells + 6 * proxy, sizeof(range)) == 0)
+        {
+            return;
+        }
+        broadphase_hash_remove(bp, proxy);
+    }
+    
+    broadphase_hash_insert(bp, proxy, range);
+}
+
+static void
+broadphase_hash_reset(Broadphase *bp)
+{
+    for(u32 i = 0; i < bp->cells_capacity; i++)
+    {
+        free(bp->cells[i].items);
+    }
+    memset(bp->cells, 0, bp->cells_capacity * sizeof(BroadphaseCell));
+    bp->cells_used = 0;
+    bp->large_len = 0;
+    
+    bp->moved_len = 0;
+    for(u32 p = 0; p < bp->proxies_len; p++)
+    {
+        bp->proxy_flags[p] = BROADPHASE_PROXY_MOVED;
+        bp->moved[bp->moved_len++] = p;
+    }
+    
+    bp->hashed_cell_size = bp->cell_size;
+    bp->hash_valid = true;
+}
+
+// NOTE: A pair of proxies shares every cell their overlap covers, it only gets
+// reported from the cell holding the overlap's min corner.
+static void
+broadphase_hash_job(void *data, u32 first, u32 one_past_last)
+{
+    Broadphase *bp = (Broadphase *)data;
+    f32 inverse_size = 1.0f / bp->cell_size;
+    BroadphasePairsBuffer buffer;
+    buffer.len = 0;
+    
+    u32 scratch_capacity = 0;
+    for(u32 c = first; c < one_past_last; c++)
+    {
+        scratch_capacity = MAX(scratch_capacity, bp->cells[bp->occupied[c]].len);
+    }
+    BroadphaseBoxes scratch = {};
+    broadphase_boxes_resize(&scratch, scratch_capacity);
+    
+    for(u32 c = first; c < one_past_last; c++)
+    {
+        BroadphaseCell *cell = bp->cells + bp->occupied[c];
+        u32 count = cell->len;
+        for(u32 i = 0; i < count; i++)
+        {
+            Vec3 min = {};
+            Vec3 max = {};
+            broadphase_boxes_get(&bp->bounds, cell->items[i], &min, &max);
+            broadphase_boxes_set(&scratch, i, min, max);
+        }
+        broadphase_boxes_pad(&scratch, count);
+        
+        for(u32 i = 0; i < count; i++)
+        {
+            Vec3 min = {};
+            Vec3 max = {};
+            broadphase_boxes_get(&scratch, i, &min, &max);
+            for(u32 j = i + 1; j < count; j += BROADPHASE_LANES)
+            {
+                u32 mask = broadphase_overlap8(&scratch, j, min, max);
+                while(mask)
+                {
+                    u32 lane = find_first_set_bit(mask);
+                    mask &= mask - 1;
+                    
+                    u32 other = j + lane;
+                    i32 x = broadphase_cell_coord(MAX(min.x, scratch.min_x[other]), inverse_size);
+                    i32 y = broadphase_cell_coord(MAX(min.y, scratch.min_y[other]), inverse_size);
+                    i32 z = broadphase_cell_coord(MAX(min.z, scratch.min_z[other]), inverse_size);
+                    if(x == cell->x && y == cell->y && z == cell->z)
+                    {
+                        broadphase_pairs_push(bp, &buffer, cell->items[i], cell->items[other]);
+                    }
+                }
+            }
+        }
+    }
+    
+    broadphase_boxes_free(&scratch);
+    broadphase_pairs_flush(bp, &buffer);
+}
+
+// NOTE: Proxies too big for the hash against everything, two large ones only pair
+// up from the lower proxy index.
+static void
+broadphase_large_job(void *data, u32 first, u32 one_past_last)
+{
+    Broadphase *bp = (Broadphase *)data;
+    u32 count = bp->proxies_len;
+    BroadphasePairsBuffer buffer;
+    buffer.len = 0;
+    
+    for(u32 l = first; l < one_past_last; l++)
+    {
+        u32 proxy = bp->large[l];
+        Vec3 min = {};
+        Vec3 max = {};
+        broadphase_boxes_get(&bp->bounds, proxy, &min, &max);
+        for(u32 j = 0; j < count; j += BROADPHASE_LANES)
+        {
+            u32 mask = broadphase_overlap8(&bp->bounds, j, min, max);
+            while(mask)
+            {
+                u32 other = j + find_first_set_bit(mask);
+                mask &= mask - 1;
+                if(FLAG_IS_SET(bp->proxy_flags[other], BROADPHASE_PROXY_LARGE) && other <= proxy)
+                {
+                    continue;
+                }
+                broadphase_pairs_push(bp, &buffer, proxy, other);
+            }
+        }
+    }
+    
+    broadphase_pairs_flush(bp, &buffer);
+}
+
+// NOTE: Picks up entities added since the last update, moved proxies were already
+// refreshed by broadphase_move. Fills bp->pairs with every overlapping pair.
+static void
+broadphase_update(Broadphase *bp, Entity *entities, u32 count, JobQueue *jobs)
+{
+    f64 start = glfwGetTime();
+    broadphase_add_entities(bp, entities, count);
+    
+    bool hash = bp->backend == BroadphaseBackend_SpatialHash;
+    if(hash)
+    {
+        if(!bp->hash_valid || bp->hashed_cell_size != bp->cell_size)
+        {
+            broadphase_hash_reset(bp);
+        }
+        for(u32 i = 0; i < bp->moved_len; i++)
+        {
+            broadphase_hash_move(bp, bp->moved[i]);
+        }
+        
+        bp->occupied_len = 0;
+        u32 live_cells = 0;
+        for(u32 i = 0; i < bp->cells_capacity; i++)
+        {
+            live_cells += bp->cells[i].len > 0;
+            if(bp->cells[i].len > 1)
+            {
+                bp->occupied[bp->occupied_len++] = i;
+            }
+        }
+        
+        // NOTE: Emptied cells stay in the table, once they are most of it start over next time
+        if(bp->cells_used > 4 * live_cells + 1024)
+        {
+            bp->hash_valid = false;
+        }
+    }
+    else
+    {
+        // NOTE: Moves aren't tracked for the hash meanwhile, switching back rebuilds it
+        bp->hash_valid = false;
+        broadphase_sort(bp);
+    }
+    
+    for(u32 i = 0; i < bp->moved_len; i++)
+    {
+        FLAG_UNSET(bp->proxy_flags[bp->moved[i]], BROADPHASE_PROXY_MOVED);
+    }
+    bp->moved_len = 0;
+    
+    for(;;)
+    {
+        bp->pairs_len = 0;
+        if(hash)
+        {
+            jobs_parallel_for(jobs, bp->occupied_len, BROADPHASE_MIN_BATCH_CELLS, broadphase_hash_job, bp);
+            jobs_parallel_for(jobs, bp->large_len, 1, broadphase_large_job, bp);
+        }
+        else
+        {
+            jobs_parallel_for(jobs, bp->proxies_len, BROADPHASE_MIN_BATCH, broadphase_sweep_job, bp);
+        }
+        
+        if(bp->pairs_len <= bp->pairs_capacity)
+        {
+            break;
+        }
+        
+        bp->pairs_capacity = MAX(bp->pairs_len, bp->pairs_capacity * 2);
+        bp->pairs = (BroadphasePair *)realloc(bp->pairs, bp->pairs_capacity * sizeof(BroadphasePair));
+    }
+    
+    bp->last_update_time = glfwGetTime() - start;
+}
@@ -0,0 +1,135 @@
+/* date = October 19th 2026 9:40 pm */
+
+#ifndef HAMSTER_BROADPHASE_H
+#define HAMSTER_BROADPHASE_H
+
+#define BROADPHASE_LANES 8
+#define BROADPHASE_NO_MESH U32MAX // NOTE: Models without hitboxes get one proxy for the whole entity
+#define BROADPHASE_DEFAULT_CELL_SIZE 4.0f
+// NOTE: Proxies spanning more cells than this stay out of the hash and get tested
+// against every other proxy instead (the floor would otherwise be in thousands of cells).
+#define BROADPHASE_MAX_PROXY_CELLS 64
+#define BROADPHASE_MIN_BATCH 1024
+#define BROADPHASE_MIN_BATCH_CELLS 256
+// NOTE: When more proxies than this get added at once they are sorted on their own
+// and merged in, insertion sort would be quadratic on them.
+#define BROADPHASE_MERGE_THRESHOLD 64
+#define BROADPHASE_PAIRS_FLUSH 128
+#define BROADPHASE_CELL_LIMIT (1 << 20)
+#define BROADPHASE_HITBOX_CHUNK 64 // NOTE: Hitboxes per transform_boxes call
+
+enum BroadphaseBackend
+{
+    BroadphaseBackend_SortAndSweep,
+    BroadphaseBackend_SpatialHash,
+};
+
+typedef u8 BroadphaseProxyFlags;
+enum
+{
+    BROADPHASE_PROXY_MOVED = 0x1,
+    BROADPHASE_PROXY_HASHED = 0x2,
+    BROADPHASE_PROXY_LARGE = 0x4,
+};
+
+// NOTE: entity_a < entity_b, meshes of the same entity never get paired
+struct BroadphasePair
+{
+    u32 entity_a;
+    u32 mesh_a;
+    u32 entity_b;
+    u32 mesh_b;
+};
+
+// NOTE: World space boxes one component per array. There are always BROADPHASE_LANES
+// boxes past the end that overlap nothing, so the kernel can read a full group anywhere.
+struct BroadphaseBoxes
+{
+    f32 *min_x;
+    f32 *min_y;
+    f32 *min_z;
+    f32 *max_x;
+    f32 *max_y;
+    f32 *max_z;
+};
+
+// NOTE: Every job collects its pairs here and appends them to Broadphase::pairs in chunks
+struct BroadphasePairsBuffer
+{
+    BroadphasePair pairs[BROADPHASE_PAIRS_FLUSH];
+    u32 len;
+};
+
+struct BroadphaseSortEntry
+{
+    f32 key;
+    u32 proxy;
+};
+
+struct BroadphaseCell
+{
+    i32 x;
+    i32 y;
+    i32 z;
+    bool used;
+    u32 *items;
+    u32 len;
+    u32 capacity;
+};
+
+// NOTE: One proxy per hitbox (so per mesh) of every entity, an entity's proxies are
+// contiguous. Moving an entity only refreshes its own proxies, the backends then pick
+// up just the moved ones. Sort and sweep keeps its order on min x between frames and
+// fixes it up with an insertion sort, the spatial hash only rebins a proxy when the
+// range of cells it covers changed. Either way the pair search is split over the job
+// queue, in sorted order for the sweep and by occupied cells for the hash.
+struct Broadphase
+{
+    BroadphaseBackend backend;
+    
+    BroadphaseBoxes bounds;
+    u32 *proxy_entity;
+    u32 *proxy_mesh;
+    BroadphaseProxyFlags *proxy_flags;
+    i32 *proxy_cells; // NOTE: Min and max cell the proxy is binned in, six per proxy
+    u32 proxies_len;
+    u32 proxies_capacity;
+    
+    u32 *entity_first_proxy;
+    u32 entities_len;
+    u32 entities_capacity;
+    
+    u32 *moved;
+    u32 moved_len;
+    
+    BroadphaseSortEntry *sorted;
+    u32 sorted_len;
+    BroadphaseBoxes sweep; // NOTE: bounds gathered in sorted order
+    u32 *sweep_proxy;
+    u32 swaps;
+    
+    f32 cell_size;
+    f32 hashed_cell_size;
+    bool hash_valid;
+    BroadphaseCell *cells;
+    u32 cells_capacity;
+    u32 cells_used;
+    u32 *occupied;
+    u32 occupied_len;
+    u32 *large;
+    u32 large_len;
+    
+    BroadphasePair *pairs;
+    u32 pairs_len;
+    u32 pairs_capacity;
+    
+    f64 last_update_time;
+};
+
+static Broadphase broadphase_create(u32 capacity = 1024);
+static void broadphase_destroy(Broadphase *bp);
+static void broadphase_move(Broadphase *bp, Entity *entities, u32 index);
+static void broadphase_update(Broadphase *bp, Entity *entities, u32 count, JobQueue *jobs);
+static u32 broadphase_overlap8(BroadphaseBoxes *boxes, u32 first, Vec3 min, Vec3 max);
+
+#endif //HAMSTER_BROADPHASE_H
@@ -0,0 +1,1285 @@
+static EntityTree
+entity_tree_create(u32 capacity)
+{
+    EntityTree result = {};
+    
+    result.capacity = MAX(capacity, 1);
+    result.nodes = (EntityTreeNode *)malloc(2 * result.capacity * sizeof(EntityTreeNode));
+    result.indices = (u32 *)malloc(result.capacity * sizeof(u32));
+    result.leaf_of = (u32 *)malloc(result.capacity * sizeof(u32));
+    result.bounds_min = (Vec3 *)malloc(result.capacity * sizeof(Vec3));
+    result.bounds_max = (Vec3 *)malloc(result.capacity * sizeof(Vec3));
+    
+    return result;
+}
+
+static void
+entity_tree_destroy(EntityTree *tree)
+{
+    free(tree->nodes);
+    free(tree->indices);
+    free(tree->leaf_of);
+    free(tree->bounds_min);
+    free(tree->bounds_max);
+    memset(tree, 0, sizeof(*tree));
+}
+
+// NOTE: World space box around the model's hitboxes, models without any fall back
+// to their vertices. The model space box goes through the entity transform as
+// center and extents, |M| * extent is the tightest axis aligned box around the
+// rotated one.
+static void
+entity_bounds(Entity *entity, Vec3 *min, Vec3 *max)
+{
+    Model *model = entity->model;
+    Vec3 local_min = Vec3(F32MAX, F32MAX, F32MAX);
+    Vec3 local_max = Vec3(-F32MAX, -F32MAX, -F32MAX);
+    for(u32 i = 0; i < model->hitboxes_len; i++)
+    {
+        Hitbox *hbox = model->hitboxes + i;
+        Vec3 far = add(hbox->refpoint, hbox->size);
+        for(u32 a = 0; a < 3; a++)
+        {
+            local_min.m[a] = MIN(local_min.m[a], MIN(hbox->refpoint.m[a], far.m[a]));
+            local_max.m[a] = MAX(local_max.m[a], MAX(hbox->refpoint.m[a], far.m[a]));
+        }
+    }
+    
+    if(model->hitboxes_len == 0)
+    {
+        for(u32 i = 0; i < model->meshes_len; i++)
+        {
+            Mesh *mesh = model->meshes + i;
+            for(u32 v = 0; v < mesh->vertices_len; v++)
+            {
+                for(u32 a = 0; a < 3; a++)
+                {
+                    local_min.m[a] = MIN(local_min.m[a], mesh->vertices.positions[v].m[a]);
+                    local_max.m[a] = MAX(local_max.m[a], mesh->vertices.positions[v].m[a]);
+                }
+            }
+        }
+    }
+    
+    if(local_min.x > local_max.x)
+    {
+        *min = entity->position;
+        *max = entity->position;
+        return;
+    }
+    
+    bounds_transform(entity_world(entity), local_min, local_max, min, max);
+}
+
+static void
+bounds_transform(Mat4 transform, Vec3 local_min, Vec3 local_max, Vec3 *min, Vec3 *max)
+{
+    Vec3 center = mul(transform, scale(add(local_min, local_max), 0.5f));
+    Vec3 extent = scale(sub(local_max, local_min), 0.5f);
+    Vec3 world_extent = {};
+    for(u32 row = 0; row < 3; row++)
+    {
+        world_extent.m[row] = fabsf(transform.a[0][row]) * extent.x + fabsf(transform.a[1][row]) * extent.y +
+            fabsf(transform.a[2][row]) * extent.z;
+    }
+    
+    *min = sub(center, world_extent);
+    *max = add(center, world_extent);
+}
+
+static f32
+bvh_area(Vec3 min, Vec3 max)
+{
+    Vec3 d = sub(max, min);
+    return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+// NOTE: SAH with equal traversal and intersection costs, a leaf pays for every
+// entity in it, an inner node only for being entered.
+static f64
+entity_tree_node_cost(EntityTreeNode *node)
+{
+    f64 area = bvh_area(node->min, node->max);
+    return node->left ? area : area * node->count;
+}
+
+static f32
+entity_tree_quality(EntityTree *tree)
+{
+    if(tree->count == 0)
+    {
+        return 0.0f;
+    }
+    
+    f32 root_area = bvh_area(tree->nodes[0].min, tree->nodes[0].max);
+    return root_area > 0.0f ? (f32)(tree->cost / root_area) : 0.0f;
+}
+
+static void
+entity_tree_split(EntityTree *tree, u32 node_index, u32 depth)
+{
+    EntityTreeNode *node = tree->nodes + node_index;
+    u32 *indices = tree->indices + node->first;
+    
+    Vec3 centroid_min = Vec3(F32MAX, F32MAX, F32MAX);
+    Vec3 centroid_max = Vec3(-F32MAX, -F32MAX, -F32MAX);
+    node->min = centroid_min;
+    node->max = centroid_max;
+    for(u32 i = 0; i < node->count; i++)
+    {
+        u32 e = indices[i];
+        Vec3 centroid = scale(add(tree->bounds_min[e], tree->bounds_max[e]), 0.5f);
+        for(u32 a = 0; a < 3; a++)
+        {
+            node->min.m[a] = MIN(node->min.m[a], tree->bounds_min[e].m[a]);
+            node->max.m[a] = MAX(node->max.m[a], tree->bounds_max[e].m[a]);
+            centroid_min.m[a] = MIN(centroid_min.m[a], centroid.m[a]);
+            centroid_max.m[a] = MAX(centroid_max.m[a], centroid.m[a]);
+        }
+    }
+    
+    if(node->count <= ENTITY_TREE_LEAF_SIZE)
+    {
+        node->left = 0;
+        for(u32 i = 0; i < node->count; i++)
+        {
+            tree->leaf_of[indices[i]] = node_index;
+        }
+        tree->cost += entity_tree_node_cost(node);
+        return;
+    }
+    
+    // NOTE: Past ENTITY_TREE_MAX_DEPTH, or when all the centroids sit in one spot,
+    // the range just gets halved so the depth stays bounded.
+    i32 best_axis = -1;
+    u32 best_split = 0;
+    f32 best_cost = F32MAX;
+    for(u32 axis = 0; axis < 3 && depth < ENTITY_TREE_MAX_DEPTH; axis++)
+    {
+        f32 extent = centroid_max.m[axis] - centroid_min.m[axis];
+        if(extent <= 0.0f)
+        {
+            continue;
+        }
+        
+        u32 bin_counts[ENTITY_TREE_BINS] = {};
+        Vec3 bin_min[ENTITY_TREE_BINS];
+        Vec3 bin_max[ENTITY_TREE_BINS];
+        for(u32 b = 0; b < ENTITY_TREE_BINS; b++)
+        {
+            bin_min[b] = Vec3(F32MAX, F32MAX, F32MAX);
+            bin_max[b] = Vec3(-F32MAX, -F32MAX, -F32MAX);
+        }
+        
+        f32 to_bin = ENTITY_TREE_BINS / extent;
+        for(u32 i = 0; i < node->count; i++)
+        {
+            u32 e = indices[i];
+            f32 centroid = 0.5f * (tree->bounds_min[e].m[axis] + tree->bounds_max[e].m[axis]);
+            u32 b = MIN((u32)((centroid - centroid_min.m[axis]) * to_bin), ENTITY_TREE_BINS - 1);
+            bin_counts[b]++;
+            for(u32 a = 0; a < 3; a++)
+            {
+                bin_min[b].m[a] = MIN(bin_min[b].m[a], tree->bounds_min[e].m[a]);
+                bin_max[b].m[a] = MAX(bin_max[b].m[a], tree->bounds_max[e].m[a]);
+            }
+        }
+        
+        // NOTE: right_cost[s] is everything in bins (s, ENTITY_TREE_BINS)
+        f32 right_cost[ENTITY_TREE_BINS];
+        Vec3 sweep_min = Vec3(F32MAX, F32MAX, F32MAX);
+        Vec3 sweep_max = Vec3(-F32MAX, -F32MAX, -F32MAX);
+        u32 sweep_count = 0;
+        for(u32 b = ENTITY_TREE_BINS - 1; b > 0; b--)
+        {
+            sweep_count += bin_counts[b];
+            for(u32 a = 0; a < 3; a++)
+            {
+                sweep_min.m[a] = MIN(sweep_min.m[a], bin_min[b].m[a]);
+                sweep_max.m[a] = MAX(sweep_max.m[a], bin_max[b].m[a]);
+            }
+            right_cost[b - 1] = sweep_count ? bvh_area(sweep_min, sweep_max) * sweep_count : 0.0f;
+        }
+        
+        sweep_min = Vec3(F32MAX, F32MAX, F32MAX);
+        sweep_max = Vec3(-F32MAX, -F32MAX, -F32MAX);
+        sweep_count = 0;
+        for(u32 s = 0; s < ENTITY_TREE_BINS - 1; s++)
+        {
+            sweep_count += bin_counts[s];
+            for(u32 a = 0; a < 3; a++)
+            {
+                sweep_min.m[a] = MIN(sweep_min.m[a], bin_min[s].m[a]);
+                sweep_max.m[a] = MAX(sweep_max.m[a], bin_max[s].m[a]);
+            }
+            if(sweep_count == 0 || sweep_count == node->count)
+            {
+                continue;
+            }
+            
+            f32 cost = bvh_area(sweep_min, sweep_max) * sweep_count + right_cost[s];
+            if(cost < best_cost)
+            {
+                best_cost = cost;
+                best_axis = axis;
+                best_split = s;
+            }
+        }
+    }
+    
+    u32 left_count = node->count / 2;
+    if(best_axis >= 0)
+    {
+        f32 extent = centroid_max.m[best_axis] - centroid_min.m[best_axis];
+        f32 to_bin = ENTITY_TREE_BINS / extent;
+        u32 i = 0;
+        u32 j = node->count;
+        while(i < j)
+        {
+            u32 e = indices[i];
+            f32 centroid = 0.5f * (tree->bounds_min[e].m[best_axis] + tree->bounds_max[e].m[best_axis]);
+            u32 b = MIN((u32)((centroid - centroid_min.m[best_axis]) * to_bin), ENTITY_TREE_BINS - 1);
+            if(b <= best_split)
+            {
+                i++;
+            }
+            else
+            {
+                indices[i] = indices[--j];
+                indices[j] = e;
+            }
+        }
+        left_count = i;
+    }
+    assert(left_count > 0 && left_count < node->count);
+    
+    u32 left = tree->nodes_len;
+    tree->nodes_len += 2;
+    node->left = left;
+    tree->cost += entity_tree_node_cost(node);
+    
+    EntityTreeNode *children = tree->nodes + left;
+    children[0] = {};
+    children[0].parent = node_index;
+    children[0].first = node->first;
+    children[0].count = left_count;
+    children[1] = {};
+    children[1].parent = node_index;
+    children[1].first = node->first + left_count;
+    children[1].count = node->count - left_count;
+    
+    entity_tree_split(tree, left, depth + 1);
+    entity_tree_split(tree, left + 1, depth + 1);
+}
+
+static void
+entity_tree_build(EntityTree *tree, Entity *entities, u32 count)
+{
+    f64 start = glfwGetTime();
+    
+    if(count > tree->capacity)
+    {
+        tree->capacity = MAX(count, tree->capacity * 2);
+        tree->nodes = (EntityTreeNode *)realloc(tree->nodes, 2 * tree->capacity * sizeof(EntityTreeNode));
+        tree->indices = (u32 *)realloc(tree->indices, tree->capacity * sizeof(u32));
+        tree->leaf_of = (u32 *)realloc(tree->leaf_of, tree->capacity * sizeof(u32));
+        tree->bounds_min = (Vec3 *)realloc(tree->bounds_min, tree->capacity * sizeof(Vec3));
+        tree->bounds_max = (Vec3 *)realloc(tree->bounds_max, tree->capacity * sizeof(Vec3));
+        assert(tree->nodes && tree->indices && tree->leaf_of && tree->bounds_min && tree->bounds_max);
+    }
+    
+    tree->count = count;
+    for(u32 i = 0; i < count; i++)
+    {
+        entity_bounds(entities + i, tree->bounds_min + i, tree->bounds_max + i);
+        tree->indices[i] = i;
+    }
+    
+    tree->cost = 0.0;
+    tree->nodes_len = 1;
+    tree->nodes[0] = {};
+    tree->nodes[0].count = count;
+    if(count)
+    {
+        entity_tree_split(tree, 0, 0);
+    }
+    
+    tree->build_cost = entity_tree_quality(tree);
+    tree->degraded = false;
+    tree->builds_count++;
+    tree->last_build_time = glfwGetTime() - start;
+}
+
+static void
+entity_tree_update(EntityTree *tree, Entity *entities, u32 count)
+{
+    if(count != tree->count || tree->degraded)
+    {
+        entity_tree_build(tree, entities, count);
+    }
+}
+
+// NOTE: Refits the entity's leaf and every node above it, the cost gets patched
+// along the way so the degradation check doesn't have to walk the whole tree.
+static void
+entity_tree_move(EntityTree *tree, Entity *entities, u32 index)
+{
+    if(index >= tree->count)
+    {
+        return;
+    }
+    
+    entity_bounds(entities + index, tree->bounds_min + index, tree->bounds_max + index);
+    
+    u32 node_index = tree->leaf_of[index];
+    for(;;)
+    {
+        EntityTreeNode *node = tree->nodes + node_index;
+        f64 old_cost = entity_tree_node_cost(node);
+        
+        if(node->left)
+        {
+            EntityTreeNode *children = tree->nodes + node->left;
+            for(u32 a = 0; a < 3; a++)
+            {
+                node->min.m[a] = MIN(children[0].min.m[a], children[1].min.m[a]);
+                node->max.m[a] = MAX(children[0].max.m[a], children[1].max.m[a]);
+            }
+        }
+        else
+        {
+            node->min = Vec3(F32MAX, F32MAX, F32MAX);
+            node->max = Vec3(-F32MAX, -F32MAX, -F32MAX);
+            for(u32 i = node->first; i < node->first + node->count; i++)
+            {
+                u32 e = tree->indices[i];
+                for(u32 a = 0; a < 3; a++)
+                {
+                    node->min.m[a] = MIN(node->min.m[a], tree->bounds_min[e].m[a]);
+                    node->max.m[a] = MAX(node->max.m[a], tree->bounds_max[e].m[a]);
+                }
+            }
+        }
+        
+        tree->cost += entity_tree_node_cost(node) - old_cost;
+        if(node_index == 0)
+        {
+            break;
+        }
+        node_index = node->parent;
+    }
+    
+    if(entity_tree_quality(tree) > tree->build_cost * ENTITY_TREE_REBUILD_RATIO)
+    {
+        tree->degraded = true;
+    }
+}
+
+static u32
+entity_tree_copy_range(EntityTree *tree, EntityTreeNode *node, u32 *results, u32 results_len, u32 max_results)
+{
+    u32 count = MIN(node->count, max_results - results_len);
+    memcpy(results + results_len, tree->indices + node->first, count * sizeof(u32));
+    
+    return results_len + count;
+}
+
+// NOTE: Returns 1 when the box is fully inside, 0 when it's partially in, -1 when it's out
+static i32
+entity_tree_box_in_frustum(Plane *planes, Vec3 min, Vec3 max)
+{
+    Vec3 center = scale(add(min, max), 0.5f);
+    Vec3 extent = scale(sub(max, min), 0.5f);
+    
+    i32 result = 1;
+    for(u32 i = 0; i < FrustumPlane_ElementCount; i++)
+    {
+        Vec3 n = planes[i].normal;
+        f32 distance = inner(center, n) + planes[i].d;
+        f32 reach = fabsf(n.x) * extent.x + fabsf(n.y) * extent.y + fabsf(n.z) * extent.z;
+        if(distance + reach <= 0.0f)
+        {
+            return -1;
+        }
+        if(distance - reach <= 0.0f)
+        {
+            result = 0;
+        }
+    }
+    
+    return result;
+}
+
+// NOTE: Only partially covered nodes get pushed, both children of one go through a
+// single frustum_test_boxes4 and the leaves test their entities four at a time.
+static u32
+entity_tree_query_frustum(EntityTree *tree, Plane *planes, u32 *results, u32 max_results)
+{
+    u32 results_len = 0;
+    tree->nodes_visited = 0;
+    if(tree->count == 0)
+    {
+        return 0;
+    }
+    
+    tree->nodes_visited++;
+    i32 root_inside = entity_tree_box_in_frustum(planes, tree->nodes[0].min, tree->nodes[0].max);
+    if(root_inside < 0)
+    {
+        return 0;
+    }
+    if(root_inside > 0)
+    {
+        return entity_tree_copy_range(tree, tree->nodes, results, 0, max_results);
+    }
+    
+    u32 stack[ENTITY_TREE_STACK_SIZE];
+    u32 stack_len = 0;
+    stack[stack_len++] = 0;
+    while(stack_len && results_len < max_results)
+    {
+        EntityTreeNode *node = tree->nodes + stack[--stack_len];
+        
+        if(node->left == 0)
+        {
+            for(u32 first = node->first; first < node->first + node->count; first += 4)
+            {
+                u32 lanes = MIN(4, node->first + node->count - first);
+                RayBoxes4 boxes = {};
+                for(u32 lane = 0; lane < lanes; lane++)
+                {
+                    u32 e = tree->indices[first + lane];
+                    ray_boxes4_set(&boxes, lane, tree->bounds_min[e], tree->bounds_max[e]);
+                }
+                
+                u32 inside = 0;
+                u32 touching = frustum_test_boxes4(planes, &boxes, &inside) & ((1u << lanes) - 1);
+                while(touching && results_len < max_results)
+                {
+                    results[results_len++] = tree->indices[first + find_first_set_bit(touching)];
+                    touching &= touching - 1;
+                }
+            }
+            continue;
+        }
+        
+        EntityTreeNode *left = tree->nodes + node->left;
+        EntityTreeNode *right = left + 1;
+        RayBoxes4 boxes = {};
+        ray_boxes4_set(&boxes, 0, left->min, left->max);
+        ray_boxes4_set(&boxes, 1, right->min, right->max);
+        tree->nodes_visited += 2;
+        
+        u32 inside = 0;
+        u32 touching = frustum_test_boxes4(planes, &boxes, &inside) & 0x3;
+        // NOTE: Right goes first so the left one is popped first
+        for(i32 c = 1; c >= 0; c--)
+        {
+            if(!((touching >> c) & 1))
+            {
+                continue;
+            }
+            
+            if((inside >> c) & 1)
+            {
+                results_len = entity_tree_copy_range(tree, left + c, results, results_len, max_results);
+            }
+            else
+            {
+                assert(stack_len < ENTITY_TREE_STACK_SIZE);
+                stack[stack_len++] = node->left + c;
+            }
+        }
+    }
+    
+    return results_len;
+}
+
+static bool
+entity_tree_boxes_overlap(Vec3 min0, Vec3 max0, Vec3 min1, Vec3 max1)
+{
+    return min0.x <= max1.x && max0.x >= min1.x &&
+        min0.y <= max1.y && max0.y >= min1.y &&
+        min0.z <= max1.z && max0.z >= min1.z;
+}
+
+static u32
+entity_tree_query_box(EntityTree *tree, Vec3 min, Vec3 max, u32 *results, u32 max_results)
+{
+    u32 results_len = 0;
+    tree->nodes_visited = 0;
+    if(tree->count == 0)
+    {
+        return 0;
+    }
+    
+    u32 stack[ENTITY_TREE_STACK_SIZE];
+    u32 stack_len = 0;
+    stack[stack_len++] = 0;
+    while(stack_len && results_len < max_results)
+    {
+        EntityTreeNode *node = tree->nodes + stack[--stack_len];
+        tree->nodes_visited++;
+        
+        if(!entity_tree_boxes_overlap(node->min, node->max, min, max))
+        {
+            continue;
+        }
+        
+        bool contained = node->min.x >= min.x && node->min.y >= min.y && node->min.z >= min.z &&
+            node->max.x <= max.x && node->max.y <= max.y && node->max.z <= max.z;
+        if(contained)
+        {
+            results_len = entity_tree_copy_range(tree, node, results, results_len, max_results);
+        }
+        else if(node->left == 0)
+        {
+            for(u32 i = node->first; i < node->first + node->count && results_len < max_results; i++)
+            {
+                u32 e = tree->indices[i];
+                if(entity_tree_boxes_overlap(tree->bounds_min[e], tree->bounds_max[e], min, max))
+                {
+                    results[results_len++] = e;
+                }
+            }
+        }
+        else
+        {
+            assert(stack_len + 2 <= ENTITY_TREE_STACK_SIZE);
+            stack[stack_len++] = node->left + 1;
+            stack[stack_len++] = node->left;
+        }
+    }
+    
+    return results_len;
+}
+
+// NOTE: Near child first and anything starting past the closest hit so far is
+// skipped. Returns -1 when nothing was hit, otherwise the closest entity and,
+// when asked for, where its mesh got hit.
+static i32
+entity_tree_raycast(EntityTree *tree, Entity *entities, Vec3 ray_origin, Vec3 ray_direction, RayHit *hit)
+{
+    tree->nodes_visited = 0;
+    if(tree->count == 0)
+    {
+        return -1;
+    }
+    
+    Vec3 inverse_direction = ray_inverse_direction(ray_direction);
+    i32 best = -1;
+    f32 best_t = F32MAX;
+    
+    u32 stack[ENTITY_TREE_STACK_SIZE];
+    f32 stack_t[ENTITY_TREE_STACK_SIZE];
+    u32 stack_len = 0;
+    f32 root_t = 0.0f;
+    f32 root_exit = 0.0f;
+    if(!ray_intersect_box(ray_origin, inverse_direction, tree->nodes[0].min, tree->nodes[0].max, F32MAX,
+                          &root_t, &root_exit))
+    {
+        return -1;
+    }
+    stack[stack_len] = 0;
+    stack_t[stack_len++] = root_t;
+    
+    while(stack_len)
+    {
+        stack_len--;
+        if(stack_t[stack_len] >= best_t)
+        {
+            continue;
+        }
+        
+        EntityTreeNode *node = tree->nodes + stack[stack_len];
+        tree->nodes_visited++;
+        if(node->left == 0)
+        {
+            for(u32 i = node->first; i < node->first + node->count; i++)
+            {
+                u32 e = tree->indices[i];
+                f32 t = 0.0f;
+                f32 t_exit = 0.0f;
+                if(!ray_intersect_box(ray_origin, inverse_direction, tree->bounds_min[e], tree->bounds_max[e],
+                                      best_t, &t, &t_exit))
+                {
+                    continue;
+                }
+                
+                RayHit entity_hit = {};
+                entity_hit.t = best_t;
+                if(ray_intersect_entity(ray_origin, ray_direction, entities + e, &entity_hit))
+                {
+                    best = e;
+                    best_t = entity_hit.t;
+                    if(hit)
+                    {
+                        *hit = entity_hit;
+                    }
+                }
+            }
+            continue;
+        }
+        
+        u32 near = node->left;
+        u32 far = node->left + 1;
+        f32 near_t = 0.0f;
+        f32 far_t = 0.0f;
+        f32 t_exit = 0.0f;
+        bool near_hit = ray_intersect_box(ray_origin, inverse_direction, tree->nodes[near].min,
+                                          tree->nodes[near].max, best_t, &near_t, &t_exit);
+        bool far_hit = ray_intersect_box(ray_origin, inverse_direction, tree->nodes[far].min,
+                                         tree->nodes[far].max, best_t, &far_t, &t_exit);
+        if(far_hit && (!near_hit || far_t < near_t))
+        {
+            u32 swap_node = near;
+            near = far;
+            far = swap_node;
+            f32 swap_t = near_t;
+            near_t = far_t;
+            far_t = swap_t;
+            bool swap_hit = near_hit;
+            near_hit = far_hit;
+            far_hit = swap_hit;
+        }
+        
+        assert(stack_len + 2 <= ENTITY_TREE_STACK_SIZE);
+        if(far_hit)
+        {
+            stack[stack_len] = far;
+            stack_t[stack_len++] = far_t;
+        }
+        if(near_hit)
+        {
+            stack[stack_len] = near;
+            stack_t[stack_len++] = near_t;
+        }
+    }
+    
+    return best;
+}
+
+struct MeshBVHBuild
+{
+    MeshBVH *bvh;
+    MeshBVHBuildNode *nodes;
+    u32 nodes_len;
+    Vec3 *bounds_min;
+    Vec3 *bounds_max;
+    Vec3 *centroids;
+};
+
+static void
+mesh_bvh_split(MeshBVHBuild *build, u32 node_index, u32 depth)
+{
+    MeshBVHBuildNode *node = build->nodes + node_index;
+    u32 *ids = build->bvh->triangle_ids + node->first;
+    
+    Vec3 centroid_min = Vec3(F32MAX, F32MAX, F32MAX);
+    Vec3 centroid_max = Vec3(-F32MAX, -F32MAX, -F32MAX);
+    node->min = centroid_min;
+    node->max = centroid_max;
+    for(u32 i = 0; i < node->count; i++)
+    {
+        u32 id = ids[i];
+        for(u32 a = 0; a < 3; a++)
+        {
+            node->min.m[a] = MIN(node->min.m[a], build->bounds_min[id].m[a]);
+            node->max.m[a] = MAX(node->max.m[a], build->bounds_max[id].m[a]);
+            centroid_min.m[a] = MIN(centroid_min.m[a], build->centroids[id].m[a]);
+            centroid_max.m[a] = MAX(centroid_max.m[a], build->centroids[id].m[a]);
+        }
+    }
+    
+    if(node->count <= 2)
+    {
+        return;
+    }
+    
+    i32 best_axis = -1;
+    u32 best_split = 0;
+    f32 best_cost = F32MAX;
+    for(u32 axis = 0; axis < 3 && depth < MESH_BVH_MAX_DEPTH; axis++)
+    {
+        f32 extent = centroid_max.m[axis] - centroid_min.m[axis];
+        if(extent <= 0.0f)
+        {
+            continue;
+        }
+        
+        u32 bin_counts[MESH_BVH_BINS] = {};
+        Vec3 bin_min[MESH_BVH_BINS];
+        Vec3 bin_max[MESH_BVH_BINS];
+        for(u32 b = 0; b < MESH_BVH_BINS; b++)
+        {
+            bin_min[b] = Vec3(F32MAX, F32MAX, F32MAX);
+            bin_max[b] = Vec3(-F32MAX, -F32MAX, -F32MAX);
+        }
+        
+        f32 to_bin = MESH_BVH_BINS / extent;
+        for(u32 i = 0; i < node->count; i++)
+        {
+            u32 id = ids[i];
+            u32 b = MIN((u32)((build->centroids[id].m[axis] - centroid_min.m[axis]) * to_bin), MESH_BVH_BINS - 1);
+            bin_counts[b]++;
+            for(u32 a = 0; a < 3; a++)
+            {
+                bin_min[b].m[a] = MIN(bin_min[b].m[a], build->bounds_min[id].m[a]);
+                bin_max[b].m[a] = MAX(bin_max[b].m[a], build->bounds_max[id].m[a]);
+            }
+        }
+        
+        f32 right_cost[MESH_BVH_BINS];
+        Vec3 sweep_min = Vec3(F32MAX, F32MAX, F32MAX);
+        Vec3 sweep_max = Vec3(-F32MAX, -F32MAX, -F32MAX);
+        u32 sweep_count = 0;
+        for(u32 b = MESH_BVH_BINS - 1; b > 0; b--)
+        {
+            sweep_count += bin_counts[b];
+            for(u32 a = 0; a < 3; a++)
+            {
+                sweep_min.m[a] = MIN(sweep_min.m[a], bin_min[b].m[a]);
+                sweep_max.m[a] = MAX(sweep_max.m[a], bin_max[b].m[a]);
+            }
+            right_cost[b - 1] = sweep_count ? bvh_area(sweep_min, sweep_max) * sweep_count : 0.0f;
+        }
+        
+        sweep_min = Vec3(F32MAX, F32MAX, F32MAX);
+        sweep_max = Vec3(-F32MAX, -F32MAX, -F32MAX);
+        sweep_count = 0;
+        for(u32 s = 0; s < MESH_BVH_BINS - 1; s++)
+        {
+            sweep_count += bin_counts[s];
+            for(u32 a = 0; a < 3; a++)
+            {
+                sweep_min.m[a] = MIN(sweep_min.m[a], bin_min[s].m[a]);
+                sweep_max.m[a] = MAX(sweep_max.m[a], bin_max[s].m[a]);
+            }
+            if(sweep_count == 0 || sweep_count == node->count)
+            {
+                continue;
+            }
+            
+            f32 cost = bvh_area(sweep_min, sweep_max) * sweep_count + right_cost[s];
+            if(cost < best_cost)
+            {
+                best_cost = cost;
+                best_axis = axis;
+                best_split = s;
+            }
+        }
+    }
+    
+    // NOTE: Splitting costs a traversal step on top of the children, small nodes stay
+    // leaves when that doesn't pay off. Past the depth limit ranges just get halved.
+    f32 area = bvh_area(node->min, node->max);
+    if(node->count <= MESH_BVH_MAX_LEAF &&
+       (best_axis < 0 || area + best_cost >= area * node->count))
+    {
+        return;
+    }
+    
+    u32 left_count = node->count / 2;
+    if(best_axis >= 0)
+    {
+        f32 extent = centroid_max.m[best_axis] - centroid_min.m[best_axis];
+        f32 to_bin = MESH_BVH_BINS / extent;
+        u32 i = 0;
+        u32 j = node->count;
+        while(i < j)
+        {
+            u32 id = ids[i];
+            u32 b = MIN((u32)((build->centroids[id].m[best_axis] - centroid_min.m[best_axis]) * to_bin),
+                        MESH_BVH_BINS - 1);
+            if(b <= best_split)
+            {
+                i++;
+            }
+            else
+            {
+                ids[i] = ids[--j];
+                ids[j] = id;
+            }
+        }
+        left_count = i;
+    }
+    assert(left_count > 0 && left_count < node->count);
+    
+    u32 left = build->nodes_len;
+    build->nodes_len += 2;
+    
+    MeshBVHBuildNode *children = build->nodes + left;
+    children[0] = {};
+    children[0].first = node->first;
+    children[0].count = left_count;
+    children[1] = {};
+    children[1].first = node->first + left_count;
+    children[1].count = node->count - left_count;
+    node->first = left;
+    node->count = 0;
+    
+    mesh_bvh_split(build, left, depth + 1);
+    mesh_bvh_split(build, left + 1, depth + 1);
+}
+
+// NOTE: Pulls up to four binary descendants into one wide node, always opening the
+// inner child with the biggest surface since that's the one rays hit the most.
+static u32
+mesh_bvh_collapse(MeshBVHBuild *build, u32 build_index, u32 depth)
+{
+    MeshBVH *bvh = build->bvh;
+    u32 node_index = bvh->nodes_len++;
+    bvh->depth = MAX(bvh->depth, depth);
+    
+    u32 children[MESH_BVH_WIDTH];
+    u32 children_len = 0;
+    MeshBVHBuildNode *build_node = build->nodes + build_index;
+    if(build_node->count)
+    {
+        // NOTE: Only when the whole mesh fit in the root leaf
+        children[children_len++] = build_index;
+    }
+    else
+    {
+        children[children_len++] = build_node->first;
+        children[children_len++] = build_node->first + 1;
+    }
+    
+    while(children_len < MESH_BVH_WIDTH)
+    {
+        i32 widest = -1;
+        f32 widest_area = -1.0f;
+        for(u32 i = 0; i < children_len; i++)
+        {
+            MeshBVHBuildNode *child = build->nodes + children[i];
+            f32 area = bvh_area(child->min, child->max);
+            if(child->count == 0 && area > widest_area)
+            {
+                widest = i;
+                widest_area = area;
+            }
+        }
+        if(widest < 0)
+        {
+            break;
+        }
+        
+        u32 opened = build->nodes[children[widest]].first;
+        children[widest] = opened;
+        children[children_len++] = opened + 1;
+    }
+    
+    MeshBVHNode *node = bvh->nodes + node_index;
+    *node = {};
+    node->children_count = children_len;
+    for(u32 i = 0; i < children_len; i++)
+    {
+        MeshBVHBuildNode *child = build->nodes + children[i];
+        ray_boxes4_set(&node->bounds, i, child->min, child->max);
+        node->count[i] = child->count;
+        node->child[i] = child->count ? child->first : mesh_bvh_collapse(build, children[i], depth + 1);
+    }
+    
+    return node_index;
+}
+
+static MeshBVH *
+mesh_bvh_build(Mesh *mesh)
+{
+    u32 triangles_len = mesh->indices_len / 3;
+    if(triangles_len == 0)
+    {
+        return NULL;
+    }
+    
+    // NOTE: Every wide node eats at least one binary inner node, there are
+    // triangles_len - 1 of those, or the single root leaf.
+    MeshBVH *bvh = (MeshBVH *)malloc(sizeof(MeshBVH));
+    bvh->triangles_len = triangles_len;
+    bvh->nodes = (MeshBVHNode *)malloc(triangles_len * sizeof(MeshBVHNode));
+    bvh->nodes_len = 0;
+    bvh->depth = 0;
+    ray_triangles_alloc(&bvh->triangles, triangles_len);
+    bvh->triangle_ids = (u32 *)malloc(triangles_len * sizeof(u32));
+    
+    MeshBVHBuild build = {};
+    build.bvh = bvh;
+    build.nodes = (MeshBVHBuildNode *)malloc(2 * triangles_len * sizeof(MeshBVHBuildNode));
+    build.bounds_min = (Vec3 *)malloc(triangles_len * sizeof(Vec3));
+    build.bounds_max = (Vec3 *)malloc(triangles_len * sizeof(Vec3));
+    build.centroids = (Vec3 *)malloc(triangles_len * sizeof(Vec3));
+    
+    Vec3 *positions = mesh->vertices.positions;
+    for(u32 i = 0; i < triangles_len; i++)
+    {
+        Vec3 v0 = positions[mesh->indices[3 * i + 0]];
+        Vec3 v1 = positions[mesh->indices[3 * i + 1]];
+        Vec3 v2 = positions[mesh->indices[3 * i + 2]];
+        for(u32 a = 0; a < 3; a++)
+        {
+            build.bounds_min[i].m[a] = MIN(v0.m[a], MIN(v1.m[a], v2.m[a]));
+            build.bounds_max[i].m[a] = MAX(v0.m[a], MAX(v1.m[a], v2.m[a]));
+        }
+        build.centroids[i] = scale(add(build.bounds_min[i], build.bounds_max[i]), 0.5f);
+        bvh->triangle_ids[i] = i;
+    }
+    
+    build.nodes_len = 1;
+    build.nodes[0] = {};
+    build.nodes[0].count = triangles_len;
+    mesh_bvh_split(&build, 0, 0);
+    mesh_bvh_collapse(&build, 0, 1);
+    assert(bvh->depth <= MESH_BVH_MAX_BUILD_DEPTH);
+    bvh->nodes = (MeshBVHNode *)realloc(bvh->nodes, bvh->nodes_len * sizeof(MeshBVHNode));
+    
+    for(u32 i = 0; i < triangles_len; i++)
+    {
+        u32 id = bvh->triangle_ids[i];
+        Vec3 v0 = positions[mesh->indices[3 * id + 0]];
+        Vec3 v1 = positions[mesh->indices[3 * id + 1]];
+        Vec3 v2 = positions[mesh->indices[3 * id + 2]];
+        ray_triangles_set(&bvh->triangles, i, v0, v1, v2);
+    }
+    
+    free(build.nodes);
+    free(build.bounds_min);
+    free(build.bounds_max);
+    free(build.centroids);
+    
+    return bvh;
+}
+
+static void
+mesh_bvh_destroy(MeshBVH *bvh)
+{
+    if(bvh)
+    {
+        free(bvh->nodes);
+        ray_triangles_free(&bvh->triangles);
+        free(bvh->triangle_ids);
+        free(bvh);
+    }
+}
+
+// NOTE: Closest hit below one child, node index or leaf range like in MeshBVHNode.
+// hit->t on the way in is how far to look. All four children of a node go through
+// one slab test and get pushed far to near, leaves included, so the nearest thing
+// always comes off the stack first. Anything that starts past the closest hit so
+// far gets skipped.
+static bool
+mesh_bvh_intersect_from(MeshBVH *bvh, u32 child, u32 count, Vec3 ray_origin, Vec3 ray_direction, RayHit *hit)
+{
+    Vec3 inverse_direction = ray_inverse_direction(ray_direction);
+    bool result = false;
+    
+    u32 stack[MESH_BVH_STACK_SIZE];
+    u32 stack_count[MESH_BVH_STACK_SIZE];
+    f32 stack_t[MESH_BVH_STACK_SIZE];
+    u32 stack_len = 0;
+    stack[stack_len] = child;
+    stack_count[stack_len] = count;
+    stack_t[stack_len++] = 0.0f;
+    
+    while(stack_len)
+    {
+        stack_len--;
+        if(stack_t[stack_len] >= hit->t)
+        {
+            continue;
+        }
+        
+        u32 first = stack[stack_len];
+        u32 count = stack_count[stack_len];
+        if(count)
+        {
+            i32 lane = ray_intersect_triangles8(ray_origin, ray_direction, &bvh->triangles, first, count,
+                                                &hit->t, &hit->u, &hit->v);
+            if(lane >= 0)
+            {
+                hit->triangle = bvh->triangle_ids[first + lane];
+                result = true;
+            }
+            continue;
+        }
+        
+        MeshBVHNode *node = bvh->nodes + first;
+        f32 t_enter[MESH_BVH_WIDTH];
+        f32 t_exit[MESH_BVH_WIDTH];
+        u32 mask = ray_intersect_boxes4(ray_origin, inverse_direction, &node->bounds, hit->t, t_enter, t_exit);
+        mask &= (1u << node->children_count) - 1;
+        
+        // NOTE: Insertion sort by entry distance, furthest first
+        u32 order[MESH_BVH_WIDTH];
+        u32 order_len = 0;
+        for(u32 i = 0; i < node->children_count; i++)
+        {
+            if(mask & (1u << i))
+            {
+                u32 j = order_len++;
+                while(j > 0 && t_enter[order[j - 1]] < t_enter[i])
+                {
+                    order[j] = order[j - 1];
+                    j--;
+                }
+                order[j] = i;
+            }
+        }
+        
+        assert(stack_len + order_len <= MESH_BVH_STACK_SIZE);
+        for(u32 i = 0; i < order_len; i++)
+        {
+            u32 lane = order[i];
+            stack[stack_len] = node->child[lane];
+            stack_count[stack_len] = node->count[lane];
+            stack_t[stack_len++] = t_enter[lane];
+        }
+    }
+    
+    return result;
+}
+
+static bool
+mesh_bvh_intersect(MeshBVH *bvh, Vec3 ray_origin, Vec3 ray_direction, RayHit *hit)
+{
+    return mesh_bvh_intersect_from(bvh, 0, 0, ray_origin, ray_direction, hit);
+}
+
+// NOTE: mesh_bvh_intersect for a packet. A child is entered by the lanes whose
+// ray hits its box and goes on the stack with just those lanes and where each of
+// them enters, ordered by the nearest entry. Lanes that found something closer
+// by the time it comes off the stack drop out. Leaves run each triangle against
+// all eight rays.
+// Once the lanes have spread out so far that only a few are left in a subtree,
+// they finish it one at a time, that's cheaper than dragging idle lanes along.
+static u32
+mesh_bvh_intersect8(MeshBVH *bvh, RayPacket8 *packet, u32 active)
+{
+    u32 result = 0;
+    
+    u32 stack[MESH_BVH_STACK_SIZE];
+    u32 stack_count[MESH_BVH_STACK_SIZE];
+    u32 stack_lanes[MESH_BVH_STACK_SIZE];
+    f32 stack_t[MESH_BVH_STACK_SIZE][8];
+    u32 stack_len = 0;
+    stack[stack_len] = 0;
+    stack_count[stack_len] = 0;
+    stack_lanes[stack_len] = active;
+    memset(stack_t[stack_len++], 0, sizeof(stack_t[0]));
+    
+    while(stack_len)
+    {
+        stack_len--;
+        u32 first = stack[stack_len];
+        u32 count = stack_count[stack_len];
+        u32 lanes = ray_packet_closer_lanes(packet, stack_lanes[stack_len], stack_t[stack_len]);
+        if(lanes == 0)
+        {
+            continue;
+        }
+        
+        if(__builtin_popcount(lanes) <= MESH_BVH_PACKET_MIN_LANES)
+        {
+            for(u32 bits = lanes; bits; bits &= bits - 1)
+            {
+                u32 lane = find_first_set_bit(bits);
+                Vec3 origin = Vec3(packet->origin_x[lane], packet->origin_y[lane], packet->origin_z[lane]);
+                Vec3 direction = Vec3(packet->direction_x[lane], packet->direction_y[lane],
+                                      packet->direction_z[lane]);
+                RayHit hit = {};
+                hit.t = packet->t[lane];
+                if(mesh_bvh_intersect_from(bvh, first, count, origin, direction, &hit))
+                {
+                    packet->t[lane] = hit.t;
+                    packet->u[lane] = hit.u;
+                    packet->v[lane] = hit.v;
+                    packet->triangle[lane] = hit.triangle;
+                    result |= 1u << lane;
+                }
+            }
+            continue;
+        }
+        
+        if(count)
+        {
+            RayTriangles *triangles = &bvh->triangles;
+            for(u32 i = first; i < first + count; i++)
+            {
+                Vec3 v0 = Vec3(triangles->v0_x[i], triangles->v0_y[i], triangles->v0_z[i]);
+                Vec3 edge1 = Vec3(triangles->edge1_x[i], triangles->edge1_y[i], triangles->edge1_z[i]);
+                Vec3 edge2 = Vec3(triangles->edge2_x[i], triangles->edge2_y[i], triangles->edge2_z[i]);
+                u32 closer = ray_packet_intersect_triangle(packet, lanes, v0, edge1, edge2);
+                for(u32 bits = closer; bits; bits &= bits - 1)
+                {
+                    packet->triangle[find_first_set_bit(bits)] = bvh->triangle_ids[i];
+                }
+                result |= closer;
+            }
+            continue;
+        }
+        
+        MeshBVHNode *node = bvh->nodes + first;
+        u32 order[MESH_BVH_WIDTH];
+        u32 order_lanes[MESH_BVH_WIDTH];
+        f32 order_t[MESH_BVH_WIDTH];
+        f32 t_enter[MESH_BVH_WIDTH][8];
+        u32 order_len = 0;
+        for(u32 i = 0; i < node->children_count; i++)
+        {
+            RayBoxes4 *bounds = &node->bounds;
+            Vec3 min = Vec3(bounds->min_x[i], bounds->min_y[i], bounds->min_z[i]);
+            Vec3 max = Vec3(bounds->max_x[i], bounds->max_y[i], bounds->max_z[i]);
+            u32 hit_lanes = ray_packet_intersect_box(packet, lanes, min, max, t_enter[i]);
+            if(hit_lanes == 0)
+            {
+                continue;
+            }
+            
+            // NOTE: Insertion sort, furthest first
+            u32 j = order_len++;
+            f32 nearest = ray_packet_nearest(hit_lanes, t_enter[i]);
+            while(j > 0 && order_t[j - 1] < nearest)
+            {
+                order[j] = order[j - 1];
+                order_lanes[j] = order_lanes[j - 1];
+                order_t[j] = order_t[j - 1];
+                j--;
+            }
+            order[j] = i;
+            order_lanes[j] = hit_lanes;
+            order_t[j] = nearest;
+        }
+        
+        assert(stack_len + order_len <= MESH_BVH_STACK_SIZE);
+        for(u32 i = 0; i < order_len; i++)
+        {
+            stack[stack_len] = node->child[order[i]];
+            stack_count[stack_len] = node->count[order[i]];
+            stack_lanes[stack_len] = order_lanes[i];
+            memcpy(stack_t[stack_len++], t_enter[order[i]], sizeof(stack_t[0]));
+        }
+    }
+    
+    return result;
+}
+
+// NOTE: entity_tree_raycast for a packet. Nodes are tested again when they come
+// off the stack since the lanes' t can only have shrunk since the push. Children
+// go in the order the first lane would visit them, coherent packets agree anyway.
+// Lanes that got a closer hit come back in the mask with hit_entities filled in.
+static u32
+entity_tree_raycast8(EntityTree *tree, Entity *entities, RayPacket8 *packet, u32 active, i32 *hit_entities)
+{
+    u32 result = 0;
+    if(tree->count == 0)
+    {
+        return result;
+    }
+    
+    u32 stack[ENTITY_TREE_STACK_SIZE];
+    u32 stack_lanes[ENTITY_TREE_STACK_SIZE];
+    u32 stack_len = 0;
+    stack[stack_len] = 0;
+    stack_lanes[stack_len++] = active;
+    
+    f32 t_enter[8];
+    while(stack_len)
+    {
+        stack_len--;
+        EntityTreeNode *node = tree->nodes + stack[stack_len];
+        u32 lanes = ray_packet_intersect_box(packet, stack_lanes[stack_len], node->min, node->max, t_enter);
+        if(lanes == 0)
+        {
+            continue;
+        }
+        
+        if(node->left == 0)
+        {
+            for(u32 i = node->first; i < node->first + node->count; i++)
+            {
+                u32 e = tree->indices[i];
+                u32 entity_lanes = ray_packet_intersect_box(packet, lanes, tree->bounds_min[e], tree->bounds_max[e],
+                                                            t_enter);
+                if(entity_lanes == 0)
+                {
+                    continue;
+                }
+                
+                u32 closer = ray_packet_intersect_entity(packet, entity_lanes, entities + e);
+                for(u32 bits = closer; bits; bits &= bits - 1)
+                {
+                    hit_entities[find_first_set_bit(bits)] = e;
+                }
+                result |= closer;
+            }
+            continue;
+        }
+        
+        u32 lane = find_first_set_bit(lanes);
+        Vec3 direction = Vec3(packet->direction_x[lane], packet->direction_y[lane], packet->direction_z[lane]);
+        EntityTreeNode *left = tree->nodes + node->left;
+        EntityTreeNode *right = left + 1;
+        f32 left_distance = inner(add(left->min, left->max), direction);
+        f32 right_distance = inner(add(right->min, right->max), direction);
+        u32 near = left_distance <= right_distance ? node->left : node->left + 1;
+        
+        assert(stack_len + 2 <= ENTITY_TREE_STACK_SIZE);
+        stack[stack_len] = near == node->left ? node->left + 1 : node->left;
+        stack_lanes[stack_len++] = lanes;
+        stack[stack_len] = near;
+        stack_lanes[stack_len++] = lanes;
+    }
+    
+    return result;
+}
+
+static void
+entity_tree_raycast_job(void *data, u32 first, u32 one_past_last)
+{
+    RaycastBatch *batch = (RaycastBatch *)data;
+    for(u32 p = first; p < one_past_last; p++)
+    {
+        u32 base = p * 8;
+        u32 lanes_count = MIN(batch->count - base, 8);
+        
+        RayPacket8 packet = {};
+        i32 hit_entities[8];
+        for(u32 lane = 0; lane < lanes_count; lane++)
+        {
+            ray_packet_set(&packet, lane, batch->origins[base + lane], batch->directions[base + lane],
+                           batch->hits[base + lane].t);
+            hit_entities[lane] = -1;
+        }
+        
+        entity_tree_raycast8(batch->tree, batch->entities, &packet, (1u << lanes_count) - 1, hit_entities);
+        for(u32 lane = 0; lane < lanes_count; lane++)
+        {
+            RayHit *hit = batch->hits + base + lane;
+            hit->t = packet.t[lane];
+            hit->u = packet.u[lane];
+            hit->v = packet.v[lane];
+            hit->triangle = packet.triangle[lane];
+            hit->mesh = packet.mesh[lane];
+            batch->hit_entities[base + lane] = hit_entities[lane];
+        }
+    }
+}
+
+// NOTE: Closest hit for each of count rays, spread over the job queue in packets
+// of eight. Like RayHit, hits[i].t is how far ray i looks on the way in, so a line
+// of sight check sets it to the distance of the target. hit_entities[i] is -1 when
+// ray i hit nothing, hits[i] is only meaningful otherwise.
+static void
+entity_tree_raycast_batch(EntityTree *tree, Entity *entities, JobQueue *jobs, Vec3 *origins, Vec3 *directions,
+                          u32 count, RayHit *hits, i32 *hit_entities)
+{
+    RaycastBatch batch = {};
+    batch.tree = tree;
+    batch.entities = entities;
+    batch.origins = origins;
+    batch.directions = directions;
+    batch.hits = hits;
+    batch.hit_entities = hit_entities;
+    batch.count = count;
+    
+    jobs_parallel_for(jobs, (count + 7) / 8, RAYCAST_BATCH_MIN_PACKETS, entity_tree_raycast_job, &batch);
+}
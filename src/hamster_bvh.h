@@ -0,0 +1,132 @@
+/* date = October 19th 2026 7:20 pm */
+
+#ifndef HAMSTER_BVH_H
+#define HAMSTER_BVH_H
+
+#define ENTITY_TREE_LEAF_SIZE 4
+#define ENTITY_TREE_BINS 16
+#define ENTITY_TREE_MAX_DEPTH 40
+#define ENTITY_TREE_STACK_SIZE 64
+// NOTE: Refitting only ever grows the SAH cost, past this multiple of the cost
+// right after a build the next entity_tree_update rebuilds from scratch.
+#define ENTITY_TREE_REBUILD_RATIO 1.5f
+
+// NOTE: Every subtree covers a contiguous range of tree->indices, so when a node
+// ends up fully inside a query its whole range is copied out without going down.
+// Leaves have left == 0, that's the root and never anyone's child.
+struct EntityTreeNode
+{
+    Vec3 min;
+    Vec3 max;
+    u32 parent;
+    u32 left; // NOTE: Right child is always left + 1
+    u32 first;
+    u32 count;
+};
+
+// NOTE: Binned SAH BVH over the world space boxes of the entities. Moving an entity
+// refits its leaf and the path up to the root, a build only happens when entities
+// got added or the refits made the tree noticeably worse.
+struct EntityTree
+{
+    EntityTreeNode *nodes;
+    u32 nodes_len;
+    
+    u32 *indices;
+    u32 *leaf_of;
+    Vec3 *bounds_min;
+    Vec3 *bounds_max;
+    u32 count;
+    u32 capacity;
+    
+    f64 cost; // NOTE: Summed over 100k+ nodes, f32 drifts too much under refits
+    f32 build_cost;
+    bool degraded;
+    
+    u32 builds_count;
+    u32 nodes_visited;
+    f64 last_build_time;
+};
+
+#define MESH_BVH_BINS 16
+#define MESH_BVH_MAX_LEAF 8 // NOTE: ray_intersect_triangles8 relies on this
+#define MESH_BVH_MAX_DEPTH 40
+#define MESH_BVH_WIDTH 4
+// NOTE: Past MESH_BVH_MAX_DEPTH nodes only get halved, which is at most 32 more
+// levels for a u32 triangle count. A wide node spans at least one binary level and
+// every one on the way down leaves at most three siblings on the stack.
+#define MESH_BVH_MAX_BUILD_DEPTH (MESH_BVH_MAX_DEPTH + 32)
+#define MESH_BVH_STACK_SIZE (3 * MESH_BVH_MAX_BUILD_DEPTH + 1)
+#define MESH_BVH_PACKET_MIN_LANES 2
+
+// NOTE: Binary SAH node, only lives while building, the tree is collapsed into
+// MeshBVHNodes afterwards.
+struct MeshBVHBuildNode
+{
+    Vec3 min;
+    Vec3 max;
+    u32 first; // NOTE: First triangle for leaves, left child otherwise (right is first + 1)
+    u32 count; // NOTE: 0 for inner nodes
+};
+
+// NOTE: Four children per node so one ray_intersect_boxes4 tests all of them.
+// Lanes past children_count are unused.
+struct MeshBVHNode
+{
+    RayBoxes4 bounds;
+    u32 child[MESH_BVH_WIDTH]; // NOTE: Node index for inner children, first triangle for leaves
+    u32 count[MESH_BVH_WIDTH]; // NOTE: Triangles in a leaf child, 0 for inner ones
+    u32 children_count;
+};
+
+// NOTE: Model space, built once at load time with binned SAH. The triangles are
+// copied out in leaf order so a leaf reads one contiguous run, which is never more
+// than MESH_BVH_MAX_LEAF and so fits one ray_intersect_triangles8 call.
+// triangle_ids maps them back to the mesh's own triangle index.
+struct MeshBVH
+{
+    MeshBVHNode *nodes;
+    u32 nodes_len;
+    RayTriangles triangles;
+    u32 *triangle_ids;
+    u32 triangles_len;
+    u32 depth; // NOTE: Wide levels, traversal never holds more than 3 * depth + 1 entries
+};
+
+// NOTE: Rays per job are this many packets of eight
+#define RAYCAST_BATCH_MIN_PACKETS 16
+
+struct RaycastBatch
+{
+    EntityTree *tree;
+    Entity *entities;
+    Vec3 *origins;
+    Vec3 *directions;
+    RayHit *hits;
+    i32 *hit_entities;
+    u32 count;
+};
+
+static EntityTree entity_tree_create(u32 capacity);
+static void entity_tree_destroy(EntityTree *tree);
+static void entity_bounds(Entity *entity, Vec3 *min, Vec3 *max);
+static void bounds_transform(Mat4 transform, Vec3 local_min, Vec3 local_max, Vec3 *min, Vec3 *max);
+static void entity_tree_build(EntityTree *tree, Entity *entities, u32 count);
+static void entity_tree_update(EntityTree *tree, Entity *entities, u32 count);
+static void entity_tree_move(EntityTree *tree, Entity *entities, u32 index);
+static f32 entity_tree_quality(EntityTree *tree);
+static u32 entity_tree_query_frustum(EntityTree *tree, Plane *planes, u32 *results, u32 max_results);
+static u32 entity_tree_query_box(EntityTree *tree, Vec3 min, Vec3 max, u32 *results, u32 max_results);
+static i32 entity_tree_raycast(EntityTree *tree, Entity *entities, Vec3 ray_origin, Vec3 ray_direction,
+                               RayHit *hit = NULL);
+static u32 entity_tree_raycast8(EntityTree *tree, Entity *entities, RayPacket8 *packet, u32 active,
+                                i32 *hit_entities);
+static void entity_tree_raycast_batch(EntityTree *tree, Entity *entities, JobQueue *jobs, Vec3 *origins,
+                                      Vec3 *directions, u32 count, RayHit *hits, i32 *hit_entities);
+
+static MeshBVH *mesh_bvh_build(Mesh *mesh);
+static void mesh_bvh_destroy(MeshBVH *bvh);
+static bool mesh_bvh_intersect(MeshBVH *bvh, Vec3 ray_origin, Vec3 ray_direction, RayHit *hit);
+static u32 mesh_bvh_intersect8(MeshBVH *bvh, RayPacket8 *packet, u32 active);
+
+#endif //HAMSTER_BVH_H
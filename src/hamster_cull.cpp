@@ -0,0 +1,432 @@
+static CullSet
+cull_create(u32 capacity)
+{
+    CullSet result = {};
+    
+    result.capacity = (capacity + CULL_LANES - 1) & ~(CULL_LANES - 1);
+    result.x = (f32 *)malloc(result.capacity * sizeof(f32));
+    result.y = (f32 *)malloc(result.capacity * sizeof(f32));
+    result.z = (f32 *)malloc(result.capacity * sizeof(f32));
+    result.radius = (f32 *)malloc(result.capacity * sizeof(f32));
+    for(u32 i = 0; i < 3; i++)
+    {
+        result.axis_x[i] = (f32 *)malloc(result.capacity * sizeof(f32));
+        result.axis_y[i] = (f32 *)malloc(result.capacity * sizeof(f32));
+        result.axis_z[i] = (f32 *)malloc(result.capacity * sizeof(f32));
+    }
+    for(u32 i = 0; i < CullView_Count; i++)
+    {
+        result.masks[i] = (u8 *)malloc(result.capacity / CULL_LANES);
+    }
+    
+    return result;
+}
+
+static void
+cull_destroy(CullSet *set)
+{
+    free(set->x);
+    free(set->y);
+    free(set->z);
+    free(set->radius);
+    for(u32 i = 0; i < 3; i++)
+    {
+        free(set->axis_x[i]);
+        free(set->axis_y[i]);
+        free(set->axis_z[i]);
+    }
+    for(u32 i = 0; i < CullView_Count; i++)
+    {
+        free(set->masks[i]);
+    }
+    memset(set, 0, sizeof(*set));
+}
+
+static void
+cull_reset(CullSet *set)
+{
+    set->count = 0;
+}
+
+// NOTE: The box is the cube around the sphere, it never rejects more than the sphere does
+static u32
+cull_push_sphere(CullSet *set, Vec3 center, f32 radius)
+{
+    Vec3 axes[3] = {
+        Vec3(radius, 0.0f, 0.0f),
+        Vec3(0.0f, radius, 0.0f),
+        Vec3(0.0f, 0.0f, radius),
+    };
+    
+    return cull_push(set, center, radius, axes);
+}
+
+// NOTE: Makes room for count more bounds, the capacity stays a multiple of CULL_LANES
+static void
+cull_reserve(CullSet *set, u32 count)
+{
+    if(set->count + count > set->capacity)
+    {
+        while(set->count + count > set->capacity)
+        {
+            set->capacity *= 2;
+        }
+        set->x = (f32 *)realloc(set->x, set->capacity * sizeof(f32));
+        set->y = (f32 *)realloc(set->y, set->capacity * sizeof(f32));
+        set->z = (f32 *)realloc(set->z, set->capacity * sizeof(f32));
+        set->radius = (f32 *)realloc(set->radius, set->capacity * sizeof(f32));
+        for(u32 i = 0; i < 3; i++)
+        {
+            set->axis_x[i] = (f32 *)realloc(set->axis_x[i], set->capacity * sizeof(f32));
+            set->axis_y[i] = (f32 *)realloc(set->axis_y[i], set->capacity * sizeof(f32));
+            set->axis_z[i] = (f32 *)realloc(set->axis_z[i], set->capacity * sizeof(f32));
+        }
+        for(u32 i = 0; i < CullView_Count; i++)
+        {
+            set->masks[i] = (u8 *)realloc(set->masks[i], set->capacity / CULL_LANES);
+        }
+        assert(set->x && set->y && set->z && set->radius);
+    }
+}
+
+static u32
+cull_push(CullSet *set, Vec3 center, f32 radius, Vec3 *axes)
+{
+    cull_reserve(set, 1);
+    
+    u32 index = set->count++;
+    set->x[index] = center.x;
+    set->y[index] = center.y;
+    set->z[index] = center.z;
+    set->radius[index] = radius;
+    for(u32 i = 0; i < 3; i++)
+    {
+        set->axis_x[i][index] = axes[i].x;
+        set->axis_y[i][index] = axes[i].y;
+        set->axis_z[i][index] = axes[i].z;
+    }
+    
+    return index;
+}
+
+// NOTE: One bound per mesh of the model, in mesh order. The meshes with a hitbox
+// get their centers and box axes through transform_points/transform_directions
+// straight into the set, the sphere grows by the largest scale of the transform.
+// Meshes past the hitboxes never get culled.
+static u32
+cull_push_model(CullSet *set, Model *model, Mat4 transform)
+{
+    cull_reserve(set, model->meshes_len);
+    u32 first = set->count;
+    
+    f32 largest_scale = 0.0f;
+    for(u32 i = 0; i < 3; i++)
+    {
+        Vec4 column = transform.columns[i];
+        largest_scale = MAX(largest_scale, len(Vec3(column.x, column.y, column.z)));
+    }
+    
+    u32 bounded = MIN(model->hitboxes_len, model->meshes_len);
+    Vec3 centers[CULL_MODEL_CHUNK];
+    Vec3 axes[3][CULL_MODEL_CHUNK];
+    for(u32 chunk = 0; chunk < bounded; chunk += CULL_MODEL_CHUNK)
+    {
+        u32 chunk_len = MIN(bounded - chunk, CULL_MODEL_CHUNK);
+        u32 index = first + chunk;
+        for(u32 i = 0; i < chunk_len; i++)
+        {
+            BoundingVolume *bounds = model->bounds + chunk + i;
+            centers[i] = bounds->center;
+            for(u32 a = 0; a < 3; a++)
+            {
+                axes[a][i] = scale(bounds->axes[a], bounds->half_size.m[a]);
+            }
+            set->radius[index + i] = bounds->radius * largest_scale;
+        }
+        
+        Vec3Array world_centers = { set->x + index, set->y + index, set->z + index };
+        transform_points(transform, centers, chunk_len, world_centers);
+        for(u32 a = 0; a < 3; a++)
+        {
+            Vec3Array world_axes = { set->axis_x[a] + index, set->axis_y[a] + index, set->axis_z[a] + index };
+            transform_directions(transform, axes[a], chunk_len, world_axes);
+        }
+    }
+    set->count += bounded;
+    
+    for(u32 mesh = bounded; mesh < model->meshes_len; mesh++)
+    {
+        cull_push_sphere(set, Vec3(0.0f, 0.0f, 0.0f), F32MAX);
+    }
+    
+    return first;
+}
+
+// NOTE: Works on whole blocks of CULL_LANES spheres, [first, one_past_last) are block indices
+static void
+cull_job(void *data, u32 first, u32 one_past_last)
+{
+    CullSet *set = (CullSet *)data;
+    
+    for(u32 view = 0; view < CullView_Count; view++)
+    {
+        Plane *planes = set->planes[view];
+        u8 *masks = set->masks[view];
+        u32 box_culled = 0;
+        
+#ifdef __AVX2__
+        __m256 nx[FrustumPlane_ElementCount];
+        __m256 ny[FrustumPlane_ElementCount];
+        __m256 nz[FrustumPlane_ElementCount];
+        __m256 nd[FrustumPlane_ElementCount];
+        for(u32 p = 0; p < FrustumPlane_ElementCount; p++)
+        {
+            nx[p] = _mm256_set1_ps(planes[p].normal.x);
+            ny[p] = _mm256_set1_ps(planes[p].normal.y);
+            nz[p] = _mm256_set1_ps(planes[p].normal.z);
+            nd[p] = _mm256_set1_ps(planes[p].d);
+        }
+        
+        __m256 zero = _mm256_setzero_ps();
+        __m256 sign = _mm256_set1_ps(-0.0f);
+        for(u32 block = first; block < one_past_last; block++)
+        {
+            u32 i = block * CULL_LANES;
+            __m256 x = _mm256_loadu_ps(set->x + i);
+            __m256 y = _mm256_loadu_ps(set->y + i);
+            __m256 z = _mm256_loadu_ps(set->z + i);
+            __m256 r = _mm256_loadu_ps(set->radius + i);
+            __m256 ax[3];
+            __m256 ay[3];
+            __m256 az[3];
+            for(u32 a = 0; a < 3; a++)
+            {
+                ax[a] = _mm256_loadu_ps(set->axis_x[a] + i);
+                ay[a] = _mm256_loadu_ps(set->axis_y[a] + i);
+                az[a] = _mm256_loadu_ps(set->axis_z[a] + i);
+            }
+            
+            __m256 sphere_inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+            __m256 box_inside = sphere_inside;
+            for(u32 p = 0; p < FrustumPlane_ElementCount; p++)
+            {
+                __m256 distance = _mm256_fmadd_ps(nx[p], x, nd[p]);
+                distance = _mm256_fmadd_ps(ny[p], y, distance);
+                distance = _mm256_fmadd_ps(nz[p], z, distance);
+                
+                __m256 reach = zero;
+                for(u32 a = 0; a < 3; a++)
+                {
+                    __m256 projected = _mm256_mul_ps(nx[p], ax[a]);
+                    projected = _mm256_fmadd_ps(ny[p], ay[a], projected);
+                    projected = _mm256_fmadd_ps(nz[p], az[a], projected);
+                    reach = _mm256_add_ps(reach, _mm256_andnot_ps(sign, projected));
+                }
+                
+                sphere_inside = _mm256_and_ps(sphere_inside,
+                                              _mm256_cmp_ps(_mm256_add_ps(distance, r), zero, _CMP_GT_OQ));
+                box_inside = _mm256_and_ps(box_inside,
+                                           _mm256_cmp_ps(_mm256_add_ps(distance, reach), zero, _CMP_GT_OQ));
+            }
+            
+            u8 sphere_mask = (u8)_mm256_movemask_ps(sphere_inside);
+            masks[block] = sphere_mask & (u8)_mm256_movemask_ps(box_inside);
+            box_culled += __builtin_popcount(sphere_mask & ~masks[block]);
+        }
+#else
+        for(u32 block = first; block < one_past_last; block++)
+        {
+            u8 mask = 0;
+            for(u32 lane = 0; lane < CULL_LANES; lane++)
+            {
+                u32 i = block * CULL_LANES + lane;
+                bool sphere_inside = true;
+                bool box_inside = true;
+                for(u32 p = 0; p < FrustumPlane_ElementCount; p++)
+                {
+                    Vec3 n = planes[p].normal;
+                    f32 distance = n.x * set->x[i] + n.y * set->y[i] + n.z * set->z[i] + planes[p].d;
+                    f32 reach = 0.0f;
+                    for(u32 a = 0; a < 3; a++)
+                    {
+                        reach += fabsf(n.x * set->axis_x[a][i] + n.y * set->axis_y[a][i] +
+                                       n.z * set->axis_z[a][i]);
+                    }
+                    sphere_inside = sphere_inside && distance + set->radius[i] > 0.0f;
+                    box_inside = box_inside && distance + reach > 0.0f;
+                }
+                mask |= (u8)((sphere_inside && box_inside) << lane);
+                box_culled += sphere_inside && !box_inside;
+            }
+            masks[block] = mask;
+        }
+#endif
+        
+        __atomic_add_fetch(&set->box_culled_counts[view], box_culled, __ATOMIC_RELAXED);
+    }
+}
+
+// NOTE: Expects set->planes to be filled in for every view
+static void
+cull_run(CullSet *set, JobQueue *jobs)
+{
+    f64 start = glfwGetTime();
+    
+    // NOTE: Pad the last block with spheres that are behind every plane
+    u32 padded = (set->count + CULL_LANES - 1) & ~(CULL_LANES - 1);
+    for(u32 i = set->count; i < padded; i++)
+    {
+        set->x[i] = 0.0f;
+        set->y[i] = 0.0f;
+        set->z[i] = 0.0f;
+        set->radius[i] = -F32MAX;
+        for(u32 a = 0; a < 3; a++)
+        {
+            set->axis_x[a][i] = 0.0f;
+            set->axis_y[a][i] = 0.0f;
+            set->axis_z[a][i] = 0.0f;
+        }
+    }
+    
+    for(u32 view = 0; view < CullView_Count; view++)
+    {
+        set->box_culled_counts[view] = 0;
+    }
+    
+    jobs_parallel_for(jobs, padded / CULL_LANES, CULL_MIN_BATCH_BLOCKS, cull_job, set);
+    
+    for(u32 view = 0; view < CullView_Count; view++)
+    {
+        u32 visible = 0;
+        for(u32 block = 0; block < padded / CULL_LANES; block++)
+        {
+            visible += __builtin_popcount(set->masks[view][block]);
+        }
+        set->visible_counts[view] = visible;
+    }
+    
+    set->last_run_time = glfwGetTime() - start;
+}
+
+static bool
+cull_visible(CullSet *set, CullView view, u32 index)
+{
+    assert(index < set->count);
+    return (set->masks[view][index / CULL_LANES] >> (index % CULL_LANES)) & 1;
+}
+
+// NOTE: Gribb/Hartmann plane extraction, works for both perspective and orthographic
+static void
+frustum_planes_from_matrix(Mat4 vp, Plane *planes)
+{
+    planes[FrustumPlane_Left].normal.x = vp.a[0][3] + vp.a[0][0];
+    planes[FrustumPlane_Left].normal.y = vp.a[1][3] + vp.a[1][0];
+    planes[FrustumPlane_Left].normal.z = vp.a[2][3] + vp.a[2][0];
+    planes[FrustumPlane_Left].d = vp.a[3][3] + vp.a[3][0];
+    
+    planes[FrustumPlane_Right].normal.x = vp.a[0][3] - vp.a[0][0];
+    planes[FrustumPlane_Right].normal.y = vp.a[1][3] - vp.a[1][0];
+    planes[FrustumPlane_Right].normal.z = vp.a[2][3] - vp.a[2][0];
+    planes[FrustumPlane_Right].d = vp.a[3][3] - vp.a[3][0];
+    
+    planes[FrustumPlane_Bottom].normal.x = vp.a[0][3] + vp.a[0][1];
+    planes[FrustumPlane_Bottom].normal.y = vp.a[1][3] + vp.a[1][1];
+    planes[FrustumPlane_Bottom].normal.z = vp.a[2][3] + vp.a[2][1];
+    planes[FrustumPlane_Bottom].d = vp.a[3][3] + vp.a[3][1];
+    
+    planes[FrustumPlane_Top].normal.x = vp.a[0][3] - vp.a[0][1];
+    planes[FrustumPlane_Top].normal.y = vp.a[1][3] - vp.a[1][1];
+    planes[FrustumPlane_Top].normal.z = vp.a[2][3] - vp.a[2][1];
+    planes[FrustumPlane_Top].d = vp.a[3][3] - vp.a[3][1];
+    
+    planes[FrustumPlane_Near].normal.x = vp.a[0][3] + vp.a[0][2];
+    planes[FrustumPlane_Near].normal.y = vp.a[1][3] + vp.a[1][2];
+    planes[FrustumPlane_Near].normal.z = vp.a[2][3] + vp.a[2][2];
+    planes[FrustumPlane_Near].d = vp.a[3][3] + vp.a[3][2];
+    
+    planes[FrustumPlane_Far].normal.x = vp.a[0][3] - vp.a[0][2];
+    planes[FrustumPlane_Far].normal.y = vp.a[1][3] - vp.a[1][2];
+    planes[FrustumPlane_Far].normal.z = vp.a[2][3] - vp.a[2][2];
+    planes[FrustumPlane_Far].d = vp.a[3][3] - vp.a[3][2];
+    
+    for(u32 i = 0; i < FrustumPlane_ElementCount; i++)
+    {
+        f32 nozf = inverse_len(planes[i].normal);
+        planes[i].normal = scale(planes[i].normal, nozf);
+        planes[i].d *= nozf;
+    }
+}
+
+// NOTE: Same test as the cull kernel's box part, four axis aligned boxes at once.
+// Returns the lanes that touch the frustum, inside_mask gets the ones fully in it.
+static u32
+frustum_test_boxes4(Plane *planes, RayBoxes4 *boxes, u32 *inside_mask)
+{
+#ifdef __SSE2__
+    __m128 half = _mm_set1_ps(0.5f);
+    __m128 sign = _mm_set1_ps(-0.0f);
+    __m128 zero = _mm_setzero_ps();
+    __m128 min_x = _mm_load_ps(boxes->min_x);
+    __m128 min_y = _mm_load_ps(boxes->min_y);
+    __m128 min_z = _mm_load_ps(boxes->min_z);
+    __m128 max_x = _mm_load_ps(boxes->max_x);
+    __m128 max_y = _mm_load_ps(boxes->max_y);
+    __m128 max_z = _mm_load_ps(boxes->max_z);
+    __m128 center_x = _mm_mul_ps(_mm_add_ps(min_x, max_x), half);
+    __m128 center_y = _mm_mul_ps(_mm_add_ps(min_y, max_y), half);
+    __m128 center_z = _mm_mul_ps(_mm_add_ps(min_z, max_z), half);
+    __m128 extent_x = _mm_mul_ps(_mm_sub_ps(max_x, min_x), half);
+    __m128 extent_y = _mm_mul_ps(_mm_sub_ps(max_y, min_y), half);
+    __m128 extent_z = _mm_mul_ps(_mm_sub_ps(max_z, min_z), half);
+    
+    __m128 touching = _mm_castsi128_ps(_mm_set1_epi32(-1));
+    __m128 inside = touching;
+    for(u32 p = 0; p < FrustumPlane_ElementCount; p++)
+    {
+        __m128 nx = _mm_set1_ps(planes[p].normal.x);
+        __m128 ny = _mm_set1_ps(planes[p].normal.y);
+        __m128 nz = _mm_set1_ps(planes[p].normal.z);
+        
+        __m128 distance = _mm_add_ps(_mm_mul_ps(nx, center_x), _mm_set1_ps(planes[p].d));
+        distance = _mm_add_ps(_mm_mul_ps(ny, center_y), distance);
+        distance = _mm_add_ps(_mm_mul_ps(nz, center_z), distance);
+        
+        __m128 reach = _mm_mul_ps(_mm_andnot_ps(sign, nx), extent_x);
+        reach = _mm_add_ps(_mm_mul_ps(_mm_andnot_ps(sign, ny), extent_y), reach);
+        reach = _mm_add_ps(_mm_mul_ps(_mm_andnot_ps(sign, nz), extent_z), reach);
+        
+        touching = _mm_and_ps(touching, _mm_cmpgt_ps(_mm_add_ps(distance, reach), zero));
+        inside = _mm_and_ps(inside, _mm_cmpgt_ps(_mm_sub_ps(distance, reach), zero));
+    }
+    
+    *inside_mask = (u32)_mm_movemask_ps(inside);
+    return (u32)_mm_movemask_ps(touching);
+#else
+    u32 touching = 0;
+    u32 inside = 0;
+    for(u32 i = 0; i < 4; i++)
+    {
+        Vec3 center = Vec3((boxes->min_x[i] + boxes->max_x[i]) * 0.5f,
+                           (boxes->min_y[i] + boxes->max_y[i]) * 0.5f,
+                           (boxes->min_z[i] + boxes->max_z[i]) * 0.5f);
+        Vec3 extent = Vec3((boxes->max_x[i] - boxes->min_x[i]) * 0.5f,
+                           (boxes->max_y[i] - boxes->min_y[i]) * 0.5f,
+                           (boxes->max_z[i] - boxes->min_z[i]) * 0.5f);
+        bool box_touching = true;
+        bool box_inside = true;
+        for(u32 p = 0; p < FrustumPlane_ElementCount; p++)
+        {
+            Vec3 n = planes[p].normal;
+            f32 distance = inner(center, n) + planes[p].d;
+            f32 reach = fabsf(n.x) * extent.x + fabsf(n.y) * extent.y + fabsf(n.z) * extent.z;
+            box_touching = box_touching && distance + reach > 0.0f;
+            box_inside = box_inside && distance - reach > 0.0f;
+        }
+        touching |= (u32)box_touching << i;
+        inside |= (u32)box_inside << i;
+    }
+    
+    *inside_mask = inside;
+    return touching;
+#endif
+}
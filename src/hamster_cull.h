@@ -0,0 +1,56 @@
+/* date = October 19th 2026 2:40 pm */
+
+#ifndef HAMSTER_CULL_H
+#define HAMSTER_CULL_H
+
+#define CULL_LANES 8
+#define CULL_MIN_BATCH_BLOCKS 1024
+#define CULL_MODEL_CHUNK 64 // NOTE: Meshes cull_push_model transforms per batch
+
+enum CullView
+{
+    CullView_Main,
+    CullView_Shadow,
+    CullView_Count,
+};
+
+// NOTE: World space bounds for everything submitted this frame, kept as SoA so
+// the kernel can test CULL_LANES of them at once. Every bound is a sphere and a box
+// around the same center, the box given by its three half axes. Something is visible
+// when both of them pass. The arrays are always padded to a multiple of CULL_LANES
+// with bounds that never pass. Results are bitmasks, one bit per bound and view,
+// 1 meaning visible.
+struct CullSet
+{
+    f32 *x;
+    f32 *y;
+    f32 *z;
+    f32 *radius;
+    f32 *axis_x[3];
+    f32 *axis_y[3];
+    f32 *axis_z[3];
+    u8 *masks[CullView_Count];
+    u32 count;
+    u32 capacity;
+    
+    Plane planes[CullView_Count][FrustumPlane_ElementCount];
+    
+    u32 visible_counts[CullView_Count];
+    u32 box_culled_counts[CullView_Count]; // NOTE: The sphere alone would've drawn these
+    f64 last_run_time;
+};
+
+static CullSet cull_create(u32 capacity = 1024);
+static void cull_destroy(CullSet *set);
+static void cull_reset(CullSet *set);
+static u32 cull_push(CullSet *set, Vec3 center, f32 radius, Vec3 *axes);
+static u32 cull_push_sphere(CullSet *set, Vec3 center, f32 radius);
+static void cull_reserve(CullSet *set, u32 count);
+static u32 cull_push_model(CullSet *set, Model *model, Mat4 transform);
+static void cull_run(CullSet *set, JobQueue *jobs);
+static bool cull_visible(CullSet *set, CullView view, u32 index);
+
+static void frustum_planes_from_matrix(Mat4 vp, Plane *planes);
+static u32 frustum_test_boxes4(Plane *planes, RayBoxes4 *boxes, u32 *inside_mask);
+
+#endif //HAMSTER_CULL_H
@@ -610,12 +610,369 @@ model_create_sponge()
     }
 
     model->hitboxes = (Hitbox *)malloc(sizeof(model->hitboxes[0]));
-    model->hitboxes[model->hitboxes_len++] = hitbox_create_from_mesh(mesh);
+    model->bounds = (BoundingVolume *)malloc(sizeof(model->bounds[0]));
+    model->hitboxes[model->hitboxes_len] = hitbox_create_from_mesh(mesh);
+    model->bounds[model->hitboxes_len] = bounding_volume_from_mesh(mesh, model->hitboxes + model->hitboxes_len);
+    model->hitboxes_len++;
+    mesh->bvh = mesh_bvh_build(mesh);
     model_finalize_mesh(mesh);
 
     return model;
 }
 
+// NOTE: A cell of a level N sponge survives if no two of its coordinates have a 1
+// at the same base 3 digit, that's the middle of some subdivision.
+static bool
+sponge_cell_filled(i32 x, i32 y, i32 z, i32 grid)
+{
+    if(x < 0 || y < 0 || z < 0 || x >= grid || y >= grid || z >= grid)
+    {
+        return false;
+    }
+    
+    while(x | y | z)
+    {
+        i32 middles = (x % 3 == 1) + (y % 3 == 1) + (z % 3 == 1);
+        if(middles > 1)
+        {
+            return false;
+        }
+        x /= 3;
+        y /= 3;
+        z /= 3;
+    }
+    
+    return true;
+}
+
+static void
+sponge_mesh_push_quad(Mesh *mesh, u32 *capacity, Vec3 p0, Vec3 du, Vec3 dv, Vec3 normal, bool flip)
+{
+    if(mesh->vertices_len + 4 > *capacity)
+    {
+        *capacity = MAX(*capacity * 2, 1024);
+        mesh->vertices.positions = (Vec3 *)realloc(mesh->vertices.positions, *capacity * sizeof(Vec3));
+        mesh->vertices.normals = (Vec3 *)realloc(mesh->vertices.normals, *capacity * sizeof(Vec3));
+        mesh->indices = (u32 *)realloc(mesh->indices, (*capacity / 4) * 6 * sizeof(u32));
+    }
+    
+    u32 base = mesh->vertices_len;
+    mesh->vertices.positions[base + 0] = p0;
+    mesh->vertices.positions[base + 1] = add(p0, du);
+    mesh->vertices.positions[base + 2] = add(add(p0, du), dv);
+    mesh->vertices.positions[base + 3] = add(p0, dv);
+    for(u32 i = 0; i < 4; i++)
+    {
+        mesh->vertices.normals[base + i] = normal;
+    }
+    mesh->vertices_len += 4;
+    
+    u32 order[2][6] = { { 0, 1, 2, 0, 2, 3 }, { 0, 2, 1, 0, 3, 2 } };
+    for(u32 i = 0; i < 6; i++)
+    {
+        mesh->indices[mesh->indices_len++] = base + order[flip][i];
+    }
+}
+
+// NOTE: Builds the visible surface of whole chunks, [first, one_past_last) are chunk
+// indices. A face is only emitted between a filled and an empty cell, neighbours
+// outside of the chunk are looked up too so chunk borders don't leave walls behind.
+// Coplanar faces get merged greedily into rectangles.
+static void
+sponge_chunk_job(void *data, u32 first, u32 one_past_last)
+{
+    SpongeBuild *build = (SpongeBuild *)data;
+    i32 side = build->chunk_cells;
+    i32 padded = side + 2;
+    f32 cell = 1.0f / build->grid;
+    
+    u8 *occupied = (u8 *)malloc(padded * padded * padded);
+    i8 *mask = (i8 *)malloc(side * side);
+    
+    for(u32 chunk = first; chunk < one_past_last; chunk++)
+    {
+        i32 origin[3];
+        origin[0] = (chunk % build->chunks_per_side) * side;
+        origin[1] = ((chunk / build->chunks_per_side) % build->chunks_per_side) * side;
+        origin[2] = (chunk / (build->chunks_per_side * build->chunks_per_side)) * side;
+        
+        for(i32 z = -1; z <= side; z++)
+        {
+            for(i32 y = -1; y <= side; y++)
+            {
+                for(i32 x = -1; x <= side; x++)
+                {
+                    occupied[((z + 1) * padded + (y + 1)) * padded + (x + 1)] =
+                        sponge_cell_filled(origin[0] + x, origin[1] + y, origin[2] + z, build->grid);
+                }
+            }
+        }
+        
+        Mesh *mesh = build->meshes + chunk;
+        u32 capacity = 0;
+        Vec3 bmin = Vec3(F32MAX, F32MAX, F32MAX);
+        Vec3 bmax = Vec3(-F32MAX, -F32MAX, -F32MAX);
+        
+        for(i32 d = 0; d < 3; d++)
+        {
+            i32 u = (d + 1) % 3;
+            i32 v = (d + 2) % 3;
+            
+            for(i32 s = 0; s <= side; s++)
+            {
+                // NOTE: The far plane belongs to the next chunk, unless there is none
+                if(s == side && origin[d] + side != (i32)build->grid)
+                {
+                    continue;
+                }
+                
+                for(i32 j = 0; j < side; j++)
+                {
+                    for(i32 i = 0; i < side; i++)
+                    {
+                        i32 c[3];
+                        c[d] = s - 1; c[u] = i; c[v] = j;
+                        bool behind = occupied[((c[2] + 1) * padded + (c[1] + 1)) * padded + (c[0] + 1)];
+                        c[d] = s;
+                        bool front = occupied[((c[2] + 1) * padded + (c[1] + 1)) * padded + (c[0] + 1)];
+                        
+                        mask[j * side + i] = behind == front ? 0 : (behind ? 1 : -1);
+                    }
+                }
+                
+                for(i32 j = 0; j < side; j++)
+                {
+                    for(i32 i = 0; i < side;)
+                    {
+                        i8 m = mask[j * side + i];
+                        if(m == 0)
+                        {
+                            i++;
+                            continue;
+                        }
+                        
+                        i32 w = 1;
+                        while(i + w < side && mask[j * side + i + w] == m)
+                        {
+                            w++;
+                        }
+                        
+                        i32 h = 1;
+                        for(; j + h < side; h++)
+                        {
+                            bool row_matches = true;
+                            for(i32 k = 0; k < w && row_matches; k++)
+                            {
+                                row_matches = mask[(j + h) * side + i + k] == m;
+                            }
+                            if(!row_matches)
+                            {
+                                break;
+                            }
+                        }
+                        
+                        for(i32 y = 0; y < h; y++)
+                        {
+                            memset(mask + (j + y) * side + i, 0, w);
+                        }
+                        
+                        f32 p[3];
+                        p[d] = (origin[d] + s) * cell - 0.5f;
+                        p[u] = (origin[u] + i) * cell - 0.5f;
+                        p[v] = (origin[v] + j) * cell - 0.5f;
+                        f32 eu[3] = {};
+                        f32 ev[3] = {};
+                        f32 n[3] = {};
+                        eu[u] = w * cell;
+                        ev[v] = h * cell;
+                        n[d] = (f32)m;
+                        
+                        Vec3 p0 = Vec3(p[0], p[1], p[2]);
+                        Vec3 du = Vec3(eu[0], eu[1], eu[2]);
+                        Vec3 dv = Vec3(ev[0], ev[1], ev[2]);
+                        sponge_mesh_push_quad(mesh, &capacity, p0, du, dv, Vec3(n[0], n[1], n[2]), m < 0);
+                        
+                        Vec3 p1 = add(add(p0, du), dv);
+                        bmin = Vec3(MIN(bmin.x, p0.x), MIN(bmin.y, p0.y), MIN(bmin.z, p0.z));
+                        bmax = Vec3(MAX(bmax.x, p1.x), MAX(bmax.y, p1.y), MAX(bmax.z, p1.z));
+                        
+                        i += w;
+                    }
+                }
+            }
+        }
+        
+        if(mesh->indices_len)
+        {
+            build->hitboxes[chunk].refpoint = bmin;
+            build->hitboxes[chunk].size = sub(bmax, bmin);
+            build->bounds[chunk] = bounding_volume_from_mesh(mesh, build->hitboxes + chunk);
+        }
+    }
+    
+    free(occupied);
+    free(mask);
+}
+
+static void
+sponge_division_job(void *data, u32 first, u32 one_past_last)
+{
+    SpongeDivision *division = (SpongeDivision *)data;
+    
+    for(u32 i = first; i < one_past_last; i++)
+    {
+        Vec3 size = divs(division->parent_sizes[i], 3.0f);
+        Vec3 parent = division->parent_positions[i];
+        Quat rotation = division->parent_rotations[i];
+        
+        u32 child = i * SPONGE_CHILDREN;
+        for(i32 x = -1; x < 2; x++)
+        {
+            for(i32 y = -1; y < 2; y++)
+            {
+                for(i32 z = -1; z < 2; z++)
+                {
+                    if(abs(x) + abs(y) + abs(z) > 1)
+                    {
+                        Vec3 offset = Vec3(x * size.x, y * size.y, z * size.z);
+                        division->sizes[child] = size;
+                        division->rotations[child] = rotation;
+                        division->positions[child] = add(parent, quat_rotate(rotation, offset));
+                        child++;
+                    }
+                }
+            }
+        }
+        assert(child == (i + 1) * SPONGE_CHILDREN);
+    }
+}
+
+// NOTE: Hands batches to the background ring until it fills up, the rest gets
+// pushed on later frames by sponge_division_finish.
+static void
+sponge_division_push(SpongeDivision *division, JobQueue *jobs)
+{
+    while(division->next_first < division->parents_count)
+    {
+        u32 one_past_last = MIN(division->next_first + SPONGE_DIVIDE_BATCH, division->parents_count);
+        if(!jobs_push_background(jobs, sponge_division_job, division, division->next_first, one_past_last,
+                                 &division->counter))
+        {
+            break;
+        }
+        division->next_first = one_past_last;
+    }
+}
+
+// NOTE: Returns right away, the children get written by the workers while the
+// current level keeps being drawn. The entity must not be changed until
+// sponge_division_finish returns true.
+static void
+sponge_division_start(SpongeDivision *division, EntityInstanced *sponge, JobQueue *jobs)
+{
+    assert(!division->active);
+    
+    division->parent_positions = sponge->positions;
+    division->parent_sizes = sponge->sizes;
+    division->parent_rotations = sponge->rotations;
+    division->parents_count = sponge->instances_count;
+    
+    u32 children_count = division->parents_count * SPONGE_CHILDREN;
+    division->positions = (Vec3 *)malloc(children_count * sizeof(Vec3));
+    division->sizes = (Vec3 *)malloc(children_count * sizeof(Vec3));
+    division->rotations = (Quat *)malloc(children_count * sizeof(Quat));
+    
+    division->counter = {};
+    division->next_first = 0;
+    division->active = true;
+    division->start_time = glfwGetTime();
+    
+    sponge_division_push(division, jobs);
+}
+
+// NOTE: Call once per frame, pushes whatever batches didn't fit yet and swaps the
+// new level in once every batch is done.
+static bool
+sponge_division_finish(SpongeDivision *division, EntityInstanced *sponge, JobQueue *jobs)
+{
+    if(!division->active)
+    {
+        return false;
+    }
+    
+    sponge_division_push(division, jobs);
+    if(division->next_first < division->parents_count || !jobs_counter_done(jobs, &division->counter))
+    {
+        return false;
+    }
+    
+    free(sponge->positions);
+    free(sponge->sizes);
+    free(sponge->rotations);
+    sponge->positions = division->positions;
+    sponge->sizes = division->sizes;
+    sponge->rotations = division->rotations;
+    sponge->instances_count = division->parents_count * SPONGE_CHILDREN;
+    entity_instanced_mark_dirty(sponge, 0, sponge->instances_count);
+    
+    division->active = false;
+    
+    return true;
+}
+
+// NOTE: The same sponge as dividing the instanced one level times, but only the
+// visible surface, merged into one mesh per SPONGE_CHUNK_CELLS^3 chunk. Lives in
+// the unit cube centered at the origin just like model_create_sponge.
+static Model *
+model_create_sponge_merged(u32 level, JobQueue *jobs)
+{
+    SpongeBuild build = {};
+    build.grid = 1;
+    for(u32 i = 0; i < level; i++)
+    {
+        build.grid *= 3;
+    }
+    build.chunk_cells = MIN(build.grid, SPONGE_CHUNK_CELLS);
+    build.chunks_per_side = build.grid / build.chunk_cells;
+    
+    u32 chunks_count = build.chunks_per_side * build.chunks_per_side * build.chunks_per_side;
+    build.meshes = (Mesh *)calloc(chunks_count, sizeof(Mesh));
+    build.hitboxes = (Hitbox *)calloc(chunks_count, sizeof(Hitbox));
+    build.bounds = (BoundingVolume *)calloc(chunks_count, sizeof(BoundingVolume));
+    
+    jobs_parallel_for(jobs, chunks_count, 1, sponge_chunk_job, &build);
+    
+    Model *model = (Model *)malloc(sizeof(Model));
+    memset(model, 0, sizeof(Model));
+    model->meshes = (Mesh *)malloc(chunks_count * sizeof(Mesh));
+    model->hitboxes = (Hitbox *)malloc(chunks_count * sizeof(Hitbox));
+    model->bounds = (BoundingVolume *)malloc(chunks_count * sizeof(BoundingVolume));
+    
+    // NOTE: Chunks in the tunnels come out empty, GL objects only get made for the rest
+    for(u32 i = 0; i < chunks_count; i++)
+    {
+        Mesh *mesh = build.meshes + i;
+        if(mesh->indices_len == 0)
+        {
+            free(mesh->vertices.positions);
+            free(mesh->vertices.normals);
+            free(mesh->indices);
+            continue;
+        }
+        
+        model->meshes[model->meshes_len] = *mesh;
+        model_finalize_mesh(&model->meshes[model->meshes_len++]);
+        model->bounds[model->hitboxes_len] = build.bounds[i];
+        model->hitboxes[model->hitboxes_len++] = build.hitboxes[i];
+    }
+    
+    free(build.meshes);
+    free(build.hitboxes);
+    free(build.bounds);
+    
+    return model;
+}
+
 static Model
 model_create_from_obj(OBJModel *obj)
 {
@@ -624,6 +981,7 @@ model_create_from_obj(OBJModel *obj)
     OBJMesh *objmesh = NULL;
     model.meshes = (Mesh *)malloc(obj->meshes_len * sizeof(Mesh));
     model.hitboxes = (Hitbox *)malloc(obj->meshes_len * sizeof(Hitbox));
+    model.bounds = (BoundingVolume *)malloc(obj->meshes_len * sizeof(BoundingVolume));
     for(u32 i = 0; i < obj->meshes_len; i++)
     {
         objmesh = &obj->meshes[i];
@@ -669,7 +1027,10 @@ model_create_from_obj(OBJModel *obj)
             mesh->indices[mesh->indices_len++] = objmesh->indices[j];
         }
         
-        model.hitboxes[model.hitboxes_len++] = hitbox_create_from_mesh(mesh);
+        model.hitboxes[model.hitboxes_len] = hitbox_create_from_mesh(mesh);
+        model.bounds[model.hitboxes_len] = bounding_volume_from_mesh(mesh, model.hitboxes + model.hitboxes_len);
+        model.hitboxes_len++;
+        mesh->bvh = mesh_bvh_build(mesh);
         model_finalize_mesh(mesh);
     }
     
@@ -679,6 +1040,81 @@ model_create_from_obj(OBJModel *obj)
     return model;
 }
 
+static u32
+mesh_vertex_stride(Mesh *mesh)
+{
+    u32 stride = sizeof(*mesh->vertices.positions);
+    stride += mesh->vertices.texture_uvs ? sizeof(*mesh->vertices.texture_uvs) : 0;
+    stride += mesh->vertices.normals ? sizeof(*mesh->vertices.normals) : 0;
+    stride += mesh->vertices.tangents ? sizeof(*mesh->vertices.tangents) : 0;
+    stride += mesh->vertices.bitangents ? sizeof(*mesh->vertices.bitangents) : 0;
+    stride += mesh->vertices.baked_light ? sizeof(*mesh->vertices.baked_light) : 0;
+    
+    return stride;
+}
+
+// NOTE: Expects the vao that should receive the attributes to be bound, this way
+// the same mesh vbo can be shared between the mesh's own vao and the vaos of instanced
+// entities. Returns the stride.
+static u32
+mesh_set_vertex_attributes(Mesh *mesh)
+{
+    bool uvs = mesh->vertices.texture_uvs != NULL;
+    bool normals = mesh->vertices.normals != NULL;
+    bool tangents = mesh->vertices.tangents != NULL;
+    bool bitangents = mesh->vertices.bitangents != NULL;
+    bool baked_light = mesh->vertices.baked_light != NULL;
+    u32 stride = mesh_vertex_stride(mesh);
+    
+    glBindBuffer(GL_ARRAY_BUFFER, mesh->vbo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->ebo);
+    
+    size_t offset = 0;
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, (void *)offset);
+    offset += sizeof(Vec3);
+    
+    if(uvs)
+    {
+        glEnableVertexAttribArray(1);
+        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, stride, (void *)offset);
+        offset += sizeof(Vec2);
+    }
+    
+    if(normals)
+    {
+        glEnableVertexAttribArray(2);
+        glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, stride, (void *)offset);
+        offset += sizeof(Vec3);
+    }
+    
+    if(tangents)
+    {
+        glEnableVertexAttribArray(3);
+        glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, stride, (void *)offset);
+        offset += sizeof(Vec3);
+    }
+    
+    if(bitangents)
+    {
+        glEnableVertexAttribArray(4);
+        glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, stride, (void *)offset);
+        offset += sizeof(Vec3);
+    }
+    
+    // NOTE: Past the instance attributes, so instanced vaos can share the vbo
+    if(baked_light)
+    {
+        glEnableVertexAttribArray(6);
+        glVertexAttribPointer(6, 4, GL_FLOAT, GL_FALSE, stride, (void *)offset);
+        offset += sizeof(Vec4);
+    }
+    
+    assert(offset == stride);
+    
+    return stride;
+}
+
 static void 
 model_finalize_mesh(Mesh *mesh)
 {
@@ -686,12 +1122,9 @@ model_finalize_mesh(Mesh *mesh)
     bool normals = mesh->vertices.normals != NULL;
     bool tangents = mesh->vertices.tangents != NULL;
     bool bitangents = mesh->vertices.bitangents != NULL;
+    bool baked_light = mesh->vertices.baked_light != NULL;
     
-    u32 stride = sizeof(*mesh->vertices.positions);
-    stride += uvs ? sizeof(*mesh->vertices.texture_uvs) : 0;
-    stride += normals ? sizeof(*mesh->vertices.normals) : 0;
-    stride += tangents ? sizeof(*mesh->vertices.tangents) : 0;
-    stride += bitangents ? sizeof(*mesh->vertices.bitangents) : 0;
+    u32 stride = mesh_vertex_stride(mesh);
     
     u32 data_len = 0;
     u32 size = mesh->vertices_len * stride;
@@ -725,6 +1158,13 @@ model_finalize_mesh(Mesh *mesh)
             data[data_len++] = mesh->vertices.bitangents[i].y;
             data[data_len++] = mesh->vertices.bitangents[i].z;
         }
+        if(baked_light)
+        {
+            data[data_len++] = mesh->vertices.baked_light[i].x;
+            data[data_len++] = mesh->vertices.baked_light[i].y;
+            data[data_len++] = mesh->vertices.baked_light[i].z;
+            data[data_len++] = mesh->vertices.baked_light[i].w;
+        }
     }
     
     assert(mesh->indices_len != 0);
@@ -743,40 +1183,7 @@ model_finalize_mesh(Mesh *mesh)
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh->ebo);
     glBufferData(GL_ELEMENT_ARRAY_BUFFER, mesh->indices_len * sizeof(u32), mesh->indices, GL_STATIC_DRAW);
     
-    size_t offset = 0;
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, (void *)offset);
-    offset += sizeof(Vec3);
-    
-    if(uvs)
-    {
-        glEnableVertexAttribArray(1);
-        glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, stride, (void *)offset);
-        offset += sizeof(Vec2);
-    }
-    
-    if(normals)
-    {
-        glEnableVertexAttribArray(2);
-        glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, stride, (void *)offset);
-        offset += sizeof(Vec3);
-    }
-    
-    if(tangents)
-    {
-        glEnableVertexAttribArray(3);
-        glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, stride, (void *)offset);
-        offset += sizeof(Vec3);
-    }
-    
-    if(bitangents)
-    {
-        glEnableVertexAttribArray(4);
-        glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, stride, (void *)offset);
-        offset += sizeof(Vec3);
-    }
-    
-    assert(offset == stride);
+    mesh_set_vertex_attributes(mesh);
 }
 
 static void 
@@ -790,9 +1197,12 @@ model_destory(Model model)
         free(model.meshes[i].vertices.normals);
         free(model.meshes[i].vertices.tangents);
         free(model.meshes[i].vertices.bitangents);
+        free(model.meshes[i].vertices.baked_light);
         glDeleteVertexArrays(1, &model.meshes[i].vao);
         glDeleteBuffers(1, &model.meshes[i].vbo);
         glDeleteBuffers(1, &model.meshes[i].ebo);
+        glDeleteTextures(1, &model.meshes[i].lightmap);
+        mesh_bvh_destroy(model.meshes[i].bvh);
     }
     
     for(u32 i = 0; i < model.materials_len; i++)
@@ -804,6 +1214,7 @@ model_destory(Model model)
     
     free(model.meshes);
     free(model.hitboxes);
+    free(model.bounds);
     free(model.materials);
 }
 
@@ -891,8 +1302,12 @@ model_mesh_normals_shade(Model *model)
 static Hitbox
 hitbox_create_from_mesh(Mesh *mesh)
 {
-    Vec3 maxpoint = {};
-    Vec3 minpoint = {};
+    Vec3 maxpoint = Vec3(-F32MAX, -F32MAX, -F32MAX);
+    Vec3 minpoint = Vec3(F32MAX, F32MAX, F32MAX);
+    if(mesh->vertices_len == 0)
+    {
+        maxpoint = minpoint = Vec3(0.0f, 0.0f, 0.0f);
+    }
     
     for(u32 i = 0; i < mesh->vertices_len; i++)
     {
@@ -923,31 +1338,194 @@ hitbox_as_cylinder(Line line, f32 r)
     return result;
 }
 
-static bool
-hitbox_in_frustum(Hitbox *hbox, Plane *planes, Mat4 transform)
+// NOTE: Size can be negative along an axis, so the corners get sorted
+static void
+hitbox_bounds(Hitbox *hbox, Vec3 *min, Vec3 *max)
+{
+    Vec3 corner = add(hbox->refpoint, hbox->size);
+    for(u32 a = 0; a < 3; a++)
+    {
+        min->m[a] = MIN(hbox->refpoint.m[a], corner.m[a]);
+        max->m[a] = MAX(hbox->refpoint.m[a], corner.m[a]);
+    }
+}
+
+// NOTE: Jacobi rotations on a symmetric 3x3, the eigenvectors come out
+// as the columns of the accumulated rotation.
+static void
+symmetric_eigenvectors(f32 m[3][3], Vec3 *vectors)
 {
-    Vec4 s4 = mul(transform, Vec4(hbox->size, 0.0f));
-    Vec3 halfsize = scale(Vec3(s4.x, s4.y, s4.z), 0.5f);
-    f32 r = sqrtf(square(halfsize.x) + square(halfsize.y) + square(halfsize.z));
-    Vec3 point = add(mul(transform, hbox->refpoint), halfsize);
+    f32 a[3][3];
+    f32 v[3][3] = { { 1.0f, 0.0f, 0.0f }, { 0.0f, 1.0f, 0.0f }, { 0.0f, 0.0f, 1.0f } };
+    memcpy(a, m, sizeof(a));
     
-    for(u32 i = 0; i < FrustumPlane_ElementCount; i++)
+    u32 pairs[3][2] = { { 0, 1 }, { 0, 2 }, { 1, 2 } };
+    for(u32 sweep = 0; sweep < 16; sweep++)
     {
-        if(inner(point, planes[i].normal) + planes[i].d + r <= 0)
+        f32 off = square(a[0][1]) + square(a[0][2]) + square(a[1][2]);
+        f32 diagonal = square(a[0][0]) + square(a[1][1]) + square(a[2][2]);
+        if(off <= 1e-12f * diagonal)
         {
-            return false;
+            break;
+        }
+        
+        for(u32 pair = 0; pair < 3; pair++)
+        {
+            u32 p = pairs[pair][0];
+            u32 q = pairs[pair][1];
+            if(a[p][q] == 0.0f)
+            {
+                continue;
+            }
+            
+            f32 theta = (a[q][q] - a[p][p]) / (2.0f * a[p][q]);
+            f32 t = (theta >= 0.0f ? 1.0f : -1.0f) / (fabsf(theta) + sqrtf(square(theta) + 1.0f));
+            f32 c = 1.0f / sqrtf(square(t) + 1.0f);
+            f32 sn = t * c;
+            
+            for(u32 k = 0; k < 3; k++)
+            {
+                f32 akp = a[k][p];
+                f32 akq = a[k][q];
+                a[k][p] = c * akp - sn * akq;
+                a[k][q] = sn * akp + c * akq;
+            }
+            for(u32 k = 0; k < 3; k++)
+            {
+                f32 apk = a[p][k];
+                f32 aqk = a[q][k];
+                a[p][k] = c * apk - sn * aqk;
+                a[q][k] = sn * apk + c * aqk;
+            }
+            for(u32 k = 0; k < 3; k++)
+            {
+                f32 vkp = v[k][p];
+                f32 vkq = v[k][q];
+                v[k][p] = c * vkp - sn * vkq;
+                v[k][q] = sn * vkp + c * vkq;
+            }
         }
     }
     
-    return true;
+    for(u32 i = 0; i < 3; i++)
+    {
+        vectors[i] = noz(Vec3(v[0][i], v[1][i], v[2][i]));
+    }
 }
 
-static Vec2
-world_point_to_screen(Vec3 world_point, Mat4 proj, Mat4 view)
+// NOTE: The OBB axes are the principal components of the vertex positions. That
+// fits long diagonal meshes well and does nothing for boxy ones, so it's only
+// kept when it's under 90% of the hitbox's volume.
+static BoundingVolume
+bounding_volume_from_mesh(Mesh *mesh, Hitbox *hbox)
 {
-    Vec3 result = {};
-    
-    result = mul(proj, mul(view, world_point));
+    BoundingVolume result = {};
+    result.axes[0] = Vec3(1.0f, 0.0f, 0.0f);
+    result.axes[1] = Vec3(0.0f, 1.0f, 0.0f);
+    result.axes[2] = Vec3(0.0f, 0.0f, 1.0f);
+    result.half_size = scale(hbox->size, 0.5f);
+    result.center = add(hbox->refpoint, result.half_size);
+    
+    Vec3 *positions = mesh->vertices.positions;
+    u32 count = mesh->vertices_len;
+    if(count >= 4)
+    {
+        Vec3 mean = Vec3(0.0f, 0.0f, 0.0f);
+        for(u32 i = 0; i < count; i++)
+        {
+            mean = add(mean, positions[i]);
+        }
+        mean = scale(mean, 1.0f / (f32)count);
+        
+        f32 covariance[3][3] = {};
+        for(u32 i = 0; i < count; i++)
+        {
+            Vec3 d = sub(positions[i], mean);
+            for(u32 r = 0; r < 3; r++)
+            {
+                for(u32 c = 0; c < 3; c++)
+                {
+                    covariance[r][c] += d.m[r] * d.m[c];
+                }
+            }
+        }
+        
+        Vec3 axes[3];
+        symmetric_eigenvectors(covariance, axes);
+        
+        Vec3 minimum = Vec3(F32MAX, F32MAX, F32MAX);
+        Vec3 maximum = Vec3(-F32MAX, -F32MAX, -F32MAX);
+        for(u32 i = 0; i < count; i++)
+        {
+            for(u32 a = 0; a < 3; a++)
+            {
+                f32 t = inner(positions[i], axes[a]);
+                minimum.m[a] = MIN(minimum.m[a], t);
+                maximum.m[a] = MAX(maximum.m[a], t);
+            }
+        }
+        
+        Vec3 extent = sub(maximum, minimum);
+        f32 obb_volume = extent.x * extent.y * extent.z;
+        f32 aabb_volume = hbox->size.x * hbox->size.y * hbox->size.z;
+        if(obb_volume < 0.9f * aabb_volume)
+        {
+            Vec3 middle = scale(add(minimum, maximum), 0.5f);
+            result.center = Vec3(0.0f, 0.0f, 0.0f);
+            for(u32 a = 0; a < 3; a++)
+            {
+                result.axes[a] = axes[a];
+                result.center = add(result.center, scale(axes[a], middle.m[a]));
+            }
+            result.half_size = scale(extent, 0.5f);
+            result.oriented = true;
+        }
+    }
+    
+    f32 radius_squared = 0.0f;
+    for(u32 i = 0; i < count; i++)
+    {
+        Vec3 d = sub(positions[i], result.center);
+        radius_squared = MAX(radius_squared, inner(d, d));
+    }
+    result.radius = sqrtf(radius_squared);
+    
+    return result;
+}
+
+// NOTE: Transformed box against each plane, the box's reach along the
+// normal is the sum of its projected half axes.
+static bool
+hitbox_in_frustum(Hitbox *hbox, Plane *planes, Mat4 transform)
+{
+    Vec3 halfsize = scale(hbox->size, 0.5f);
+    Vec3 center = mul(transform, add(hbox->refpoint, halfsize));
+    Vec3 axes[3];
+    for(u32 a = 0; a < 3; a++)
+    {
+        Vec4 column = transform.columns[a];
+        axes[a] = scale(Vec3(column.x, column.y, column.z), halfsize.m[a]);
+    }
+    
+    for(u32 i = 0; i < FrustumPlane_ElementCount; i++)
+    {
+        f32 reach = fabsf(inner(axes[0], planes[i].normal)) + fabsf(inner(axes[1], planes[i].normal)) +
+            fabsf(inner(axes[2], planes[i].normal));
+        if(inner(center, planes[i].normal) + planes[i].d + reach <= 0)
+        {
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+static Vec2
+world_point_to_screen(Vec3 world_point, Mat4 proj, Mat4 view)
+{
+    Vec3 result = {};
+    
+    result = mul(proj, mul(view, world_point));
     result = scale(result, 1.0f / result.z); // Perspective division.
     
     return Vec2(result.x, result.y);
@@ -968,6 +1546,46 @@ ndc_to_ray_direction(Vec2 ndc, Mat4 proj_inversed, Mat4 view_inversed)
     return result;
 }
 
+// NOTE: Frustum through a rectangle on the screen, the side planes go through the
+// eye and two corner rays each, near and far are taken from the whole view. Pass the
+// current proj and view, the cached camera planes are from the last rendered frame.
+static void
+frustum_planes_from_ndc_rect(Vec2 ndc_min, Vec2 ndc_max, Vec3 eye, Mat4 proj, Mat4 view, Plane *planes)
+{
+    Mat4 proj_inversed = inverse(proj);
+    Mat4 view_inversed = inverse(view);
+    Vec3 bottom_left = ndc_to_ray_direction(Vec2(ndc_min.x, ndc_min.y), proj_inversed, view_inversed);
+    Vec3 bottom_right = ndc_to_ray_direction(Vec2(ndc_max.x, ndc_min.y), proj_inversed, view_inversed);
+    Vec3 top_right = ndc_to_ray_direction(Vec2(ndc_max.x, ndc_max.y), proj_inversed, view_inversed);
+    Vec3 top_left = ndc_to_ray_direction(Vec2(ndc_min.x, ndc_max.y), proj_inversed, view_inversed);
+    Vec3 center = ndc_to_ray_direction(scale(add(ndc_min, ndc_max), 0.5f), proj_inversed, view_inversed);
+    
+    Vec3 sides[4][2] = {};
+    sides[FrustumPlane_Left][0] = top_left;
+    sides[FrustumPlane_Left][1] = bottom_left;
+    sides[FrustumPlane_Right][0] = bottom_right;
+    sides[FrustumPlane_Right][1] = top_right;
+    sides[FrustumPlane_Bottom][0] = bottom_left;
+    sides[FrustumPlane_Bottom][1] = bottom_right;
+    sides[FrustumPlane_Top][0] = top_right;
+    sides[FrustumPlane_Top][1] = top_left;
+    for(u32 i = 0; i < ARRAY_LEN(sides); i++)
+    {
+        Vec3 normal = noz(cross(sides[i][0], sides[i][1]));
+        if(inner(normal, center) < 0.0f)
+        {
+            normal = negate(normal);
+        }
+        planes[i].normal = normal;
+        planes[i].d = -inner(normal, eye);
+    }
+    
+    Plane view_planes[FrustumPlane_ElementCount];
+    frustum_planes_from_matrix(mul(proj, view), view_planes);
+    planes[FrustumPlane_Near] = view_planes[FrustumPlane_Near];
+    planes[FrustumPlane_Far] = view_planes[FrustumPlane_Far];
+}
+
 static Vec2
 screen_to_ndc(f32 xmouse, f32 ymouse, f32 width, f32 height)
 {
@@ -1204,135 +1822,538 @@ ray_intersect_model(Vec3 ray_origin, Vec3 ray_direction, Model *model)
     return false;
 }
 
-static bool 
-ray_intersect_mesh_transformed(Vec3 ray_origin, Vec3 ray_direction, Mesh *mesh, Mat4 transform)
+// NOTE: Möller–Trumbore, both sides count as a hit. Only hits in (0, *t) are taken.
+static bool
+ray_intersect_triangle(Vec3 ray_origin, Vec3 ray_direction, Vec3 v0, Vec3 edge1, Vec3 edge2,
+                       f32 *t, f32 *u, f32 *v)
 {
-    for(u32 t = 0; t < mesh->indices_len; t += 3)
+    Vec3 pvec = cross(ray_direction, edge2);
+    f32 det = inner(edge1, pvec);
+    if(det == 0.0f)
     {
-        Vec3 v0 = mul(transform, mesh->vertices.positions[mesh->indices[t + 0]]);
-        Vec3 v1 = mul(transform, mesh->vertices.positions[mesh->indices[t + 1]]);
-        Vec3 v2 = mul(transform, mesh->vertices.positions[mesh->indices[t + 2]]);
-        
-        Vec3 normal0 = mesh->vertices.normals[mesh->indices[t + 0]];
-        Vec3 normal1 = mesh->vertices.normals[mesh->indices[t + 1]];
-        Vec3 normal2 = mesh->vertices.normals[mesh->indices[t + 2]];
-        
-        // NOTE(mateusz): I don't know if this is going to be faster,
-        // but my guess is that it's going to be, because either the
-        // model is smoothed or not, so it will be basicly free.
-        Vec3 normal = {};
-        if(normal0 == normal1 && normal1 == normal2) {
-            normal = normal0;
-        } else {
-            normal = triangle_normal(v0, v1, v2);
+        return false;
+    }
+    
+    f32 inverse_det = 1.0f / det;
+    Vec3 tvec = sub(ray_origin, v0);
+    f32 hit_u = inner(tvec, pvec) * inverse_det;
+    if(hit_u < 0.0f || hit_u > 1.0f)
+    {
+        return false;
+    }
+    
+    Vec3 qvec = cross(tvec, edge1);
+    f32 hit_v = inner(ray_direction, qvec) * inverse_det;
+    if(hit_v < 0.0f || hit_u + hit_v > 1.0f)
+    {
+        return false;
+    }
+    
+    f32 hit_t = inner(edge2, qvec) * inverse_det;
+    if(hit_t <= 0.0f || hit_t >= *t)
+    {
+        return false;
+    }
+    
+    *t = hit_t;
+    *u = hit_u;
+    *v = hit_v;
+    return true;
+}
+
+// NOTE: One ray against up to eight consecutive triangles, same rules as
+// ray_intersect_triangle. Returns the lane of the closest hit in (0, *t), or -1.
+static i32
+ray_intersect_triangles8(Vec3 ray_origin, Vec3 ray_direction, RayTriangles *triangles, u32 first, u32 count,
+                         f32 *t, f32 *u, f32 *v)
+{
+    assert(count <= 8 && first + count <= triangles->count);
+#ifdef __AVX2__
+    __m256 dx = _mm256_set1_ps(ray_direction.x);
+    __m256 dy = _mm256_set1_ps(ray_direction.y);
+    __m256 dz = _mm256_set1_ps(ray_direction.z);
+    __m256 e1x = _mm256_loadu_ps(triangles->edge1_x + first);
+    __m256 e1y = _mm256_loadu_ps(triangles->edge1_y + first);
+    __m256 e1z = _mm256_loadu_ps(triangles->edge1_z + first);
+    __m256 e2x = _mm256_loadu_ps(triangles->edge2_x + first);
+    __m256 e2y = _mm256_loadu_ps(triangles->edge2_y + first);
+    __m256 e2z = _mm256_loadu_ps(triangles->edge2_z + first);
+    
+    __m256 px = _mm256_fmsub_ps(dy, e2z, _mm256_mul_ps(dz, e2y));
+    __m256 py = _mm256_fmsub_ps(dz, e2x, _mm256_mul_ps(dx, e2z));
+    __m256 pz = _mm256_fmsub_ps(dx, e2y, _mm256_mul_ps(dy, e2x));
+    __m256 det = _mm256_fmadd_ps(e1x, px, _mm256_fmadd_ps(e1y, py, _mm256_mul_ps(e1z, pz)));
+    __m256 inverse_det = _mm256_div_ps(_mm256_set1_ps(1.0f), det);
+    
+    __m256 tx = _mm256_sub_ps(_mm256_set1_ps(ray_origin.x), _mm256_loadu_ps(triangles->v0_x + first));
+    __m256 ty = _mm256_sub_ps(_mm256_set1_ps(ray_origin.y), _mm256_loadu_ps(triangles->v0_y + first));
+    __m256 tz = _mm256_sub_ps(_mm256_set1_ps(ray_origin.z), _mm256_loadu_ps(triangles->v0_z + first));
+    __m256 hit_u = _mm256_mul_ps(_mm256_fmadd_ps(tx, px, _mm256_fmadd_ps(ty, py, _mm256_mul_ps(tz, pz))), inverse_det);
+    
+    __m256 qx = _mm256_fmsub_ps(ty, e1z, _mm256_mul_ps(tz, e1y));
+    __m256 qy = _mm256_fmsub_ps(tz, e1x, _mm256_mul_ps(tx, e1z));
+    __m256 qz = _mm256_fmsub_ps(tx, e1y, _mm256_mul_ps(ty, e1x));
+    __m256 hit_v = _mm256_mul_ps(_mm256_fmadd_ps(dx, qx, _mm256_fmadd_ps(dy, qy, _mm256_mul_ps(dz, qz))), inverse_det);
+    __m256 hit_t = _mm256_mul_ps(_mm256_fmadd_ps(e2x, qx, _mm256_fmadd_ps(e2y, qy, _mm256_mul_ps(e2z, qz))),
+                                 inverse_det);
+    
+    __m256 zero = _mm256_setzero_ps();
+    __m256 one = _mm256_set1_ps(1.0f);
+    __m256 inside = _mm256_and_ps(_mm256_cmp_ps(det, zero, _CMP_NEQ_OQ), _mm256_cmp_ps(hit_u, zero, _CMP_GE_OQ));
+    inside = _mm256_and_ps(inside, _mm256_cmp_ps(hit_u, one, _CMP_LE_OQ));
+    inside = _mm256_and_ps(inside, _mm256_cmp_ps(hit_v, zero, _CMP_GE_OQ));
+    inside = _mm256_and_ps(inside, _mm256_cmp_ps(_mm256_add_ps(hit_u, hit_v), one, _CMP_LE_OQ));
+    inside = _mm256_and_ps(inside, _mm256_cmp_ps(hit_t, zero, _CMP_GT_OQ));
+    inside = _mm256_and_ps(inside, _mm256_cmp_ps(hit_t, _mm256_set1_ps(*t), _CMP_LT_OQ));
+    u32 hits = (u32)_mm256_movemask_ps(inside) & ((1u << count) - 1);
+    if(hits == 0)
+    {
+        return -1;
+    }
+    
+    alignas(32) f32 ts[8];
+    alignas(32) f32 us[8];
+    alignas(32) f32 vs[8];
+    _mm256_store_ps(ts, hit_t);
+    _mm256_store_ps(us, hit_u);
+    _mm256_store_ps(vs, hit_v);
+    
+    i32 result = -1;
+    for(; hits; hits &= hits - 1)
+    {
+        u32 lane = find_first_set_bit(hits);
+        if(ts[lane] < *t)
+        {
+            *t = ts[lane];
+            *u = us[lane];
+            *v = vs[lane];
+            result = lane;
         }
-        
-        if(ray_intersect_triangle(ray_origin, ray_direction, v0, v1, v2, normal))
+    }
+    
+    return result;
+#else
+    i32 result = -1;
+    for(u32 i = 0; i < count; i++)
+    {
+        Vec3 v0 = Vec3(triangles->v0_x[first + i], triangles->v0_y[first + i], triangles->v0_z[first + i]);
+        Vec3 edge1 = Vec3(triangles->edge1_x[first + i], triangles->edge1_y[first + i], triangles->edge1_z[first + i]);
+        Vec3 edge2 = Vec3(triangles->edge2_x[first + i], triangles->edge2_y[first + i], triangles->edge2_z[first + i]);
+        if(ray_intersect_triangle(ray_origin, ray_direction, v0, edge1, edge2, t, u, v))
         {
-            return true;
+            result = i;
         }
     }
     
-    return false;
+    return result;
+#endif
 }
 
-static bool
-ray_intersect_hitbox(Vec3 ray_origin, Vec3 ray_direction, Hitbox *hbox, f32 *dist_result)
+// NOTE: One allocation for all nine arrays, the padding triangles stay zeroed
+// and a zero determinant never hits.
+static void
+ray_triangles_alloc(RayTriangles *triangles, u32 count)
 {
-    // NOTE(mateusz): We are using intersect triangle here because it's already
-    // implemented but if it's too slow look into square intersection. But I don't
-    // really know if it will work 100% of the time with all of the rotations and stuff.
-    
-    Vec3 vertices[VERTICES_PER_CUBE] = {
-        hbox->refpoint,
-        add(hbox->refpoint, Vec3(hbox->size.x, 0.0f, 0.0f)), // x
-        add(hbox->refpoint, Vec3(0.0f, hbox->size.y, 0.0f)), // y
-        add(hbox->refpoint, Vec3(0.0f, 0.0f, hbox->size.z)), // z
-        add(hbox->refpoint, Vec3(hbox->size.x, hbox->size.y, 0.0f)), // xy
-        add(hbox->refpoint, Vec3(0.0f, hbox->size.y, hbox->size.z)), // yz
-        add(hbox->refpoint, Vec3(hbox->size.x, 0.0f, hbox->size.z)), // xz
-        add(hbox->refpoint, hbox->size),
+    u32 stride = count + RAY_TRIANGLES_PADDING;
+    f32 *memory = (f32 *)calloc(9 * stride, sizeof(f32));
+    f32 **arrays[9] = {
+        &triangles->v0_x, &triangles->v0_y, &triangles->v0_z,
+        &triangles->edge1_x, &triangles->edge1_y, &triangles->edge1_z,
+        &triangles->edge2_x, &triangles->edge2_y, &triangles->edge2_z,
     };
+    for(u32 i = 0; i < ARRAY_LEN(arrays); i++)
+    {
+        *arrays[i] = memory + i * stride;
+    }
+    triangles->count = count;
+}
+
+static void
+ray_triangles_free(RayTriangles *triangles)
+{
+    free(triangles->v0_x);
+    *triangles = {};
+}
+
+static void
+ray_triangles_set(RayTriangles *triangles, u32 index, Vec3 v0, Vec3 v1, Vec3 v2)
+{
+    Vec3 edge1 = sub(v1, v0);
+    Vec3 edge2 = sub(v2, v0);
+    triangles->v0_x[index] = v0.x;
+    triangles->v0_y[index] = v0.y;
+    triangles->v0_z[index] = v0.z;
+    triangles->edge1_x[index] = edge1.x;
+    triangles->edge1_y[index] = edge1.y;
+    triangles->edge1_z[index] = edge1.z;
+    triangles->edge2_x[index] = edge2.x;
+    triangles->edge2_y[index] = edge2.y;
+    triangles->edge2_z[index] = edge2.z;
+}
+
+static void
+ray_packet_set(RayPacket8 *packet, u32 lane, Vec3 origin, Vec3 direction, f32 t_max)
+{
+    assert(lane < 8);
+    Vec3 inverse_direction = ray_inverse_direction(direction);
+    packet->origin_x[lane] = origin.x;
+    packet->origin_y[lane] = origin.y;
+    packet->origin_z[lane] = origin.z;
+    packet->direction_x[lane] = direction.x;
+    packet->direction_y[lane] = direction.y;
+    packet->direction_z[lane] = direction.z;
+    packet->inverse_x[lane] = inverse_direction.x;
+    packet->inverse_y[lane] = inverse_direction.y;
+    packet->inverse_z[lane] = inverse_direction.z;
+    packet->t[lane] = t_max;
+    packet->u[lane] = 0.0f;
+    packet->v[lane] = 0.0f;
+    packet->triangle[lane] = 0;
+    packet->mesh[lane] = 0;
+}
+
+#ifdef __AVX2__
+static __m256
+ray_packet_lanes_mask(u32 active)
+{
+    __m256i bits = _mm256_setr_epi32(0x1, 0x2, 0x4, 0x8, 0x10, 0x20, 0x40, 0x80);
+    __m256i selected = _mm256_and_si256(_mm256_set1_epi32(active), bits);
+    return _mm256_castsi256_ps(_mm256_cmpeq_epi32(selected, bits));
+}
+#endif
+
+// NOTE: Slab test of every active ray against one box, clipped to each ray's own
+// [0, t]. Returns the lanes that hit, entry distances go to t_enter.
+static u32
+ray_packet_intersect_box(RayPacket8 *packet, u32 active, Vec3 min, Vec3 max, f32 *t_enter)
+{
+#ifdef __AVX2__
+    __m256 enter = _mm256_setzero_ps();
+    __m256 exit = _mm256_load_ps(packet->t);
+    f32 *origins[3] = { packet->origin_x, packet->origin_y, packet->origin_z };
+    f32 *inverses[3] = { packet->inverse_x, packet->inverse_y, packet->inverse_z };
+    for(u32 a = 0; a < 3; a++)
+    {
+        __m256 origin = _mm256_load_ps(origins[a]);
+        __m256 inverse = _mm256_load_ps(inverses[a]);
+        __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(min.m[a]), origin), inverse);
+        __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(max.m[a]), origin), inverse);
+        enter = _mm256_max_ps(_mm256_min_ps(t0, t1), enter);
+        exit = _mm256_min_ps(_mm256_max_ps(t0, t1), exit);
+    }
     
-    Vec3 v0 = {};
-    Vec3 v1 = {};
-    Vec3 v2 = {};
-    Vec3 normal = {};
-    
-    // Front face
-    v0 = vertices[3];
-    v1 = vertices[5];
-    v2 = vertices[6];
-    // NOTE(mateusz): If slow, on the pararell faces we can just negate the normal
-    normal = triangle_normal(v0, v1, v2);
-    if(ray_intersect_triangle(ray_origin, ray_direction, v0, v1, v2, normal, dist_result)) { return true; }
-    
-    v0 = vertices[6];
-    v1 = vertices[5];
-    v2 = vertices[7];
-    if(ray_intersect_triangle(ray_origin, ray_direction, v0, v1, v2, normal, dist_result)) { return true; }
-    
-    // Back face
-    v0 = vertices[0];
-    v1 = vertices[1];
-    v2 = vertices[2];
-    normal = triangle_normal(v0, v1, v2);
-    if(ray_intersect_triangle(ray_origin, ray_direction, v0, v1, v2, normal, dist_result)) { return true; }
-    
-    v0 = vertices[1];
-    v1 = vertices[4];
-    v2 = vertices[2];
-    if(ray_intersect_triangle(ray_origin, ray_direction, v0, v1, v2, normal, dist_result)) { return true; }
-    
-    // Left face
-    v0 = vertices[0];
-    v1 = vertices[2];
-    v2 = vertices[3];
-    normal = triangle_normal(v0, v1, v2);
-    if(ray_intersect_triangle(ray_origin, ray_direction, v0, v1, v2, normal, dist_result)) { return true; }
-    
-    v2 = vertices[3];
-    v1 = vertices[2];
-    v0 = vertices[5];
-    if(ray_intersect_triangle(ray_origin, ray_direction, v0, v1, v2, normal, dist_result)) { return true; }
-    
-    // Right face
-    v0 = vertices[1];
-    v1 = vertices[4];
-    v2 = vertices[6];
-    normal = triangle_normal(v0, v1, v2);
-    if(ray_intersect_triangle(ray_origin, ray_direction, v0, v1, v2, normal, dist_result)) { return true; }
-    
-    v0 = vertices[6];
-    v1 = vertices[4];
-    v2 = vertices[7];
-    if(ray_intersect_triangle(ray_origin, ray_direction, v0, v1, v2, normal, dist_result)) { return true; }
-    
-    // Top face
-    v0 = vertices[2];
-    v1 = vertices[5];
-    v2 = vertices[4];
-    normal = triangle_normal(v0, v1, v2);
-    if(ray_intersect_triangle(ray_origin, ray_direction, v0, v1, v2, normal, dist_result)) { return true; }
-    
-    v0 = vertices[4];
-    v1 = vertices[5];
-    v2 = vertices[7];
-    if(ray_intersect_triangle(ray_origin, ray_direction, v0, v1, v2, normal, dist_result)) { return true; }
-    
-    // Bottom face
-    v0 = vertices[0];
-    v1 = vertices[1];
-    v2 = vertices[3];
-    normal = triangle_normal(v0, v1, v2);
-    if(ray_intersect_triangle(ray_origin, ray_direction, v0, v1, v2, normal, dist_result)) { return true; }
-    
-    v0 = vertices[1];
-    v1 = vertices[3];
-    v2 = vertices[6];
-    if(ray_intersect_triangle(ray_origin, ray_direction, v0, v1, v2, normal, dist_result)) { return true; }
+    _mm256_storeu_ps(t_enter, enter);
+    return (u32)_mm256_movemask_ps(_mm256_cmp_ps(enter, exit, _CMP_LE_OQ)) & active;
+#else
+    u32 result = 0;
+    for(u32 lane = 0; lane < 8; lane++)
+    {
+        if(active & (1u << lane))
+        {
+            Vec3 origin = Vec3(packet->origin_x[lane], packet->origin_y[lane], packet->origin_z[lane]);
+            Vec3 inverse = Vec3(packet->inverse_x[lane], packet->inverse_y[lane], packet->inverse_z[lane]);
+            f32 t_exit = 0.0f;
+            result |= (u32)ray_intersect_box(origin, inverse, min, max, packet->t[lane],
+                                             t_enter + lane, &t_exit) << lane;
+        }
+    }
     
-    return false;
+    return result;
+#endif
+}
+
+// NOTE: The active lanes whose t_enter is still in front of their closest hit
+static u32
+ray_packet_closer_lanes(RayPacket8 *packet, u32 active, f32 *t_enter)
+{
+#ifdef __AVX2__
+    __m256 closer = _mm256_cmp_ps(_mm256_loadu_ps(t_enter), _mm256_load_ps(packet->t), _CMP_LT_OQ);
+    return (u32)_mm256_movemask_ps(closer) & active;
+#else
+    u32 result = 0;
+    for(u32 lane = 0; lane < 8; lane++)
+    {
+        result |= (u32)(t_enter[lane] < packet->t[lane]) << lane;
+    }
+    
+    return result & active;
+#endif
+}
+
+// NOTE: Smallest t_enter over the active lanes, F32MAX when there are none
+static f32
+ray_packet_nearest(u32 active, f32 *t_enter)
+{
+#ifdef __AVX2__
+    __m256 t = _mm256_blendv_ps(_mm256_set1_ps(F32MAX), _mm256_loadu_ps(t_enter), ray_packet_lanes_mask(active));
+    __m128 m = _mm_min_ps(_mm256_castps256_ps128(t), _mm256_extractf128_ps(t, 1));
+    m = _mm_min_ps(m, _mm_movehl_ps(m, m));
+    m = _mm_min_ss(m, _mm_shuffle_ps(m, m, 1));
+    return _mm_cvtss_f32(m);
+#else
+    f32 result = F32MAX;
+    for(u32 lanes = active; lanes; lanes &= lanes - 1)
+    {
+        result = MIN(result, t_enter[find_first_set_bit(lanes)]);
+    }
+    
+    return result;
+#endif
+}
+
+// NOTE: Every active ray against one triangle, same rules as ray_intersect_triangle.
+// Lanes that got a closer hit have t, u and v updated and come back in the mask.
+static u32
+ray_packet_intersect_triangle(RayPacket8 *packet, u32 active, Vec3 v0, Vec3 edge1, Vec3 edge2)
+{
+#ifdef __AVX2__
+    __m256 dx = _mm256_load_ps(packet->direction_x);
+    __m256 dy = _mm256_load_ps(packet->direction_y);
+    __m256 dz = _mm256_load_ps(packet->direction_z);
+    __m256 e1x = _mm256_set1_ps(edge1.x);
+    __m256 e1y = _mm256_set1_ps(edge1.y);
+    __m256 e1z = _mm256_set1_ps(edge1.z);
+    __m256 e2x = _mm256_set1_ps(edge2.x);
+    __m256 e2y = _mm256_set1_ps(edge2.y);
+    __m256 e2z = _mm256_set1_ps(edge2.z);
+    
+    __m256 px = _mm256_fmsub_ps(dy, e2z, _mm256_mul_ps(dz, e2y));
+    __m256 py = _mm256_fmsub_ps(dz, e2x, _mm256_mul_ps(dx, e2z));
+    __m256 pz = _mm256_fmsub_ps(dx, e2y, _mm256_mul_ps(dy, e2x));
+    __m256 det = _mm256_fmadd_ps(e1x, px, _mm256_fmadd_ps(e1y, py, _mm256_mul_ps(e1z, pz)));
+    __m256 inverse_det = _mm256_div_ps(_mm256_set1_ps(1.0f), det);
+    
+    __m256 tx = _mm256_sub_ps(_mm256_load_ps(packet->origin_x), _mm256_set1_ps(v0.x));
+    __m256 ty = _mm256_sub_ps(_mm256_load_ps(packet->origin_y), _mm256_set1_ps(v0.y));
+    __m256 tz = _mm256_sub_ps(_mm256_load_ps(packet->origin_z), _mm256_set1_ps(v0.z));
+    __m256 hit_u = _mm256_mul_ps(_mm256_fmadd_ps(tx, px, _mm256_fmadd_ps(ty, py, _mm256_mul_ps(tz, pz))), inverse_det);
+    
+    __m256 qx = _mm256_fmsub_ps(ty, e1z, _mm256_mul_ps(tz, e1y));
+    __m256 qy = _mm256_fmsub_ps(tz, e1x, _mm256_mul_ps(tx, e1z));
+    __m256 qz = _mm256_fmsub_ps(tx, e1y, _mm256_mul_ps(ty, e1x));
+    __m256 hit_v = _mm256_mul_ps(_mm256_fmadd_ps(dx, qx, _mm256_fmadd_ps(dy, qy, _mm256_mul_ps(dz, qz))), inverse_det);
+    __m256 hit_t = _mm256_mul_ps(_mm256_fmadd_ps(e2x, qx, _mm256_fmadd_ps(e2y, qy, _mm256_mul_ps(e2z, qz))),
+                                 inverse_det);
+    
+    __m256 zero = _mm256_setzero_ps();
+    __m256 one = _mm256_set1_ps(1.0f);
+    __m256 old_t = _mm256_load_ps(packet->t);
+    __m256 inside = _mm256_and_ps(ray_packet_lanes_mask(active), _mm256_cmp_ps(det, zero, _CMP_NEQ_OQ));
+    inside = _mm256_and_ps(inside, _mm256_cmp_ps(hit_u, zero, _CMP_GE_OQ));
+    inside = _mm256_and_ps(inside, _mm256_cmp_ps(hit_u, one, _CMP_LE_OQ));
+    inside = _mm256_and_ps(inside, _mm256_cmp_ps(hit_v, zero, _CMP_GE_OQ));
+    inside = _mm256_and_ps(inside, _mm256_cmp_ps(_mm256_add_ps(hit_u, hit_v), one, _CMP_LE_OQ));
+    inside = _mm256_and_ps(inside, _mm256_cmp_ps(hit_t, zero, _CMP_GT_OQ));
+    inside = _mm256_and_ps(inside, _mm256_cmp_ps(hit_t, old_t, _CMP_LT_OQ));
+    
+    _mm256_store_ps(packet->t, _mm256_blendv_ps(old_t, hit_t, inside));
+    _mm256_store_ps(packet->u, _mm256_blendv_ps(_mm256_load_ps(packet->u), hit_u, inside));
+    _mm256_store_ps(packet->v, _mm256_blendv_ps(_mm256_load_ps(packet->v), hit_v, inside));
+    return (u32)_mm256_movemask_ps(inside);
+#else
+    u32 result = 0;
+    for(u32 lane = 0; lane < 8; lane++)
+    {
+        if(active & (1u << lane))
+        {
+            Vec3 origin = Vec3(packet->origin_x[lane], packet->origin_y[lane], packet->origin_z[lane]);
+            Vec3 direction = Vec3(packet->direction_x[lane], packet->direction_y[lane], packet->direction_z[lane]);
+            result |= (u32)ray_intersect_triangle(origin, direction, v0, edge1, edge2, packet->t + lane,
+                                                  packet->u + lane, packet->v + lane) << lane;
+        }
+    }
+    
+    return result;
+#endif
+}
+
+// NOTE: Closest hit in model space, meshes without a BVH test every triangle
+static bool
+ray_intersect_mesh(Vec3 ray_origin, Vec3 ray_direction, Mesh *mesh, RayHit *hit)
+{
+    if(mesh->bvh)
+    {
+        return mesh_bvh_intersect(mesh->bvh, ray_origin, ray_direction, hit);
+    }
+    
+    bool result = false;
+    for(u32 i = 0; i + 2 < mesh->indices_len; i += 3)
+    {
+        Vec3 v0 = mesh->vertices.positions[mesh->indices[i + 0]];
+        Vec3 v1 = mesh->vertices.positions[mesh->indices[i + 1]];
+        Vec3 v2 = mesh->vertices.positions[mesh->indices[i + 2]];
+        if(ray_intersect_triangle(ray_origin, ray_direction, v0, sub(v1, v0), sub(v2, v0), &hit->t, &hit->u, &hit->v))
+        {
+            hit->triangle = i / 3;
+            result = true;
+        }
+    }
+    
+    return result;
+}
+
+// NOTE: The ray goes into model space once instead of every vertex going out.
+// The direction isn't renormalized so t stays comparable with world space hits.
+static bool 
+ray_intersect_mesh_transformed(Vec3 ray_origin, Vec3 ray_direction, Mesh *mesh, Mat4 transform, RayHit *hit)
+{
+    Mat4 inversed = inverse(transform);
+    Vec3 local_origin = mul(inversed, ray_origin);
+    Vec4 local_direction = mul(inversed, Vec4(ray_direction, 0.0f));
+    
+    return ray_intersect_mesh(local_origin, Vec3(local_direction.x, local_direction.y, local_direction.z), mesh, hit);
+}
+
+// NOTE: A zero component gets the biggest finite inverse instead of an infinity,
+// otherwise a ray starting right on a box face would compute 0 * inf = NaN there.
+static Vec3
+ray_inverse_direction(Vec3 ray_direction)
+{
+    Vec3 result = {};
+    for(u32 a = 0; a < 3; a++)
+    {
+        f32 d = ray_direction.m[a];
+        result.m[a] = d != 0.0f ? 1.0f / d : copysignf(F32MAX, d);
+    }
+    
+    return result;
+}
+
+// NOTE: Branchless slab test clipped to [0, t_max], takes the inverse from
+// ray_inverse_direction. MIN/MAX are written in the same operand order minps and
+// maxps use, so the scalar and wide versions agree lane for lane.
+static bool
+ray_intersect_box(Vec3 ray_origin, Vec3 inverse_direction, Vec3 min, Vec3 max, f32 t_max,
+                  f32 *t_enter, f32 *t_exit)
+{
+    f32 enter = 0.0f;
+    f32 exit = t_max;
+    for(u32 a = 0; a < 3; a++)
+    {
+        f32 t0 = (min.m[a] - ray_origin.m[a]) * inverse_direction.m[a];
+        f32 t1 = (max.m[a] - ray_origin.m[a]) * inverse_direction.m[a];
+        enter = MAX(MIN(t0, t1), enter);
+        exit = MIN(MAX(t0, t1), exit);
+    }
+    
+    *t_enter = enter;
+    *t_exit = exit;
+    return enter <= exit;
+}
+
+// NOTE: Same test over four boxes, bit i of the result is set when box i got hit
+static u32
+ray_intersect_boxes4(Vec3 ray_origin, Vec3 inverse_direction, RayBoxes4 *boxes, f32 t_max,
+                     f32 *t_enter, f32 *t_exit)
+{
+#ifdef __SSE2__
+    __m128 enter = _mm_setzero_ps();
+    __m128 exit = _mm_set1_ps(t_max);
+    f32 *mins[3] = { boxes->min_x, boxes->min_y, boxes->min_z };
+    f32 *maxs[3] = { boxes->max_x, boxes->max_y, boxes->max_z };
+    for(u32 a = 0; a < 3; a++)
+    {
+        __m128 origin = _mm_set1_ps(ray_origin.m[a]);
+        __m128 inverse = _mm_set1_ps(inverse_direction.m[a]);
+        __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(mins[a]), origin), inverse);
+        __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(maxs[a]), origin), inverse);
+        enter = _mm_max_ps(_mm_min_ps(t0, t1), enter);
+        exit = _mm_min_ps(_mm_max_ps(t0, t1), exit);
+    }
+    
+    _mm_storeu_ps(t_enter, enter);
+    _mm_storeu_ps(t_exit, exit);
+    return (u32)_mm_movemask_ps(_mm_cmple_ps(enter, exit));
+#else
+    u32 result = 0;
+    for(u32 i = 0; i < 4; i++)
+    {
+        Vec3 min = Vec3(boxes->min_x[i], boxes->min_y[i], boxes->min_z[i]);
+        Vec3 max = Vec3(boxes->max_x[i], boxes->max_y[i], boxes->max_z[i]);
+        result |= (u32)ray_intersect_box(ray_origin, inverse_direction, min, max, t_max,
+                                         t_enter + i, t_exit + i) << i;
+    }
+    
+    return result;
+#endif
+}
+
+static u32
+ray_intersect_boxes8(Vec3 ray_origin, Vec3 inverse_direction, RayBoxes8 *boxes, f32 t_max,
+                     f32 *t_enter, f32 *t_exit)
+{
+#ifdef __AVX__
+    __m256 enter = _mm256_setzero_ps();
+    __m256 exit = _mm256_set1_ps(t_max);
+    f32 *mins[3] = { boxes->min_x, boxes->min_y, boxes->min_z };
+    f32 *maxs[3] = { boxes->max_x, boxes->max_y, boxes->max_z };
+    for(u32 a = 0; a < 3; a++)
+    {
+        __m256 origin = _mm256_set1_ps(ray_origin.m[a]);
+        __m256 inverse = _mm256_set1_ps(inverse_direction.m[a]);
+        __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(mins[a]), origin), inverse);
+        __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(maxs[a]), origin), inverse);
+        enter = _mm256_max_ps(_mm256_min_ps(t0, t1), enter);
+        exit = _mm256_min_ps(_mm256_max_ps(t0, t1), exit);
+    }
+    
+    _mm256_storeu_ps(t_enter, enter);
+    _mm256_storeu_ps(t_exit, exit);
+    return (u32)_mm256_movemask_ps(_mm256_cmp_ps(enter, exit, _CMP_LE_OQ));
+#else
+    // NOTE: Two SSE halves, the lanes are 16 byte aligned either way
+    RayBoxes4 halves[2];
+    for(u32 h = 0; h < 2; h++)
+    {
+        memcpy(halves[h].min_x, boxes->min_x + 4 * h, sizeof(halves[h].min_x));
+        memcpy(halves[h].min_y, boxes->min_y + 4 * h, sizeof(halves[h].min_y));
+        memcpy(halves[h].min_z, boxes->min_z + 4 * h, sizeof(halves[h].min_z));
+        memcpy(halves[h].max_x, boxes->max_x + 4 * h, sizeof(halves[h].max_x));
+        memcpy(halves[h].max_y, boxes->max_y + 4 * h, sizeof(halves[h].max_y));
+        memcpy(halves[h].max_z, boxes->max_z + 4 * h, sizeof(halves[h].max_z));
+    }
+    
+    u32 low = ray_intersect_boxes4(ray_origin, inverse_direction, halves + 0, t_max, t_enter, t_exit);
+    u32 high = ray_intersect_boxes4(ray_origin, inverse_direction, halves + 1, t_max, t_enter + 4, t_exit + 4);
+    return low | (high << 4);
+#endif
+}
+
+static void
+ray_boxes4_set(RayBoxes4 *boxes, u32 lane, Vec3 min, Vec3 max)
+{
+    assert(lane < 4);
+    boxes->min_x[lane] = min.x;
+    boxes->min_y[lane] = min.y;
+    boxes->min_z[lane] = min.z;
+    boxes->max_x[lane] = max.x;
+    boxes->max_y[lane] = max.y;
+    boxes->max_z[lane] = max.z;
+}
+
+static void
+ray_boxes8_set(RayBoxes8 *boxes, u32 lane, Vec3 min, Vec3 max)
+{
+    assert(lane < 8);
+    boxes->min_x[lane] = min.x;
+    boxes->min_y[lane] = min.y;
+    boxes->min_z[lane] = min.z;
+    boxes->max_x[lane] = max.x;
+    boxes->max_y[lane] = max.y;
+    boxes->max_z[lane] = max.z;
+}
+
+// NOTE: Distance to where the ray enters the box, 0 when it starts inside
+static bool
+ray_intersect_hitbox(Vec3 ray_origin, Vec3 ray_direction, Hitbox *hbox, f32 *dist_result)
+{
+    Vec3 min = {};
+    Vec3 max = {};
+    hitbox_bounds(hbox, &min, &max);
+    
+    f32 t_exit = 0.0f;
+    return ray_intersect_box(ray_origin, ray_inverse_direction(ray_direction), min, max, F32MAX,
+                             dist_result, &t_exit);
 }
 
 
@@ -1344,28 +2365,123 @@ ray_intersect_hitbox(Vec3 ray_origin, Vec3 ray_direction, Hitbox *hbox)
     return ray_intersect_hitbox(ray_origin, ray_direction, hbox, &tmp);
 }
 
-// NOTE(mateusz): This is in no way a final function, it should really be called
-// debug somehow. Real intersections will be working a bit different. //// HOW???
+// NOTE: Closest hit over every mesh that has a hitbox, the cached inverse of the
+// transform the renderer uses takes the ray into model space once for all of them.
+// The hitboxes go through the slab test eight at a time and only the meshes whose
+// box the ray enters before the closest hit so far get their triangles tested.
 static bool 
-ray_intersect_entity(Vec3 ray_origin, Vec3 ray_direction, Entity *entity)
+ray_intersect_entity(Vec3 ray_origin, Vec3 ray_direction, Entity *entity, RayHit *hit)
 {
-    Mat4 transform = create_translate(Mat4(1.0f), entity->position);
-    transform = scale(transform, entity->size);
+    Mat4 inversed = entity_inversed(entity);
+    Vec3 local_origin = mul(inversed, ray_origin);
+    Vec4 direction4 = mul(inversed, Vec4(ray_direction, 0.0f));
+    Vec3 local_direction = Vec3(direction4.x, direction4.y, direction4.z);
+    Vec3 inverse_direction = ray_inverse_direction(local_direction);
+    
+    Model *model = entity->model;
+    bool result = false;
+    for(u32 first = 0; first < model->hitboxes_len; first += 8)
+    {
+        u32 lanes = MIN(8, model->hitboxes_len - first);
+        RayBoxes8 boxes = {};
+        for(u32 lane = 0; lane < lanes; lane++)
+        {
+            Hitbox *hbox = model->hitboxes + first + lane;
+            ray_boxes8_set(&boxes, lane, hbox->refpoint, add(hbox->refpoint, hbox->size));
+        }
+        
+        f32 t_enter[8];
+        f32 t_exit[8];
+        u32 mask = ray_intersect_boxes8(local_origin, inverse_direction, &boxes, hit->t, t_enter, t_exit);
+        for(mask &= (1u << lanes) - 1; mask; mask &= mask - 1)
+        {
+            u32 lane = find_first_set_bit(mask);
+            if(t_enter[lane] < hit->t &&
+               ray_intersect_mesh(local_origin, local_direction, &model->meshes[first + lane], hit))
+            {
+                hit->mesh = first + lane;
+                result = true;
+            }
+        }
+    }
+    
+    return result;
+}
+
+// NOTE: Packet version of ray_intersect_mesh, returns the lanes that got a closer hit
+static u32
+ray_packet_intersect_mesh(RayPacket8 *packet, u32 active, Mesh *mesh)
+{
+    if(mesh->bvh)
+    {
+        return mesh_bvh_intersect8(mesh->bvh, packet, active);
+    }
+    
+    u32 result = 0;
+    for(u32 i = 0; i + 2 < mesh->indices_len; i += 3)
+    {
+        Vec3 v0 = mesh->vertices.positions[mesh->indices[i + 0]];
+        Vec3 v1 = mesh->vertices.positions[mesh->indices[i + 1]];
+        Vec3 v2 = mesh->vertices.positions[mesh->indices[i + 2]];
+        u32 closer = ray_packet_intersect_triangle(packet, active, v0, sub(v1, v0), sub(v2, v0));
+        for(u32 lanes = closer; lanes; lanes &= lanes - 1)
+        {
+            packet->triangle[find_first_set_bit(lanes)] = i / 3;
+        }
+        result |= closer;
+    }
+    
+    return result;
+}
+
+// NOTE: Same as ray_intersect_entity for every active lane, the rays go into
+// model space together and only the lanes that got closer are copied back.
+static u32
+ray_packet_intersect_entity(RayPacket8 *packet, u32 active, Entity *entity)
+{
+    Mat4 inversed = entity_inversed(entity);
+    
+    RayPacket8 local = *packet;
+    for(u32 lanes = active; lanes; lanes &= lanes - 1)
+    {
+        u32 lane = find_first_set_bit(lanes);
+        Vec3 origin = mul(inversed, Vec3(packet->origin_x[lane], packet->origin_y[lane], packet->origin_z[lane]));
+        Vec4 direction4 = mul(inversed, Vec4(packet->direction_x[lane], packet->direction_y[lane],
+                                             packet->direction_z[lane], 0.0f));
+        ray_packet_set(&local, lane, origin, Vec3(direction4.x, direction4.y, direction4.z), packet->t[lane]);
+    }
+    
+    u32 result = 0;
     for(u32 i = 0; i < entity->model->hitboxes_len; i++)
     {
-        Hitbox transformed_hbox = {};
-        transformed_hbox.refpoint = mul(transform, entity->model->hitboxes[i].refpoint);
-        transformed_hbox.size = entity->model->hitboxes[i].size;
-        bool hitbox_intersect = ray_intersect_hitbox(ray_origin, ray_direction, &transformed_hbox);
-        if(hitbox_intersect)
+        u32 closer = ray_packet_intersect_mesh(&local, active, &entity->model->meshes[i]);
+        for(u32 lanes = closer; lanes; lanes &= lanes - 1)
         {
-            bool model_intersect = ray_intersect_mesh_transformed(ray_origin, ray_direction,
-                                                                  &entity->model->meshes[i], transform);
-            if(model_intersect) { return model_intersect; }
+            local.mesh[find_first_set_bit(lanes)] = i;
         }
+        result |= closer;
     }
     
-    return false;
+    for(u32 lanes = result; lanes; lanes &= lanes - 1)
+    {
+        u32 lane = find_first_set_bit(lanes);
+        packet->t[lane] = local.t[lane];
+        packet->u[lane] = local.u[lane];
+        packet->v[lane] = local.v[lane];
+        packet->triangle[lane] = local.triangle[lane];
+        packet->mesh[lane] = local.mesh[lane];
+    }
+    
+    return result;
+}
+
+static bool 
+ray_intersect_entity(Vec3 ray_origin, Vec3 ray_direction, Entity *entity)
+{
+    RayHit hit = {};
+    hit.t = F32MAX;
+    
+    return ray_intersect_entity(ray_origin, ray_direction, entity, &hit);
 }
 
 static bool
@@ -1390,6 +2506,479 @@ click_result_swap_func(void *elem0, void *elem1)
     return true;
 }
 
+static void
+entity_transform_update(Entity *entity)
+{
+    // NOTE: Stays dirty until entity_update_hierarchy gets to it
+    if(entity->node != TRANSFORM_TREE_ROOT)
+    {
+        return;
+    }
+    
+    entity->world = transform_compose(entity->position, entity->rotate, entity->size, &entity->inversed);
+    FLAG_UNSET(entity->flags, ENTITY_FLAGS_TRANSFORM_DIRTY);
+}
+
+// NOTE: Once a frame after everything that moves entities has run, so the passes,
+// the queries and the jobs afterwards only ever read the cached matrices.
+static u32
+entity_update_transforms(Entity *entities, u32 count)
+{
+    u32 result = 0;
+    for(u32 i = 0; i < count; i++)
+    {
+        Entity *entity = entities + i;
+        if(entity->node == TRANSFORM_TREE_ROOT && FLAG_IS_SET(entity->flags, ENTITY_FLAGS_TRANSFORM_DIRTY))
+        {
+            entity_transform_update(entity);
+            result++;
+        }
+    }
+    
+    return result;
+}
+
+static Mat4
+entity_world(Entity *entity)
+{
+    if(FLAG_IS_SET(entity->flags, ENTITY_FLAGS_TRANSFORM_DIRTY))
+    {
+        entity_transform_update(entity);
+    }
+    
+    return entity->world;
+}
+
+static Mat4
+entity_inversed(Entity *entity)
+{
+    if(FLAG_IS_SET(entity->flags, ENTITY_FLAGS_TRANSFORM_DIRTY))
+    {
+        entity_transform_update(entity);
+    }
+    
+    return entity->inversed;
+}
+
+// NOTE: Every entity gets its own queries, entities sharing a model would
+// otherwise overwrite each other's results.
+static OcclusionQuery *
+entity_occlusion_queries(Entity *entity)
+{
+    u32 meshes_len = entity->model->meshes_len;
+    if(entity->occlusion_queries_len != meshes_len)
+    {
+        entity_destroy_queries(entity);
+        
+        entity->occlusion_queries = (OcclusionQuery *)calloc(meshes_len, sizeof(OcclusionQuery));
+        entity->occlusion_queries_len = meshes_len;
+        for(u32 i = 0; i < meshes_len; i++)
+        {
+            glGenQueries(1, &entity->occlusion_queries[i].query);
+        }
+    }
+    
+    return entity->occlusion_queries;
+}
+
+static void
+entity_destroy_queries(Entity *entity)
+{
+    for(u32 i = 0; i < entity->occlusion_queries_len; i++)
+    {
+        glDeleteQueries(1, &entity->occlusion_queries[i].query);
+    }
+    free(entity->occlusion_queries);
+    entity->occlusion_queries = NULL;
+    entity->occlusion_queries_len = 0;
+}
+
+// NOTE: The entity keeps its position, size and rotate, which from now on are
+// relative to the parent, so it jumps unless the parent sits at the origin.
+// A parent that isn't in the tree yet goes right under the root with its current
+// transform. No parent attaches the entity to the root, which works as a detach.
+static void
+entity_attach(TransformTree *tree, Entity *entity, Entity *parent)
+{
+    u32 parent_node = TRANSFORM_TREE_ROOT;
+    if(parent)
+    {
+        assert(parent != entity);
+        if(parent->node == TRANSFORM_TREE_ROOT)
+        {
+            parent->node = transform_tree_add(tree, TRANSFORM_TREE_ROOT, parent->position, parent->rotate,
+                                              parent->size);
+        }
+        parent_node = parent->node;
+    }
+    
+    if(entity->node == TRANSFORM_TREE_ROOT)
+    {
+        entity->node = transform_tree_add(tree, parent_node, entity->position, entity->rotate, entity->size);
+    }
+    else
+    {
+        transform_tree_set_parent(tree, entity->node, parent_node);
+    }
+    FLAG_SET(entity->flags, ENTITY_FLAGS_TRANSFORM_DIRTY);
+}
+
+// NOTE: The dirty attached entities hand their transforms to the tree, one update
+// goes over it and everything under a node that changed gets its matrices back.
+// The inverse is a general one, a rotated child of a non uniformly scaled parent
+// shears. Returns how many entities moved, transform_tree_changed says which.
+static u32
+entity_update_hierarchy(TransformTree *tree, Entity *entities, u32 count, JobQueue *jobs)
+{
+    // NOTE: Nothing attached, just the root
+    if(tree->count == 1)
+    {
+        return 0;
+    }
+    
+    for(u32 i = 0; i < count; i++)
+    {
+        Entity *entity = entities + i;
+        if(entity->node != TRANSFORM_TREE_ROOT && FLAG_IS_SET(entity->flags, ENTITY_FLAGS_TRANSFORM_DIRTY))
+        {
+            transform_tree_set_local(tree, entity->node, entity->position, entity->rotate, entity->size);
+        }
+    }
+    
+    transform_tree_update(tree, jobs);
+    
+    u32 result = 0;
+    for(u32 i = 0; i < count; i++)
+    {
+        Entity *entity = entities + i;
+        if(entity->node != TRANSFORM_TREE_ROOT && transform_tree_changed(tree, entity->node))
+        {
+            entity->world = transform_tree_world(tree, entity->node);
+            entity->inversed = inverse(entity->world);
+            FLAG_UNSET(entity->flags, ENTITY_FLAGS_TRANSFORM_DIRTY);
+            result++;
+        }
+    }
+    
+    return result;
+}
+
+static void
+entity_instanced_mark_dirty(EntityInstanced *entity, u32 first, u32 count)
+{
+    if(count == 0)
+    {
+        return;
+    }
+    
+    if(entity->dirty_begin == entity->dirty_end)
+    {
+        entity->dirty_begin = first;
+        entity->dirty_end = first + count;
+    }
+    else
+    {
+        entity->dirty_begin = MIN(entity->dirty_begin, first);
+        entity->dirty_end = MAX(entity->dirty_end, first + count);
+    }
+}
+
+static u32
+instance_format_stride(InstanceFormat format)
+{
+    return format == InstanceFormat_Half ? sizeof(InstanceDataHalf) : sizeof(InstanceData);
+}
+
+// NOTE: Quat is stored as (w, x, y, z), the instance data wants (x, y, z, w). One
+// too short to normalize (zero, denormal or NaN) goes out as the identity, the
+// wide path in instances_build_job does the same.
+static void
+instance_write(u8 *dest, Vec3 position, Quat rotation, Vec3 size, bool half)
+{
+    f32 length_sq = (rotation.v.x * rotation.v.x + rotation.v.y * rotation.v.y) +
+        (rotation.v.z * rotation.v.z + rotation.w * rotation.w);
+    Quat q = length_sq >= F32MIN ? noz(rotation) : Quat();
+    
+    InstanceData *instance = (InstanceData *)dest;
+    instance->position = position;
+    instance->rotation[0] = f32_to_snorm16(q.v.x);
+    instance->rotation[1] = f32_to_snorm16(q.v.y);
+    instance->rotation[2] = f32_to_snorm16(q.v.z);
+    instance->rotation[3] = f32_to_snorm16(q.w);
+    
+    if(half)
+    {
+        InstanceDataHalf *instance_half = (InstanceDataHalf *)dest;
+        instance_half->scale[0] = f32_to_half(size.x);
+        instance_half->scale[1] = f32_to_half(size.y);
+        instance_half->scale[2] = f32_to_half(size.z);
+        instance_half->scale[3] = 0;
+    }
+    else
+    {
+        instance->scale = size;
+    }
+}
+
+// NOTE: Builds instances [base + first, base + one_past_last) into dest, where dest
+// points at instance number base. Runs on the job threads.
+static void
+instances_build_job(void *data, u32 first, u32 one_past_last)
+{
+    InstanceBuild *build = (InstanceBuild *)data;
+    EntityInstanced *entity = build->entity;
+    u32 stride = build->stride;
+    u32 i = first;
+    
+#if defined(__AVX2__) && defined(__F16C__)
+    __m256 snorm_max = _mm256_set1_ps(32767.0f);
+    __m256 length_sq_min = _mm256_set1_ps(F32MIN);
+    __m256 identity = _mm256_setr_ps(0.0f, 0.0f, 0.0f, 32767.0f, 0.0f, 0.0f, 0.0f, 32767.0f);
+    for(; i + 8 <= one_past_last; i += 8)
+    {
+        u32 index = build->base + i;
+        u8 *dest = build->dest + i * stride;
+        
+        // NOTE: Two quaternions per register, rotated into (x, y, z, w) order
+        const f32 *r = (const f32 *)(entity->rotations + index);
+        __m256 q01 = _mm256_permute_ps(_mm256_loadu_ps(r + 0), _MM_SHUFFLE(0, 3, 2, 1));
+        __m256 q23 = _mm256_permute_ps(_mm256_loadu_ps(r + 8), _MM_SHUFFLE(0, 3, 2, 1));
+        __m256 q45 = _mm256_permute_ps(_mm256_loadu_ps(r + 16), _MM_SHUFFLE(0, 3, 2, 1));
+        __m256 q67 = _mm256_permute_ps(_mm256_loadu_ps(r + 24), _MM_SHUFFLE(0, 3, 2, 1));
+        
+        // NOTE: Squared lengths end up as [0 2 4 6 | 1 3 5 7], so broadcasting
+        // element n inside each lane lines up with q(2n)q(2n+1).
+        __m256 s0 = _mm256_hadd_ps(_mm256_mul_ps(q01, q01), _mm256_mul_ps(q23, q23));
+        __m256 s1 = _mm256_hadd_ps(_mm256_mul_ps(q45, q45), _mm256_mul_ps(q67, q67));
+        __m256 length_sq = _mm256_hadd_ps(s0, s1);
+        __m256 norm = _mm256_div_ps(snorm_max, _mm256_sqrt_ps(length_sq));
+        
+        // NOTE: The same guard as instance_write, a quaternion failing it (NaN
+        // included) gets the identity instead of 0 * inf
+        __m256 valid = _mm256_cmp_ps(length_sq, length_sq_min, _CMP_GE_OQ);
+        q01 = _mm256_blendv_ps(identity, _mm256_mul_ps(q01, _mm256_permute_ps(norm, 0x00)),
+                               _mm256_permute_ps(valid, 0x00));
+        q23 = _mm256_blendv_ps(identity, _mm256_mul_ps(q23, _mm256_permute_ps(norm, 0x55)),
+                               _mm256_permute_ps(valid, 0x55));
+        q45 = _mm256_blendv_ps(identity, _mm256_mul_ps(q45, _mm256_permute_ps(norm, 0xaa)),
+                               _mm256_permute_ps(valid, 0xaa));
+        q67 = _mm256_blendv_ps(identity, _mm256_mul_ps(q67, _mm256_permute_ps(norm, 0xff)),
+                               _mm256_permute_ps(valid, 0xff));
+        
+        // NOTE: packs works per lane, giving [q0 q2 | q1 q3] and [q4 q6 | q5 q7]
+        __m256i r0213 = _mm256_packs_epi32(_mm256_cvtps_epi32(q01), _mm256_cvtps_epi32(q23));
+        __m256i r4657 = _mm256_packs_epi32(_mm256_cvtps_epi32(q45), _mm256_cvtps_epi32(q67));
+        u64 rotations[8] = {
+            (u64)_mm256_extract_epi64(r0213, 0), (u64)_mm256_extract_epi64(r0213, 2),
+            (u64)_mm256_extract_epi64(r0213, 1), (u64)_mm256_extract_epi64(r0213, 3),
+            (u64)_mm256_extract_epi64(r4657, 0), (u64)_mm256_extract_epi64(r4657, 2),
+            (u64)_mm256_extract_epi64(r4657, 1), (u64)_mm256_extract_epi64(r4657, 3),
+        };
+        
+        const f32 *sizes = (const f32 *)(entity->sizes + index);
+        u16 half_sizes[24];
+        if(build->half)
+        {
+            _mm_storeu_si128((__m128i *)(half_sizes + 0), _mm256_cvtps_ph(_mm256_loadu_ps(sizes + 0), _MM_FROUND_TO_NEAREST_INT));
+            _mm_storeu_si128((__m128i *)(half_sizes + 8), _mm256_cvtps_ph(_mm256_loadu_ps(sizes + 8), _MM_FROUND_TO_NEAREST_INT));
+            _mm_storeu_si128((__m128i *)(half_sizes + 16), _mm256_cvtps_ph(_mm256_loadu_ps(sizes + 16), _MM_FROUND_TO_NEAREST_INT));
+        }
+        
+        for(u32 j = 0; j < 8; j++)
+        {
+            u8 *instance = dest + j * stride;
+            memcpy(instance + offsetof(InstanceData, position), entity->positions + index + j, sizeof(Vec3));
+            memcpy(instance + offsetof(InstanceData, rotation), rotations + j, sizeof(u64));
+            if(build->half)
+            {
+                u16 scale[4] = { half_sizes[3 * j + 0], half_sizes[3 * j + 1], half_sizes[3 * j + 2], 0 };
+                memcpy(instance + offsetof(InstanceDataHalf, scale), scale, sizeof(scale));
+            }
+            else
+            {
+                memcpy(instance + offsetof(InstanceData, scale), sizes + 3 * j, sizeof(Vec3));
+            }
+        }
+    }
+#endif
+    
+    for(; i < one_past_last; i++)
+    {
+        u32 index = build->base + i;
+        instance_write(build->dest + i * stride, entity->positions[index],
+                       entity->rotations[index], entity->sizes[index], build->half);
+    }
+}
+
+// NOTE: Called by the renderer right before drawing. When nothing was marked
+// dirty this does no work at all, so a static set of instances costs nothing per frame.
+static void
+entity_instanced_update(EntityInstanced *entity, JobQueue *jobs)
+{
+    Model *model = entity->model;
+    u32 stride = instance_format_stride(entity->format);
+    bool half = entity->format == InstanceFormat_Half;
+    
+    if(entity->vaos == NULL)
+    {
+        if(entity->instance_vbo == 0)
+        {
+            glGenBuffers(1, &entity->instance_vbo);
+        }
+        
+        // NOTE: One vao per mesh, reusing the mesh's vbo/ebo and adding the instance
+        // data on locations 3-5. Those overlap tangents/bitangents, instanced
+        // meshes don't use normal mapping.
+        entity->vaos = (GLuint *)malloc(model->meshes_len * sizeof(GLuint));
+        glGenVertexArrays(model->meshes_len, entity->vaos);
+        for(u32 i = 0; i < model->meshes_len; i++)
+        {
+            glBindVertexArray(entity->vaos[i]);
+            mesh_set_vertex_attributes(&model->meshes[i]);
+            
+            glBindBuffer(GL_ARRAY_BUFFER, entity->instance_vbo);
+            glEnableVertexAttribArray(3);
+            glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, stride,
+                                  (void *)offsetof(InstanceData, position));
+            glEnableVertexAttribArray(4);
+            glVertexAttribPointer(4, 4, GL_SHORT, GL_TRUE, stride,
+                                  (void *)offsetof(InstanceData, rotation));
+            glEnableVertexAttribArray(5);
+            if(half)
+            {
+                glVertexAttribPointer(5, 3, GL_HALF_FLOAT, GL_FALSE, stride,
+                                      (void *)offsetof(InstanceDataHalf, scale));
+            }
+            else
+            {
+                glVertexAttribPointer(5, 3, GL_FLOAT, GL_FALSE, stride,
+                                      (void *)offsetof(InstanceData, scale));
+            }
+            
+            for(u32 location = 3; location < 6; location++)
+            {
+                glVertexAttribDivisor(location, 1);
+            }
+        }
+        glBindVertexArray(0);
+    }
+    
+    if(entity->gpu_generated)
+    {
+        return;
+    }
+    
+    glBindBuffer(GL_ARRAY_BUFFER, entity->instance_vbo);
+    if(entity->instances_capacity < entity->instances_count)
+    {
+        // NOTE: Reallocating the storage keeps the buffer name so the vaos stay
+        // valid, but the old contents are gone and everything has to be rebuilt.
+        u32 capacity = MAX(entity->instances_capacity, 64);
+        while(capacity < entity->instances_count)
+        {
+            capacity *= 2;
+        }
+        
+        glBufferData(GL_ARRAY_BUFFER, capacity * stride, NULL, GL_STATIC_DRAW);
+        entity->instances_capacity = capacity;
+        entity->dirty_begin = 0;
+        entity->dirty_end = entity->instances_count;
+    }
+    
+    entity->dirty_end = MIN(entity->dirty_end, entity->instances_count);
+    if(entity->dirty_begin < entity->dirty_end)
+    {
+        u32 count = entity->dirty_end - entity->dirty_begin;
+        u8 *data = (u8 *)glMapBufferRange(GL_ARRAY_BUFFER, entity->dirty_begin * stride, count * stride,
+                                          GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+        assert(data);
+        
+        InstanceBuild build = {};
+        build.entity = entity;
+        build.dest = data;
+        build.base = entity->dirty_begin;
+        build.stride = stride;
+        build.half = half;
+        jobs_parallel_for(jobs, count, INSTANCES_MIN_BATCH, instances_build_job, &build);
+        
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+    }
+    
+    entity->dirty_begin = 0;
+    entity->dirty_end = 0;
+}
+
+// NOTE: The attribute layout is baked into the vaos, so they are thrown
+// away and rebuilt together with the whole buffer on the next update.
+static void
+entity_instanced_set_format(EntityInstanced *entity, InstanceFormat format)
+{
+    if(entity->format == format)
+    {
+        return;
+    }
+    
+    entity->format = format;
+    if(entity->vaos)
+    {
+        glDeleteVertexArrays(entity->model->meshes_len, entity->vaos);
+        free(entity->vaos);
+        entity->vaos = NULL;
+    }
+    entity->instances_capacity = 0;
+}
+
+static void
+entity_instanced_destroy(EntityInstanced *entity)
+{
+    if(entity->vaos)
+    {
+        glDeleteVertexArrays(entity->model->meshes_len, entity->vaos);
+        glDeleteBuffers(1, &entity->instance_vbo);
+        free(entity->vaos);
+    }
+    
+    InstanceCulling *culling = &entity->culling;
+    for(u32 i = 0; i < 2; i++)
+    {
+        if(culling->vaos[i])
+        {
+            glDeleteVertexArrays(culling->meshes_len, culling->vaos[i]);
+            free(culling->vaos[i]);
+        }
+    }
+    glDeleteBuffers(2, culling->culled_vbos);
+    glDeleteBuffers(1, &culling->indirect_buffer);
+    glDeleteVertexArrays(1, &culling->source_vao);
+    glDeleteQueries(2, culling->queries);
+    
+    free(entity->positions);
+    free(entity->sizes);
+    free(entity->rotations);
+    memset(entity, 0, sizeof(*entity));
+}
+
+// NOTE: Sphere around the union of all the hitboxes, in model space
+static void
+model_bounding_sphere(Model *model, Vec3 *center, f32 *radius)
+{
+    Vec3 min = Vec3(F32MAX, F32MAX, F32MAX);
+    Vec3 max = Vec3(-F32MAX, -F32MAX, -F32MAX);
+    for(u32 i = 0; i < model->hitboxes_len; i++)
+    {
+        Hitbox *hbox = model->hitboxes + i;
+        Vec3 far = add(hbox->refpoint, hbox->size);
+        for(u32 j = 0; j < 3; j++)
+        {
+            min.m[j] = MIN(min.m[j], MIN(hbox->refpoint.m[j], far.m[j]));
+            max.m[j] = MAX(max.m[j], MAX(hbox->refpoint.m[j], far.m[j]));
+        }
+    }
+    
+    *center = scale(add(min, max), 0.5f);
+    *radius = len(scale(sub(max, min), 0.5f));
+}
+
 static AxisClickResult 
 closest_click_result(AxisClickResult xaxis, AxisClickResult yaxis, AxisClickResult zaxis)
 {
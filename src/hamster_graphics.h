@@ -108,8 +108,11 @@ struct Vertices
 	Vec3 *normals;
     Vec3 *tangents;
     Vec3 *bitangents;
+    Vec4 *baked_light; // NOTE: Filled in by bake_static_lighting, see BakeSettings
 };
 
+struct MeshBVH;
+
 struct Mesh
 {
     char material_name[64];
@@ -121,6 +124,9 @@ struct Mesh
 	GLuint vao;
 	GLuint vbo;
 	GLuint ebo;
+    
+    MeshBVH *bvh; // NOTE: Model space, NULL for meshes that never get picked
+    GLuint lightmap; // NOTE: Baked light in the mesh's uvs, 0 when not lightmapped
 };
 
 // TODO(mateusz): Creating a model for a hitbox each frame is expensive,
@@ -137,12 +143,30 @@ struct Hitbox
 	Vec3 size;
 };
 
+// NOTE: Built once per mesh at load time, model space. The box is the axis aligned
+// hitbox unless the PCA fitted one is noticeably smaller, then it's oriented.
+// The sphere shares the box's center and only reaches the farthest vertex.
+struct BoundingVolume
+{
+    Vec3 center;
+    f32 radius;
+    Vec3 axes[3];
+    Vec3 half_size;
+    bool oriented;
+};
+
 typedef u32 ModelFlags;
 enum
 {
 	MODEL_FLAGS_GOURAUD_SHADED = 0x1,
 	MODEL_FLAGS_MESH_NORMALS_SHADED = 0x2,
 	MODEL_FLAGS_DRAW_HITBOXES = 0x4,
+	// NOTE: Rasterized into the software occlusion buffer, keep these low poly
+	// and never larger than what they actually cover
+	MODEL_FLAGS_OCCLUDER = 0x8,
+    // NOTE: Baked into a lightmap instead of per vertex, the uvs have to
+    // cover [0, 1] without overlapping
+    MODEL_FLAGS_LIGHTMAPPED = 0x10,
 };
 
 typedef u32 MaterialFlags;
@@ -170,6 +194,7 @@ struct Model
 {
     Mesh *meshes;
     Hitbox *hitboxes;
+    BoundingVolume *bounds; // NOTE: One per hitbox
     Material *materials;
     u32 meshes_len;
     u32 hitboxes_len;
@@ -189,6 +214,98 @@ struct Line2D
     Vec2 point1;
 };
 
+// NOTE: The point is origin + t * direction, barycentrics are for the triangle's
+// second and third vertex. Set t to how far to look before casting.
+struct RayHit
+{
+    f32 t;
+    f32 u;
+    f32 v;
+    u32 triangle;
+    u32 mesh;
+};
+
+// NOTE: Boxes one component per array so the wide slab tests load a lane group
+// with a single load. Lanes past the ones in use are garbage, mask them out.
+struct RayBoxes4
+{
+    alignas(16) f32 min_x[4];
+    alignas(16) f32 min_y[4];
+    alignas(16) f32 min_z[4];
+    alignas(16) f32 max_x[4];
+    alignas(16) f32 max_y[4];
+    alignas(16) f32 max_z[4];
+};
+
+struct RayBoxes8
+{
+    alignas(32) f32 min_x[8];
+    alignas(32) f32 min_y[8];
+    alignas(32) f32 min_z[8];
+    alignas(32) f32 max_x[8];
+    alignas(32) f32 max_y[8];
+    alignas(32) f32 max_z[8];
+};
+
+// NOTE: Triangles as a vertex and the two edges out of it, one component per
+// array. The arrays are padded with RAY_TRIANGLES_PADDING zeroed triangles so
+// an 8 wide load starting at any triangle stays in bounds.
+#define RAY_TRIANGLES_PADDING 8
+struct RayTriangles
+{
+    f32 *v0_x;
+    f32 *v0_y;
+    f32 *v0_z;
+    f32 *edge1_x;
+    f32 *edge1_y;
+    f32 *edge1_z;
+    f32 *edge2_x;
+    f32 *edge2_y;
+    f32 *edge2_z;
+    u32 count;
+};
+
+// NOTE: Eight rays cast together, each lane works like a RayHit: set t to how far
+// to look before casting, afterwards t, u, v, triangle and mesh describe the hit.
+struct RayPacket8
+{
+    alignas(32) f32 origin_x[8];
+    alignas(32) f32 origin_y[8];
+    alignas(32) f32 origin_z[8];
+    alignas(32) f32 direction_x[8];
+    alignas(32) f32 direction_y[8];
+    alignas(32) f32 direction_z[8];
+    alignas(32) f32 inverse_x[8];
+    alignas(32) f32 inverse_y[8];
+    alignas(32) f32 inverse_z[8];
+    alignas(32) f32 t[8];
+    alignas(32) f32 u[8];
+    alignas(32) f32 v[8];
+    u32 triangle[8];
+    u32 mesh[8];
+};
+
+typedef u32 EntityFlags;
+enum
+{
+    ENTITY_FLAGS_EMPTY = 0x0,
+    // NOTE: Drawn through render_push_model_newest
+    ENTITY_FLAGS_MAPPED_NORMALS = 0x1,
+    // NOTE: Never moves, gets baked light and occludes the other static entities in the bake
+    ENTITY_FLAGS_STATIC = 0x2,
+    // NOTE: position, size or rotate changed since world and inversed were composed
+    ENTITY_FLAGS_TRANSFORM_DIRTY = 0x4,
+};
+
+// NOTE: Hardware occlusion query against one mesh's hitbox, issued at the end of
+// a frame and consumed by the next frame's conditional render. frame is the one it
+// was issued in, 0 if it never was.
+struct OcclusionQuery
+{
+    GLuint query;
+    u32 frame;
+};
+
 struct Entity
 {
 	Vec3 position;
@@ -196,8 +313,88 @@ struct Entity
 	Quat rotate;
     
 	Model *model;
+    EntityFlags flags;
+    
+    // NOTE: Composed from the three above by entity_transform_update, once per
+    // change instead of once per use. Anything that writes position, size or
+    // rotate sets ENTITY_FLAGS_TRANSFORM_DIRTY, entity_world and entity_inversed
+    // bring them back up to date.
+    Mat4 world;
+    Mat4 inversed;
+    
+    // NOTE: TRANSFORM_TREE_ROOT unless attached (see entity_attach), then position,
+    // size and rotate are relative to the parent and the two matrices come out of
+    // the tree in entity_update_hierarchy instead.
+    u32 node;
+    
+    // NOTE: One per mesh of model, made by entity_occlusion_queries on first use
+    OcclusionQuery *occlusion_queries;
+    u32 occlusion_queries_len;
+};
+
+enum InstanceFormat
+{
+    InstanceFormat_Float,
+    InstanceFormat_Half,
 };
 
+// NOTE: Per-instance data as the vertex shader sees it, the matrix is
+// rebuilt there. Rotation is a unit quaternion stored as snorm16 (x, y, z, w).
+struct InstanceData
+{
+    Vec3 position;
+    i16 rotation[4];
+    Vec3 scale;
+};
+
+struct InstanceDataHalf
+{
+    Vec3 position;
+    i16 rotation[4];
+    u16 scale[4];
+};
+
+#define INSTANCES_MIN_BATCH 4096
+
+struct EntityInstanced;
+
+struct InstanceBuild
+{
+    EntityInstanced *entity;
+    u8 *dest;
+    u32 base;
+    u32 stride;
+    bool half;
+};
+
+// NOTE: GPU side culling output, filled by render_cull_instances. The compute
+// path only uses culled_vbos[0] and the indirect buffer. The transform feedback
+// path ping-pongs between both buffers, ready is the one whose survivor count has
+// come back (-1 until the first one does) and pending marks queries in flight.
+struct InstanceCulling
+{
+    GLuint culled_vbos[2];
+    GLuint *vaos[2];
+    GLuint indirect_buffer;
+    u32 capacity;
+    u32 meshes_len;
+    InstanceFormat format;
+    
+    GLuint source_vao;
+    GLuint queries[2];
+    u32 visible_counts[2];
+    bool pending[2];
+    i32 ready;
+    
+    Vec3 bounds_center;
+    f32 bounds_radius;
+};
+
+// NOTE: Instance data lives on the GPU for as long as the entity does.
+// Whoever changes positions/sizes/rotations has to call entity_instanced_mark_dirty
+// and only that range gets rebuilt and uploaded by entity_instanced_update.
+// When gpu_generated is set the buffer was filled on the GPU and the CPU arrays
+// don't describe it, see render_generate_sponge.
 struct EntityInstanced
 {
     Vec3 *positions;
@@ -206,6 +403,61 @@ struct EntityInstanced
     u32 instances_count;
 
     Model *model;
+    
+    InstanceFormat format;
+    bool gpu_generated;
+    GLuint instance_vbo;
+    GLuint *vaos;
+    u32 instances_capacity;
+    u32 dirty_begin;
+    u32 dirty_end;
+    
+    InstanceCulling culling;
+};
+
+// NOTE: Cells per side of one merged sponge chunk, has to be a power of 3.
+// Every chunk becomes its own mesh with its own hitbox so it can be culled.
+#define SPONGE_CHUNK_CELLS 27
+
+struct SpongeBuild
+{
+    u32 grid;
+    u32 chunk_cells;
+    u32 chunks_per_side;
+    Mesh *meshes;
+    Hitbox *hitboxes;
+    BoundingVolume *bounds;
+};
+
+#define SPONGE_CHILDREN 20
+#define SPONGE_DIVIDE_BATCH 4096
+// NOTE: 20^6 instances of the full float format is just under 2 GB, and 20^8 no
+// longer fits the u32 instance count at all.
+#define SPONGE_MAX_LEVEL 6
+// NOTE: Dividing on the CPU keeps positions, sizes and rotations (40 bytes per cube)
+// of both levels until the swap, on top of the instance buffer. The 64M cubes of
+// level 6 would take 2.5 GB for the new arrays alone, only the GPU goes that deep.
+#define SPONGE_CPU_MAX_LEVEL 5
+
+// NOTE: One subdivision step running on the job pool. Parent i writes its children
+// to [i * SPONGE_CHILDREN, (i + 1) * SPONGE_CHILDREN) of freshly allocated arrays,
+// the entity keeps its old arrays (and keeps rendering them) until
+// sponge_division_finish swaps them in.
+struct SpongeDivision
+{
+    Vec3 *parent_positions;
+    Vec3 *parent_sizes;
+    Quat *parent_rotations;
+    u32 parents_count;
+    
+    Vec3 *positions;
+    Vec3 *sizes;
+    Quat *rotations;
+    
+    JobCounter counter;
+    u32 next_first;
+    bool active;
+    f64 start_time;
 };
 
 struct AxisClickResult
@@ -269,17 +521,28 @@ static void model_load_obj_materials(Model *model, OBJMaterial *materials, u32 c
 static Model model_create_basic();
 static Model model_create_debug_floor();
 static Model model_create_from_obj(OBJModel *obj);
+static Model *model_create_sponge();
+static Model *model_create_sponge_merged(u32 level, JobQueue *jobs);
+static bool sponge_cell_filled(i32 x, i32 y, i32 z, i32 grid);
+static void sponge_division_start(SpongeDivision *division, EntityInstanced *sponge, JobQueue *jobs);
+static bool sponge_division_finish(SpongeDivision *division, EntityInstanced *sponge, JobQueue *jobs);
 static void model_finalize_mesh(Mesh *mesh);
+static u32 mesh_vertex_stride(Mesh *mesh);
+static u32 mesh_set_vertex_attributes(Mesh *mesh);
 static void model_destory(Model model);
 static void model_gouraud_shade(Model *model);
 static void model_mesh_normals_shade(Model *model);
 
 static Hitbox hitbox_create_from_mesh(Mesh *mesh);
+static BoundingVolume bounding_volume_from_mesh(Mesh *mesh, Hitbox *hbox);
 static Hitbox hitbox_as_cylinder(Line line, Vec3 r);
 static bool hitbox_in_frustum(Hitbox *hbox, Plane *planes, Mat4 transform);
+static void hitbox_bounds(Hitbox *hbox, Vec3 *min, Vec3 *max);
 
 static Vec2 world_point_to_screen(Vec3 world, Mat4 proj, Mat4 view);
 static Vec3 ndc_to_ray_direction(Vec2 ndc, Mat4 proj_inversed, Mat4 view_inversed);
+static void frustum_planes_from_ndc_rect(Vec2 ndc_min, Vec2 ndc_max, Vec3 eye, Mat4 proj, Mat4 view,
+                                         Plane *planes);
 static Vec2 screen_to_ndc(f32 xmouse, f32 ymouse, f32 width, f32 height);
 static Line line_from_direction(Vec3 origin, Vec3 direction, f32 line_length);
 
@@ -289,9 +552,49 @@ static UIElement ui_element_create(Vec2 position, Vec2 size, const char *texture
 
 static bool ray_intersect_triangle(Vec3 ray_origin, Vec3 ray_direction, Vec3 v0, Vec3 v1, Vec3 v2, Vec3 normal);
 static bool ray_intersect_model(Vec3 ray_origin, Vec3 ray_direction, Model *model);
-static bool ray_intersect_mesh_transformed(Vec3 ray_origin, Vec3 ray_direction, Model *model, Mat4 transform);
+static bool ray_intersect_triangle(Vec3 ray_origin, Vec3 ray_direction, Vec3 v0, Vec3 edge1, Vec3 edge2,
+                                   f32 *t, f32 *u, f32 *v);
+static i32 ray_intersect_triangles8(Vec3 ray_origin, Vec3 ray_direction, RayTriangles *triangles, u32 first, u32 count,
+                                    f32 *t, f32 *u, f32 *v);
+static void ray_triangles_alloc(RayTriangles *triangles, u32 count);
+static void ray_triangles_free(RayTriangles *triangles);
+static void ray_triangles_set(RayTriangles *triangles, u32 index, Vec3 v0, Vec3 v1, Vec3 v2);
+static void ray_packet_set(RayPacket8 *packet, u32 lane, Vec3 origin, Vec3 direction, f32 t_max);
+static u32 ray_packet_intersect_box(RayPacket8 *packet, u32 active, Vec3 min, Vec3 max, f32 *t_enter);
+static u32 ray_packet_closer_lanes(RayPacket8 *packet, u32 active, f32 *t_enter);
+static f32 ray_packet_nearest(u32 active, f32 *t_enter);
+static u32 ray_packet_intersect_triangle(RayPacket8 *packet, u32 active, Vec3 v0, Vec3 edge1, Vec3 edge2);
+static u32 ray_packet_intersect_mesh(RayPacket8 *packet, u32 active, Mesh *mesh);
+static u32 ray_packet_intersect_entity(RayPacket8 *packet, u32 active, Entity *entity);
+static bool ray_intersect_mesh(Vec3 ray_origin, Vec3 ray_direction, Mesh *mesh, RayHit *hit);
+static bool ray_intersect_mesh_transformed(Vec3 ray_origin, Vec3 ray_direction, Mesh *mesh, Mat4 transform, RayHit *hit);
+static Vec3 ray_inverse_direction(Vec3 ray_direction);
+static bool ray_intersect_box(Vec3 ray_origin, Vec3 inverse_direction, Vec3 min, Vec3 max, f32 t_max,
+                              f32 *t_enter, f32 *t_exit);
+static u32 ray_intersect_boxes4(Vec3 ray_origin, Vec3 inverse_direction, RayBoxes4 *boxes, f32 t_max,
+                                f32 *t_enter, f32 *t_exit);
+static u32 ray_intersect_boxes8(Vec3 ray_origin, Vec3 inverse_direction, RayBoxes8 *boxes, f32 t_max,
+                                f32 *t_enter, f32 *t_exit);
+static void ray_boxes4_set(RayBoxes4 *boxes, u32 lane, Vec3 min, Vec3 max);
+static void ray_boxes8_set(RayBoxes8 *boxes, u32 lane, Vec3 min, Vec3 max);
+static bool ray_intersect_hitbox(Vec3 ray_origin, Vec3 ray_direction, Hitbox *hbox, f32 *dist_result);
 static bool ray_intersect_hitbox(Vec3 ray_origin, Vec3 ray_direction, Hitbox *hbox);
 static bool ray_intersect_entity(Vec3 ray_origin, Vec3 ray_direction, Entity *entity);
+static bool ray_intersect_entity(Vec3 ray_origin, Vec3 ray_direction, Entity *entity, RayHit *hit);
+
+static void entity_transform_update(Entity *entity);
+static u32 entity_update_transforms(Entity *entities, u32 count);
+static Mat4 entity_world(Entity *entity);
+static Mat4 entity_inversed(Entity *entity);
+static OcclusionQuery *entity_occlusion_queries(Entity *entity);
+static void entity_destroy_queries(Entity *entity);
+static void entity_attach(TransformTree *tree, Entity *entity, Entity *parent);
+static u32 entity_update_hierarchy(TransformTree *tree, Entity *entities, u32 count, JobQueue *jobs);
+static void entity_instanced_mark_dirty(EntityInstanced *entity, u32 first, u32 count);
+static void entity_instanced_update(EntityInstanced *entity, JobQueue *jobs);
+static void entity_instanced_set_format(EntityInstanced *entity, InstanceFormat format);
+static void entity_instanced_destroy(EntityInstanced *entity);
+static void model_bounding_sphere(Model *model, Vec3 *center, f32 *radius);
 
 static AxisClickResult closest_click_result(AxisClickResult xaxis, AxisClickResult yaxis, AxisClickResult zaxis);
 
@@ -0,0 +1,275 @@
+static bool
+jobs_take(JobQueue *queue, Job *job, bool background)
+{
+    if(queue->head != queue->tail)
+    {
+        *job = queue->jobs[queue->tail % JOBS_QUEUE_SIZE];
+        queue->tail++;
+        
+        return true;
+    }
+    
+    if(background && queue->background_head != queue->background_tail)
+    {
+        *job = queue->background[queue->background_tail % JOBS_BACKGROUND_QUEUE_SIZE];
+        queue->background_tail++;
+        
+        return true;
+    }
+    
+    return false;
+}
+
+static void
+jobs_finish(JobQueue *queue, Job *job)
+{
+    pthread_mutex_lock(&queue->mutex);
+    queue->pending--;
+    if(job->counter)
+    {
+        job->counter->pending--;
+    }
+    if(queue->pending == 0 || (job->counter && job->counter->pending == 0))
+    {
+        pthread_cond_broadcast(&queue->work_done);
+    }
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+static void *
+jobs_worker(void *arg)
+{
+    JobQueue *queue = (JobQueue *)arg;
+    
+    for(;;)
+    {
+        Job job = {};
+        
+        pthread_mutex_lock(&queue->mutex);
+        while(queue->running && !jobs_take(queue, &job, true))
+        {
+            pthread_cond_wait(&queue->work_added, &queue->mutex);
+        }
+        bool running = queue->running;
+        pthread_mutex_unlock(&queue->mutex);
+        
+        if(!running)
+        {
+            break;
+        }
+        
+        job.function(job.data, job.first, job.one_past_last);
+        jobs_finish(queue, &job);
+    }
+    
+    return NULL;
+}
+
+// NOTE: threads_count == 0 means one worker per core, minus the calling thread.
+static void
+jobs_init(JobQueue *queue, u32 threads_count)
+{
+    memset(queue, 0, sizeof(*queue));
+    
+    if(threads_count == 0)
+    {
+        i64 cores = sysconf(_SC_NPROCESSORS_ONLN);
+        threads_count = cores > 1 ? (u32)cores - 1 : 1;
+    }
+    threads_count = MIN(threads_count, JOBS_MAX_THREADS);
+    
+    pthread_mutex_init(&queue->mutex, NULL);
+    pthread_cond_init(&queue->work_added, NULL);
+    pthread_cond_init(&queue->work_done, NULL);
+    queue->running = true;
+    
+    for(u32 i = 0; i < threads_count; i++)
+    {
+        int error = pthread_create(&queue->threads[i], NULL, jobs_worker, queue);
+        assert(error == 0);
+        queue->threads_count++;
+    }
+}
+
+static void
+jobs_shutdown(JobQueue *queue)
+{
+    jobs_wait(queue);
+    
+    pthread_mutex_lock(&queue->mutex);
+    queue->running = false;
+    pthread_cond_broadcast(&queue->work_added);
+    pthread_mutex_unlock(&queue->mutex);
+    
+    for(u32 i = 0; i < queue->threads_count; i++)
+    {
+        pthread_join(queue->threads[i], NULL);
+    }
+    
+    pthread_cond_destroy(&queue->work_done);
+    pthread_cond_destroy(&queue->work_added);
+    pthread_mutex_destroy(&queue->mutex);
+}
+
+static void
+jobs_push(JobQueue *queue, JobFunction function, void *data, u32 first, u32 one_past_last,
+          JobCounter *counter)
+{
+    pthread_mutex_lock(&queue->mutex);
+    
+    // NOTE: Full queue, do the work right here instead of blocking
+    if(queue->head - queue->tail == JOBS_QUEUE_SIZE || queue->threads_count == 0)
+    {
+        pthread_mutex_unlock(&queue->mutex);
+        function(data, first, one_past_last);
+        return;
+    }
+    
+    Job *job = &queue->jobs[queue->head % JOBS_QUEUE_SIZE];
+    job->function = function;
+    job->data = data;
+    job->first = first;
+    job->one_past_last = one_past_last;
+    job->counter = counter;
+    queue->head++;
+    queue->pending++;
+    if(counter)
+    {
+        counter->pending++;
+    }
+    
+    pthread_cond_signal(&queue->work_added);
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+// NOTE: Never runs the job inline, returns false when the background ring is full
+// and it's up to the caller to try again later.
+static bool
+jobs_push_background(JobQueue *queue, JobFunction function, void *data, u32 first, u32 one_past_last,
+                     JobCounter *counter)
+{
+    if(queue->threads_count == 0)
+    {
+        function(data, first, one_past_last);
+        return true;
+    }
+    
+    pthread_mutex_lock(&queue->mutex);
+    
+    if(queue->background_head - queue->background_tail == JOBS_BACKGROUND_QUEUE_SIZE)
+    {
+        pthread_mutex_unlock(&queue->mutex);
+        return false;
+    }
+    
+    Job *job = &queue->background[queue->background_head % JOBS_BACKGROUND_QUEUE_SIZE];
+    job->function = function;
+    job->data = data;
+    job->first = first;
+    job->one_past_last = one_past_last;
+    job->counter = counter;
+    queue->background_head++;
+    queue->pending++;
+    if(counter)
+    {
+        counter->pending++;
+    }
+    
+    pthread_cond_signal(&queue->work_added);
+    pthread_mutex_unlock(&queue->mutex);
+    
+    return true;
+}
+
+static void
+jobs_wait(JobQueue *queue)
+{
+    for(;;)
+    {
+        Job job = {};
+        
+        pthread_mutex_lock(&queue->mutex);
+        bool took = jobs_take(queue, &job, true);
+        if(!took)
+        {
+            while(queue->pending)
+            {
+                pthread_cond_wait(&queue->work_done, &queue->mutex);
+            }
+        }
+        pthread_mutex_unlock(&queue->mutex);
+        
+        if(!took)
+        {
+            break;
+        }
+        
+        job.function(job.data, job.first, job.one_past_last);
+        jobs_finish(queue, &job);
+    }
+}
+
+// NOTE: Like jobs_wait, but returns as soon as the jobs of this counter are done.
+// While waiting it still helps with whatever is next in the main ring, which can be
+// somebody else's job, but never with background jobs.
+static void
+jobs_wait_counter(JobQueue *queue, JobCounter *counter)
+{
+    for(;;)
+    {
+        Job job = {};
+        
+        pthread_mutex_lock(&queue->mutex);
+        bool done = counter->pending == 0;
+        bool took = !done && jobs_take(queue, &job, false);
+        if(!done && !took)
+        {
+            while(counter->pending)
+            {
+                pthread_cond_wait(&queue->work_done, &queue->mutex);
+            }
+            done = true;
+        }
+        pthread_mutex_unlock(&queue->mutex);
+        
+        if(done)
+        {
+            break;
+        }
+        
+        job.function(job.data, job.first, job.one_past_last);
+        jobs_finish(queue, &job);
+    }
+}
+
+static bool
+jobs_counter_done(JobQueue *queue, JobCounter *counter)
+{
+    pthread_mutex_lock(&queue->mutex);
+    bool done = counter->pending == 0;
+    pthread_mutex_unlock(&queue->mutex);
+    
+    return done;
+}
+
+// NOTE: Splits [0, count) into roughly one batch per thread (never smaller than
+// min_batch) and blocks until all of them are done. Small counts run inline.
+static void
+jobs_parallel_for(JobQueue *queue, u32 count, u32 min_batch, JobFunction function, void *data)
+{
+    u32 threads = queue->threads_count + 1;
+    u32 batch = MAX((count + threads - 1) / threads, MAX(min_batch, 1));
+    
+    if(batch >= count)
+    {
+        function(data, 0, count);
+        return;
+    }
+    
+    JobCounter counter = {};
+    for(u32 first = 0; first < count; first += batch)
+    {
+        jobs_push(queue, function, data, first, MIN(first + batch, count), &counter);
+    }
+    jobs_wait_counter(queue, &counter);
+}
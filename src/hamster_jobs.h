@@ -0,0 +1,65 @@
+/* date = October 19th 2026 10:12 am */
+
+#ifndef HAMSTER_JOBS_H
+#define HAMSTER_JOBS_H
+
+#define JOBS_MAX_THREADS 16
+#define JOBS_QUEUE_SIZE 256
+#define JOBS_BACKGROUND_QUEUE_SIZE 64
+
+typedef void (* JobFunction)(void *data, u32 first, u32 one_past_last);
+
+// NOTE: Counts the unfinished jobs of one batch, so a caller can wait for (or poll)
+// only its own work while other batches keep running in the background.
+// Only touched with the queue mutex held.
+struct JobCounter
+{
+    u32 pending;
+};
+
+struct Job
+{
+    JobFunction function;
+    void *data;
+    u32 first;
+    u32 one_past_last;
+    JobCounter *counter;
+};
+
+// NOTE: Simple fixed size thread pool. Jobs are pushed into a ring protected by
+// a single mutex, which is fine as long as the jobs are a lot coarser than the lock.
+// The thread calling jobs_wait also works on the queue instead of sleeping.
+// Background work goes into its own ring. Workers only pick it up when the main
+// ring is empty and the waiting functions never run it, so a frame never ends up
+// stuck behind it.
+struct JobQueue
+{
+    pthread_t threads[JOBS_MAX_THREADS];
+    u32 threads_count;
+    
+    pthread_mutex_t mutex;
+    pthread_cond_t work_added;
+    pthread_cond_t work_done;
+    
+    Job jobs[JOBS_QUEUE_SIZE];
+    u32 head;
+    u32 tail;
+    Job background[JOBS_BACKGROUND_QUEUE_SIZE];
+    u32 background_head;
+    u32 background_tail;
+    u32 pending;
+    bool running;
+};
+
+static void jobs_init(JobQueue *queue, u32 threads_count = 0);
+static void jobs_shutdown(JobQueue *queue);
+static void jobs_push(JobQueue *queue, JobFunction function, void *data, u32 first, u32 one_past_last,
+                      JobCounter *counter = NULL);
+static bool jobs_push_background(JobQueue *queue, JobFunction function, void *data, u32 first, u32 one_past_last,
+                                 JobCounter *counter);
+static void jobs_wait(JobQueue *queue);
+static void jobs_wait_counter(JobQueue *queue, JobCounter *counter);
+static bool jobs_counter_done(JobQueue *queue, JobCounter *counter);
+static void jobs_parallel_for(JobQueue *queue, u32 count, u32 min_batch, JobFunction function, void *data);
+
+#endif //HAMSTER_JOBS_H
@@ -197,6 +197,41 @@ clamp01(f32 a)
 	return result;
 }
 
+// NOTE: Round to nearest, denormals are flushed to zero and anything
+// out of range becomes infinity. Good enough for instance scales.
+inline static u16
+f32_to_half(f32 a)
+{
+    u32 bits = 0;
+    memcpy(&bits, &a, sizeof(bits));
+    
+    u32 sign = (bits >> 16) & 0x8000;
+    i32 exponent = (i32)((bits >> 23) & 0xff) - 127 + 15;
+    u32 mantissa = bits & 0x7fffff;
+    
+    if(exponent <= 0)
+    {
+        return (u16)sign;
+    }
+    if(exponent >= 31)
+    {
+        return (u16)(sign | 0x7c00);
+    }
+    
+    u32 result = sign | (exponent << 10) | (mantissa >> 13);
+    result += (mantissa >> 12) & 1;
+    
+    return (u16)result;
+}
+
+inline static i16
+f32_to_snorm16(f32 a)
+{
+    f32 scaled = clamp(a, -1.0f, 1.0f) * 32767.0f;
+    
+    return (i16)(scaled >= 0.0f ? scaled + 0.5f : scaled - 0.5f);
+}
+
 inline static Vec2
 add(Vec2 a, Vec2 b)
 {
@@ -358,7 +393,7 @@ lerp(Vec2 a, f32 t, Vec2 b)
 inline static Vec2 
 perp(Vec2 a)
 {
-    Vec2 result = { .x = -a.y, .y = a.x };
+    Vec2 result = Vec2(-a.y, a.x);
     
     return result;
 }
@@ -598,7 +633,7 @@ sub(Vec4 a, Vec4 b)
     result.x = a.x - b.x;
     result.y = a.y - b.y;
     result.z = a.z - b.z;
-    result.z = a.w - b.w;
+    result.w = a.w - b.w;
     
     return result;
 }
@@ -673,7 +708,7 @@ len(Vec4 a)
 {
     f32 result = 0.0f;
     
-    result = a.x * a.x + a.y * a.y + a.z * a.z * a.w * a.w;
+    result = a.x * a.x + a.y * a.y + a.z * a.z + a.w * a.w;
     
     result = sqrtf(result);
     
@@ -685,7 +720,7 @@ inverse_len(Vec4 a)
 {
     f32 result = 0.0f;
     
-    result = a.x * a.x + a.y * a.y + a.z * a.z * a.w * a.w;
+    result = a.x * a.x + a.y * a.y + a.z * a.z + a.w * a.w;
     
     result = 1.0f / sqrtf(result);
     
@@ -837,6 +872,16 @@ create_qrot(f32 theta, Vec3 dir)
     return noz(result);
 }
 
+// NOTE: Rotates v by the unit quaternion q, same as quat_rotate in the shaders
+inline static Vec3
+quat_rotate(Quat q, Vec3 v)
+{
+    Vec3 t = scale(cross(q.v, v), 2.0f);
+    Vec3 result = add(add(v, scale(t, q.w)), cross(q.v, t));
+    
+    return result;
+}
+
 inline static Quat
 qrot(Quat a, f32 angle, Vec3 dir)
 {
@@ -1015,6 +1060,38 @@ mul(Mat4 a, Mat4 b)
 {
     Mat4 result = { 0 };
     
+#ifdef __AVX__
+    // NOTE: Two columns of the result at once, each is the columns of a weighted by
+    // a column of b and summed in the same order as the scalar version. Only 16 byte
+    // loads and stores, Mat4 gets copied around in 16 byte pieces and a 32 byte access
+    // straddling two of them stalls on store forwarding.
+    __m128 column0 = _mm_loadu_ps(a.a[0]);
+    __m128 column1 = _mm_loadu_ps(a.a[1]);
+    __m128 column2 = _mm_loadu_ps(a.a[2]);
+    __m128 column3 = _mm_loadu_ps(a.a[3]);
+    __m256 a0 = _mm256_insertf128_ps(_mm256_castps128_ps256(column0), column0, 1);
+    __m256 a1 = _mm256_insertf128_ps(_mm256_castps128_ps256(column1), column1, 1);
+    __m256 a2 = _mm256_insertf128_ps(_mm256_castps128_ps256(column2), column2, 1);
+    __m256 a3 = _mm256_insertf128_ps(_mm256_castps128_ps256(column3), column3, 1);
+    
+    __m256 b01 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(b.a[0])), _mm_loadu_ps(b.a[1]), 1);
+    __m256 b23 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(b.a[2])), _mm_loadu_ps(b.a[3]), 1);
+    
+    __m256 c01 = _mm256_mul_ps(a0, _mm256_shuffle_ps(b01, b01, 0x00));
+    c01 = _mm256_add_ps(c01, _mm256_mul_ps(a1, _mm256_shuffle_ps(b01, b01, 0x55)));
+    c01 = _mm256_add_ps(c01, _mm256_mul_ps(a2, _mm256_shuffle_ps(b01, b01, 0xaa)));
+    c01 = _mm256_add_ps(c01, _mm256_mul_ps(a3, _mm256_shuffle_ps(b01, b01, 0xff)));
+    
+    __m256 c23 = _mm256_mul_ps(a0, _mm256_shuffle_ps(b23, b23, 0x00));
+    c23 = _mm256_add_ps(c23, _mm256_mul_ps(a1, _mm256_shuffle_ps(b23, b23, 0x55)));
+    c23 = _mm256_add_ps(c23, _mm256_mul_ps(a2, _mm256_shuffle_ps(b23, b23, 0xaa)));
+    c23 = _mm256_add_ps(c23, _mm256_mul_ps(a3, _mm256_shuffle_ps(b23, b23, 0xff)));
+    
+    _mm_storeu_ps(result.a[0], _mm256_castps256_ps128(c01));
+    _mm_storeu_ps(result.a[1], _mm256_extractf128_ps(c01, 1));
+    _mm_storeu_ps(result.a[2], _mm256_castps256_ps128(c23));
+    _mm_storeu_ps(result.a[3], _mm256_extractf128_ps(c23, 1));
+#else
     result.a[0][0] = a.a[0][0] * b.a[0][0] + a.a[1][0] * b.a[0][1] + a.a[2][0] * b.a[0][2] + a.a[3][0] * b.a[0][3];
     result.a[1][0] = a.a[0][0] * b.a[1][0] + a.a[1][0] * b.a[1][1] + a.a[2][0] * b.a[1][2] + a.a[3][0] * b.a[1][3];
     result.a[2][0] = a.a[0][0] * b.a[2][0] + a.a[1][0] * b.a[2][1] + a.a[2][0] * b.a[2][2] + a.a[3][0] * b.a[2][3];
@@ -1034,6 +1111,7 @@ mul(Mat4 a, Mat4 b)
     result.a[1][3] = a.a[0][3] * b.a[1][0] + a.a[1][3] * b.a[1][1] + a.a[2][3] * b.a[1][2] + a.a[3][3] * b.a[1][3];
     result.a[2][3] = a.a[0][3] * b.a[2][0] + a.a[1][3] * b.a[2][1] + a.a[2][3] * b.a[2][2] + a.a[3][3] * b.a[2][3];
     result.a[3][3] = a.a[0][3] * b.a[3][0] + a.a[1][3] * b.a[3][1] + a.a[2][3] * b.a[3][2] + a.a[3][3] * b.a[3][3];
+#endif
     
     return result;
 }
@@ -1063,9 +1141,74 @@ mul(Mat4 a, Vec4 v)
     return result;
 }
 
+#ifdef __SSE2__
+// NOTE: Cofactor expansion with the 2x2 determinants of the two right columns
+// worked out four at a time, INVERSE_FACTORS gives them for rows r1 and r2. These are
+// the products and sums of the scalar version, so the two agree bit for bit unless
+// the compiler fuses the scalar ones into multiply adds.
+#define INVERSE_FACTORS(c1, c2, c3, r1, r2) \
+_mm_sub_ps(_mm_mul_ps(_mm_shuffle_ps(c2, c1, _MM_SHUFFLE(r1, r1, r1, r1)), \
+                      _mm_shuffle_ps(_mm_shuffle_ps(c3, c2, _MM_SHUFFLE(r2, r2, r2, r2)), \
+                                     _mm_shuffle_ps(c3, c2, _MM_SHUFFLE(r2, r2, r2, r2)), \
+                                     _MM_SHUFFLE(2, 0, 0, 0))), \
+           _mm_mul_ps(_mm_shuffle_ps(_mm_shuffle_ps(c3, c2, _MM_SHUFFLE(r1, r1, r1, r1)), \
+                                     _mm_shuffle_ps(c3, c2, _MM_SHUFFLE(r1, r1, r1, r1)), \
+                                     _MM_SHUFFLE(2, 0, 0, 0)), \
+                      _mm_shuffle_ps(c2, c1, _MM_SHUFFLE(r2, r2, r2, r2))))
+#define INVERSE_ROW(c0, c1, r) \
+_mm_shuffle_ps(_mm_shuffle_ps(c1, c0, _MM_SHUFFLE(r, r, r, r)), \
+               _mm_shuffle_ps(c1, c0, _MM_SHUFFLE(r, r, r, r)), \
+               _MM_SHUFFLE(2, 2, 2, 0))
+#endif
+
 static Mat4
 inverse(Mat4 v)
 {
+#ifdef __SSE2__
+    __m128 c0 = _mm_loadu_ps(v.a[0]);
+    __m128 c1 = _mm_loadu_ps(v.a[1]);
+    __m128 c2 = _mm_loadu_ps(v.a[2]);
+    __m128 c3 = _mm_loadu_ps(v.a[3]);
+    
+    __m128 fac0 = INVERSE_FACTORS(c1, c2, c3, 2, 3);
+    __m128 fac1 = INVERSE_FACTORS(c1, c2, c3, 1, 3);
+    __m128 fac2 = INVERSE_FACTORS(c1, c2, c3, 1, 2);
+    __m128 fac3 = INVERSE_FACTORS(c1, c2, c3, 0, 3);
+    __m128 fac4 = INVERSE_FACTORS(c1, c2, c3, 0, 2);
+    __m128 fac5 = INVERSE_FACTORS(c1, c2, c3, 0, 1);
+    
+    __m128 row0 = INVERSE_ROW(c0, c1, 0);
+    __m128 row1 = INVERSE_ROW(c0, c1, 1);
+    __m128 row2 = INVERSE_ROW(c0, c1, 2);
+    __m128 row3 = INVERSE_ROW(c0, c1, 3);
+    
+    __m128 sign_a = _mm_setr_ps(1.0f, -1.0f, 1.0f, -1.0f);
+    __m128 sign_b = _mm_setr_ps(-1.0f, 1.0f, -1.0f, 1.0f);
+    
+    __m128 inv0 = _mm_sub_ps(_mm_mul_ps(row1, fac0), _mm_mul_ps(row2, fac1));
+    inv0 = _mm_mul_ps(sign_a, _mm_add_ps(inv0, _mm_mul_ps(row3, fac2)));
+    __m128 inv1 = _mm_sub_ps(_mm_mul_ps(row0, fac0), _mm_mul_ps(row2, fac3));
+    inv1 = _mm_mul_ps(sign_b, _mm_add_ps(inv1, _mm_mul_ps(row3, fac4)));
+    __m128 inv2 = _mm_sub_ps(_mm_mul_ps(row0, fac1), _mm_mul_ps(row1, fac3));
+    inv2 = _mm_mul_ps(sign_a, _mm_add_ps(inv2, _mm_mul_ps(row3, fac5)));
+    __m128 inv3 = _mm_sub_ps(_mm_mul_ps(row0, fac2), _mm_mul_ps(row1, fac4));
+    inv3 = _mm_mul_ps(sign_b, _mm_add_ps(inv3, _mm_mul_ps(row2, fac5)));
+    
+    // NOTE: First row of the adjugate dotted with the first column gives the determinant
+    __m128 firsts = _mm_shuffle_ps(_mm_shuffle_ps(inv0, inv1, _MM_SHUFFLE(0, 0, 0, 0)),
+                                   _mm_shuffle_ps(inv2, inv3, _MM_SHUFFLE(0, 0, 0, 0)),
+                                   _MM_SHUFFLE(2, 0, 2, 0));
+    __m128 dot = _mm_mul_ps(c0, firsts);
+    dot = _mm_add_ps(dot, _mm_shuffle_ps(dot, dot, _MM_SHUFFLE(2, 3, 0, 1)));
+    dot = _mm_add_ps(dot, _mm_shuffle_ps(dot, dot, _MM_SHUFFLE(1, 0, 3, 2)));
+    __m128 det = _mm_div_ps(_mm_set1_ps(1.0f), dot);
+    
+    Mat4 result;
+    _mm_storeu_ps(result.a[0], _mm_mul_ps(inv0, det));
+    _mm_storeu_ps(result.a[1], _mm_mul_ps(inv1, det));
+    _mm_storeu_ps(result.a[2], _mm_mul_ps(inv2, det));
+    _mm_storeu_ps(result.a[3], _mm_mul_ps(inv3, det));
+#else
     f32 a = v.a[0][0], e = v.a[1][0], i = v.a[2][0], m = v.a[3][0],
     b = v.a[0][1], f = v.a[1][1], j = v.a[2][1], n = v.a[3][1],
     c = v.a[0][2], g = v.a[1][2], k = v.a[2][2], o = v.a[3][2],
@@ -1106,6 +1249,7 @@ inverse(Mat4 v)
                       c * result.a[2][0] + d * result.a[3][0]);
     
     result = scale(result, det);
+#endif
     
     return result;
 }
@@ -0,0 +1,388 @@
+static OcclusionBuffer
+occlusion_create()
+{
+    OcclusionBuffer result = {};
+    
+    u32 width = OCCLUSION_WIDTH;
+    u32 height = OCCLUSION_HEIGHT;
+    for(;;)
+    {
+        OcclusionLevel *level = &result.levels[result.levels_count++];
+        level->width = width;
+        level->height = height;
+        level->depth = (f32 *)malloc(width * height * sizeof(f32));
+        
+        if((width == 1 && height == 1) || result.levels_count == OCCLUSION_MAX_LEVELS)
+        {
+            break;
+        }
+        width = MAX((width + 1) / 2, 1);
+        height = MAX((height + 1) / 2, 1);
+    }
+    
+    result.triangles_capacity = 1024;
+    result.triangles = (OcclusionTriangle *)malloc(result.triangles_capacity * sizeof(OcclusionTriangle));
+    
+    return result;
+}
+
+static void
+occlusion_destroy(OcclusionBuffer *buffer)
+{
+    for(u32 i = 0; i < buffer->levels_count; i++)
+    {
+        free(buffer->levels[i].depth);
+    }
+    free(buffer->triangles);
+    memset(buffer, 0, sizeof(*buffer));
+}
+
+static void
+occlusion_begin(OcclusionBuffer *buffer, Mat4 view_proj)
+{
+    buffer->view_proj = view_proj;
+    buffer->triangles_len = 0;
+    buffer->tested_count = 0;
+    buffer->occluded_count = 0;
+}
+
+static void
+occlusion_push_triangle(OcclusionBuffer *buffer, Vec4 v0, Vec4 v1, Vec4 v2)
+{
+    if(buffer->triangles_len == buffer->triangles_capacity)
+    {
+        buffer->triangles_capacity *= 2;
+        buffer->triangles = (OcclusionTriangle *)realloc(buffer->triangles,
+                                                         buffer->triangles_capacity * sizeof(OcclusionTriangle));
+    }
+    
+    OcclusionTriangle *triangle = &buffer->triangles[buffer->triangles_len++];
+    Vec4 vertices[3] = { v0, v1, v2 };
+    for(u32 i = 0; i < 3; i++)
+    {
+        f32 inv_w = 1.0f / vertices[i].w;
+        triangle->x[i] = (vertices[i].x * inv_w * 0.5f + 0.5f) * OCCLUSION_WIDTH;
+        triangle->y[i] = (vertices[i].y * inv_w * 0.5f + 0.5f) * OCCLUSION_HEIGHT;
+        triangle->z[i] = vertices[i].z * inv_w * 0.5f + 0.5f;
+    }
+}
+
+// NOTE: Triangles are clipped against the near plane only, anything else is
+// taken care of by clamping the bounding box to the buffer. Clipping only ever
+// removes area, so the occluder never grows.
+static void
+occlusion_push_mesh(OcclusionBuffer *buffer, Mesh *mesh, Mat4 transform)
+{
+    Mat4 mvp = mul(buffer->view_proj, transform);
+    
+    for(u32 i = 0; i + 2 < mesh->indices_len; i += 3)
+    {
+        Vec4 clip[3];
+        u32 outside[4] = {};
+        for(u32 j = 0; j < 3; j++)
+        {
+            Vec3 p = mesh->vertices.positions[mesh->indices[i + j]];
+            clip[j] = mul(mvp, Vec4(p.x, p.y, p.z, 1.0f));
+            outside[0] += clip[j].x < -clip[j].w;
+            outside[1] += clip[j].x > clip[j].w;
+            outside[2] += clip[j].y < -clip[j].w;
+            outside[3] += clip[j].y > clip[j].w;
+        }
+        
+        if(outside[0] == 3 || outside[1] == 3 || outside[2] == 3 || outside[3] == 3)
+        {
+            continue;
+        }
+        
+        // NOTE: Sutherland-Hodgman against z + w >= 0, at most 4 vertices come out
+        Vec4 polygon[4];
+        u32 polygon_len = 0;
+        for(u32 j = 0; j < 3; j++)
+        {
+            Vec4 a = clip[j];
+            Vec4 b = clip[(j + 1) % 3];
+            f32 da = a.z + a.w;
+            f32 db = b.z + b.w;
+            
+            if(da >= 0.0f)
+            {
+                polygon[polygon_len++] = a;
+            }
+            if((da >= 0.0f) != (db >= 0.0f))
+            {
+                f32 t = da / (da - db);
+                polygon[polygon_len++] = Vec4(a.x + (b.x - a.x) * t, a.y + (b.y - a.y) * t,
+                                              a.z + (b.z - a.z) * t, a.w + (b.w - a.w) * t);
+            }
+        }
+        
+        for(u32 j = 2; j < polygon_len; j++)
+        {
+            occlusion_push_triangle(buffer, polygon[0], polygon[j - 1], polygon[j]);
+        }
+    }
+}
+
+// NOTE: Each band of OCCLUSION_BAND_ROWS rows belongs to exactly one job, so there
+// is no sharing between threads, [first, one_past_last) are band indices.
+// Every job walks all triangles, which is fine for a handful of occluders.
+static void
+occlusion_raster_job(void *data, u32 first, u32 one_past_last)
+{
+    OcclusionBuffer *buffer = (OcclusionBuffer *)data;
+    f32 *depth = buffer->levels[0].depth;
+    
+    for(u32 band = first; band < one_past_last; band++)
+    {
+        i32 band_first = band * OCCLUSION_BAND_ROWS;
+        i32 band_last = band_first + OCCLUSION_BAND_ROWS - 1;
+        
+        for(i32 i = band_first * OCCLUSION_WIDTH; i < (band_last + 1) * OCCLUSION_WIDTH; i++)
+        {
+            depth[i] = 1.0f;
+        }
+        
+        for(u32 t = 0; t < buffer->triangles_len; t++)
+        {
+            OcclusionTriangle *triangle = &buffer->triangles[t];
+            f32 x0 = triangle->x[0], y0 = triangle->y[0];
+            f32 x1 = triangle->x[1], y1 = triangle->y[1];
+            f32 x2 = triangle->x[2], y2 = triangle->y[2];
+            f32 z0 = triangle->z[0], z1 = triangle->z[1], z2 = triangle->z[2];
+            
+            f32 area = (x1 - x0) * (y2 - y0) - (y1 - y0) * (x2 - x0);
+            if(area < 0.0f)
+            {
+                f32 tmp;
+                tmp = x1; x1 = x2; x2 = tmp;
+                tmp = y1; y1 = y2; y2 = tmp;
+                tmp = z1; z1 = z2; z2 = tmp;
+                area = -area;
+            }
+            if(area <= 0.0f)
+            {
+                continue;
+            }
+            
+            // NOTE: Clamped as floats first, vertices close to the near plane can
+            // land far outside of what fits in an i32
+            i32 ymin = (i32)floorf(MAX(MIN(y0, MIN(y1, y2)), (f32)band_first));
+            i32 ymax = (i32)ceilf(MIN(MAX(y0, MAX(y1, y2)), (f32)band_last));
+            i32 xmin = (i32)floorf(MAX(MIN(x0, MIN(x1, x2)), 0.0f)) & ~7;
+            i32 xmax = (i32)ceilf(MIN(MAX(x0, MAX(x1, x2)), (f32)(OCCLUSION_WIDTH - 1)));
+            if(ymin > ymax || xmin > xmax)
+            {
+                continue;
+            }
+            
+            // NOTE: Edge i is the one opposite of vertex i, e(p) = a * p.x + b * p.y + c
+            f32 a0 = y1 - y2, b0 = x2 - x1, c0 = (y2 - y1) * x1 - (x2 - x1) * y1;
+            f32 a1 = y2 - y0, b1 = x0 - x2, c1 = (y0 - y2) * x2 - (x0 - x2) * y2;
+            f32 a2 = y0 - y1, b2 = x1 - x0, c2 = (y1 - y0) * x0 - (x1 - x0) * y0;
+            
+            f32 inv_area = 1.0f / area;
+            f32 za = ((z1 - z0) * a1 + (z2 - z0) * a2) * inv_area;
+            f32 zb = ((z1 - z0) * b1 + (z2 - z0) * b2) * inv_area;
+            f32 zc = z0 + ((z1 - z0) * c1 + (z2 - z0) * c2) * inv_area;
+            
+            for(i32 y = ymin; y <= ymax; y++)
+            {
+                f32 py = y + 0.5f;
+                f32 *row = depth + y * OCCLUSION_WIDTH;
+                
+#ifdef __AVX2__
+                __m256 lanes = _mm256_setr_ps(0.5f, 1.5f, 2.5f, 3.5f, 4.5f, 5.5f, 6.5f, 7.5f);
+                __m256 zero = _mm256_setzero_ps();
+                __m256 row0 = _mm256_set1_ps(b0 * py + c0);
+                __m256 row1 = _mm256_set1_ps(b1 * py + c1);
+                __m256 row2 = _mm256_set1_ps(b2 * py + c2);
+                __m256 rowz = _mm256_set1_ps(zb * py + zc);
+                
+                for(i32 x = xmin; x <= xmax; x += 8)
+                {
+                    __m256 px = _mm256_add_ps(_mm256_set1_ps((f32)x), lanes);
+                    __m256 e0 = _mm256_fmadd_ps(_mm256_set1_ps(a0), px, row0);
+                    __m256 e1 = _mm256_fmadd_ps(_mm256_set1_ps(a1), px, row1);
+                    __m256 e2 = _mm256_fmadd_ps(_mm256_set1_ps(a2), px, row2);
+                    
+                    __m256 inside = _mm256_and_ps(_mm256_cmp_ps(e0, zero, _CMP_GE_OQ),
+                                                  _mm256_and_ps(_mm256_cmp_ps(e1, zero, _CMP_GE_OQ),
+                                                                _mm256_cmp_ps(e2, zero, _CMP_GE_OQ)));
+                    if(_mm256_movemask_ps(inside) == 0)
+                    {
+                        continue;
+                    }
+                    
+                    __m256 z = _mm256_fmadd_ps(_mm256_set1_ps(za), px, rowz);
+                    __m256 old = _mm256_loadu_ps(row + x);
+                    __m256 nearest = _mm256_blendv_ps(old, _mm256_min_ps(old, z), inside);
+                    _mm256_storeu_ps(row + x, nearest);
+                }
+#else
+                for(i32 x = xmin; x <= xmax; x++)
+                {
+                    f32 px = x + 0.5f;
+                    if(a0 * px + b0 * py + c0 >= 0.0f && a1 * px + b1 * py + c1 >= 0.0f &&
+                       a2 * px + b2 * py + c2 >= 0.0f)
+                    {
+                        row[x] = MIN(row[x], za * px + zb * py + zc);
+                    }
+                }
+#endif
+            }
+        }
+    }
+}
+
+static void
+occlusion_rasterize(OcclusionBuffer *buffer, JobQueue *jobs)
+{
+    jobs_parallel_for(jobs, OCCLUSION_HEIGHT / OCCLUSION_BAND_ROWS, 1, occlusion_raster_job, buffer);
+    
+    // NOTE: Every texel keeps the farthest of the (up to) 2x2 texels under it
+    for(u32 i = 1; i < buffer->levels_count; i++)
+    {
+        OcclusionLevel *src = &buffer->levels[i - 1];
+        OcclusionLevel *dst = &buffer->levels[i];
+        
+        for(u32 y = 0; y < dst->height; y++)
+        {
+            u32 sy0 = 2 * y;
+            u32 sy1 = MIN(2 * y + 1, src->height - 1);
+            for(u32 x = 0; x < dst->width; x++)
+            {
+                u32 sx0 = 2 * x;
+                u32 sx1 = MIN(2 * x + 1, src->width - 1);
+                f32 farthest = MAX(MAX(src->depth[sy0 * src->width + sx0], src->depth[sy0 * src->width + sx1]),
+                                   MAX(src->depth[sy1 * src->width + sx0], src->depth[sy1 * src->width + sx1]));
+                dst->depth[y * dst->width + x] = farthest;
+            }
+        }
+    }
+}
+
+// NOTE: Tests the box around the sphere. Its nearest corner against the farthest
+// occluder depth of a pyramid level where the box covers at most 4x4 texels.
+// Anything that touches the near plane or falls outside of the buffer is visible.
+static bool
+occlusion_sphere_visible(OcclusionBuffer *buffer, Vec3 center, f32 radius)
+{
+    if(radius >= F32MAX * 0.5f)
+    {
+        return true;
+    }
+    
+    f32 xmin = F32MAX, ymin = F32MAX, xmax = -F32MAX, ymax = -F32MAX;
+    f32 nearest = F32MAX;
+    for(u32 i = 0; i < 8; i++)
+    {
+        Vec4 corner = Vec4(center.x + ((i & 1) ? radius : -radius),
+                           center.y + ((i & 2) ? radius : -radius),
+                           center.z + ((i & 4) ? radius : -radius), 1.0f);
+        Vec4 clip = mul(buffer->view_proj, corner);
+        if(clip.w <= 0.0f || clip.z < -clip.w)
+        {
+            return true;
+        }
+        
+        f32 inv_w = 1.0f / clip.w;
+        f32 x = (clip.x * inv_w * 0.5f + 0.5f) * OCCLUSION_WIDTH;
+        f32 y = (clip.y * inv_w * 0.5f + 0.5f) * OCCLUSION_HEIGHT;
+        xmin = MIN(xmin, x);
+        xmax = MAX(xmax, x);
+        ymin = MIN(ymin, y);
+        ymax = MAX(ymax, y);
+        nearest = MIN(nearest, clip.z * inv_w * 0.5f + 0.5f);
+    }
+    
+    if(xmax < 0.0f || ymax < 0.0f || xmin > OCCLUSION_WIDTH || ymin > OCCLUSION_HEIGHT)
+    {
+        return true;
+    }
+    
+    i32 x0 = (i32)floorf(MAX(xmin, 0.0f));
+    i32 y0 = (i32)floorf(MAX(ymin, 0.0f));
+    i32 x1 = (i32)ceilf(MIN(xmax, (f32)(OCCLUSION_WIDTH - 1)));
+    i32 y1 = (i32)ceilf(MIN(ymax, (f32)(OCCLUSION_HEIGHT - 1)));
+    if(x0 > x1 || y0 > y1)
+    {
+        return true;
+    }
+    
+    u32 k = 0;
+    while(k + 1 < buffer->levels_count && ((x1 >> k) - (x0 >> k) > 3 || (y1 >> k) - (y0 >> k) > 3))
+    {
+        k++;
+    }
+    
+    OcclusionLevel *level = &buffer->levels[k];
+    for(i32 y = y0 >> k; y <= MIN(y1 >> k, (i32)level->height - 1); y++)
+    {
+        for(i32 x = x0 >> k; x <= MIN(x1 >> k, (i32)level->width - 1); x++)
+        {
+            if(level->depth[y * level->width + x] >= nearest)
+            {
+                return true;
+            }
+        }
+    }
+    
+    return false;
+}
+
+// NOTE: Blocks of CULL_LANES spheres, only the ones still visible get tested
+static void
+occlusion_cull_job(void *data, u32 first, u32 one_past_last)
+{
+    OcclusionCullJob *job = (OcclusionCullJob *)data;
+    CullSet *set = job->set;
+    u8 *masks = set->masks[job->view];
+    
+    for(u32 block = first; block < one_past_last; block++)
+    {
+        u8 mask = masks[block];
+        for(u32 lane = 0; lane < CULL_LANES; lane++)
+        {
+            if(!(mask & (1 << lane)))
+            {
+                continue;
+            }
+            
+            u32 i = block * CULL_LANES + lane;
+            if(!occlusion_sphere_visible(job->buffer, Vec3(set->x[i], set->y[i], set->z[i]), set->radius[i]))
+            {
+                mask &= ~(1 << lane);
+            }
+        }
+        masks[block] = mask;
+    }
+}
+
+// NOTE: Expects cull_run to have been done on the set, clears the bits of
+// everything hidden behind the occluders and updates the visible count.
+static void
+occlusion_cull(OcclusionBuffer *buffer, CullSet *set, CullView view, JobQueue *jobs)
+{
+    buffer->tested_count = set->visible_counts[view];
+    buffer->occluded_count = 0;
+    if(buffer->triangles_len == 0)
+    {
+        return;
+    }
+    
+    OcclusionCullJob job = {};
+    job.buffer = buffer;
+    job.set = set;
+    job.view = view;
+    
+    u32 blocks = (set->count + CULL_LANES - 1) / CULL_LANES;
+    jobs_parallel_for(jobs, blocks, OCCLUSION_MIN_BATCH_BLOCKS, occlusion_cull_job, &job);
+    
+    u32 visible = 0;
+    for(u32 block = 0; block < blocks; block++)
+    {
+        visible += __builtin_popcount(set->masks[view][block]);
+    }
+    buffer->occluded_count = set->visible_counts[view] - visible;
+    set->visible_counts[view] = visible;
+}
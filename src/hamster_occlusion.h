@@ -0,0 +1,63 @@
+/* date = October 19th 2026 6:05 pm */
+
+#ifndef HAMSTER_OCCLUSION_H
+#define HAMSTER_OCCLUSION_H
+
+// NOTE: Width has to be a multiple of 8 so a row splits into whole AVX blocks,
+// height a multiple of OCCLUSION_BAND_ROWS.
+#define OCCLUSION_WIDTH 320
+#define OCCLUSION_HEIGHT 192
+#define OCCLUSION_BAND_ROWS 16
+#define OCCLUSION_MAX_LEVELS 10
+#define OCCLUSION_MIN_BATCH_BLOCKS 64
+
+// NOTE: Screen space triangle, x/y in depth buffer pixels, z is depth in [0, 1]
+struct OcclusionTriangle
+{
+    f32 x[3];
+    f32 y[3];
+    f32 z[3];
+};
+
+struct OcclusionLevel
+{
+    f32 *depth;
+    u32 width;
+    u32 height;
+};
+
+// NOTE: A few chosen occluders get rasterized on the CPU into a small depth buffer,
+// level 0 of a pyramid where each texel keeps the farthest depth of the 2x2 below it.
+// Bounds that are behind every texel they cover can't be seen and get dropped
+// before anything is submitted.
+struct OcclusionBuffer
+{
+    OcclusionLevel levels[OCCLUSION_MAX_LEVELS];
+    u32 levels_count;
+    
+    OcclusionTriangle *triangles;
+    u32 triangles_len;
+    u32 triangles_capacity;
+    
+    Mat4 view_proj;
+    u32 tested_count;
+    u32 occluded_count;
+    f64 last_run_time;
+};
+
+struct OcclusionCullJob
+{
+    OcclusionBuffer *buffer;
+    CullSet *set;
+    CullView view;
+};
+
+static OcclusionBuffer occlusion_create();
+static void occlusion_destroy(OcclusionBuffer *buffer);
+static void occlusion_begin(OcclusionBuffer *buffer, Mat4 view_proj);
+static void occlusion_push_mesh(OcclusionBuffer *buffer, Mesh *mesh, Mat4 transform);
+static void occlusion_rasterize(OcclusionBuffer *buffer, JobQueue *jobs);
+static bool occlusion_sphere_visible(OcclusionBuffer *buffer, Vec3 center, f32 radius);
+static void occlusion_cull(OcclusionBuffer *buffer, CullSet *set, CullView view, JobQueue *jobs);
+
+#endif //HAMSTER_OCCLUSION_H
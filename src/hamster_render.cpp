@@ -6,6 +6,11 @@ render_create_queue(u32 size)
     queue.max_size = size;
     queue.entries = malloc(queue.max_size);
     
+    queue.debug.vertices_max = 256;
+    queue.debug.vertices = (DebugVertex *)malloc(queue.debug.vertices_max * sizeof(DebugVertex));
+    queue.debug.boxes_max = 64;
+    queue.debug.boxes = (DebugBox *)malloc(queue.debug.boxes_max * sizeof(DebugBox));
+    
     return queue;
 }
 
@@ -13,6 +18,8 @@ static void
 render_destory_queue(RenderQueue *queue)
 {
     free(queue->entries);
+    free(queue->debug.vertices);
+    free(queue->debug.boxes);
 }
 
 static void
@@ -41,35 +48,58 @@ render_push_skybox(RenderQueue *queue, Cubemap skybox)
 }
 
 static void
-render_push_line(RenderQueue *queue, Line line)
+render_push_line(RenderQueue *queue, Line line, Vec3 color)
 {
-    RenderEntryLine *entry = render_push_entry(queue, RenderEntryLine);
+    DebugDraw *debug = &queue->debug;
+    if(debug->vertices_len + 2 > debug->vertices_max)
+    {
+        debug->vertices_max *= 2;
+        debug->vertices = (DebugVertex *)realloc(debug->vertices, debug->vertices_max * sizeof(DebugVertex));
+        assert(debug->vertices);
+    }
     
-    entry->line = line;
+    debug->vertices[debug->vertices_len++] = { line.point0, color };
+    debug->vertices[debug->vertices_len++] = { line.point1, color };
 }
 
 static void
-render_push_hitbox(RenderQueue *queue, Entity entity)
+render_push_debug_box(DebugDraw *debug, Mat4 transform, Vec3 color)
 {
-    RenderEntryHitbox *entry = render_push_entry(queue, RenderEntryHitbox);
+    if(debug->boxes_len == debug->boxes_max)
+    {
+        debug->boxes_max *= 2;
+        debug->boxes = (DebugBox *)realloc(debug->boxes, debug->boxes_max * sizeof(DebugBox));
+        assert(debug->boxes);
+    }
     
-    entry->position = entity.position;
-    entry->size = entity.size;
-    entry->orientation = entity.rotate;
-    entry->hbox = entity.model->hitboxes;
-    entry->hbox_len = entity.model->hitboxes_len;
+    debug->boxes[debug->boxes_len++] = { transform, color };
+}
+
+static void
+render_push_hitbox(RenderQueue *queue, Entity *entity, Vec3 color)
+{
+    Model *model = entity->model;
+    Mat4 world = entity_world(entity);
+    for(u32 i = 0; i < model->hitboxes_len; i++)
+    {
+        Hitbox *hbox = model->hitboxes + i;
+        
+        // NOTE: Unit cube -> hitbox in model space -> world space
+        Mat4 transform = scale(Mat4(1.0f), hbox->size);
+        transform = translate(transform, hbox->refpoint);
+        transform = mul(world, transform);
+        
+        render_push_debug_box(&queue->debug, transform, color);
+    }
 }
 
 static void
-render_push_hitbox(RenderQueue *queue, Hitbox *hbox)
+render_push_hitbox(RenderQueue *queue, Hitbox *hbox, Vec3 color)
 {
-    RenderEntryHitbox *entry = render_push_entry(queue, RenderEntryHitbox);
+    Mat4 transform = scale(Mat4(1.0f), hbox->size);
+    transform = translate(transform, hbox->refpoint);
     
-    entry->position = Vec3(0.0f, 0.0f, 0.0f);
-    entry->size = Vec3(1.0f, 1.0f, 1.0f);
-    entry->orientation = create_qrot(0.0f, Vec3(0.0f, 1.0f, 0.0f));
-    entry->hbox = hbox;
-    entry->hbox_len = 1;
+    render_push_debug_box(&queue->debug, transform, color);
 }
 
 static void
@@ -81,25 +111,27 @@ render_push_ui(RenderQueue *queue, UIElement element)
 }
 
 static void
-render_push_model_newest(RenderQueue *queue, Entity entity)
+render_push_model_newest(RenderQueue *queue, Entity *entity, u32 pick_id)
 {
     RenderEntryModelNewest *entry = render_push_entry(queue, RenderEntryModelNewest);
     
-    entry->position = entity.position;
-    entry->size = entity.size;
-    entry->orientation = entity.rotate;
-    entry->model = entity.model;
+    entry->transform = entity_world(entity);
+    entry->inversed = entity->inversed;
+    entry->model = entity->model;
+    entry->queries = entity_occlusion_queries(entity);
+    entry->pick_id = pick_id;
 }
 
 static void
-render_push_model(RenderQueue *queue, Entity entity)
+render_push_model(RenderQueue *queue, Entity *entity, u32 pick_id)
 {
     RenderEntryModel *entry = render_push_entry(queue, RenderEntryModel);
     
-    entry->position = entity.position;
-    entry->size = entity.size;
-    entry->orientation = entity.rotate;
-    entry->model = entity.model;
+    entry->transform = entity_world(entity);
+    entry->inversed = entity->inversed;
+    entry->model = entity->model;
+    entry->queries = entity_occlusion_queries(entity);
+    entry->pick_id = pick_id;
 }
 
 static void
@@ -107,22 +139,7 @@ render_push_instanced_model(RenderQueue *queue, EntityInstanced *entity)
 {
     RenderEntryModelInstanced *entry = render_push_entry(queue, RenderEntryModelInstanced);
     
-#if 0
-    entry->positions = (Vec3 *)malloc(entity->instances_count * sizeof(entity->positions[0]));
-    entry->sizes = (Vec3 *)malloc(entity->instances_count * sizeof(entity->sizes[0]));
-    entry->orientations = (Quat *)malloc(entity->instances_count * sizeof(entity->rotations[0]));
-
-    memcpy(entry->positions, entity->positions, entity->instances_count * sizeof(entity->positions[0]));
-    memcpy(entry->sizes, entity->sizes, entity->instances_count * sizeof(entity->sizes[0]));
-    memcpy(entry->orientations, entity->rotations, entity->instances_count * sizeof(entity->rotations[0]));
-#else
-    entry->positions = entity->positions;
-    entry->sizes = entity->sizes;
-    entry->orientations = entity->rotations;
-#endif
-
-    entry->instances_count = entity->instances_count;
-    entry->model = entity->model;
+    entry->entity = entity;
 }
 
 static void
@@ -131,6 +148,7 @@ render_load_uniforms(RenderContext *ctx, i32 index)
     GLuint pid = ctx->programs[index].id;
     
     ctx->program_uniforms[index].model = glGetUniformLocation(pid, "model");
+    ctx->program_uniforms[index].normal_matrix = glGetUniformLocation(pid, "normal_matrix");
     ctx->program_uniforms[index].view = glGetUniformLocation(pid, "view");
     ctx->program_uniforms[index].proj = glGetUniformLocation(pid, "proj");
     ctx->program_uniforms[index].transform = glGetUniformLocation(pid, "transform");
@@ -166,6 +184,27 @@ render_load_uniforms(RenderContext *ctx, i32 index)
     ctx->program_uniforms[index].material_specular_exponent = glGetUniformLocation(pid, "material.specular_exponent");
     ctx->program_uniforms[index].light_proj_view = glGetUniformLocation(pid, "light_proj_view");
     ctx->program_uniforms[index].shadow_map = glGetUniformLocation(pid, "shadow_map");
+    ctx->program_uniforms[index].object_id = glGetUniformLocation(pid, "object_id");
+    ctx->program_uniforms[index].use_baked_light = glGetUniformLocation(pid, "use_baked_light");
+    ctx->program_uniforms[index].use_lightmap = glGetUniformLocation(pid, "use_lightmap");
+    ctx->program_uniforms[index].lightmap = glGetUniformLocation(pid, "lightmap");
+}
+
+static void
+render_load_cull_uniforms(RenderContext *ctx)
+{
+    GLuint pid = ctx->instance_cull_program;
+    // NOTE: Neither version built, render_cull_instances never gets past its check
+    if(pid == 0)
+    {
+        return;
+    }
+    
+    ctx->instance_cull_uniforms.frustum_planes = glGetUniformLocation(pid, "frustum_planes");
+    ctx->instance_cull_uniforms.bounds = glGetUniformLocation(pid, "bounds");
+    ctx->instance_cull_uniforms.half_scale = glGetUniformLocation(pid, "half_scale");
+    ctx->instance_cull_uniforms.instances_count = glGetUniformLocation(pid, "instances_count");
+    ctx->instance_cull_uniforms.instance_words = glGetUniformLocation(pid, "instance_words");
 }
 
 static void
@@ -176,7 +215,7 @@ render_load_programs(RenderContext *ctx)
     ctx->programs[ShaderProgram_InstancedSimple] = program_create_from_files(1, 2, INSTANCED_SIMPLE_VERTEX_FILENAME, INSTANCED_SIMPLE_FRAG_FILENAME, LIGHT_FRAG_FILENAME);
     ctx->programs[ShaderProgram_Skybox] = program_create_from_files(1, 1, SKYBOX_VERTEX_FILENAME, SKYBOX_FRAG_FILENAME);
     ctx->programs[ShaderProgram_UI] = program_create_from_files(1, 1, UI_VERTEX_FILENAME, UI_FRAG_FILENAME);
-    ctx->programs[ShaderProgram_Line] = program_create_from_files(1, 1, MAIN_VERTEX_FILENAME, LINE_FRAG_FILENAME);
+    ctx->programs[ShaderProgram_DebugDraw] = program_create_from_files(1, 1, DEBUG_VERTEX_FILENAME, DEBUG_FRAG_FILENAME);
     ctx->programs[ShaderProgram_HDR] = 
         program_create_from_files(1, 1, HDR_VERTEX_FILENAME, HDR_FRAG_FILENAME);
     ctx->programs[ShaderProgram_SunDepth] = program_create_from_files(1, 1, SUN_DEPTH_VERTEX_FILENAME, SUN_DEPTH_FRAG_FILENAME);
@@ -190,7 +229,10 @@ render_load_programs(RenderContext *ctx)
 static void
 render_prepass(RenderContext *ctx, i32 window_width, i32 window_height)
 {
+    ctx->frame++;
     get_frustum_planes(ctx);
+    render_compute_light_proj_view(ctx);
+    transient_begin_frame(&ctx->transient);
     
     if(FLAG_IS_SET(ctx->flags, RENDER_WINDOW_RESIZED))
     {
@@ -203,6 +245,8 @@ render_prepass(RenderContext *ctx, i32 window_width, i32 window_height)
         glBindRenderbuffer(GL_RENDERBUFFER, ctx->rbo_depth);
         glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT, (f32)window_width, (f32)window_height);
         
+        pick_resize(&ctx->pick, window_width, window_height);
+        
         assert(glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE);
         
         FLAG_NEGATE(ctx->flags, RENDER_WINDOW_RESIZED);
@@ -267,44 +311,111 @@ static void
 get_frustum_planes(RenderContext *ctx)
 {
     Mat4 vp = mul(ctx->proj, ctx->view);
-    Plane *planes = ctx->cam.frustum_planes;
-    
-    planes[FrustumPlane_Left].normal.x = vp.a[0][3] + vp.a[0][0];
-    planes[FrustumPlane_Left].normal.y = vp.a[1][3] + vp.a[1][0];
-    planes[FrustumPlane_Left].normal.z = vp.a[2][3] + vp.a[2][0];
-    planes[FrustumPlane_Left].d = vp.a[3][3] + vp.a[3][0];
-    
-    planes[FrustumPlane_Right].normal.x = vp.a[0][3] - vp.a[0][0];
-    planes[FrustumPlane_Right].normal.y = vp.a[1][3] - vp.a[1][0];
-    planes[FrustumPlane_Right].normal.z = vp.a[2][3] - vp.a[2][0];
-    planes[FrustumPlane_Right].d = vp.a[3][3] - vp.a[3][0];
-    
-    planes[FrustumPlane_Bottom].normal.x = vp.a[0][3] + vp.a[0][1];
-    planes[FrustumPlane_Bottom].normal.y = vp.a[1][3] + vp.a[1][1];
-    planes[FrustumPlane_Bottom].normal.z = vp.a[2][3] + vp.a[2][1];
-    planes[FrustumPlane_Bottom].d = vp.a[3][3] + vp.a[3][1];
-    
-    planes[FrustumPlane_Top].normal.x = vp.a[0][3] - vp.a[0][1];
-    planes[FrustumPlane_Top].normal.y = vp.a[1][3] - vp.a[1][1];
-    planes[FrustumPlane_Top].normal.z = vp.a[2][3] - vp.a[2][1];
-    planes[FrustumPlane_Top].d = vp.a[3][3] - vp.a[3][1];
+    frustum_planes_from_matrix(vp, ctx->cam.frustum_planes);
+}
+
+static void
+render_compute_light_proj_view(RenderContext *ctx)
+{
+    f32 sun_away = 2.0f;
+    Vec3 sun_pos = scale(negate(ctx->sun.direction), sun_away);
+    Mat4 sun_view = look_at(add(noz(negate(sun_pos)), sun_pos), sun_pos, Vec3(0.0f, 1.0f, 0.0f));
+    Mat4 ort = create_orthographic(-10.0f, 10.0f, -10.0f, 10.0f, -10.0f, 10.0f);
+    ctx->light_proj_view = mul(ort, sun_view);
+}
+
+// NOTE: Gathers the bounds of every mesh in the queue and tests them all against
+// the camera and the sun frustum before anything is submitted. Meshes without
+// a hitbox get a sphere that always passes.
+static void
+render_cull_queue(RenderQueue *queue, RenderContext *ctx)
+{
+    CullSet *cull = &ctx->cull;
+    cull_reset(cull);
+    memcpy(cull->planes[CullView_Main], ctx->cam.frustum_planes, sizeof(ctx->cam.frustum_planes));
+    frustum_planes_from_matrix(ctx->light_proj_view, cull->planes[CullView_Shadow]);
     
-    planes[FrustumPlane_Near].normal.x = vp.a[0][3] + vp.a[0][2];
-    planes[FrustumPlane_Near].normal.y = vp.a[1][3] + vp.a[1][2];
-    planes[FrustumPlane_Near].normal.z = vp.a[2][3] + vp.a[2][2];
-    planes[FrustumPlane_Near].d = vp.a[3][3] + vp.a[3][2];
+    RenderHeader *header = (RenderHeader *)queue->entries;
+    for(u32 i = 0; i < queue->len; i++)
+    {
+        Model *model = NULL;
+        Mat4 transform = Mat4(1.0f);
+        u32 *cull_index = NULL;
+        
+        if(header->type == RenderType_RenderEntryModel)
+        {
+            RenderEntryModel *entry = (RenderEntryModel *)header;
+            transform = entry->transform;
+            model = entry->model;
+            cull_index = &entry->cull_index;
+        }
+        else if(header->type == RenderType_RenderEntryModelNewest)
+        {
+            RenderEntryModelNewest *entry = (RenderEntryModelNewest *)header;
+            transform = entry->transform;
+            model = entry->model;
+            cull_index = &entry->cull_index;
+        }
+        
+        if(model)
+        {
+            *cull_index = cull_push_model(cull, model, transform);
+        }
+        
+        header = (RenderHeader *)((u8 *)header + header->size);
+    }
     
-    planes[FrustumPlane_Far].normal.x = vp.a[0][3] - vp.a[0][2];
-    planes[FrustumPlane_Far].normal.y = vp.a[1][3] - vp.a[1][2];
-    planes[FrustumPlane_Far].normal.z = vp.a[2][3] - vp.a[2][2];
-    planes[FrustumPlane_Far].d = vp.a[3][3] - vp.a[3][2];
+    cull_run(cull, ctx->jobs);
+}
+
+// NOTE: Runs after render_cull_queue, the occluders only make it into the buffer
+// when they passed the frustum test themselves.
+static void
+render_occlusion_cull(RenderQueue *queue, RenderContext *ctx)
+{
+    f64 start = glfwGetTime();
+    OcclusionBuffer *occlusion = &ctx->occlusion;
+    occlusion_begin(occlusion, mul(ctx->proj, ctx->view));
     
-    for(u32 i = 0; i < FrustumPlane_ElementCount; i++)
+    RenderHeader *header = (RenderHeader *)queue->entries;
+    for(u32 i = 0; i < queue->len; i++)
     {
-        f32 nozf = inverse_len(planes[i].normal);
-        planes[i].normal = scale(planes[i].normal, nozf);
-        planes[i].d *= nozf;
+        Model *model = NULL;
+        Mat4 transform = Mat4(1.0f);
+        u32 cull_index = 0;
+        
+        if(header->type == RenderType_RenderEntryModel)
+        {
+            RenderEntryModel *entry = (RenderEntryModel *)header;
+            transform = entry->transform;
+            model = entry->model;
+            cull_index = entry->cull_index;
+        }
+        else if(header->type == RenderType_RenderEntryModelNewest)
+        {
+            RenderEntryModelNewest *entry = (RenderEntryModelNewest *)header;
+            transform = entry->transform;
+            model = entry->model;
+            cull_index = entry->cull_index;
+        }
+        
+        if(model && FLAG_IS_SET(model->flags, MODEL_FLAGS_OCCLUDER))
+        {
+            for(u32 mesh = 0; mesh < model->meshes_len; mesh++)
+            {
+                if(cull_visible(&ctx->cull, CullView_Main, cull_index + mesh))
+                {
+                    occlusion_push_mesh(occlusion, model->meshes + mesh, transform);
+                }
+            }
+        }
+        
+        header = (RenderHeader *)((u8 *)header + header->size);
     }
+    
+    occlusion_rasterize(occlusion, ctx->jobs);
+    occlusion_cull(occlusion, &ctx->cull, CullView_Main, ctx->jobs);
+    occlusion->last_run_time = glfwGetTime() - start;
 }
 
 static void
@@ -338,113 +449,6 @@ render_draw_queue(RenderQueue *queue, RenderContext *ctx)
                 
                 header = (RenderHeader *)(++entry);
             } break;
-            case RenderType_RenderEntryLine:
-            {
-                // TODO(mateusz): Here and in the RenderEntryHitbox we are creating
-                // and destroying a new vao for each draw call, that's not really optimal.
-                // We maybe could use some transient gpu memory that's passed around with
-                // the RenderContext??
-                GLuint program_id = ctx->programs[ShaderProgram_Line].id;
-                auto uniloc = &ctx->program_uniforms[ShaderProgram_Line];
-                glUseProgram(program_id);
-                
-                GLuint vao = 0;
-                glGenVertexArrays(1, &vao);
-                glBindVertexArray(vao);
-                
-                GLuint vbo = 0;
-                glGenBuffers(1, &vbo);
-                glBindBuffer(GL_ARRAY_BUFFER, vbo);
-                
-                RenderEntryLine *entry = (RenderEntryLine *)header;
-                glBufferData(GL_ARRAY_BUFFER, sizeof(entry->line), &entry->line, GL_STATIC_DRAW);
-                
-                glVertexAttribPointer(0, 3, GL_FLOAT, GL_TRUE, 3 * sizeof(float), nullptr);
-                glEnableVertexAttribArray(0);
-                
-                opengl_set_uniform(uniloc->view, ctx->view);
-                opengl_set_uniform(uniloc->proj, ctx->proj);
-                // TODO(mateusz): Write a diffrent line shader so we don't have to
-                // cover ourselvs with setting the model to identify.
-                opengl_set_uniform(uniloc->model, Mat4(1.0f));
-                
-                glDrawArrays(GL_LINES, 0, 2);
-                
-                glDeleteVertexArrays(1, &vao);
-                glDeleteBuffers(1, &vbo);
-                
-                header = (RenderHeader *)(++entry);
-            }break;
-            case RenderType_RenderEntryHitbox:
-            {
-                GLuint program_id = ctx->programs[ShaderProgram_Line].id;
-                auto uniloc = &ctx->program_uniforms[ShaderProgram_Line];
-                glUseProgram(program_id);
-                
-                opengl_set_uniform(uniloc->view, ctx->view);
-                opengl_set_uniform(uniloc->proj, ctx->proj);
-                
-                RenderEntryHitbox *entry = (RenderEntryHitbox *)header;
-                for(u32 i = 0; i < entry->hbox_len; i++)
-                {
-                    Hitbox *hbox = entry->hbox + i;
-                    Vec3 vertices[VERTICES_PER_CUBE] = {
-                        hbox->refpoint,
-                        add(hbox->refpoint, Vec3(hbox->size.x, 0.0f, 0.0f)), // x
-                        add(hbox->refpoint, Vec3(0.0f, hbox->size.y, 0.0f)), // y
-                        add(hbox->refpoint, Vec3(0.0f, 0.0f, hbox->size.z)), // z
-                        add(hbox->refpoint, Vec3(hbox->size.x, hbox->size.y, 0.0f)), // xy
-                        add(hbox->refpoint, Vec3(0.0f, hbox->size.y, hbox->size.z)), // yz
-                        add(hbox->refpoint, Vec3(hbox->size.x, 0.0f, hbox->size.z)), // xz
-                        add(hbox->refpoint, hbox->size),
-                    };
-                    
-                    u32 indicies[INDICES_PER_CUBE] = {
-                        0, 1, // start to x
-                        1, 4, // x to xy
-                        4, 2, // xy to y
-                        2, 0, // y to start
-                        
-                        0, 3, // start to z
-                        1, 6, // x to xz
-                        4, 7, // xy to xyz
-                        2, 5, // y to yz
-                        
-                        3, 6, // z to xz
-                        6, 7, // xz to xyz
-                        7, 5, // xyz to yz
-                        5, 3, // yz to 
-                    };
-                    
-                    GLuint hbox_vao, hbox_vbo, hbox_ebo = 0;
-                    
-                    glGenVertexArrays(1, &hbox_vao);
-                    glGenBuffers(1, &hbox_vbo);
-                    glGenBuffers(1, &hbox_ebo);
-                    
-                    glBindVertexArray(hbox_vao);
-                    glBindBuffer(GL_ARRAY_BUFFER, hbox_vbo);
-                    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, hbox_ebo);
-                    
-                    glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
-                    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indicies), indicies, GL_STATIC_DRAW);
-                    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(f32), nullptr);
-                    glEnableVertexAttribArray(0);
-                    
-                    Mat4 transform = scale(Mat4(1.0f), entry->size);
-                    transform = rotate_quat(transform, entry->orientation);
-                    transform = translate(transform, entry->position);
-                    opengl_set_uniform(uniloc->model, transform);
-                    
-                    glDrawElements(GL_LINES, ARRAY_LEN(indicies), GL_UNSIGNED_INT, NULL);
-                    
-                    glDeleteVertexArrays(1, &hbox_vao);
-                    glDeleteBuffers(1, &hbox_vbo);
-                    glDeleteBuffers(1, &hbox_ebo);
-                }
-                
-                header = (RenderHeader *)(++entry);
-            }break;
             case RenderType_RenderEntryUI:
             {
                 GLuint program_id = ctx->programs[ShaderProgram_UI].id;
@@ -462,6 +466,8 @@ render_draw_queue(RenderQueue *queue, RenderContext *ctx)
                 opengl_set_uniform(uniloc->transform, transform);
                 opengl_set_uniform(uniloc->ortho, ctx->ortho);
                 
+                // NOTE: The crosshair would cover whatever is picked in the middle of the screen
+                glColorMaski(1, GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
                 glEnable(GL_BLEND);
                 
                 glBindVertexArray(entry->element.vao);
@@ -472,6 +478,7 @@ render_draw_queue(RenderQueue *queue, RenderContext *ctx)
                 glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
                 
                 glDisable(GL_BLEND);
+                glColorMaski(1, GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
                 // NOTE(mateusz): I don't know why this was here, but i guess I did a hack for it.
                 // I broke the rendering of UI elements on top of the skybox, now it works.
                 //glDisable(GL_DEPTH_TEST);
@@ -523,25 +530,33 @@ render_draw_queue(RenderQueue *queue, RenderContext *ctx)
                 
                 opengl_set_uniform(uniloc->show_normal_map, FLAG_IS_SET(ctx->flags, RENDER_SHOW_NORMAL_MAP));
                 opengl_set_uniform(uniloc->use_mapped_normals, FLAG_IS_SET(ctx->flags, RENDER_USE_MAPPED_NORMALS));
+                opengl_set_uniform(uniloc->use_baked_light, FLAG_IS_SET(ctx->flags, RENDER_BAKED_LIGHT));
+                glUniform1i(uniloc->lightmap, 5);
                 
                 RenderEntryModelNewest *entry = (RenderEntryModelNewest *)header;
                 
-                Mat4 transform = scale(Mat4(1.0f), entry->size);
-                transform = rotate_quat(transform, entry->orientation);
-                transform = translate(transform, entry->position);
-                opengl_set_uniform(uniloc->model, transform);
+                opengl_set_uniform(uniloc->model, entry->transform);
+                // NOTE: Uploaded transposed, the shader takes the upper 3x3 as is
+                opengl_set_uniform(uniloc->normal_matrix, entry->inversed, GL_TRUE);
                 
                 Model *model = entry->model;
                 for(u32 i = 0; i < model->meshes_len; i++)
                 {
-                    if(!hitbox_in_frustum(model->hitboxes + i, ctx->cam.frustum_planes, transform))
+                    if(!cull_visible(&ctx->cull, CullView_Main, entry->cull_index + i))
                     {
                         continue;
                     }
                     glBindVertexArray(model->meshes[i].vao);
+                    opengl_set_uniform(uniloc->object_id, entry->pick_id ? entry->pick_id | (i << PICK_MESH_SHIFT) : 0);
                     
                     drawn++;
                     Mesh *mesh = &model->meshes[i];
+                    opengl_set_uniform(uniloc->use_lightmap, (i32)(mesh->lightmap != 0));
+                    if(mesh->lightmap)
+                    {
+                        glActiveTexture(GL_TEXTURE5);
+                        glBindTexture(GL_TEXTURE_2D, mesh->lightmap);
+                    }
                     Material *material = NULL;
                     for(u32 i = 0; i < model->materials_len; i++)
                     {
@@ -587,7 +602,20 @@ render_draw_queue(RenderQueue *queue, RenderContext *ctx)
                         opengl_set_uniform(uniloc->material_specular_exponent, 1.0f);
                     }
                     
+                    // NOTE: Only a query from last frame, with GL_QUERY_NO_WAIT it draws
+                    // anyway if the result isn't back yet.
+                    OcclusionQuery *query = entry->queries + i;
+                    bool conditional = FLAG_IS_SET(ctx->flags, RENDER_OCCLUSION_QUERIES) &&
+                        query->frame != 0 && query->frame + 1 == ctx->frame;
+                    if(conditional)
+                    {
+                        glBeginConditionalRender(query->query, GL_QUERY_NO_WAIT);
+                    }
                     glDrawElements(GL_TRIANGLES, mesh->indices_len, GL_UNSIGNED_INT, NULL);
+                    if(conditional)
+                    {
+                        glEndConditionalRender();
+                    }
                 }
                 
                 header = (RenderHeader *)(++entry);
@@ -626,20 +654,31 @@ render_draw_queue(RenderQueue *queue, RenderContext *ctx)
                 
                 opengl_set_uniform(program_id, "show_normal_map", FLAG_IS_SET(ctx->flags, RENDER_SHOW_NORMAL_MAP));
                 opengl_set_uniform(program_id, "use_mapped_normals", FLAG_IS_SET(ctx->flags, RENDER_USE_MAPPED_NORMALS));
+                opengl_set_uniform(uniloc->use_baked_light, FLAG_IS_SET(ctx->flags, RENDER_BAKED_LIGHT));
+                glUniform1i(uniloc->lightmap, 5);
                 
                 RenderEntryModel *entry = (RenderEntryModel *)header;
                 
-                Mat4 transform = scale(Mat4(1.0f), entry->size);
-                transform = rotate_quat(transform, entry->orientation);
-                transform = translate(transform, entry->position);
-                opengl_set_uniform(program_id, "model", transform);
+                opengl_set_uniform(program_id, "model", entry->transform);
+                opengl_set_uniform(uniloc->normal_matrix, entry->inversed, GL_TRUE);
                 
                 Model *model = entry->model;
                 for(u32 i = 0; i < model->meshes_len; i++)
                 {
+                    if(!cull_visible(&ctx->cull, CullView_Main, entry->cull_index + i))
+                    {
+                        continue;
+                    }
                     glBindVertexArray(model->meshes[i].vao);
+                    opengl_set_uniform(uniloc->object_id, entry->pick_id ? entry->pick_id | (i << PICK_MESH_SHIFT) : 0);
                     
                     Mesh *mesh = &model->meshes[i];
+                    opengl_set_uniform(uniloc->use_lightmap, (i32)(mesh->lightmap != 0));
+                    if(mesh->lightmap)
+                    {
+                        glActiveTexture(GL_TEXTURE5);
+                        glBindTexture(GL_TEXTURE_2D, mesh->lightmap);
+                    }
                     Material *material = NULL;
                     for(u32 i = 0; i < model->materials_len; i++)
                     {
@@ -685,7 +724,20 @@ render_draw_queue(RenderQueue *queue, RenderContext *ctx)
                         opengl_set_uniform(program_id, "material.specular_exponent", 1.0f);
                     }
                     
+                    // NOTE: Only a query from last frame, with GL_QUERY_NO_WAIT it draws
+                    // anyway if the result isn't back yet.
+                    OcclusionQuery *query = entry->queries + i;
+                    bool conditional = FLAG_IS_SET(ctx->flags, RENDER_OCCLUSION_QUERIES) &&
+                        query->frame != 0 && query->frame + 1 == ctx->frame;
+                    if(conditional)
+                    {
+                        glBeginConditionalRender(query->query, GL_QUERY_NO_WAIT);
+                    }
                     glDrawElements(GL_TRIANGLES, mesh->indices_len, GL_UNSIGNED_INT, NULL);
+                    if(conditional)
+                    {
+                        glEndConditionalRender();
+                    }
                 }
                 
                 header = (RenderHeader *)(++entry);
@@ -726,40 +778,22 @@ render_draw_queue(RenderQueue *queue, RenderContext *ctx)
                 opengl_set_uniform(program_id, "use_mapped_normals", FLAG_IS_SET(ctx->flags, RENDER_USE_MAPPED_NORMALS));
                 
                 RenderEntryModelInstanced *entry = (RenderEntryModelInstanced *)header;
-                u64 models_size = sizeof(Mat4) * entry->instances_count;
-                Mat4 *models = (Mat4 *)malloc(models_size);
-                for(u32 i = 0; i < entry->instances_count; i++)
+                EntityInstanced *entity = entry->entity;
+                entity_instanced_update(entity, ctx->jobs);
+                
+                GLuint *vaos = entity->vaos;
+                u32 instances_count = entity->instances_count;
+                bool culled = false;
+                if(FLAG_IS_SET(ctx->flags, RENDER_GPU_CULL_INSTANCES))
                 {
-                    models[i] = Mat4(1.0f);
-                    models[i] = scale(models[i], entry->sizes[i]);
-                    //models[i] = rotate_quat(models[i], entry->orientations[i]);
-                    models[i] = translate(models[i], entry->positions[i]);
+                    culled = render_cull_instances(ctx, entity, &vaos, &instances_count);
+                    glUseProgram(program_id);
                 }
                 
-                GLuint instance_vbo = 0;
-                glGenBuffers(1, &instance_vbo);
-                glBindBuffer(GL_ARRAY_BUFFER, instance_vbo);
-                // TODO(mateusz): GL_STREAM_DRAW seems like a good candidate...
-                glBufferData(GL_ARRAY_BUFFER, models_size, models, GL_STATIC_DRAW);
-
-                Model *model = entry->model;
+                Model *model = entity->model;
                 for(u32 i = 0; i < model->meshes_len; i++)
                 {
-                    glBindVertexArray(model->meshes[i].vao);
-
-                    glEnableVertexAttribArray(3);
-                    glVertexAttribPointer(3, 4, GL_FLOAT, GL_FALSE, sizeof(Mat4), (void *)(0x0));
-                    glEnableVertexAttribArray(4);
-                    glVertexAttribPointer(4, 4, GL_FLOAT, GL_FALSE, sizeof(Mat4), (void *)(sizeof(Vec4)));
-                    glEnableVertexAttribArray(5);
-                    glVertexAttribPointer(5, 4, GL_FLOAT, GL_FALSE, sizeof(Mat4), (void *)(2 * sizeof(Vec4)));
-                    glEnableVertexAttribArray(6);
-                    glVertexAttribPointer(6, 4, GL_FLOAT, GL_FALSE, sizeof(Mat4), (void *)(3 * sizeof(Vec4)));
-
-                    glVertexAttribDivisor(3, 1);
-                    glVertexAttribDivisor(4, 1);
-                    glVertexAttribDivisor(5, 1);
-                    glVertexAttribDivisor(6, 1);
+                    glBindVertexArray(vaos[i]);
                     
                     Mesh *mesh = &model->meshes[i];
                     Material *material = NULL;
@@ -807,17 +841,18 @@ render_draw_queue(RenderQueue *queue, RenderContext *ctx)
                         opengl_set_uniform(program_id, "material.specular_exponent", 1.0f);
                     }
                     
-                    glDrawElementsInstanced(GL_TRIANGLES, mesh->indices_len, GL_UNSIGNED_INT, 0, entry->instances_count);
+                    if(culled && ctx->instance_cull_compute)
+                    {
+                        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, entity->culling.indirect_buffer);
+                        glDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT,
+                                               (void *)(i * sizeof(DrawElementsIndirectCommand)));
+                    }
+                    else
+                    {
+                        glDrawElementsInstanced(GL_TRIANGLES, mesh->indices_len, GL_UNSIGNED_INT, 0, instances_count);
+                    }
                 }
                 
-                free(models);
-                glDeleteBuffers(1, &instance_vbo);
-
-#if 0
-                free(entry->positions);
-                free(entry->sizes);
-                free(entry->orientations);
-#endif
                 header = (RenderHeader *)(++entry);
             }break;
         }
@@ -825,130 +860,991 @@ render_draw_queue(RenderQueue *queue, RenderContext *ctx)
 }
 
 static void
-render_draw_sun_depth(RenderQueue *queue, RenderContext *ctx)
+render_draw_debug(DebugDraw *debug, RenderContext *ctx)
 {
-    glViewport(0, 0, ctx->shadow_map_height * ctx->aspect_ratio, ctx->shadow_map_height);
-    glBindFramebuffer(GL_FRAMEBUFFER, ctx->sun_fbo);
-    glClear(GL_DEPTH_BUFFER_BIT);
+    if(debug->vertices_len == 0 && debug->boxes_len == 0)
+    {
+        return;
+    }
     
-    glCullFace(GL_FRONT);
+    GLuint program_id = ctx->programs[ShaderProgram_DebugDraw].id;
+    auto uniloc = &ctx->program_uniforms[ShaderProgram_DebugDraw];
+    glUseProgram(program_id);
     
-    GLuint program_id = ctx->programs[ShaderProgram_SunDepth].id;
-    auto uniloc = &ctx->program_uniforms[ShaderProgram_SunDepth];
+    opengl_set_uniform(uniloc->view, ctx->view);
+    opengl_set_uniform(uniloc->proj, ctx->proj);
+    
+    TransientAllocation lines = transient_push(&ctx->transient, debug->vertices,
+                                               debug->vertices_len * sizeof(DebugVertex), sizeof(f32));
+    TransientAllocation boxes = transient_push(&ctx->transient, debug->boxes,
+                                               debug->boxes_len * sizeof(DebugBox), sizeof(Vec4));
+    transient_flush(&ctx->transient);
+    
+    if(debug->vertices_len && lines.ptr)
+    {
+        glBindVertexArray(ctx->debug_line_vao);
+        glBindBuffer(GL_ARRAY_BUFFER, ctx->transient.buffer);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(DebugVertex),
+                              (void *)(lines.offset + offsetof(DebugVertex, position)));
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(DebugVertex),
+                              (void *)(lines.offset + offsetof(DebugVertex, color)));
+        
+        // NOTE: Lines are already in world space, the instance transform
+        // attributes are disabled on this vao so they read the constant identity.
+        for(u32 i = 0; i < 4; i++)
+        {
+            Vec4 column = Mat4(1.0f).columns[i];
+            glVertexAttrib4f(2 + i, column.x, column.y, column.z, column.w);
+        }
+        
+        glDrawArrays(GL_LINES, 0, debug->vertices_len);
+    }
+    
+    if(debug->boxes_len && boxes.ptr)
+    {
+        glBindVertexArray(ctx->debug_box_vao);
+        glBindBuffer(GL_ARRAY_BUFFER, ctx->transient.buffer);
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(DebugBox),
+                              (void *)(boxes.offset + offsetof(DebugBox, color)));
+        for(u32 i = 0; i < 4; i++)
+        {
+            glVertexAttribPointer(2 + i, 4, GL_FLOAT, GL_FALSE, sizeof(DebugBox),
+                                  (void *)(boxes.offset + offsetof(DebugBox, transform) + i * sizeof(Vec4)));
+        }
+        
+        glDrawElementsInstanced(GL_LINES, INDICES_PER_CUBE, GL_UNSIGNED_INT, NULL, debug->boxes_len);
+    }
+    
+    glBindVertexArray(0);
+}
+
+// NOTE: Runs right after the main pass, so the whole scene's depth is the occluder.
+// Every frustum visible mesh with a hitbox gets a query around its (slightly grown)
+// hitbox and the next frame draws it under conditional render. Boxes the camera
+// could be inside of are skipped, those meshes just draw unconditionally.
+static void
+render_issue_occlusion_queries(RenderQueue *queue, RenderContext *ctx)
+{
+    GLuint program_id = ctx->programs[ShaderProgram_DebugDraw].id;
+    auto uniloc = &ctx->program_uniforms[ShaderProgram_DebugDraw];
     glUseProgram(program_id);
+    opengl_set_uniform(uniloc->view, ctx->view);
+    opengl_set_uniform(uniloc->proj, ctx->proj);
     
-    f32 sun_away = 2.0f;
-    Vec3 sun_pos = scale(negate(ctx->sun.direction), sun_away);
-    Mat4 sun_view = look_at(add(noz(negate(sun_pos)), sun_pos), sun_pos, Vec3(0.0f, 1.0f, 0.0f));
-    Mat4 ort = create_orthographic(-10.0f, 10.0f, -10.0f, 10.0f, -10.0f, 10.0f);
-    Mat4 light_proj_view = mul(ort, sun_view);
-    ctx->light_proj_view = light_proj_view;
-    opengl_set_uniform(uniloc->light_proj_view, light_proj_view);
+    glBindVertexArray(ctx->query_box_vao);
+    glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+    glDepthMask(GL_FALSE);
+    glDepthFunc(GL_LEQUAL);
     
+    CullSet *cull = &ctx->cull;
     RenderHeader *header = (RenderHeader *)queue->entries;
     for(u32 i = 0; i < queue->len; i++)
     {
-        switch(header->type)
+        Model *model = NULL;
+        OcclusionQuery *queries = NULL;
+        Mat4 transform = Mat4(1.0f);
+        u32 cull_index = 0;
+        
+        if(header->type == RenderType_RenderEntryModel)
         {
-            case RenderType_RenderEntryModel:
+            RenderEntryModel *entry = (RenderEntryModel *)header;
+            transform = entry->transform;
+            model = entry->model;
+            queries = entry->queries;
+            cull_index = entry->cull_index;
+        }
+        else if(header->type == RenderType_RenderEntryModelNewest)
+        {
+            RenderEntryModelNewest *entry = (RenderEntryModelNewest *)header;
+            transform = entry->transform;
+            model = entry->model;
+            queries = entry->queries;
+            cull_index = entry->cull_index;
+        }
+        
+        for(u32 m = 0; model && m < model->meshes_len; m++)
+        {
+            u32 index = cull_index + m;
+            if(m >= model->hitboxes_len || !cull_visible(cull, CullView_Main, index))
             {
-                RenderEntryModel *entry = (RenderEntryModel *)header;
+                continue;
+            }
+            
+            Vec3 center = Vec3(cull->x[index], cull->y[index], cull->z[index]);
+            f32 reach = cull->radius[index] + 2.0f * ctx->perspective_near;
+            Vec3 to_camera = sub(ctx->cam.position, center);
+            if(inner(to_camera, to_camera) < reach * reach)
+            {
+                continue;
+            }
+            
+            Hitbox *hbox = model->hitboxes + m;
+            f32 grow = 0.01f;
+            Mat4 box = scale(Mat4(1.0f), scale(hbox->size, 1.0f + 2.0f * grow));
+            box = translate(box, sub(hbox->refpoint, scale(hbox->size, grow)));
+            box = mul(transform, box);
+            for(u32 c = 0; c < 4; c++)
+            {
+                Vec4 column = box.columns[c];
+                glVertexAttrib4f(2 + c, column.x, column.y, column.z, column.w);
+            }
+            
+            glBeginQuery(ctx->occlusion_query_target, queries[m].query);
+            glDrawElements(GL_TRIANGLES, 36, GL_UNSIGNED_INT, NULL);
+            glEndQuery(ctx->occlusion_query_target);
+            queries[m].frame = ctx->frame;
+        }
+        
+        header = (RenderHeader *)((u8 *)header + header->size);
+    }
+    
+    glDepthFunc(GL_LESS);
+    glDepthMask(GL_TRUE);
+    glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+    glBindVertexArray(0);
+}
+
+static void
+instance_culling_prepare(InstanceCulling *culling, EntityInstanced *entity, bool compute)
+{
+    Model *model = entity->model;
+    
+    if(culling->indirect_buffer == 0)
+    {
+        model_bounding_sphere(model, &culling->bounds_center, &culling->bounds_radius);
+        culling->meshes_len = model->meshes_len;
+        
+        glGenBuffers(2, culling->culled_vbos);
+        glGenBuffers(1, &culling->indirect_buffer);
+        glGenQueries(2, culling->queries);
+        glGenVertexArrays(1, &culling->source_vao);
+        
+        DrawElementsIndirectCommand *commands = (DrawElementsIndirectCommand *)
+            malloc(model->meshes_len * sizeof(DrawElementsIndirectCommand));
+        memset(commands, 0, model->meshes_len * sizeof(DrawElementsIndirectCommand));
+        for(u32 i = 0; i < model->meshes_len; i++)
+        {
+            commands[i].count = model->meshes[i].indices_len;
+        }
+        glBindBuffer(GL_ARRAY_BUFFER, culling->indirect_buffer);
+        glBufferData(GL_ARRAY_BUFFER, model->meshes_len * sizeof(DrawElementsIndirectCommand),
+                     commands, GL_DYNAMIC_DRAW);
+        free(commands);
+    }
+    
+    u32 buffers = compute ? 1 : 2;
+    if(culling->capacity != entity->instances_capacity || culling->format != entity->format ||
+       culling->vaos[0] == NULL)
+    {
+        culling->capacity = entity->instances_capacity;
+        culling->format = entity->format;
+        culling->pending[0] = false;
+        culling->pending[1] = false;
+        culling->ready = -1;
+        
+        bool half = entity->format == InstanceFormat_Half;
+        for(u32 b = 0; b < buffers; b++)
+        {
+            glBindBuffer(GL_ARRAY_BUFFER, culling->culled_vbos[b]);
+            glBufferData(GL_ARRAY_BUFFER, culling->capacity * INSTANCE_CULLED_STRIDE, NULL, GL_DYNAMIC_COPY);
+            
+            // NOTE: Same setup as entity_instanced_update but with the culled stride
+            if(culling->vaos[b] == NULL)
+            {
+                culling->vaos[b] = (GLuint *)malloc(model->meshes_len * sizeof(GLuint));
+                glGenVertexArrays(model->meshes_len, culling->vaos[b]);
+            }
+            for(u32 i = 0; i < model->meshes_len; i++)
+            {
+                glBindVertexArray(culling->vaos[b][i]);
+                mesh_set_vertex_attributes(&model->meshes[i]);
                 
-                Mat4 transform = scale(Mat4(1.0f), entry->size);
-                transform = rotate_quat(transform, entry->orientation);
-                transform = translate(transform, entry->position);
-                opengl_set_uniform(uniloc->model, transform);
-                for(u32 i = 0; i < entry->model->meshes_len; i++)
+                glBindBuffer(GL_ARRAY_BUFFER, culling->culled_vbos[b]);
+                glEnableVertexAttribArray(3);
+                glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, INSTANCE_CULLED_STRIDE,
+                                      (void *)offsetof(InstanceData, position));
+                glEnableVertexAttribArray(4);
+                glVertexAttribPointer(4, 4, GL_SHORT, GL_TRUE, INSTANCE_CULLED_STRIDE,
+                                      (void *)offsetof(InstanceData, rotation));
+                glEnableVertexAttribArray(5);
+                if(half)
                 {
-                    Mesh *mesh = entry->model->meshes + i;
-                    glBindVertexArray(mesh->vao);
-                    glDrawElements(GL_TRIANGLES, mesh->indices_len, GL_UNSIGNED_INT, NULL);
+                    glVertexAttribPointer(5, 3, GL_HALF_FLOAT, GL_FALSE, INSTANCE_CULLED_STRIDE,
+                                          (void *)offsetof(InstanceDataHalf, scale));
                 }
-                
-                header = (RenderHeader *)(++entry);
-            }break;
-            case RenderType_RenderEntryModelNewest:
-            {
-                RenderEntryModelNewest *entry = (RenderEntryModelNewest *)header;
-                
-                Mat4 transform = scale(Mat4(1.0f), entry->size);
-                transform = rotate_quat(transform, entry->orientation);
-                transform = translate(transform, entry->position);
-                assert(glGetError() == GL_NO_ERROR);
-                opengl_set_uniform(uniloc->model, transform);
-                
-                for(u32 i = 0; i < entry->model->meshes_len; i++)
+                else
                 {
-                    Mesh *mesh = entry->model->meshes + i;
-                    glBindVertexArray(mesh->vao);
-                    glDrawElements(GL_TRIANGLES, mesh->indices_len, GL_UNSIGNED_INT, NULL);
+                    glVertexAttribPointer(5, 3, GL_FLOAT, GL_FALSE, INSTANCE_CULLED_STRIDE,
+                                          (void *)offsetof(InstanceData, scale));
                 }
                 
-                header = (RenderHeader *)(++entry);
-            }break;
-            default:
-            {
-                header = (RenderHeader *)((u8 *)header + header->size);
-            }break;
+                for(u32 location = 3; location < 6; location++)
+                {
+                    glVertexAttribDivisor(location, 1);
+                }
+            }
+        }
+        
+        if(!compute)
+        {
+            // NOTE: The transform feedback pass reads the raw instance words,
+            // half instances are 7 words so the last component is left out.
+            u32 stride = instance_format_stride(entity->format);
+            glBindVertexArray(culling->source_vao);
+            glBindBuffer(GL_ARRAY_BUFFER, entity->instance_vbo);
+            glEnableVertexAttribArray(0);
+            glVertexAttribIPointer(0, 4, GL_UNSIGNED_INT, stride, (void *)0);
+            glEnableVertexAttribArray(1);
+            glVertexAttribIPointer(1, half ? 3 : 4, GL_UNSIGNED_INT, stride, (void *)(4 * sizeof(u32)));
         }
+        
+        glBindVertexArray(0);
     }
-    
-    glCullFace(GL_BACK);
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
 }
 
-static void 
-render_end(RenderQueue *queue, RenderContext *ctx, i32 window_width, i32 window_height)
+// NOTE: Tests every instance's bounding sphere against the camera frustum on the GPU
+// and compacts the survivors. With compute shaders the counts go straight into the
+// indirect buffer and *visible_count is meaningless. The transform feedback fallback
+// never waits on its query, it hands back the newest buffer whose count has already
+// arrived and only culls into the other one once that one is free again. Returns
+// false when culling isn't available or no count has come back yet.
+static bool
+render_cull_instances(RenderContext *ctx, EntityInstanced *entity, GLuint **vaos, u32 *visible_count)
 {
-    render_prepass(ctx, window_width, window_height);
+    if(ctx->instance_cull_program == 0 || entity->instances_count == 0)
+    {
+        return false;
+    }
     
-    render_draw_sun_depth(queue, ctx);
+    InstanceCulling *culling = &entity->culling;
+    instance_culling_prepare(culling, entity, ctx->instance_cull_compute);
     
-    glViewport(0, 0, window_width, window_height);
-    glBindFramebuffer(GL_FRAMEBUFFER, ctx->hdr_fbo);
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-    render_draw_queue(queue, ctx);
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    GLuint program = ctx->instance_cull_program;
+    auto uniloc = &ctx->instance_cull_uniforms;
+    glUseProgram(program);
     
-    // TODO: Each element stores the same infomation in it's own vao and vbo,
-    // it would be faster and cheaper if each of them used the same one.
-    f32 vertices[] = {
-        -1.0f,  1.0f, 0.0f, 0.0f, 1.0f,
-        -1.0f, -1.0f, 0.0f, 0.0f, 0.0f,
-        1.0f,  1.0f, 0.0f, 1.0f, 1.0f,
-        1.0f, -1.0f, 0.0f, 1.0f, 0.0f,
-    };
+    Plane *planes = ctx->cam.frustum_planes;
+    f32 plane_data[4 * FrustumPlane_ElementCount];
+    for(u32 i = 0; i < FrustumPlane_ElementCount; i++)
+    {
+        plane_data[4 * i + 0] = planes[i].normal.x;
+        plane_data[4 * i + 1] = planes[i].normal.y;
+        plane_data[4 * i + 2] = planes[i].normal.z;
+        plane_data[4 * i + 3] = planes[i].d;
+    }
+    glUniform4fv(uniloc->frustum_planes, FrustumPlane_ElementCount, plane_data);
+    glUniform4f(uniloc->bounds, culling->bounds_center.x,
+                culling->bounds_center.y, culling->bounds_center.z, culling->bounds_radius);
+    glUniform1i(uniloc->half_scale, (i32)(entity->format == InstanceFormat_Half));
     
-    GLuint vao = 0;
-    GLuint vbo = 0;
+    if(ctx->instance_cull_compute)
+    {
+        glUniform1ui(uniloc->instances_count, entity->instances_count);
+        glUniform1ui(uniloc->instance_words, instance_format_stride(entity->format) / sizeof(u32));
+        
+        u32 zero = 0;
+        glBindBuffer(GL_DRAW_INDIRECT_BUFFER, culling->indirect_buffer);
+        glBufferSubData(GL_DRAW_INDIRECT_BUFFER, offsetof(DrawElementsIndirectCommand, instance_count),
+                        sizeof(zero), &zero);
+        
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, entity->instance_vbo);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 1, culling->culled_vbos[0]);
+        glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, culling->indirect_buffer);
+        glDispatchCompute((entity->instances_count + INSTANCE_CULL_GROUP_SIZE - 1) / INSTANCE_CULL_GROUP_SIZE, 1, 1);
+        // NOTE: The copy below reads the count the shader wrote, so it needs the update barrier too
+        glMemoryBarrier(GL_COMMAND_BARRIER_BIT | GL_VERTEX_ATTRIB_ARRAY_BARRIER_BIT |
+                        GL_BUFFER_UPDATE_BARRIER_BIT);
+        
+        // NOTE: Every mesh draws the same survivors, copy the count over on the GPU
+        for(u32 i = 1; i < culling->meshes_len; i++)
+        {
+            glCopyBufferSubData(GL_DRAW_INDIRECT_BUFFER, GL_DRAW_INDIRECT_BUFFER,
+                                offsetof(DrawElementsIndirectCommand, instance_count),
+                                i * sizeof(DrawElementsIndirectCommand) + offsetof(DrawElementsIndirectCommand, instance_count),
+                                sizeof(u32));
+        }
+        
+        *vaos = culling->vaos[0];
+        *visible_count = entity->instances_count;
+    }
+    else
+    {
+        for(u32 b = 0; b < 2; b++)
+        {
+            if(!culling->pending[b])
+            {
+                continue;
+            }
+            
+            GLuint available = 0;
+            glGetQueryObjectuiv(culling->queries[b], GL_QUERY_RESULT_AVAILABLE, &available);
+            if(available)
+            {
+                glGetQueryObjectuiv(culling->queries[b], GL_QUERY_RESULT, &culling->visible_counts[b]);
+                culling->pending[b] = false;
+                culling->ready = b;
+            }
+        }
+        
+        // NOTE: Never cull into the buffer being drawn, and skip a frame rather
+        // than overwrite one whose count is still on its way.
+        u32 write = culling->ready == 1 ? 0 : 1;
+        if(!culling->pending[write])
+        {
+            glEnable(GL_RASTERIZER_DISCARD);
+            glBindVertexArray(culling->source_vao);
+            glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, culling->culled_vbos[write]);
+            glBeginQuery(GL_TRANSFORM_FEEDBACK_PRIMITIVES_WRITTEN, culling->queries[write]);
+            glBeginTransformFeedback(GL_POINTS);
+            glDrawArrays(GL_POINTS, 0, entity->instances_count);
+            glEndTransformFeedback();
+            glEndQuery(GL_TRANSFORM_FEEDBACK_PRIMITIVES_WRITTEN);
+            glDisable(GL_RASTERIZER_DISCARD);
+            glBindVertexArray(0);
+            culling->pending[write] = true;
+        }
+        
+        if(culling->ready < 0)
+        {
+            return false;
+        }
+        
+        *vaos = culling->vaos[culling->ready];
+        *visible_count = culling->visible_counts[culling->ready];
+    }
     
-    glGenVertexArrays(1, &vao);
-    glBindVertexArray(vao);
-    glGenBuffers(1, &vbo);
-    glBindBuffer(GL_ARRAY_BUFFER, vbo);
+    return true;
+}
+
+// NOTE: Expands the sponge to the given level without the instances ever touching
+// the CPU. Every level is one transform feedback pass, each parent point becomes 20
+// children in the geometry shader. The passes ping-pong between the entity's instance
+// buffer and a scratch buffer, ordered so the last one lands in the instance buffer and
+// the entity's vaos stay valid. The entity is switched to gpu_generated, so
+// entity_instanced_update leaves the buffer alone from now on.
+static bool
+render_generate_sponge(RenderContext *ctx, EntityInstanced *entity, Vec3 position, Vec3 size,
+                       Quat rotation, u32 level)
+{
+    if(ctx->sponge_generate_program == 0)
+    {
+        return false;
+    }
     
-    glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(f32), nullptr);
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(f32), (void *)(3 * sizeof(f32)));
-    glEnableVertexAttribArray(1);
+    level = MIN(level, SPONGE_MAX_LEVEL);
+    u32 count = 1;
+    for(u32 i = 0; i < level; i++)
+    {
+        count *= SPONGE_CHILDREN;
+    }
+    u32 stride = sizeof(InstanceData);
+    
+    entity_instanced_set_format(entity, InstanceFormat_Float);
+    entity->gpu_generated = true;
+    entity->instances_count = count;
+    entity_instanced_update(entity, ctx->jobs);
+    
+    if(entity->instances_capacity < count)
+    {
+        glBindBuffer(GL_ARRAY_BUFFER, entity->instance_vbo);
+        glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)count * stride, NULL, GL_STATIC_DRAW);
+        entity->instances_capacity = count;
+    }
+    
+    u32 scratch_count = count / SPONGE_CHILDREN;
+    if(level > 0 && ctx->sponge_scratch_capacity < scratch_count)
+    {
+        glBindBuffer(GL_ARRAY_BUFFER, ctx->sponge_scratch_vbo);
+        glBufferData(GL_ARRAY_BUFFER, (GLsizeiptr)scratch_count * stride, NULL, GL_DYNAMIC_COPY);
+        ctx->sponge_scratch_capacity = scratch_count;
+    }
+    
+    // NOTE: Pass i (counting from 0) writes into the instance buffer when the number
+    // of passes left after it is even, the seed goes wherever the first pass reads from.
+    GLuint buffers[2] = { entity->instance_vbo, ctx->sponge_scratch_vbo };
+    u32 source = level % 2;
+    
+    u8 seed[sizeof(InstanceData)];
+    instance_write(seed, position, rotation, size, false);
+    glBindBuffer(GL_ARRAY_BUFFER, buffers[source]);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, stride, seed);
+    
+    glUseProgram(ctx->sponge_generate_program);
+    glBindVertexArray(ctx->sponge_generate_vao);
+    glEnable(GL_RASTERIZER_DISCARD);
+    
+    u32 parents = 1;
+    for(u32 i = 0; i < level; i++)
+    {
+        u32 destination = source ^ 1;
+        
+        glBindBuffer(GL_ARRAY_BUFFER, buffers[source]);
+        glEnableVertexAttribArray(0);
+        glVertexAttribIPointer(0, 4, GL_UNSIGNED_INT, stride, (void *)0);
+        glEnableVertexAttribArray(1);
+        glVertexAttribIPointer(1, 4, GL_UNSIGNED_INT, stride, (void *)(4 * sizeof(u32)));
+        
+        glBindBufferRange(GL_TRANSFORM_FEEDBACK_BUFFER, 0, buffers[destination], 0,
+                          (GLsizeiptr)parents * SPONGE_CHILDREN * stride);
+        glBeginTransformFeedback(GL_POINTS);
+        glDrawArrays(GL_POINTS, 0, parents);
+        glEndTransformFeedback();
+        
+        parents *= SPONGE_CHILDREN;
+        source = destination;
+    }
+    assert(source == 0 && parents == count);
+    
+    glDisable(GL_RASTERIZER_DISCARD);
+    glBindBufferBase(GL_TRANSFORM_FEEDBACK_BUFFER, 0, 0);
+    glBindVertexArray(0);
+    
+    entity->dirty_begin = 0;
+    entity->dirty_end = 0;
+    
+    return true;
+}
+
+static void
+render_draw_sun_depth(RenderQueue *queue, RenderContext *ctx)
+{
+    glViewport(0, 0, ctx->shadow_map_height * ctx->aspect_ratio, ctx->shadow_map_height);
+    glBindFramebuffer(GL_FRAMEBUFFER, ctx->sun_fbo);
+    glClear(GL_DEPTH_BUFFER_BIT);
+    
+    glCullFace(GL_FRONT);
+    
+    GLuint program_id = ctx->programs[ShaderProgram_SunDepth].id;
+    auto uniloc = &ctx->program_uniforms[ShaderProgram_SunDepth];
+    glUseProgram(program_id);
+    
+    opengl_set_uniform(uniloc->light_proj_view, ctx->light_proj_view);
+    
+    RenderHeader *header = (RenderHeader *)queue->entries;
+    for(u32 i = 0; i < queue->len; i++)
+    {
+        switch(header->type)
+        {
+            case RenderType_RenderEntryModel:
+            {
+                RenderEntryModel *entry = (RenderEntryModel *)header;
+                
+                opengl_set_uniform(uniloc->model, entry->transform);
+                for(u32 i = 0; i < entry->model->meshes_len; i++)
+                {
+                    if(!cull_visible(&ctx->cull, CullView_Shadow, entry->cull_index + i))
+                    {
+                        continue;
+                    }
+                    Mesh *mesh = entry->model->meshes + i;
+                    glBindVertexArray(mesh->vao);
+                    glDrawElements(GL_TRIANGLES, mesh->indices_len, GL_UNSIGNED_INT, NULL);
+                }
+                
+                header = (RenderHeader *)(++entry);
+            }break;
+            case RenderType_RenderEntryModelNewest:
+            {
+                RenderEntryModelNewest *entry = (RenderEntryModelNewest *)header;
+                
+                assert(glGetError() == GL_NO_ERROR);
+                opengl_set_uniform(uniloc->model, entry->transform);
+                
+                for(u32 i = 0; i < entry->model->meshes_len; i++)
+                {
+                    if(!cull_visible(&ctx->cull, CullView_Shadow, entry->cull_index + i))
+                    {
+                        continue;
+                    }
+                    Mesh *mesh = entry->model->meshes + i;
+                    glBindVertexArray(mesh->vao);
+                    glDrawElements(GL_TRIANGLES, mesh->indices_len, GL_UNSIGNED_INT, NULL);
+                }
+                
+                header = (RenderHeader *)(++entry);
+            }break;
+            default:
+            {
+                header = (RenderHeader *)((u8 *)header + header->size);
+            }break;
+        }
+    }
+    
+    glCullFace(GL_BACK);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+}
+
+static void 
+render_end(RenderQueue *queue, RenderContext *ctx, i32 window_width, i32 window_height)
+{
+    render_prepass(ctx, window_width, window_height);
+    render_cull_queue(queue, ctx);
+    if(FLAG_IS_SET(ctx->flags, RENDER_OCCLUSION_CULL))
+    {
+        render_occlusion_cull(queue, ctx);
+    }
+    
+    render_draw_sun_depth(queue, ctx);
+    
+    glViewport(0, 0, window_width, window_height);
+    glBindFramebuffer(GL_FRAMEBUFFER, ctx->hdr_fbo);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    bool id_buffer = FLAG_IS_SET(ctx->flags, RENDER_ID_BUFFER);
+    if(id_buffer)
+    {
+        GLenum attachments[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+        GLuint zero[4] = {};
+        glDrawBuffers(ARRAY_LEN(attachments), attachments);
+        glClearBufferuiv(GL_COLOR, 1, zero);
+    }
+    render_draw_queue(queue, ctx);
+    if(id_buffer)
+    {
+        glDrawBuffer(GL_COLOR_ATTACHMENT0);
+        pick_readback(&ctx->pick, window_width, window_height);
+    }
+    if(FLAG_IS_SET(ctx->flags, RENDER_OCCLUSION_QUERIES))
+    {
+        render_issue_occlusion_queries(queue, ctx);
+    }
+    render_draw_debug(&queue->debug, ctx);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
     
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     glUseProgram(ctx->programs[ShaderProgram_HDR].id);
     glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_2D, ctx->color_buffer);
     
+    glBindVertexArray(ctx->screen_quad_vao);
     glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
     
-    glDeleteBuffers(1, &vbo);
-    glDeleteVertexArrays(1, &vao);
+    transient_end_frame(&ctx->transient);
     
     //printf("drawn = %d\n", drawn);
     queue->len = 0;
     queue->size = 0;
+    queue->debug.vertices_len = 0;
+    queue->debug.boxes_len = 0;
     memset(queue->entries, 0, queue->max_size);
 }
 
+static void
+render_create_buffers(RenderContext *ctx)
+{
+    ctx->transient = transient_create();
+    ctx->cull = cull_create();
+    ctx->occlusion = occlusion_create();
+    
+    if(GLEW_VERSION_4_3 || (GLEW_ARB_compute_shader && GLEW_ARB_shader_storage_buffer_object))
+    {
+        ctx->instance_cull_program = program_create_compute(INSTANCE_CULL_COMPUTE_FILENAME);
+        ctx->instance_cull_compute = ctx->instance_cull_program != 0;
+    }
+    if(ctx->instance_cull_program == 0)
+    {
+        const char *varyings[] = { "culled_lo", "culled_hi" };
+        ctx->instance_cull_program = program_create_transform_feedback(INSTANCE_CULL_VERTEX_FILENAME,
+                                                                       INSTANCE_CULL_GEOMETRY_FILENAME,
+                                                                       varyings, ARRAY_LEN(varyings));
+    }
+    render_load_cull_uniforms(ctx);
+    
+    const char *sponge_varyings[] = { "child_lo", "child_hi" };
+    ctx->sponge_generate_program = program_create_transform_feedback(SPONGE_GENERATE_VERTEX_FILENAME,
+                                                                     SPONGE_GENERATE_GEOMETRY_FILENAME,
+                                                                     sponge_varyings, ARRAY_LEN(sponge_varyings));
+    glGenVertexArrays(1, &ctx->sponge_generate_vao);
+    glGenBuffers(1, &ctx->sponge_scratch_vbo);
+    
+    // NOTE: Attribute pointers on this one are respecified for every draw
+    // since the offset into the ring changes each time.
+    glGenVertexArrays(1, &ctx->transient_vao);
+    
+    f32 vertices[] = {
+        -1.0f,  1.0f, 0.0f, 0.0f, 1.0f,
+        -1.0f, -1.0f, 0.0f, 0.0f, 0.0f,
+        1.0f,  1.0f, 0.0f, 1.0f, 1.0f,
+        1.0f, -1.0f, 0.0f, 1.0f, 0.0f,
+    };
+    
+    glGenVertexArrays(1, &ctx->screen_quad_vao);
+    glBindVertexArray(ctx->screen_quad_vao);
+    glGenBuffers(1, &ctx->screen_quad_vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, ctx->screen_quad_vbo);
+    
+    glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(f32), nullptr);
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(f32), (void *)(3 * sizeof(f32)));
+    glEnableVertexAttribArray(1);
+    
+    Vec3 cube_vertices[VERTICES_PER_CUBE] = {
+        Vec3(0.0f, 0.0f, 0.0f),
+        Vec3(1.0f, 0.0f, 0.0f), // x
+        Vec3(0.0f, 1.0f, 0.0f), // y
+        Vec3(0.0f, 0.0f, 1.0f), // z
+        Vec3(1.0f, 1.0f, 0.0f), // xy
+        Vec3(0.0f, 1.0f, 1.0f), // yz
+        Vec3(1.0f, 0.0f, 1.0f), // xz
+        Vec3(1.0f, 1.0f, 1.0f),
+    };
+    
+    u32 cube_indicies[INDICES_PER_CUBE] = {
+        0, 1, // start to x
+        1, 4, // x to xy
+        4, 2, // xy to y
+        2, 0, // y to start
+        
+        0, 3, // start to z
+        1, 6, // x to xz
+        4, 7, // xy to xyz
+        2, 5, // y to yz
+        
+        3, 6, // z to xz
+        6, 7, // xz to xyz
+        7, 5, // xyz to yz
+        5, 3, // yz to 
+    };
+    
+    // NOTE: Both debug vaos only point into the transient buffer, so render_draw_debug
+    // respecifies the pointers every frame. The unit cube is the only static part.
+    glGenVertexArrays(1, &ctx->debug_line_vao);
+    glBindVertexArray(ctx->debug_line_vao);
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+    
+    glGenVertexArrays(1, &ctx->debug_box_vao);
+    glBindVertexArray(ctx->debug_box_vao);
+    
+    glGenBuffers(1, &ctx->debug_cube_vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, ctx->debug_cube_vbo);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(cube_vertices), cube_vertices, GL_STATIC_DRAW);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vec3), nullptr);
+    glEnableVertexAttribArray(0);
+    
+    glGenBuffers(1, &ctx->debug_cube_ebo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ctx->debug_cube_ebo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(cube_indicies), cube_indicies, GL_STATIC_DRAW);
+    
+    for(u32 i = 1; i < 6; i++)
+    {
+        glEnableVertexAttribArray(i);
+        glVertexAttribDivisor(i, 1);
+    }
+    
+    // NOTE: Same unit cube as solid triangles, wound outwards, for the occlusion
+    // query boxes. The transform comes from constant attributes so nothing else is enabled.
+    u32 cube_triangle_indicies[] = {
+        0, 2, 4, 0, 4, 1, // z = 0
+        3, 6, 7, 3, 7, 5, // z = 1
+        0, 3, 5, 0, 5, 2, // x = 0
+        1, 4, 7, 1, 7, 6, // x = 1
+        0, 1, 6, 0, 6, 3, // y = 0
+        2, 5, 7, 2, 7, 4, // y = 1
+    };
+    
+    glGenVertexArrays(1, &ctx->query_box_vao);
+    glBindVertexArray(ctx->query_box_vao);
+    glBindBuffer(GL_ARRAY_BUFFER, ctx->debug_cube_vbo);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vec3), nullptr);
+    glEnableVertexAttribArray(0);
+    
+    glGenBuffers(1, &ctx->query_cube_ebo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ctx->query_cube_ebo);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(cube_triangle_indicies), cube_triangle_indicies, GL_STATIC_DRAW);
+    
+    // NOTE: Conservative lets the driver answer early, any samples is just as correct
+    bool conservative = GLEW_VERSION_4_3 || GLEW_ARB_ES3_compatibility;
+    ctx->occlusion_query_target = conservative ? GL_ANY_SAMPLES_PASSED_CONSERVATIVE : GL_ANY_SAMPLES_PASSED;
+    
+    glBindVertexArray(0);
+}
+
+static TransientBuffer
+transient_create(u32 region_size)
+{
+    TransientBuffer result = {};
+    result.region_size = region_size;
+    result.persistent = GLEW_ARB_buffer_storage;
+    
+    glGenBuffers(1, &result.buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, result.buffer);
+    
+    if(result.persistent)
+    {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        u32 buffer_size = region_size * TRANSIENT_FRAMES;
+        glBufferStorage(GL_ARRAY_BUFFER, buffer_size, NULL, flags);
+        result.mapped = (u8 *)glMapBufferRange(GL_ARRAY_BUFFER, 0, buffer_size, flags);
+        assert(result.mapped);
+    }
+    else
+    {
+        // NOTE: Orphaning already gives us a fresh block of memory each frame,
+        // so one region is enough here and the driver does the rotating.
+        glBufferData(GL_ARRAY_BUFFER, region_size, NULL, GL_STREAM_DRAW);
+        result.staging = (u8 *)malloc(region_size);
+        assert(result.staging);
+    }
+    
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    
+    return result;
+}
+
+static void
+transient_destroy(TransientBuffer *transient)
+{
+    for(u32 i = 0; i < TRANSIENT_FRAMES; i++)
+    {
+        if(transient->fences[i])
+        {
+            glClientWaitSync(transient->fences[i], GL_SYNC_FLUSH_COMMANDS_BIT, ~0ull);
+            glDeleteSync(transient->fences[i]);
+            transient->fences[i] = 0;
+        }
+    }
+    
+    if(transient->persistent)
+    {
+        glBindBuffer(GL_ARRAY_BUFFER, transient->buffer);
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+    
+    glDeleteBuffers(1, &transient->buffer);
+    free(transient->staging);
+    
+    transient->buffer = 0;
+    transient->mapped = NULL;
+    transient->staging = NULL;
+}
+
+static void
+transient_begin_frame(TransientBuffer *transient)
+{
+    if(transient->overflow_bytes)
+    {
+        // NOTE: Last frame didn't fit, grow so the next one does. This stalls
+        // until the GPU is done with every region, but it only happens when
+        // the scene gets bigger than anything seen before.
+        u32 needed = transient->last_frame_bytes + transient->overflow_bytes;
+        u32 new_size = transient->region_size;
+        while(new_size < needed)
+        {
+            new_size *= 2;
+        }
+        
+        u32 peak = transient->peak_frame_bytes;
+        transient_destroy(transient);
+        *transient = transient_create(new_size);
+        transient->peak_frame_bytes = peak;
+    }
+    
+    transient->region_index = (transient->region_index + 1) % TRANSIENT_FRAMES;
+    
+    GLsync fence = transient->fences[transient->region_index];
+    if(fence)
+    {
+        GLenum wait = glClientWaitSync(fence, 0, 0);
+        while(wait != GL_ALREADY_SIGNALED && wait != GL_CONDITION_SATISFIED)
+        {
+            assert(wait != GL_WAIT_FAILED);
+            wait = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000);
+        }
+        glDeleteSync(fence);
+        transient->fences[transient->region_index] = 0;
+    }
+    
+    if(!transient->persistent)
+    {
+        glBindBuffer(GL_ARRAY_BUFFER, transient->buffer);
+        glBufferData(GL_ARRAY_BUFFER, transient->region_size, NULL, GL_STREAM_DRAW);
+    }
+    
+    transient->offset = 0;
+    transient->flushed = 0;
+    transient->frame_bytes = 0;
+    transient->overflow_bytes = 0;
+}
+
+static void
+transient_end_frame(TransientBuffer *transient)
+{
+    if(transient->persistent)
+    {
+        transient->fences[transient->region_index] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+    
+    transient->last_frame_bytes = transient->frame_bytes;
+    if(transient->frame_bytes > transient->peak_frame_bytes)
+    {
+        transient->peak_frame_bytes = transient->frame_bytes;
+    }
+}
+
+// NOTE: The returned offset is relative to the start of the buffer object so
+// it can be passed straight into glVertexAttribPointer/glDrawElements. When
+// the region is full ptr is NULL and the draw should be skipped.
+static TransientAllocation
+transient_alloc(TransientBuffer *transient, u32 size, u32 alignment)
+{
+    TransientAllocation result = {};
+    
+    u32 aligned = ((transient->offset + alignment - 1) / alignment) * alignment;
+    if(aligned + size > transient->region_size)
+    {
+        transient->overflow_bytes += size;
+        return result;
+    }
+    
+    u32 region_start = transient->persistent ? transient->region_index * transient->region_size : 0;
+    u8 *base = transient->persistent ? transient->mapped : transient->staging;
+    
+    result.ptr = base + region_start + aligned;
+    result.offset = region_start + aligned;
+    result.size = size;
+    
+    transient->frame_bytes += (aligned - transient->offset) + size;
+    transient->offset = aligned + size;
+    
+    return result;
+}
+
+static TransientAllocation
+transient_push(TransientBuffer *transient, const void *data, u32 size, u32 alignment)
+{
+    TransientAllocation result = transient_alloc(transient, size, alignment);
+    if(result.ptr)
+    {
+        memcpy(result.ptr, data, size);
+    }
+    
+    return result;
+}
+
+// NOTE: Makes everything allocated since the last flush visible to the GPU.
+// The persistent mapping is coherent so there is nothing to do there.
+static void
+transient_flush(TransientBuffer *transient)
+{
+    if(!transient->persistent && transient->offset > transient->flushed)
+    {
+        glBindBuffer(GL_ARRAY_BUFFER, transient->buffer);
+        glBufferSubData(GL_ARRAY_BUFFER, transient->flushed, transient->offset - transient->flushed,
+                        transient->staging + transient->flushed);
+    }
+    
+    transient->flushed = transient->offset;
+}
+
+static PickBuffer
+pick_create(i32 width, i32 height)
+{
+    PickBuffer result = {};
+    
+    glGenTextures(1, &result.id_buffer);
+    glBindTexture(GL_TEXTURE_2D, result.id_buffer);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    pick_resize(&result, width, height);
+    
+    glGenBuffers(PICK_FRAMES, result.pbos);
+    for(u32 i = 0; i < PICK_FRAMES; i++)
+    {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, result.pbos[i]);
+        glBufferData(GL_PIXEL_PACK_BUFFER, sizeof(u32), NULL, GL_STREAM_READ);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    
+    return result;
+}
+
+static void
+pick_resize(PickBuffer *pick, i32 width, i32 height)
+{
+    glBindTexture(GL_TEXTURE_2D, pick->id_buffer);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_R32UI, width, height, 0, GL_RED_INTEGER, GL_UNSIGNED_INT, NULL);
+}
+
+// NOTE: x and y are window coordinates, top left is the origin
+static void
+pick_request(PickBuffer *pick, i32 x, i32 y, bool clicked)
+{
+    pick->request_x = x;
+    pick->request_y = y;
+    pick->request_clicked = pick->request_clicked || clicked;
+    pick->request_pending = true;
+}
+
+// NOTE: Called with hdr_fbo bound, right after the main pass wrote the IDs
+static void
+pick_readback(PickBuffer *pick, i32 window_width, i32 window_height)
+{
+    // NOTE: Oldest first, so a later hover doesn't get overwritten by an earlier one
+    for(u32 i = 0; i < PICK_FRAMES; i++)
+    {
+        u32 index = (pick->index + i) % PICK_FRAMES;
+        GLsync fence = pick->fences[index];
+        if(!fence)
+        {
+            continue;
+        }
+        
+        GLenum wait = glClientWaitSync(fence, 0, 0);
+        assert(wait != GL_WAIT_FAILED);
+        if(wait != GL_ALREADY_SIGNALED && wait != GL_CONDITION_SATISFIED)
+        {
+            continue;
+        }
+        glDeleteSync(fence);
+        pick->fences[index] = 0;
+        
+        u32 id = 0;
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pick->pbos[index]);
+        glGetBufferSubData(GL_PIXEL_PACK_BUFFER, 0, sizeof(id), &id);
+        pick->hovered_id = id;
+        if(pick->pbo_clicked[index])
+        {
+            pick->clicked_id = id;
+            pick->click_ready = true;
+        }
+    }
+    
+    if(!pick->request_pending)
+    {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        return;
+    }
+    
+    if(pick->fences[pick->index])
+    {
+        // NOTE: The GPU is more than PICK_FRAMES behind, a click waits for the next frame
+        pick->readbacks_dropped++;
+        pick->request_pending = pick->request_clicked;
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        return;
+    }
+    
+    i32 x = pick->request_x;
+    i32 y = window_height - 1 - pick->request_y;
+    if(x >= 0 && x < window_width && y >= 0 && y < window_height)
+    {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, pick->pbos[pick->index]);
+        glReadBuffer(GL_COLOR_ATTACHMENT1);
+        glReadPixels(x, y, 1, 1, GL_RED_INTEGER, GL_UNSIGNED_INT, NULL);
+        glReadBuffer(GL_COLOR_ATTACHMENT0);
+        
+        pick->fences[pick->index] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        pick->pbo_clicked[pick->index] = pick->request_clicked;
+        pick->index = (pick->index + 1) % PICK_FRAMES;
+    }
+    
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    pick->request_pending = false;
+    pick->request_clicked = false;
+}
+
 // Takes a compiled shader, checks if it produced an error
 // returns false if it did, true otherwise.
 static bool
@@ -1085,6 +1981,74 @@ program_create_from_files(u32 vertex_count, u32 fragment_count, ...)
     return result;
 }
 
+// NOTE: Returns 0 when the file doesn't compile, the error is already printed.
+static GLuint
+program_compile_shader(GLenum type, const char *filename)
+{
+    FILE *f = fopen(filename, "r");
+    assert(f);
+    char *src = read_file_to_string(f);
+    fclose(f);
+    
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &src, NULL);
+    glCompileShader(shader);
+    free(src);
+    
+    if(!program_shader_ok(shader))
+    {
+        printf("Error in file [%s]\n", filename);
+        glDeleteShader(shader);
+        return 0;
+    }
+    
+    return shader;
+}
+
+static GLuint
+program_create_compute(const char *filename)
+{
+    GLuint shader = program_compile_shader(GL_COMPUTE_SHADER, filename);
+    if(shader == 0)
+    {
+        return 0;
+    }
+    
+    GLuint program = glCreateProgram();
+    glAttachShader(program, shader);
+    glLinkProgram(program);
+    glDeleteShader(shader);
+    assert(program_ok(program));
+    
+    return program;
+}
+
+// NOTE: Varyings are captured interleaved into a single buffer
+static GLuint
+program_create_transform_feedback(const char *vertex_filename, const char *geometry_filename,
+                                  const char **varyings, u32 varyings_count)
+{
+    GLuint vertex_shader = program_compile_shader(GL_VERTEX_SHADER, vertex_filename);
+    GLuint geometry_shader = program_compile_shader(GL_GEOMETRY_SHADER, geometry_filename);
+    if(vertex_shader == 0 || geometry_shader == 0)
+    {
+        glDeleteShader(vertex_shader);
+        glDeleteShader(geometry_shader);
+        return 0;
+    }
+    
+    GLuint program = glCreateProgram();
+    glAttachShader(program, vertex_shader);
+    glAttachShader(program, geometry_shader);
+    glTransformFeedbackVaryings(program, varyings_count, varyings, GL_INTERLEAVED_ATTRIBS);
+    glLinkProgram(program);
+    glDeleteShader(vertex_shader);
+    glDeleteShader(geometry_shader);
+    assert(program_ok(program));
+    
+    return program;
+}
+
 static void
 camera_calculate_vectors(Camera *cam)
 {
@@ -1121,6 +2085,13 @@ opengl_set_uniform(GLuint location, i32 v)
     assert(glGetError() == GL_NO_ERROR);
 }
 
+static void
+opengl_set_uniform(GLuint location, u32 v)
+{
+    glUniform1ui(location, v);
+    assert(glGetError() == GL_NO_ERROR);
+}
+
 static void
 opengl_set_uniform(GLuint program, const char *name, i32 v)
 {
@@ -10,7 +10,6 @@
 #define INSTANCED_SIMPLE_VERTEX_FILENAME "src/shaders/instanced_simple_vertex.glsl"
 #define INSTANCED_SIMPLE_FRAG_FILENAME "src/shaders/instanced_simple_frag.glsl"
 #define LIGHT_FRAG_FILENAME "src/shaders/lights.glsl"
-#define LINE_FRAG_FILENAME "src/shaders/line_vertex.glsl"
 #define UI_VERTEX_FILENAME "src/shaders/ui_vertex.glsl"
 #define UI_FRAG_FILENAME "src/shaders/ui_frag.glsl"
 #define SKYBOX_VERTEX_FILENAME "src/shaders/skybox_vertex.glsl"
@@ -19,6 +18,18 @@
 #define HDR_FRAG_FILENAME "src/shaders/hdr_frag.glsl"
 #define SUN_DEPTH_VERTEX_FILENAME "src/shaders/sun_depth_vertex.glsl"
 #define SUN_DEPTH_FRAG_FILENAME "src/shaders/sun_depth_frag.glsl"
+#define DEBUG_VERTEX_FILENAME "src/shaders/debug_vertex.glsl"
+#define DEBUG_FRAG_FILENAME "src/shaders/debug_frag.glsl"
+#define INSTANCE_CULL_COMPUTE_FILENAME "src/shaders/instance_cull_compute.glsl"
+#define INSTANCE_CULL_VERTEX_FILENAME "src/shaders/instance_cull_vertex.glsl"
+#define INSTANCE_CULL_GEOMETRY_FILENAME "src/shaders/instance_cull_geometry.glsl"
+#define SPONGE_GENERATE_VERTEX_FILENAME "src/shaders/sponge_generate_vertex.glsl"
+#define SPONGE_GENERATE_GEOMETRY_FILENAME "src/shaders/sponge_generate_geometry.glsl"
+
+// NOTE: Culled instances are always written with the float layout stride,
+// half instances just leave the last word unused.
+#define INSTANCE_CULLED_STRIDE 32
+#define INSTANCE_CULL_GROUP_SIZE 64
 
 enum ShaderProgram_Id
 {
@@ -27,7 +38,7 @@ enum ShaderProgram_Id
     ShaderProgram_InstancedSimple,
     ShaderProgram_Skybox,
     ShaderProgram_UI,
-    ShaderProgram_Line,
+    ShaderProgram_DebugDraw,
     ShaderProgram_HDR,
     ShaderProgram_SunDepth,
     ShaderProgram_LastElement,
@@ -47,6 +58,7 @@ struct ShaderProgram
 struct ShaderProgramUniforms
 {
     GLuint model;
+    GLuint normal_matrix;
     GLuint view;
     GLuint proj;
     GLuint transform;
@@ -82,13 +94,26 @@ struct ShaderProgramUniforms
     GLuint material_specular_exponent;
     GLuint light_proj_view;
     GLuint shadow_map;
+    GLuint object_id;
+    GLuint use_baked_light;
+    GLuint use_lightmap;
+    GLuint lightmap;
+};
+
+// NOTE: instance_cull_program's locations, the compute and the transform feedback
+// versions use the same names
+struct InstanceCullUniforms
+{
+    GLuint frustum_planes;
+    GLuint bounds;
+    GLuint half_scale;
+    GLuint instances_count;
+    GLuint instance_words;
 };
 
 enum RenderType
 {
     RenderType_RenderEntrySkybox,
-    RenderType_RenderEntryLine,
-    RenderType_RenderEntryHitbox,
     RenderType_RenderEntryUI,
     RenderType_RenderEntryModelNewest,
     RenderType_RenderEntryModel,
@@ -107,22 +132,6 @@ struct RenderEntrySkybox
     Cubemap cube;
 };
 
-struct RenderEntryLine
-{
-    RenderHeader header;
-    Line line;
-};
-
-struct RenderEntryHitbox
-{
-    RenderHeader header;
-    Vec3 position;
-    Vec3 size;
-    Quat orientation;
-    Hitbox *hbox;
-    u32 hbox_len;
-};
-
 struct RenderEntryUI
 {
     RenderHeader header;
@@ -132,29 +141,57 @@ struct RenderEntryUI
 struct RenderEntryModelNewest
 {
     RenderHeader header;
-    Vec3 position;
-    Vec3 size;
-    Quat orientation;
+    Mat4 transform;
+    Mat4 inversed;
     Model *model;
+    OcclusionQuery *queries;
+    u32 cull_index;
+    u32 pick_id;
 };
 
 struct RenderEntryModel
 {
     RenderHeader header;
-    Vec3 position;
-    Vec3 size;
-    Quat orientation;
+    Mat4 transform;
+    Mat4 inversed;
     Model *model;
+    OcclusionQuery *queries;
+    u32 cull_index;
+    u32 pick_id;
 };
 
 struct RenderEntryModelInstanced
 {
     RenderHeader header;
-    Vec3 *positions;
-    Vec3 *sizes;
-    Quat *orientations;
-    u32 instances_count;
-    Model *model;
+    EntityInstanced *entity;
+};
+
+#define DEBUG_DRAW_DEFAULT_COLOR Vec3(1.0f, 0.0f, 0.0f)
+
+struct DebugVertex
+{
+    Vec3 position;
+    Vec3 color;
+};
+
+struct DebugBox
+{
+    Mat4 transform;
+    Vec3 color;
+};
+
+// NOTE: Lines and hitbox wireframes don't go through the entries, they are
+// collected here for the whole frame and go out in (at most) two draw calls.
+// Boxes are instances of a single unit cube wireframe.
+struct DebugDraw
+{
+    DebugVertex *vertices;
+    u32 vertices_len;
+    u32 vertices_max;
+    
+    DebugBox *boxes;
+    u32 boxes_len;
+    u32 boxes_max;
 };
 
 struct RenderQueue
@@ -163,6 +200,82 @@ struct RenderQueue
 	u32 size;
 	u32 max_size;
 	u32 len;
+    
+    DebugDraw debug;
+};
+
+#define TRANSIENT_FRAMES 3
+#define TRANSIENT_DEFAULT_REGION_SIZE MB(4)
+
+struct TransientAllocation
+{
+    void *ptr;
+    u32 offset;
+    u32 size;
+};
+
+// NOTE: Ring buffer for GPU data that only lives for a single frame (lines,
+// hitboxes, instance matrices...). The buffer is split into TRANSIENT_FRAMES
+// regions and each region is guarded by a fence, so we never write over something
+// the GPU is still reading. With ARB_buffer_storage the whole thing is mapped
+// persistently and allocations write straight into GPU visible memory. Without it
+// allocations go into a CPU staging copy which transient_flush uploads into a
+// buffer that is orphaned at the start of each frame.
+struct TransientBuffer
+{
+    GLuint buffer;
+    u8 *mapped;
+    u8 *staging;
+    bool persistent;
+    
+    u32 region_size;
+    u32 region_index;
+    u32 offset;
+    u32 flushed;
+    GLsync fences[TRANSIENT_FRAMES];
+    
+    u32 frame_bytes;
+    u32 last_frame_bytes;
+    u32 peak_frame_bytes;
+    u32 overflow_bytes;
+};
+
+#define PICK_FRAMES 2
+// NOTE: Low bits are the entity index + 1 (0 is nothing), the mesh goes above them
+#define PICK_MESH_SHIFT 20
+#define PICK_ENTITY_MASK ((1u << PICK_MESH_SHIFT) - 1)
+
+// NOTE: Entity/mesh IDs get written into an R32UI attachment of hdr_fbo during the
+// main pass. A pick copies one pixel of it into a pixel pack buffer and fences it,
+// the value is picked up a frame later when the fence has passed, so the CPU never
+// waits on the GPU. Clicks are kept in the request until a buffer frees up, hovers
+// just get dropped.
+struct PickBuffer
+{
+    GLuint id_buffer;
+    GLuint pbos[PICK_FRAMES];
+    GLsync fences[PICK_FRAMES];
+    bool pbo_clicked[PICK_FRAMES];
+    u32 index;
+    
+    i32 request_x;
+    i32 request_y;
+    bool request_pending;
+    bool request_clicked;
+    
+    u32 hovered_id;
+    u32 clicked_id;
+    bool click_ready;
+    u32 readbacks_dropped;
+};
+
+struct DrawElementsIndirectCommand
+{
+    u32 count;
+    u32 instance_count;
+    u32 first_index;
+    u32 base_vertex;
+    u32 base_instance;
 };
 
 typedef u32 RenderContextFlags;
@@ -172,6 +285,11 @@ enum
     RENDER_DRAW_HITBOXES = 0x2,
     RENDER_SHOW_NORMAL_MAP = 0x4,
     RENDER_USE_MAPPED_NORMALS = 0x8,
+    RENDER_GPU_CULL_INSTANCES = 0x10,
+    RENDER_OCCLUSION_CULL = 0x20,
+    RENDER_OCCLUSION_QUERIES = 0x40,
+    RENDER_ID_BUFFER = 0x80,
+    RENDER_BAKED_LIGHT = 0x100,
 };
 
 struct RenderContext
@@ -181,6 +299,7 @@ struct RenderContext
     GLuint hdr_fbo;
     GLuint color_buffer;
     GLuint rbo_depth;
+    PickBuffer pick;
     
     GLuint sun_fbo;
     GLuint sun_depth_map;
@@ -190,6 +309,32 @@ struct RenderContext
     GLuint white_texture;
     GLuint black_texture;
     
+    JobQueue *jobs;
+    CullSet cull;
+    OcclusionBuffer occlusion;
+    TransientBuffer transient;
+    GLuint transient_vao;
+    GLuint screen_quad_vao;
+    GLuint screen_quad_vbo;
+    
+    GLuint debug_line_vao;
+    GLuint debug_box_vao;
+    GLuint debug_cube_vbo;
+    GLuint debug_cube_ebo;
+    GLuint query_box_vao;
+    GLuint query_cube_ebo;
+    GLenum occlusion_query_target;
+    u32 frame;
+    
+    // NOTE: Not part of programs[], these don't go through the hot reload
+    GLuint instance_cull_program;
+    InstanceCullUniforms instance_cull_uniforms;
+    bool instance_cull_compute;
+    GLuint sponge_generate_program;
+    GLuint sponge_generate_vao;
+    GLuint sponge_scratch_vbo;
+    u32 sponge_scratch_capacity;
+    
     Spotlight spot;
     DirectLight sun;
     PointLight point_light;
@@ -214,27 +359,54 @@ static void render_destory_queue(RenderQueue *queue);
 #define render_push_entry(queue, type) (type *)_render_push_entry(queue, sizeof(type), RenderType_##type)
 static void *_render_push_entry(RenderQueue *queue, u32 struct_size, RenderType type);
 static void render_push_skybox(RenderQueue *queue, Cubemap skybox);
-static void render_push_line(RenderQueue *queue, Line line);
-static void render_push_hitbox(RenderQueue *queue, Entity entity);
+static void render_push_line(RenderQueue *queue, Line line, Vec3 color = DEBUG_DRAW_DEFAULT_COLOR);
+static void render_push_hitbox(RenderQueue *queue, Entity *entity, Vec3 color = DEBUG_DRAW_DEFAULT_COLOR);
+static void render_push_hitbox(RenderQueue *queue, Hitbox *hbox, Vec3 color = DEBUG_DRAW_DEFAULT_COLOR);
 static void render_push_ui(RenderQueue *queue, UIElement element);
-static void render_push_model_newest(RenderQueue *queue, Entity entity);
-static void render_push_model(RenderQueue *queue, Entity entity);
+static void render_push_model_newest(RenderQueue *queue, Entity *entity, u32 pick_id = 0);
+static void render_push_model(RenderQueue *queue, Entity *entity, u32 pick_id = 0);
 
 static void render_prepass(RenderContext *ctx, i32 window_width, i32 window_height);
 static void get_frustum_planes(RenderContext *ctx);
+static void render_compute_light_proj_view(RenderContext *ctx);
+static void render_cull_queue(RenderQueue *queue, RenderContext *ctx);
+static void render_occlusion_cull(RenderQueue *queue, RenderContext *ctx);
+static void render_issue_occlusion_queries(RenderQueue *queue, RenderContext *ctx);
 static void render_draw_queue(RenderQueue *queue, RenderContext *ctx);
+static void render_draw_debug(DebugDraw *debug, RenderContext *ctx);
+static bool render_cull_instances(RenderContext *ctx, EntityInstanced *entity, GLuint **vaos, u32 *visible_count);
+static bool render_generate_sponge(RenderContext *ctx, EntityInstanced *entity, Vec3 position, Vec3 size,
+                                   Quat rotation, u32 level);
 static void render_end(RenderQueue *queue, RenderContext *ctx, i32 window_width, i32 window_height);
+static void render_create_buffers(RenderContext *ctx);
+
+static TransientBuffer transient_create(u32 region_size = TRANSIENT_DEFAULT_REGION_SIZE);
+static void transient_destroy(TransientBuffer *transient);
+static void transient_begin_frame(TransientBuffer *transient);
+static void transient_end_frame(TransientBuffer *transient);
+static TransientAllocation transient_alloc(TransientBuffer *transient, u32 size, u32 alignment);
+static TransientAllocation transient_push(TransientBuffer *transient, const void *data, u32 size, u32 alignment);
+static void transient_flush(TransientBuffer *transient);
+
+static PickBuffer pick_create(i32 width, i32 height);
+static void pick_resize(PickBuffer *pick, i32 width, i32 height);
+static void pick_request(PickBuffer *pick, i32 x, i32 y, bool clicked);
+static void pick_readback(PickBuffer *pick, i32 window_width, i32 window_height);
 
 static void render_load_programs(RenderContext *ctx);
 static bool program_shader_ok(GLuint shader);
 static bool program_ok(GLuint program);
 static ShaderProgram program_create_from_files(u32 vertex_count, u32 fragment_count, ...);
 static ShaderProgram program_create_from_file_arrays(u32 vertex_count, u32 fragment_count, const char **vertex_filenames, const char **fragment_filenames);
+static GLuint program_compile_shader(GLenum type, const char *filename);
+static GLuint program_create_compute(const char *filename);
+static GLuint program_create_transform_feedback(const char *vertex_filename, const char *geometry_filename, const char **varyings, u32 varyings_count);
 
 static void camera_calculate_vectors(Camera *cam);
 static void camera_mouse_moved(Camera *cam, f32 dx, f32 dy);
 
 static void opengl_set_uniform(GLuint location, i32 v);
+static void opengl_set_uniform(GLuint location, u32 v);
 static void opengl_set_uniform(GLuint location, f32 val);
 static void opengl_set_uniform(GLuint location, Vec3 vec);
 static void opengl_set_uniform(GLuint location, Mat4 mat, GLboolean transpose = GL_FALSE);
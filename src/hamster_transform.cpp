@@ -0,0 +1,913 @@
+// NOTE: T * R * S written out, the rotation's columns scaled by the size and the
+// position as the last column. Same matrix as translate(rotate_quat(scale(Mat4(1),
+// size), rotation), position) without the two full products. The inverse is
+// S^-1 * R^T * T^-1, rotate_from_quat normalizes so R is orthonormal and its
+// transpose is its inverse, row i is just the rotation's column i over size i.
+static Mat4
+transform_compose(Vec3 position, Quat rotation, Vec3 size, Mat4 *inversed)
+{
+    Mat4 result = rotate_from_quat(rotation);
+    if(inversed)
+    {
+        *inversed = Mat4(1.0f);
+        for(u32 row = 0; row < 3; row++)
+        {
+            f32 *column = result.a[row];
+            f32 inverse_size = 1.0f / size.m[row];
+            inversed->a[0][row] = column[0] * inverse_size;
+            inversed->a[1][row] = column[1] * inverse_size;
+            inversed->a[2][row] = column[2] * inverse_size;
+            inversed->a[3][row] = -(column[0] * position.x + column[1] * position.y +
+                                    column[2] * position.z) * inverse_size;
+        }
+    }
+    
+    result.columns[0] = scale(result.columns[0], size.x);
+    result.columns[1] = scale(result.columns[1], size.y);
+    result.columns[2] = scale(result.columns[2], size.z);
+    result.columns[3] = Vec4(position, 1.0f);
+    
+    return result;
+}
+
+static Vec3Array
+vec3_array_create(u32 count)
+{
+    Vec3Array result = {};
+    result.x = (f32 *)malloc(MAX(count, 1) * sizeof(f32));
+    result.y = (f32 *)malloc(MAX(count, 1) * sizeof(f32));
+    result.z = (f32 *)malloc(MAX(count, 1) * sizeof(f32));
+    assert(result.x && result.y && result.z);
+    
+    return result;
+}
+
+static void
+vec3_array_destroy(Vec3Array *array)
+{
+    free(array->x);
+    free(array->y);
+    free(array->z);
+    *array = {};
+}
+
+static Vec3Array
+vec3_array_offset(Vec3Array array, u32 offset)
+{
+    Vec3Array result = {};
+    result.x = array.x + offset;
+    result.y = array.y + offset;
+    result.z = array.z + offset;
+    
+    return result;
+}
+
+static Vec3
+vec3_array_get(Vec3Array array, u32 index)
+{
+    return Vec3(array.x[index], array.y[index], array.z[index]);
+}
+
+// NOTE: The scalar tails do the same fused multiply adds as the wide loops, so a
+// point comes out the same no matter where a batch boundary cut the array.
+static f32
+transform_dot3(f32 x, f32 a, f32 y, f32 b, f32 z, f32 c)
+{
+#ifdef __AVX2__
+    return fmaf(z, c, fmaf(y, b, x * a));
+#else
+    return x * a + y * b + z * c;
+#endif
+}
+
+// NOTE: w only scales the translation, so directions skip it
+static void
+transform_one(Mat4 *transform, f32 w, f32 x, f32 y, f32 z, Vec3Array out, u32 index)
+{
+    f32 *column0 = transform->a[0];
+    f32 *column1 = transform->a[1];
+    f32 *column2 = transform->a[2];
+    f32 *column3 = transform->a[3];
+    out.x[index] = transform_dot3(x, column0[0], y, column1[0], z, column2[0]) + column3[0] * w;
+    out.y[index] = transform_dot3(x, column0[1], y, column1[1], z, column2[1]) + column3[1] * w;
+    out.z[index] = transform_dot3(x, column0[2], y, column1[2], z, column2[2]) + column3[2] * w;
+}
+
+#ifdef __AVX2__
+// NOTE: m is [column][row] of the upper 3x3, t the translation already scaled by w
+static void
+transform_wide_setup(Mat4 *transform, f32 w, __m256 m[3][3], __m256 t[3])
+{
+    for(u32 column = 0; column < 3; column++)
+    {
+        for(u32 row = 0; row < 3; row++)
+        {
+            m[column][row] = _mm256_set1_ps(transform->a[column][row]);
+        }
+    }
+    for(u32 row = 0; row < 3; row++)
+    {
+        t[row] = _mm256_set1_ps(transform->a[3][row] * w);
+    }
+}
+
+static void
+transform_wide_store(__m256 m[3][3], __m256 t[3], __m256 x, __m256 y, __m256 z, Vec3Array out, u32 index)
+{
+    __m256 rx = _mm256_mul_ps(x, m[0][0]);
+    __m256 ry = _mm256_mul_ps(x, m[0][1]);
+    __m256 rz = _mm256_mul_ps(x, m[0][2]);
+    rx = _mm256_fmadd_ps(y, m[1][0], rx);
+    ry = _mm256_fmadd_ps(y, m[1][1], ry);
+    rz = _mm256_fmadd_ps(y, m[1][2], rz);
+    rx = _mm256_fmadd_ps(z, m[2][0], rx);
+    ry = _mm256_fmadd_ps(z, m[2][1], ry);
+    rz = _mm256_fmadd_ps(z, m[2][2], rz);
+    _mm256_storeu_ps(out.x + index, _mm256_add_ps(rx, t[0]));
+    _mm256_storeu_ps(out.y + index, _mm256_add_ps(ry, t[1]));
+    _mm256_storeu_ps(out.z + index, _mm256_add_ps(rz, t[2]));
+}
+
+// NOTE: Eight packed Vec3s are six 16 byte rows, pairing row k with row k + 3 puts
+// points 0-3 in the low lanes and 4-7 in the high ones, after which the same
+// in-lane shuffles pull out x, y and z for both halves.
+static void
+transform_load_aos8(Vec3 *points, __m256 *x, __m256 *y, __m256 *z)
+{
+    f32 *p = (f32 *)points;
+    __m256 m03 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(p + 0)), _mm_loadu_ps(p + 12), 1);
+    __m256 m14 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(p + 4)), _mm_loadu_ps(p + 16), 1);
+    __m256 m25 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(p + 8)), _mm_loadu_ps(p + 20), 1);
+    
+    __m256 xy = _mm256_shuffle_ps(m14, m25, _MM_SHUFFLE(2, 1, 3, 2));
+    __m256 yz = _mm256_shuffle_ps(m03, m14, _MM_SHUFFLE(1, 0, 2, 1));
+    *x = _mm256_shuffle_ps(m03, xy, _MM_SHUFFLE(2, 0, 3, 0));
+    *y = _mm256_shuffle_ps(yz, xy, _MM_SHUFFLE(3, 1, 2, 0));
+    *z = _mm256_shuffle_ps(yz, m25, _MM_SHUFFLE(3, 0, 3, 1));
+}
+#endif
+
+static void
+transform_aos(Mat4 transform, f32 w, Vec3 *input, u32 count, Vec3Array out)
+{
+    u32 i = 0;
+#ifdef __AVX2__
+    __m256 m[3][3];
+    __m256 t[3];
+    transform_wide_setup(&transform, w, m, t);
+    for(; i + TRANSFORM_LANES <= count; i += TRANSFORM_LANES)
+    {
+        __m256 x, y, z;
+        transform_load_aos8(input + i, &x, &y, &z);
+        transform_wide_store(m, t, x, y, z, out, i);
+    }
+#endif
+    for(; i < count; i++)
+    {
+        transform_one(&transform, w, input[i].x, input[i].y, input[i].z, out, i);
+    }
+}
+
+static void
+transform_soa(Mat4 transform, f32 w, Vec3Array input, u32 count, Vec3Array out)
+{
+    u32 i = 0;
+#ifdef __AVX2__
+    __m256 m[3][3];
+    __m256 t[3];
+    transform_wide_setup(&transform, w, m, t);
+    for(; i + TRANSFORM_LANES <= count; i += TRANSFORM_LANES)
+    {
+        transform_wide_store(m, t, _mm256_loadu_ps(input.x + i), _mm256_loadu_ps(input.y + i),
+                             _mm256_loadu_ps(input.z + i), out, i);
+    }
+#endif
+    for(; i < count; i++)
+    {
+        transform_one(&transform, w, input.x[i], input.y[i], input.z[i], out, i);
+    }
+}
+
+static void
+transform_points(Mat4 transform, Vec3 *points, u32 count, Vec3Array out)
+{
+    transform_aos(transform, 1.0f, points, count, out);
+}
+
+static void
+transform_points(Mat4 transform, Vec3Array points, u32 count, Vec3Array out)
+{
+    transform_soa(transform, 1.0f, points, count, out);
+}
+
+static void
+transform_directions(Mat4 transform, Vec3 *directions, u32 count, Vec3Array out)
+{
+    transform_aos(transform, 0.0f, directions, count, out);
+}
+
+static void
+transform_directions(Mat4 transform, Vec3Array directions, u32 count, Vec3Array out)
+{
+    transform_soa(transform, 0.0f, directions, count, out);
+}
+
+// NOTE: The same center and extent construction as bounds_transform, the box
+// around the transformed box, just eight at a time.
+static void
+transform_boxes(Mat4 transform, Vec3Array local_min, Vec3Array local_max, u32 count,
+                Vec3Array min, Vec3Array max)
+{
+    f32 reach[3][3];
+    for(u32 column = 0; column < 3; column++)
+    {
+        for(u32 row = 0; row < 3; row++)
+        {
+            reach[column][row] = fabsf(transform.a[column][row]);
+        }
+    }
+    
+    u32 i = 0;
+#ifdef __AVX2__
+    __m256 m[3][3];
+    __m256 t[3];
+    transform_wide_setup(&transform, 1.0f, m, t);
+    __m256 wide_reach[3][3];
+    for(u32 column = 0; column < 3; column++)
+    {
+        for(u32 row = 0; row < 3; row++)
+        {
+            wide_reach[column][row] = _mm256_set1_ps(reach[column][row]);
+        }
+    }
+    
+    __m256 half = _mm256_set1_ps(0.5f);
+    for(; i + TRANSFORM_LANES <= count; i += TRANSFORM_LANES)
+    {
+        __m256 min_x = _mm256_loadu_ps(local_min.x + i);
+        __m256 min_y = _mm256_loadu_ps(local_min.y + i);
+        __m256 min_z = _mm256_loadu_ps(local_min.z + i);
+        __m256 max_x = _mm256_loadu_ps(local_max.x + i);
+        __m256 max_y = _mm256_loadu_ps(local_max.y + i);
+        __m256 max_z = _mm256_loadu_ps(local_max.z + i);
+        
+        // NOTE: The centers go through min first and get moved out to max after
+        transform_wide_store(m, t, _mm256_mul_ps(_mm256_add_ps(min_x, max_x), half),
+                             _mm256_mul_ps(_mm256_add_ps(min_y, max_y), half),
+                             _mm256_mul_ps(_mm256_add_ps(min_z, max_z), half), min, i);
+        __m256 ex = _mm256_mul_ps(_mm256_sub_ps(max_x, min_x), half);
+        __m256 ey = _mm256_mul_ps(_mm256_sub_ps(max_y, min_y), half);
+        __m256 ez = _mm256_mul_ps(_mm256_sub_ps(max_z, min_z), half);
+        
+        f32 *centers[3] = { min.x + i, min.y + i, min.z + i };
+        f32 *maxs[3] = { max.x + i, max.y + i, max.z + i };
+        for(u32 row = 0; row < 3; row++)
+        {
+            __m256 extent = _mm256_mul_ps(wide_reach[0][row], ex);
+            extent = _mm256_fmadd_ps(wide_reach[1][row], ey, extent);
+            extent = _mm256_fmadd_ps(wide_reach[2][row], ez, extent);
+            
+            __m256 center = _mm256_loadu_ps(centers[row]);
+            _mm256_storeu_ps(centers[row], _mm256_sub_ps(center, extent));
+            _mm256_storeu_ps(maxs[row], _mm256_add_ps(center, extent));
+        }
+    }
+#endif
+    for(; i < count; i++)
+    {
+        Vec3 lmin = vec3_array_get(local_min, i);
+        Vec3 lmax = vec3_array_get(local_max, i);
+        Vec3 center = scale(add(lmin, lmax), 0.5f);
+        Vec3 extent = scale(sub(lmax, lmin), 0.5f);
+        transform_one(&transform, 1.0f, center.x, center.y, center.z, min, i);
+        
+        f32 *centers[3] = { min.x + i, min.y + i, min.z + i };
+        f32 *maxs[3] = { max.x + i, max.y + i, max.z + i };
+        for(u32 row = 0; row < 3; row++)
+        {
+            f32 world_extent = transform_dot3(reach[0][row], extent.x, reach[1][row], extent.y,
+                                              reach[2][row], extent.z);
+            *maxs[row] = *centers[row] + world_extent;
+            *centers[row] = *centers[row] - world_extent;
+        }
+    }
+}
+
+static void
+transform_job(void *data, u32 first, u32 one_past_last)
+{
+    TransformBatch *batch = (TransformBatch *)data;
+    transform_aos(batch->transform, batch->w, batch->input + first, one_past_last - first,
+                  vec3_array_offset(batch->output, first));
+}
+
+static void
+transform_points_batch(JobQueue *jobs, Mat4 transform, Vec3 *points, u32 count, Vec3Array out)
+{
+    TransformBatch batch = {};
+    batch.transform = transform;
+    batch.w = 1.0f;
+    batch.input = points;
+    batch.output = out;
+    jobs_parallel_for(jobs, count, TRANSFORM_MIN_BATCH, transform_job, &batch);
+}
+
+static void
+transform_directions_batch(JobQueue *jobs, Mat4 transform, Vec3 *directions, u32 count, Vec3Array out)
+{
+    TransformBatch batch = {};
+    batch.transform = transform;
+    batch.w = 0.0f;
+    batch.input = directions;
+    batch.output = out;
+    jobs_parallel_for(jobs, count, TRANSFORM_MIN_BATCH, transform_job, &batch);
+}
+
+static void
+transform_tree_reserve(TransformTree *tree, u32 count)
+{
+    if(count <= tree->capacity)
+    {
+        return;
+    }
+    
+    tree->capacity = MAX(count, tree->capacity * 2);
+    tree->parent = (u32 *)realloc(tree->parent, tree->capacity * sizeof(u32));
+    tree->depth = (u32 *)realloc(tree->depth, tree->capacity * sizeof(u32));
+    tree->node_of = (u32 *)realloc(tree->node_of, tree->capacity * sizeof(u32));
+    tree->positions = (Vec3 *)realloc(tree->positions, tree->capacity * sizeof(Vec3));
+    tree->rotations = (Quat *)realloc(tree->rotations, tree->capacity * sizeof(Quat));
+    tree->sizes = (Vec3 *)realloc(tree->sizes, tree->capacity * sizeof(Vec3));
+    tree->world = (Mat4 *)realloc(tree->world, tree->capacity * sizeof(Mat4));
+    tree->dirty = (u8 *)realloc(tree->dirty, tree->capacity * sizeof(u8));
+    tree->changed = (u8 *)realloc(tree->changed, tree->capacity * sizeof(u8));
+    tree->dirty_next = (u32 *)realloc(tree->dirty_next, tree->capacity * sizeof(u32));
+    tree->children_first = (u32 *)realloc(tree->children_first, tree->capacity * sizeof(u32));
+    tree->children_len = (u32 *)realloc(tree->children_len, tree->capacity * sizeof(u32));
+    tree->slot_of = (u32 *)realloc(tree->slot_of, tree->capacity * sizeof(u32));
+    tree->level_first = (u32 *)realloc(tree->level_first, (tree->capacity + 1) * sizeof(u32));
+    tree->dirty_first = (u32 *)realloc(tree->dirty_first, (tree->capacity + 1) * sizeof(u32));
+    tree->visited = (u32 *)realloc(tree->visited, tree->capacity * sizeof(u32));
+}
+
+static TransformTree
+transform_tree_create(u32 capacity)
+{
+    TransformTree result = {};
+    transform_tree_reserve(&result, MAX(capacity, 1));
+    
+    // NOTE: The root is level 0 on its own and never gets dirty
+    result.parent[TRANSFORM_TREE_ROOT] = TRANSFORM_TREE_ROOT;
+    result.depth[TRANSFORM_TREE_ROOT] = 0;
+    result.node_of[TRANSFORM_TREE_ROOT] = TRANSFORM_TREE_ROOT;
+    result.slot_of[TRANSFORM_TREE_ROOT] = TRANSFORM_TREE_ROOT;
+    result.positions[TRANSFORM_TREE_ROOT] = Vec3(0.0f, 0.0f, 0.0f);
+    result.rotations[TRANSFORM_TREE_ROOT] = Quat();
+    result.sizes[TRANSFORM_TREE_ROOT] = Vec3(1.0f, 1.0f, 1.0f);
+    result.world[TRANSFORM_TREE_ROOT] = Mat4(1.0f);
+    result.dirty[TRANSFORM_TREE_ROOT] = 0;
+    result.changed[TRANSFORM_TREE_ROOT] = 0;
+    result.children_first[TRANSFORM_TREE_ROOT] = 1;
+    result.children_len[TRANSFORM_TREE_ROOT] = 0;
+    result.count = 1;
+    
+    result.level_first[0] = 0;
+    result.level_first[1] = 1;
+    result.levels_len = 1;
+    result.dirty_first[0] = TRANSFORM_TREE_NONE;
+    result.range_first = result.count;
+    
+    return result;
+}
+
+static void
+transform_tree_destroy(TransformTree *tree)
+{
+    free(tree->parent);
+    free(tree->depth);
+    free(tree->node_of);
+    free(tree->positions);
+    free(tree->rotations);
+    free(tree->sizes);
+    free(tree->world);
+    free(tree->dirty);
+    free(tree->changed);
+    free(tree->dirty_next);
+    free(tree->children_first);
+    free(tree->children_len);
+    free(tree->slot_of);
+    free(tree->level_first);
+    free(tree->dirty_first);
+    free(tree->visited);
+    memset(tree, 0, sizeof(*tree));
+}
+
+// NOTE: Nodes are never removed, so the new one's handle is also the next free
+// slot. Appending keeps the slots sorted as long as the last slot's parent isn't
+// after the new node's, otherwise the next update sorts them again.
+static u32
+transform_tree_add(TransformTree *tree, u32 parent, Vec3 position, Quat rotation, Vec3 size)
+{
+    assert(parent < tree->count);
+    transform_tree_reserve(tree, tree->count + 1);
+    
+    u32 slot = tree->count++;
+    u32 node = slot;
+    u32 parent_slot = tree->slot_of[parent];
+    tree->parent[slot] = parent_slot;
+    tree->depth[slot] = tree->depth[parent_slot] + 1;
+    tree->node_of[slot] = node;
+    tree->slot_of[node] = slot;
+    tree->positions[slot] = position;
+    tree->rotations[slot] = rotation;
+    tree->sizes[slot] = size;
+    tree->world[slot] = Mat4(1.0f);
+    tree->dirty[slot] = 1;
+    tree->changed[slot] = 0;
+    tree->children_first[slot] = tree->count;
+    tree->children_len[slot] = 0;
+    
+    u32 depth = tree->depth[slot];
+    if(tree->unsorted || parent_slot < tree->parent[slot - 1])
+    {
+        tree->unsorted = true;
+    }
+    else
+    {
+        if(depth == tree->levels_len)
+        {
+            tree->dirty_first[tree->levels_len++] = TRANSFORM_TREE_NONE;
+        }
+        tree->level_first[tree->levels_len] = tree->count;
+        tree->dirty_next[slot] = tree->dirty_first[depth];
+        tree->dirty_first[depth] = slot;
+        if(tree->children_len[parent_slot]++ == 0)
+        {
+            tree->children_first[parent_slot] = slot;
+        }
+    }
+    
+    return node;
+}
+
+static void
+transform_tree_set_local(TransformTree *tree, u32 node, Vec3 position, Quat rotation, Vec3 size)
+{
+    assert(node != TRANSFORM_TREE_ROOT && node < tree->count);
+    u32 slot = tree->slot_of[node];
+    tree->positions[slot] = position;
+    tree->rotations[slot] = rotation;
+    tree->sizes[slot] = size;
+    
+    // NOTE: While unsorted the depth might be off, the sort finds it from the flag
+    if(!tree->dirty[slot] && !tree->unsorted)
+    {
+        u32 depth = tree->depth[slot];
+        tree->dirty_next[slot] = tree->dirty_first[depth];
+        tree->dirty_first[depth] = slot;
+    }
+    tree->dirty[slot] = 1;
+}
+
+// NOTE: The node keeps its local transform, so it jumps to the same place relative
+// to the new parent. Its subtree's depths and the dirty lists are only worked out
+// again by the sort.
+static void
+transform_tree_set_parent(TransformTree *tree, u32 node, u32 parent)
+{
+    assert(node != TRANSFORM_TREE_ROOT && node < tree->count && parent < tree->count);
+    u32 slot = tree->slot_of[node];
+    u32 parent_slot = tree->slot_of[parent];
+    for(u32 at = parent_slot; at != TRANSFORM_TREE_ROOT; at = tree->parent[at])
+    {
+        assert(at != slot && "Parenting a node under its own subtree");
+    }
+    
+    tree->parent[slot] = parent_slot;
+    tree->dirty[slot] = 1;
+    tree->unsorted = true;
+}
+
+static void
+transform_tree_permute(void *array, u32 element_size, u32 *new_slot, u32 count, u8 *scratch)
+{
+    u8 *bytes = (u8 *)array;
+    for(u32 slot = 0; slot < count; slot++)
+    {
+        memcpy(scratch + new_slot[slot] * element_size, bytes + slot * element_size, element_size);
+    }
+    memcpy(array, scratch, count * element_size);
+}
+
+// NOTE: Breadth first from the root over the children grouped by parent slot, so
+// every level comes out as one run with the children of a slot next to each other
+// in the order of their parents. Siblings keep the order they got added in.
+static void
+transform_tree_sort(TransformTree *tree)
+{
+    u32 count = tree->count;
+    u32 *children_first = (u32 *)calloc(count + 1, sizeof(u32));
+    u32 *children = (u32 *)malloc(count * sizeof(u32));
+    u32 *order = (u32 *)malloc(count * sizeof(u32));
+    u32 *new_slot = (u32 *)malloc(count * sizeof(u32));
+    
+    for(u32 slot = 1; slot < count; slot++)
+    {
+        children_first[tree->parent[slot] + 1]++;
+    }
+    for(u32 slot = 0; slot < count; slot++)
+    {
+        children_first[slot + 1] += children_first[slot];
+    }
+    u32 *next = new_slot;
+    memcpy(next, children_first, count * sizeof(u32));
+    for(u32 slot = 1; slot < count; slot++)
+    {
+        children[next[tree->parent[slot]]++] = slot;
+    }
+    
+    order[0] = TRANSFORM_TREE_ROOT;
+    u32 order_len = 1;
+    for(u32 i = 0; i < order_len; i++)
+    {
+        u32 slot = order[i];
+        for(u32 child = children_first[slot]; child < children_first[slot + 1]; child++)
+        {
+            order[order_len++] = children[child];
+        }
+    }
+    assert(order_len == count);
+    
+    // NOTE: A parent comes before its children in the order, so its depth is there
+    u32 levels_len = 0;
+    for(u32 i = 0; i < count; i++)
+    {
+        u32 slot = order[i];
+        u32 depth = slot == TRANSFORM_TREE_ROOT ? 0 : tree->depth[tree->parent[slot]] + 1;
+        tree->depth[slot] = depth;
+        if(depth == levels_len)
+        {
+            tree->level_first[levels_len++] = i;
+        }
+        new_slot[slot] = i;
+    }
+    tree->level_first[levels_len] = count;
+    
+    // NOTE: The references between slots get remapped before the arrays move
+    for(u32 slot = 0; slot < count; slot++)
+    {
+        tree->parent[slot] = new_slot[tree->parent[slot]];
+        tree->slot_of[tree->node_of[slot]] = new_slot[slot];
+    }
+    
+    u8 *scratch = (u8 *)malloc(count * sizeof(Mat4));
+    transform_tree_permute(tree->parent, sizeof(u32), new_slot, count, scratch);
+    transform_tree_permute(tree->depth, sizeof(u32), new_slot, count, scratch);
+    transform_tree_permute(tree->node_of, sizeof(u32), new_slot, count, scratch);
+    transform_tree_permute(tree->positions, sizeof(Vec3), new_slot, count, scratch);
+    transform_tree_permute(tree->rotations, sizeof(Quat), new_slot, count, scratch);
+    transform_tree_permute(tree->sizes, sizeof(Vec3), new_slot, count, scratch);
+    transform_tree_permute(tree->world, sizeof(Mat4), new_slot, count, scratch);
+    transform_tree_permute(tree->dirty, sizeof(u8), new_slot, count, scratch);
+    transform_tree_permute(tree->changed, sizeof(u8), new_slot, count, scratch);
+    
+    // NOTE: The children of a slot are the run of slots with it as the parent
+    memset(tree->children_len, 0, count * sizeof(u32));
+    for(u32 slot = count; slot-- > 1;)
+    {
+        tree->children_first[tree->parent[slot]] = slot;
+        tree->children_len[tree->parent[slot]]++;
+    }
+    tree->children_first[TRANSFORM_TREE_ROOT] = 1;
+    
+    tree->levels_len = levels_len;
+    for(u32 level = 0; level < levels_len; level++)
+    {
+        tree->dirty_first[level] = TRANSFORM_TREE_NONE;
+    }
+    for(u32 slot = 0; slot < count; slot++)
+    {
+        if(tree->dirty[slot])
+        {
+            u32 depth = tree->depth[slot];
+            tree->dirty_next[slot] = tree->dirty_first[depth];
+            tree->dirty_first[depth] = slot;
+        }
+    }
+    tree->unsorted = false;
+    
+    free(scratch);
+    free(new_slot);
+    free(order);
+    free(children);
+    free(children_first);
+}
+
+#ifdef __AVX2__
+// NOTE: Same idea as transform_load_aos8, row k paired with row k + 4 and a 4x4
+// transpose inside of each lane.
+static void
+transform_load_quat8(Quat *rotations, __m256 *w, __m256 *i, __m256 *j, __m256 *k)
+{
+    f32 *q = (f32 *)rotations;
+    __m256 r0 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(q + 0)), _mm_loadu_ps(q + 16), 1);
+    __m256 r1 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(q + 4)), _mm_loadu_ps(q + 20), 1);
+    __m256 r2 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(q + 8)), _mm_loadu_ps(q + 24), 1);
+    __m256 r3 = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(q + 12)), _mm_loadu_ps(q + 28), 1);
+    
+    __m256 wi01 = _mm256_unpacklo_ps(r0, r1);
+    __m256 wi23 = _mm256_unpacklo_ps(r2, r3);
+    __m256 jk01 = _mm256_unpackhi_ps(r0, r1);
+    __m256 jk23 = _mm256_unpackhi_ps(r2, r3);
+    *w = _mm256_shuffle_ps(wi01, wi23, _MM_SHUFFLE(1, 0, 1, 0));
+    *i = _mm256_shuffle_ps(wi01, wi23, _MM_SHUFFLE(3, 2, 3, 2));
+    *j = _mm256_shuffle_ps(jk01, jk23, _MM_SHUFFLE(1, 0, 1, 0));
+    *k = _mm256_shuffle_ps(jk01, jk23, _MM_SHUFFLE(3, 2, 3, 2));
+}
+
+// NOTE: The inverse of transform_load_quat8, column c of eight matrices from its
+// x, y, z and w across the lanes. Only 16 byte stores, see mul.
+static void
+transform_store_column8(Mat4 *out, u32 column, __m256 x, __m256 y, __m256 z, __m256 w)
+{
+    __m256 xy01 = _mm256_unpacklo_ps(x, y);
+    __m256 zw01 = _mm256_unpacklo_ps(z, w);
+    __m256 xy23 = _mm256_unpackhi_ps(x, y);
+    __m256 zw23 = _mm256_unpackhi_ps(z, w);
+    __m256 c0 = _mm256_shuffle_ps(xy01, zw01, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 c1 = _mm256_shuffle_ps(xy01, zw01, _MM_SHUFFLE(3, 2, 3, 2));
+    __m256 c2 = _mm256_shuffle_ps(xy23, zw23, _MM_SHUFFLE(1, 0, 1, 0));
+    __m256 c3 = _mm256_shuffle_ps(xy23, zw23, _MM_SHUFFLE(3, 2, 3, 2));
+    _mm_storeu_ps(out[0].a[column], _mm256_castps256_ps128(c0));
+    _mm_storeu_ps(out[1].a[column], _mm256_castps256_ps128(c1));
+    _mm_storeu_ps(out[2].a[column], _mm256_castps256_ps128(c2));
+    _mm_storeu_ps(out[3].a[column], _mm256_castps256_ps128(c3));
+    _mm_storeu_ps(out[4].a[column], _mm256_extractf128_ps(c0, 1));
+    _mm_storeu_ps(out[5].a[column], _mm256_extractf128_ps(c1, 1));
+    _mm_storeu_ps(out[6].a[column], _mm256_extractf128_ps(c2, 1));
+    _mm_storeu_ps(out[7].a[column], _mm256_extractf128_ps(c3, 1));
+}
+
+// NOTE: transform_compose for eight transforms in a row, the products of the scalar
+// rotate_from_quat with one node per lane.
+static void
+transform_compose8(Vec3 *positions, Quat *rotations, Vec3 *sizes, Mat4 *out)
+{
+    __m256 qw, qi, qj, qk;
+    __m256 px, py, pz;
+    __m256 sx, sy, sz;
+    transform_load_quat8(rotations, &qw, &qi, &qj, &qk);
+    transform_load_aos8(positions, &px, &py, &pz);
+    transform_load_aos8(sizes, &sx, &sy, &sz);
+    
+    __m256 ww = _mm256_mul_ps(qw, qw);
+    __m256 ii = _mm256_mul_ps(qi, qi);
+    __m256 jj = _mm256_mul_ps(qj, qj);
+    __m256 kk = _mm256_mul_ps(qk, qk);
+    __m256 twos = _mm256_div_ps(_mm256_set1_ps(2.0f), _mm256_add_ps(_mm256_add_ps(ww, ii), _mm256_add_ps(jj, kk)));
+    __m256 one = _mm256_set1_ps(1.0f);
+    __m256 zero = _mm256_setzero_ps();
+    
+    __m256 ij = _mm256_mul_ps(qi, qj);
+    __m256 ik = _mm256_mul_ps(qi, qk);
+    __m256 jk = _mm256_mul_ps(qj, qk);
+    __m256 iw = _mm256_mul_ps(qi, qw);
+    __m256 jw = _mm256_mul_ps(qj, qw);
+    __m256 kw = _mm256_mul_ps(qk, qw);
+    
+    __m256 m00 = _mm256_sub_ps(one, _mm256_mul_ps(twos, _mm256_add_ps(jj, kk)));
+    __m256 m01 = _mm256_mul_ps(twos, _mm256_add_ps(ij, kw));
+    __m256 m02 = _mm256_mul_ps(twos, _mm256_sub_ps(ik, jw));
+    transform_store_column8(out, 0, _mm256_mul_ps(m00, sx), _mm256_mul_ps(m01, sx), _mm256_mul_ps(m02, sx), zero);
+    
+    __m256 m10 = _mm256_mul_ps(twos, _mm256_sub_ps(ij, kw));
+    __m256 m11 = _mm256_sub_ps(one, _mm256_mul_ps(twos, _mm256_add_ps(ii, kk)));
+    __m256 m12 = _mm256_mul_ps(twos, _mm256_add_ps(jk, iw));
+    transform_store_column8(out, 1, _mm256_mul_ps(m10, sy), _mm256_mul_ps(m11, sy), _mm256_mul_ps(m12, sy), zero);
+    
+    __m256 m20 = _mm256_mul_ps(twos, _mm256_add_ps(ik, jw));
+    __m256 m21 = _mm256_mul_ps(twos, _mm256_sub_ps(jk, iw));
+    __m256 m22 = _mm256_sub_ps(one, _mm256_mul_ps(twos, _mm256_add_ps(ii, jj)));
+    transform_store_column8(out, 2, _mm256_mul_ps(m20, sz), _mm256_mul_ps(m21, sz), _mm256_mul_ps(m22, sz), zero);
+    
+    transform_store_column8(out, 3, px, py, pz, one);
+}
+#endif
+
+// NOTE: Only reads the level above, which is finished by the time this one starts.
+// Every slot whose node or parent changed gets its local transform composed again
+// and multiplied with the parent's world.
+static void
+transform_tree_level_job(void *data, u32 first, u32 one_past_last)
+{
+    TransformTreeLevel *level = (TransformTreeLevel *)data;
+    TransformTree *tree = level->tree;
+    u32 begin = level->first + first;
+    u32 end = level->first + one_past_last;
+    u32 *parent = tree->parent;
+    u8 *dirty = tree->dirty;
+    u8 *changed = tree->changed;
+    Mat4 *world = tree->world;
+    
+    u32 slot = begin;
+#ifdef __AVX2__
+    // NOTE: A run of eight gets composed together as soon as one of them changed,
+    // straight into the multiply so the locals never go out to memory
+    Mat4 composed[TRANSFORM_LANES];
+    for(; slot + TRANSFORM_LANES <= end; slot += TRANSFORM_LANES)
+    {
+        u32 changed8 = 0;
+        for(u32 lane = 0; lane < TRANSFORM_LANES; lane++)
+        {
+            u8 lane_changed = dirty[slot + lane] | changed[parent[slot + lane]];
+            changed[slot + lane] = lane_changed;
+            changed8 |= lane_changed << lane;
+        }
+        if(changed8 == 0)
+        {
+            continue;
+        }
+        memset(dirty + slot, 0, TRANSFORM_LANES * sizeof(u8));
+        
+        transform_compose8(tree->positions + slot, tree->rotations + slot, tree->sizes + slot, composed);
+        for(u32 lane = 0; lane < TRANSFORM_LANES; lane++)
+        {
+            if(changed8 & (1 << lane))
+            {
+                world[slot + lane] = mul(world[parent[slot + lane]], composed[lane]);
+            }
+        }
+    }
+#endif
+    for(; slot < end; slot++)
+    {
+        u8 slot_changed = dirty[slot] | changed[parent[slot]];
+        changed[slot] = slot_changed;
+        dirty[slot] = 0;
+        if(slot_changed)
+        {
+            Mat4 local = transform_compose(tree->positions[slot], tree->rotations[slot], tree->sizes[slot]);
+            world[slot] = mul(world[parent[slot]], local);
+        }
+    }
+}
+
+// NOTE: The same for a list of slots that all changed, the list flagged them already.
+// Siblings come in a row, eight slots in a row get composed together.
+static void
+transform_tree_list_job(void *data, u32 first, u32 one_past_last)
+{
+    TransformTreeLevel *level = (TransformTreeLevel *)data;
+    TransformTree *tree = level->tree;
+    u32 *slots = level->slots;
+    u32 *parent = tree->parent;
+    Mat4 *world = tree->world;
+    
+    u32 i = first;
+#ifdef __AVX2__
+    Mat4 composed[TRANSFORM_LANES];
+    while(i + TRANSFORM_LANES <= one_past_last)
+    {
+        u32 slot = slots[i];
+        u32 run = 1;
+        while(run < TRANSFORM_LANES && slots[i + run] == slot + run)
+        {
+            run++;
+        }
+        if(run < TRANSFORM_LANES)
+        {
+            world[slot] = mul(world[parent[slot]], transform_compose(tree->positions[slot], tree->rotations[slot],
+                                                                     tree->sizes[slot]));
+            tree->dirty[slot] = 0;
+            i++;
+            continue;
+        }
+        
+        transform_compose8(tree->positions + slot, tree->rotations + slot, tree->sizes + slot, composed);
+        for(u32 lane = 0; lane < TRANSFORM_LANES; lane++)
+        {
+            world[slot + lane] = mul(world[parent[slot + lane]], composed[lane]);
+        }
+        memset(tree->dirty + slot, 0, TRANSFORM_LANES * sizeof(u8));
+        i += TRANSFORM_LANES;
+    }
+#endif
+    for(; i < one_past_last; i++)
+    {
+        u32 slot = slots[i];
+        world[slot] = mul(world[parent[slot]], transform_compose(tree->positions[slot], tree->rotations[slot],
+                                                                 tree->sizes[slot]));
+        tree->dirty[slot] = 0;
+    }
+}
+
+// NOTE: Appends the slots of a level that need a new world to the visited list, the
+// children of the slots that changed in the level above and the dirty ones that
+// aren't among them. Gives up and returns false once there are more than limit.
+static bool
+transform_tree_list_level(TransformTree *tree, u32 level, u32 above_first, u32 above_end, u32 limit)
+{
+    u32 list_first = tree->visited_len;
+    for(u32 i = above_first; i < above_end; i++)
+    {
+        u32 above = tree->visited[i];
+        u32 child = tree->children_first[above];
+        u32 children_end = child + tree->children_len[above];
+        if(tree->visited_len - list_first + children_end - child > limit)
+        {
+            return false;
+        }
+        
+        for(; child < children_end; child++)
+        {
+            tree->changed[child] = 1;
+            tree->visited[tree->visited_len++] = child;
+        }
+    }
+    
+    for(u32 slot = tree->dirty_first[level]; slot != TRANSFORM_TREE_NONE; slot = tree->dirty_next[slot])
+    {
+        if(!tree->changed[slot])
+        {
+            if(tree->visited_len - list_first == limit)
+            {
+                return false;
+            }
+            tree->changed[slot] = 1;
+            tree->visited[tree->visited_len++] = slot;
+        }
+    }
+    
+    return true;
+}
+
+// NOTE: Goes through the slots that need it one by one while there are few of
+// them, once a level has too many every slot of the rest of the levels gets
+// checked instead. The changed flags of the last update get cleared first, while
+// its slots are still where they were.
+static void
+transform_tree_update(TransformTree *tree, JobQueue *jobs)
+{
+    f64 start = glfwGetTime();
+    for(u32 i = 0; i < tree->visited_len; i++)
+    {
+        tree->changed[tree->visited[i]] = 0;
+    }
+    memset(tree->changed + tree->range_first, 0, (tree->count - tree->range_first) * sizeof(u8));
+    
+    if(tree->unsorted)
+    {
+        transform_tree_sort(tree);
+    }
+    
+    tree->visited_len = 0;
+    u32 above_first = 0;
+    u32 level = 1;
+    for(; level < tree->levels_len; level++)
+    {
+        u32 level_len = tree->level_first[level + 1] - tree->level_first[level];
+        u32 limit = MAX(level_len / TRANSFORM_TREE_LIST_FRACTION, TRANSFORM_TREE_MIN_BATCH);
+        u32 list_first = tree->visited_len;
+        if(!transform_tree_list_level(tree, level, above_first, list_first, limit))
+        {
+            tree->visited_len = list_first;
+            break;
+        }
+        
+        TransformTreeLevel batch = {};
+        batch.tree = tree;
+        batch.slots = tree->visited + list_first;
+        jobs_parallel_for(jobs, tree->visited_len - list_first, TRANSFORM_TREE_MIN_BATCH,
+                          transform_tree_list_job, &batch);
+        above_first = list_first;
+    }
+    
+    tree->range_first = tree->level_first[level];
+    for(; level < tree->levels_len; level++)
+    {
+        TransformTreeLevel batch = {};
+        batch.tree = tree;
+        batch.first = tree->level_first[level];
+        jobs_parallel_for(jobs, tree->level_first[level + 1] - batch.first, TRANSFORM_TREE_MIN_BATCH,
+                          transform_tree_level_job, &batch);
+    }
+    
+    for(level = 0; level < tree->levels_len; level++)
+    {
+        tree->dirty_first[level] = TRANSFORM_TREE_NONE;
+    }
+    tree->last_visited = tree->visited_len + tree->count - tree->range_first;
+    tree->last_update_time = glfwGetTime() - start;
+}
+
+static Mat4
+transform_tree_world(TransformTree *tree, u32 node)
+{
+    return tree->world[tree->slot_of[node]];
+}
+
+static bool
+transform_tree_changed(TransformTree *tree, u32 node)
+{
+    return tree->changed[tree->slot_of[node]];
+}
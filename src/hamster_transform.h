@@ -0,0 +1,120 @@
+/* date = October 19th 2026 11:50 pm */
+
+#ifndef HAMSTER_TRANSFORM_H
+#define HAMSTER_TRANSFORM_H
+
+#define TRANSFORM_LANES 8
+// NOTE: Below this many points per job the threads cost more than the
+// transforms, anything smaller than one batch runs inline.
+#define TRANSFORM_MIN_BATCH 8192
+
+// NOTE: One array per component, for writing straight into SoA buffers like the
+// cull set or for the wide kernels that come after. Offsetting a Vec3Array
+// (see vec3_array_offset) gives a view into the middle of one.
+struct Vec3Array
+{
+    f32 *x;
+    f32 *y;
+    f32 *z;
+};
+
+// NOTE: Shared by the job, w is 1 for points and 0 for directions
+struct TransformBatch
+{
+    Mat4 transform;
+    f32 w;
+    Vec3 *input;
+    Vec3Array output;
+};
+
+// NOTE: Node 0, identity, everything else hangs somewhere under it
+#define TRANSFORM_TREE_ROOT 0
+// NOTE: Slots of one level per job, a level smaller than that runs inline
+#define TRANSFORM_TREE_MIN_BATCH 4096
+// NOTE: Ends a per level dirty list
+#define TRANSFORM_TREE_NONE U32MAX
+// NOTE: A level only goes through its changed slots while they are at most one in
+// this many of it (or one batch), past that the whole level is cheaper
+#define TRANSFORM_TREE_LIST_FRACTION 4
+
+// NOTE: Parent/child transforms as SoA sorted breadth first, every level is one run
+// of slots (level_first[d] up to level_first[d + 1]) and inside of a level the
+// slots go in the order of their parents, so the children of a slot are one run
+// too (children_first up to children_first + children_len). An update goes level by level, a level only reads the one above. While few
+// nodes changed it only visits the dirty ones and the children of the ones that
+// changed in the level above, after that every slot of the remaining levels gets
+// split across the job queue. Node handles stay the same when the slots get
+// re-sorted after adding or reparenting, slot_of maps a node to its slot.
+struct TransformTree
+{
+    // NOTE: By slot
+    u32 *parent; // NOTE: Slot of the parent, the root's is itself
+    u32 *depth;
+    u32 *node_of;
+    Vec3 *positions;
+    Quat *rotations;
+    Vec3 *sizes;
+    Mat4 *world;
+    u8 *dirty; // NOTE: The local transform changed since the last update
+    u8 *changed; // NOTE: World recomputed by the last update, dirty or under a dirty node
+    u32 *dirty_next; // NOTE: Next dirty slot of the same level
+    u32 *children_first; // NOTE: Only kept while sorted, like the dirty lists
+    u32 *children_len;
+    
+    // NOTE: By node
+    u32 *slot_of;
+    
+    // NOTE: By level, levels_len + 1 entries
+    u32 *level_first;
+    u32 *dirty_first; // NOTE: First dirty slot of the level, only kept while sorted
+    u32 levels_len;
+    u32 count;
+    u32 capacity;
+    
+    bool unsorted;
+    
+    // NOTE: Slots the last update went through one by one, and where it switched to
+    // whole levels (count if it never did), the next one clears their changed flags
+    u32 *visited;
+    u32 visited_len;
+    u32 range_first;
+    
+    u32 last_visited;
+    f64 last_update_time;
+};
+
+// NOTE: Either a run of slots from first or, with slots set, a list of them
+struct TransformTreeLevel
+{
+    TransformTree *tree;
+    u32 first;
+    u32 *slots;
+};
+
+static Mat4 transform_compose(Vec3 position, Quat rotation, Vec3 size, Mat4 *inversed = NULL);
+
+static TransformTree transform_tree_create(u32 capacity);
+static void transform_tree_destroy(TransformTree *tree);
+static u32 transform_tree_add(TransformTree *tree, u32 parent, Vec3 position, Quat rotation, Vec3 size);
+static void transform_tree_set_local(TransformTree *tree, u32 node, Vec3 position, Quat rotation, Vec3 size);
+static void transform_tree_set_parent(TransformTree *tree, u32 node, u32 parent);
+static void transform_tree_update(TransformTree *tree, JobQueue *jobs);
+static Mat4 transform_tree_world(TransformTree *tree, u32 node);
+static bool transform_tree_changed(TransformTree *tree, u32 node);
+
+static Vec3Array vec3_array_create(u32 count);
+static void vec3_array_destroy(Vec3Array *array);
+static Vec3Array vec3_array_offset(Vec3Array array, u32 offset);
+static Vec3 vec3_array_get(Vec3Array array, u32 index);
+
+static void transform_points(Mat4 transform, Vec3 *points, u32 count, Vec3Array out);
+static void transform_points(Mat4 transform, Vec3Array points, u32 count, Vec3Array out);
+static void transform_directions(Mat4 transform, Vec3 *directions, u32 count, Vec3Array out);
+static void transform_directions(Mat4 transform, Vec3Array directions, u32 count, Vec3Array out);
+static void transform_boxes(Mat4 transform, Vec3Array local_min, Vec3Array local_max, u32 count,
+                            Vec3Array min, Vec3Array max);
+static void transform_points_batch(JobQueue *jobs, Mat4 transform, Vec3 *points, u32 count, Vec3Array out);
+static void transform_directions_batch(JobQueue *jobs, Mat4 transform, Vec3 *directions, u32 count,
+                                       Vec3Array out);
+                                       
+#endif //HAMSTER_TRANSFORM_H
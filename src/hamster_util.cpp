@@ -318,6 +318,9 @@ editor_tick(ProgramState *state)
                                 scale(picked->last_axis.direction, t1_scalar));
         
         picked->entity->position = new_position;
+        FLAG_SET(picked->entity->flags, ENTITY_FLAGS_TRANSFORM_DIRTY);
+        entity_tree_move(&state->entity_tree, state->entities, (u32)(picked->entity - state->entities));
+        broadphase_move(&state->broadphase, state->entities, (u32)(picked->entity - state->entities));
     }
     
 }
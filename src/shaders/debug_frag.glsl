@@ -0,0 +1,10 @@
+#version 330 core
+
+in vec3 pixel_color_in;
+
+out vec4 pixel_color;
+
+void main()
+{
+    pixel_color = vec4(pixel_color_in, 1.0);
+}
@@ -0,0 +1,15 @@
+#version 330 core
+layout (location = 0) in vec3 vertex_pos;
+layout (location = 1) in vec3 vertex_color;
+layout (location = 2) in mat4 instance_transform;
+
+uniform mat4 proj;
+uniform mat4 view;
+
+out vec3 pixel_color_in;
+
+void main()
+{
+    pixel_color_in = vertex_color;
+	gl_Position = proj * view * instance_transform * vec4(vertex_pos, 1.0);
+}
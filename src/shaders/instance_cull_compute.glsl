@@ -0,0 +1,69 @@
+#version 430 core
+layout (local_size_x = 64) in;
+
+struct DrawCommand
+{
+    uint count;
+    uint instance_count;
+    uint first_index;
+    uint base_vertex;
+    uint base_instance;
+};
+
+layout (std430, binding = 0) readonly buffer Instances { uint instances[]; };
+layout (std430, binding = 1) writeonly buffer Culled { uint culled[]; };
+layout (std430, binding = 2) buffer Commands { DrawCommand commands[]; };
+
+uniform vec4 frustum_planes[6];
+uniform vec4 bounds;
+uniform uint instances_count;
+uniform uint instance_words;
+uniform bool half_scale;
+
+const uint CULLED_WORDS = 8u;
+
+vec3 quat_rotate(vec4 q, vec3 v)
+{
+    vec3 t = 2.0 * cross(q.xyz, v);
+    return v + q.w * t + cross(q.xyz, t);
+}
+
+void main()
+{
+    uint id = gl_GlobalInvocationID.x;
+    if(id >= instances_count)
+    {
+        return;
+    }
+    
+    // NOTE: Same layout as InstanceData/InstanceDataHalf on the CPU side
+    uint base = id * instance_words;
+    vec3 position = uintBitsToFloat(uvec3(instances[base + 0u], instances[base + 1u], instances[base + 2u]));
+    vec4 rotation = normalize(vec4(unpackSnorm2x16(instances[base + 3u]), unpackSnorm2x16(instances[base + 4u])));
+    vec3 scale;
+    if(half_scale)
+    {
+        scale = vec3(unpackHalf2x16(instances[base + 5u]), unpackHalf2x16(instances[base + 6u]).x);
+    }
+    else
+    {
+        scale = uintBitsToFloat(uvec3(instances[base + 5u], instances[base + 6u], instances[base + 7u]));
+    }
+    
+    vec3 center = position + quat_rotate(rotation, bounds.xyz * scale);
+    float radius = bounds.w * max(abs(scale.x), max(abs(scale.y), abs(scale.z)));
+    for(int i = 0; i < 6; i++)
+    {
+        if(dot(frustum_planes[i].xyz, center) + frustum_planes[i].w + radius <= 0.0)
+        {
+            return;
+        }
+    }
+    
+    uint slot = atomicAdd(commands[0].instance_count, 1u);
+    uint dest = slot * CULLED_WORDS;
+    for(uint i = 0u; i < instance_words; i++)
+    {
+        culled[dest + i] = instances[base + i];
+    }
+}
@@ -0,0 +1,21 @@
+#version 330 core
+layout (points) in;
+layout (points, max_vertices = 1) out;
+
+flat in uvec4 vertex_lo[];
+flat in uvec4 vertex_hi[];
+flat in int visible[];
+
+flat out uvec4 culled_lo;
+flat out uvec4 culled_hi;
+
+void main()
+{
+    if(visible[0] != 0)
+    {
+        culled_lo = vertex_lo[0];
+        culled_hi = vertex_hi[0];
+        EmitVertex();
+        EndPrimitive();
+    }
+}
@@ -0,0 +1,65 @@
+#version 330 core
+layout (location = 0) in uvec4 instance_lo;
+layout (location = 1) in uvec4 instance_hi;
+
+uniform vec4 frustum_planes[6];
+uniform vec4 bounds;
+uniform bool half_scale;
+
+flat out uvec4 vertex_lo;
+flat out uvec4 vertex_hi;
+flat out int visible;
+
+vec3 quat_rotate(vec4 q, vec3 v)
+{
+    vec3 t = 2.0 * cross(q.xyz, v);
+    return v + q.w * t + cross(q.xyz, t);
+}
+
+// NOTE: No unpackSnorm2x16/unpackHalf2x16 in 3.30, do it by hand
+vec2 unpack_snorm(uint word)
+{
+    int lo = int(word << 16) >> 16;
+    int hi = int(word) >> 16;
+    return clamp(vec2(lo, hi) / 32767.0, -1.0, 1.0);
+}
+
+float half_to_float(uint h)
+{
+    uint exponent = (h >> 10) & 0x1fu;
+    uint mantissa = h & 0x3ffu;
+    float value = exponent == 0u ? float(mantissa) * exp2(-24.0) :
+        (1.0 + float(mantissa) / 1024.0) * exp2(float(exponent) - 15.0);
+    return (h & 0x8000u) != 0u ? -value : value;
+}
+
+void main()
+{
+    vertex_lo = instance_lo;
+    vertex_hi = instance_hi;
+    
+    vec3 position = uintBitsToFloat(instance_lo.xyz);
+    vec4 rotation = normalize(vec4(unpack_snorm(instance_lo.w), unpack_snorm(instance_hi.x)));
+    vec3 scale;
+    if(half_scale)
+    {
+        scale = vec3(half_to_float(instance_hi.y & 0xffffu), half_to_float(instance_hi.y >> 16),
+                     half_to_float(instance_hi.z & 0xffffu));
+    }
+    else
+    {
+        scale = uintBitsToFloat(instance_hi.yzw);
+    }
+    
+    vec3 center = position + quat_rotate(rotation, bounds.xyz * scale);
+    float radius = bounds.w * max(abs(scale.x), max(abs(scale.y), abs(scale.z)));
+    
+    visible = 1;
+    for(int i = 0; i < 6; i++)
+    {
+        if(dot(frustum_planes[i].xyz, center) + frustum_planes[i].w + radius <= 0.0)
+        {
+            visible = 0;
+        }
+    }
+}
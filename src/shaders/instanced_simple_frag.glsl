@@ -34,7 +34,8 @@ in vec3 pixel_pos;
 in vec4 light_moved_pixel_pos;
 in vec3 pixel_normal;
 in vec2 pixel_texuv;
-out vec4 pixel_color;
+layout(location = 0) out vec4 pixel_color;
+layout(location = 1) out uint pixel_id;
 
 uniform vec3 view_pos;
 uniform vec3 light_pos;
@@ -53,6 +54,8 @@ vec3 calculate_direct_light(DirectionalLight light, Material material, vec3 diff
 
 void main()
 {
+    pixel_id = 0u;
+    
     vec2 _uv = pixel_texuv;
     vec3 _normal = normalize(pixel_normal);
     vec3 view_dir = normalize(view_pos - pixel_pos);
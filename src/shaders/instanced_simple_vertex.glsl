@@ -2,7 +2,9 @@
 layout (location = 0) in vec3 vertex_pos;
 layout (location = 1) in vec2 texuv;
 layout (location = 2) in vec3 normal;
-layout (location = 3) in mat4 instanceMatrix;
+layout (location = 3) in vec3 instance_position;
+layout (location = 4) in vec4 instance_rotation;
+layout (location = 5) in vec3 instance_scale;
 
 uniform mat4 proj;
 uniform mat4 view;
@@ -13,13 +15,25 @@ out vec3 pixel_pos;
 out vec3 pixel_normal;
 out vec2 pixel_texuv;
 
+// NOTE: q.xyz is the vector part, q.w the scalar part
+vec3 quat_rotate(vec4 q, vec3 v)
+{
+    vec3 t = 2.0 * cross(q.xyz, v);
+    return v + q.w * t + cross(q.xyz, t);
+}
+
 void main()
 {
-    vec3 frag_pos = vec3(instanceMatrix * vec4(vertex_pos, 1.0));
+    // NOTE: The rotation was quantized, renormalize so it doesn't scale the mesh
+    vec4 q = normalize(instance_rotation);
+    
+    // NOTE: model = T * R * S, so the normal matrix (R * S^-1) is just a rotation
+    // of the normal divided by the scale, no inverse needed.
+    vec3 frag_pos = quat_rotate(q, vertex_pos * instance_scale) + instance_position;
     pixel_pos = frag_pos;
     light_moved_pixel_pos = light_proj_view * vec4(frag_pos, 1.0);
-	pixel_normal = mat3(transpose(inverse(instanceMatrix))) * normal;
+	pixel_normal = quat_rotate(q, normal / instance_scale);
 	pixel_texuv = texuv;
     
-    gl_Position = proj * view * instanceMatrix * vec4(vertex_pos, 1.0); 
-}
\ No newline at end of file
+    gl_Position = proj * view * vec4(frag_pos, 1.0); 
+}
@@ -1,8 +0,0 @@
-#version 330 core
-
-out vec4 pixel_color;
-
-void main()
-{
-    pixel_color = vec4(1.0, 0.0, 0.0, 1.0);
-}
\ No newline at end of file
@@ -50,7 +50,11 @@ in vec2 pixel_texuv;
 in vec3 tangent_view_pos;
 in vec3 tangent_light_pos;
 in mat3 in_tbn;
-out vec4 pixel_color;
+in vec4 pixel_baked_light;
+layout(location = 0) out vec4 pixel_color;
+layout(location = 1) out uint pixel_id;
+
+uniform uint object_id;
 
 uniform SpotLight spotlight;
 uniform DirectionalLight direct_light;
@@ -60,6 +64,9 @@ uniform sampler2D diffuse_map;
 uniform sampler2D specular_map;
 uniform sampler2D normal_map;
 uniform sampler2D shadow_map;
+uniform sampler2D lightmap;
+uniform bool use_baked_light;
+uniform bool use_lightmap;
 uniform bool show_normal_map;
 uniform bool use_mapped_normals;
 
@@ -71,6 +78,8 @@ float eval_shadow(vec4 light_moved_pixel_pos, sampler2D shadow_map);
 
 void main()
 {
+    pixel_id = object_id;
+    
     if(show_normal_map)
     {
         vec3 mapped_normal = normalize(texture(normal_map, pixel_texuv).rgb);
@@ -105,6 +114,13 @@ void main()
         vec3 point_shade = eval_point_light(point_light, material, diffuse_map_factor, specular_map_factor, _normal, pixel_pos, view_dir);
         float shadow = eval_shadow(light_moved_pixel_pos, shadow_map);
         vec3 result = spot_shade + ((1.0 - shadow) * direct_shade) + point_shade;
+        if(use_baked_light)
+        {
+            // NOTE: Same as in simple_frag, the ambient gets occluded instead of shadowed
+            vec4 baked = use_lightmap ? texture(lightmap, pixel_texuv) : pixel_baked_light;
+            vec3 ambient = direct_light.ambient_component * material.ambient_component;
+            result += ambient * (baked.a - (1.0 - shadow)) + baked.rgb * diffuse_map_factor * material.diffuse_component;
+        }
         result = clamp(result, 0.0, 1.0);
         
         pixel_color = vec4(result, 1.0);
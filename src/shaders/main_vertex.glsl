@@ -4,10 +4,12 @@ layout (location = 1) in vec2 texuv;
 layout (location = 2) in vec3 normal;
 layout (location = 3) in vec3 tangent;
 layout (location = 4) in vec3 bitangent;
+layout (location = 6) in vec4 baked_light;
 
 uniform mat4 proj;
 uniform mat4 view;
 uniform mat4 model;
+uniform mat4 normal_matrix; // NOTE: transpose(inverse(model)), done once on the CPU
 uniform vec3 view_pos;
 uniform vec3 light_pos;
 uniform mat4 light_proj_view;
@@ -19,10 +21,11 @@ out vec3 tangent_view_pos;
 out vec3 tangent_light_pos;
 out vec4 light_moved_pixel_pos;
 out mat3 in_tbn;
+out vec4 pixel_baked_light;
 
 void main()
 {
-    mat3 normalMatrix = transpose(inverse(mat3(model)));
+    mat3 normalMatrix = mat3(normal_matrix);
     vec3 T = normalize(normalMatrix * tangent);
     vec3 N = normalize(normalMatrix * normal);
     vec3 B = normalize(normalMatrix * bitangent);
@@ -35,8 +38,9 @@ void main()
     tangent_view_pos = view_pos;
     tangent_light_pos = light_pos;
     
-	pixel_normal = mat3(transpose(inverse(model))) * normal;
+	pixel_normal = normalMatrix * normal;
 	pixel_texuv = texuv;
+    pixel_baked_light = baked_light;
     in_tbn = tbn;
     
 	gl_Position = proj * view * model * vec4(vertex_pos.xyz, 1.0);
@@ -34,7 +34,11 @@ in vec3 pixel_pos;
 in vec4 light_moved_pixel_pos;
 in vec3 pixel_normal;
 in vec2 pixel_texuv;
-out vec4 pixel_color;
+in vec4 pixel_baked_light;
+layout(location = 0) out vec4 pixel_color;
+layout(location = 1) out uint pixel_id;
+
+uniform uint object_id;
 
 uniform vec3 view_pos;
 uniform vec3 light_pos;
@@ -43,6 +47,9 @@ uniform DirectionalLight direct_light;
 uniform Material material;
 uniform sampler2D tex_sampler;
 uniform sampler2D shadow_map;
+uniform sampler2D lightmap;
+uniform bool use_baked_light;
+uniform bool use_lightmap;
 
 float eval_shadow(vec4 light_moved_pixel_pos, sampler2D shadow_map);
 // NOTE(mateusz): This shader differs from the main shader only in
@@ -53,6 +60,8 @@ vec3 calculate_direct_light(DirectionalLight light, Material material, vec3 diff
 
 void main()
 {
+    pixel_id = object_id;
+    
     vec2 _uv = pixel_texuv;
     vec3 _normal = normalize(pixel_normal);
     vec3 view_dir = normalize(view_pos - pixel_pos);
@@ -63,6 +72,14 @@ void main()
     vec3 direct_shade = calculate_direct_light(direct_light, material, neutral_diffuse, neutral_specular, _normal, view_dir);
     float shadow = eval_shadow(light_moved_pixel_pos, shadow_map);
     vec3 result = spot_shade + ((1.0 - shadow) * direct_shade);
+    if(use_baked_light)
+    {
+        // NOTE: The flat ambient (which the shadow also took away) becomes the baked
+        // occlusion times ambient, plus the light bounced off the static geometry
+        vec4 baked = use_lightmap ? texture(lightmap, pixel_texuv) : pixel_baked_light;
+        vec3 ambient = direct_light.ambient_component * material.ambient_component;
+        result += ambient * (baked.a - (1.0 - shadow)) + baked.rgb * material.diffuse_component;
+    }
     
     pixel_color = texture(tex_sampler, pixel_texuv) * vec4(result, 1.0);
 }
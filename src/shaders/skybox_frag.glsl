@@ -3,9 +3,11 @@
 in vec3 pixel_texuv;
 uniform samplerCube skybox_sampler;
 
-out vec4 pixel_color;
+layout(location = 0) out vec4 pixel_color;
+layout(location = 1) out uint pixel_id;
 
 void main()
 {
+    pixel_id = 0u;
     pixel_color = texture(skybox_sampler, pixel_texuv);
 }
\ No newline at end of file
@@ -0,0 +1,51 @@
+#version 330 core
+layout (points) in;
+layout (points, max_vertices = 20) out;
+
+flat in uvec4 vertex_lo[];
+flat in uvec4 vertex_hi[];
+
+flat out uvec4 child_lo;
+flat out uvec4 child_hi;
+
+// NOTE: q.xyz is the vector part, q.w the scalar part
+vec3 quat_rotate(vec4 q, vec3 v)
+{
+    vec3 t = 2.0 * cross(q.xyz, v);
+    return v + q.w * t + cross(q.xyz, t);
+}
+
+// NOTE: Two snorm16 components per word, the first one in the low half
+vec2 unpack_snorm16(uint word)
+{
+    ivec2 halves = ivec2(int(word << 16u) >> 16, int(word) >> 16);
+    return max(vec2(halves) / 32767.0, -1.0);
+}
+
+// NOTE: Words are laid out like InstanceData (full float scale), position in lo.xyz,
+// rotation in lo.w and hi.x, scale in hi.yzw. Children keep the parent's rotation
+// and sit at offsets rotated by it, same as sponge_division_job on the CPU.
+void main()
+{
+    vec3 position = uintBitsToFloat(vertex_lo[0].xyz);
+    vec3 size = uintBitsToFloat(vertex_hi[0].yzw) / 3.0;
+    vec4 rotation = normalize(vec4(unpack_snorm16(vertex_lo[0].w), unpack_snorm16(vertex_hi[0].x)));
+    
+    for(int x = -1; x < 2; x++)
+    {
+        for(int y = -1; y < 2; y++)
+        {
+            for(int z = -1; z < 2; z++)
+            {
+                if(abs(x) + abs(y) + abs(z) > 1)
+                {
+                    vec3 offset = quat_rotate(rotation, vec3(x, y, z) * size);
+                    child_lo = uvec4(floatBitsToUint(position + offset), vertex_lo[0].w);
+                    child_hi = uvec4(vertex_hi[0].x, floatBitsToUint(size));
+                    EmitVertex();
+                    EndPrimitive();
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,12 @@
+#version 330 core
+layout (location = 0) in uvec4 instance_lo;
+layout (location = 1) in uvec4 instance_hi;
+
+flat out uvec4 vertex_lo;
+flat out uvec4 vertex_hi;
+
+void main()
+{
+    vertex_lo = instance_lo;
+    vertex_hi = instance_hi;
+}
@@ -0,0 +1,433 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <ctime>
+#include <cstdarg>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <x86intrin.h>
+
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+
+#include <libs/imgui/imgui.h>
+#include <libs/imgui/imgui_impl_glfw.h>
+#include <libs/imgui/imgui_impl_opengl3.h>
+
+#include "libs/stb/stb_image.h"
+
+// NOTE: The whole engine like hamster.cpp has it, minus main. Nothing in here
+// touches GL, the meshes are filled in by hand and never uploaded.
+#include "src/hamster_math.h"
+#include "src/hamster_util.h"
+#include "src/hamster_jobs.h"
+#include "src/hamster_transform.h"
+#include "src/hamster_graphics.h"
+#include "src/hamster_scene.h"
+#include "src/hamster_cull.h"
+#include "src/hamster_occlusion.h"
+#include "src/hamster_bvh.h"
+#include "src/hamster_broadphase.h"
+#include "src/hamster_bake.h"
+#include "src/hamster_render.h"
+#include "src/hamster.h"
+
+#include "src/hamster_math.cpp"
+#include "src/hamster_util.cpp"
+#include "src/hamster_jobs.cpp"
+#include "src/hamster_transform.cpp"
+#include "src/hamster_graphics.cpp"
+#include "src/hamster_scene.cpp"
+#include "src/hamster_cull.cpp"
+#include "src/hamster_occlusion.cpp"
+#include "src/hamster_bvh.cpp"
+#include "src/hamster_broadphase.cpp"
+#include "src/hamster_bake.cpp"
+#include "src/hamster_render.cpp"
+
+// NOTE: Checks mesh_bvh_intersect and ray_intersect_entity against every triangle
+// NOTE: Checks the pairs of both broadphase backends against every pair of proxies
+// tested one by one, built with `make test`. Pass "bench" (and optionally a thread
+// count) to time both on 50k boxes that all move every frame.
+
+#define TEST_ENTITIES 1500
+#define TEST_ADDED 500
+#define TEST_FRAMES 5
+#define TEST_SPACE 30.0f // NOTE: Half the side of the cube the test entities are in
+#define BENCH_ENTITIES 50000
+#define BENCH_SPACE 100.0f
+#define BENCH_FRAMES 10
+
+// NOTE: One box, two boxes next to each other (two proxies per entity) and one
+// without hitboxes that the broadphase bounds by its vertices
+struct TestModels
+{
+    Hitbox box_hitbox;
+    Hitbox pair_hitboxes[2];
+    Vec3 bare_vertices[8];
+    Mesh bare_mesh;
+    
+    Model box;
+    Model pair;
+    Model bare;
+};
+
+static void
+test_models_init(TestModels *models)
+{
+    models->box_hitbox.refpoint = Vec3(-0.5f, -0.5f, -0.5f);
+    models->box_hitbox.size = Vec3(1.0f, 1.0f, 1.0f);
+    models->box.hitboxes = &models->box_hitbox;
+    models->box.hitboxes_len = 1;
+    
+    models->pair_hitboxes[0].refpoint = Vec3(-1.0f, -0.5f, -0.5f);
+    models->pair_hitboxes[0].size = Vec3(0.9f, 1.0f, 1.0f);
+    models->pair_hitboxes[1].refpoint = Vec3(1.0f, -0.5f, -0.5f);
+    models->pair_hitboxes[1].size = Vec3(-0.9f, 1.0f, 1.0f); // NOTE: Negative sizes happen in the scenes too
+    models->pair.hitboxes = models->pair_hitboxes;
+    models->pair.hitboxes_len = 2;
+    
+    for(u32 i = 0; i < 8; i++)
+    {
+        models->bare_vertices[i] = Vec3(i & 1 ? 0.6f : -0.4f, i & 2 ? 0.5f : -0.5f, i & 4 ? 0.3f : -0.7f);
+    }
+    models->bare_mesh.vertices.positions = models->bare_vertices;
+    models->bare_mesh.vertices_len = 8;
+    models->bare.meshes = &models->bare_mesh;
+    models->bare.meshes_len = 1;
+}
+
+static Vec3
+test_random_vec3(RandomSeries *series, f32 scale)
+{
+    return Vec3(random_bilateral(series) * scale, random_bilateral(series) * scale, random_bilateral(series) * scale);
+}
+
+static void
+test_place(Entity *entity, RandomSeries *series, f32 space)
+{
+    entity->position = test_random_vec3(series, space);
+    entity->rotate = create_qrot(random_bilateral(series) * 3.0f, noz(add(test_random_vec3(series, 1.0f),
+                                                                          Vec3(0.0f, 1.5f, 0.0f))));
+    FLAG_SET(entity->flags, ENTITY_FLAGS_TRANSFORM_DIRTY);
+}
+
+// NOTE: Every 50th entity is large enough to stay out of the hash, the two slabs
+// going through the whole scene always are
+static void
+test_entities(Entity *entities, u32 first, u32 count, TestModels *models, RandomSeries *series)
+{
+    for(u32 i = first; i < count; i++)
+    {
+        Entity *entity = entities + i;
+        memset(entity, 0, sizeof(*entity));
+        u32 kind = i % 3;
+        entity->model = kind == 0 ? &models->box : kind == 1 ? &models->pair : &models->bare;
+        f32 size = 0.3f + random_unilateral(series) * 2.5f;
+        if(i % 50 == 0)
+        {
+            size *= 8.0f;
+        }
+        entity->size = Vec3(size, size * (0.5f + random_unilateral(series)), size);
+        test_place(entity, series, TEST_SPACE);
+    }
+    
+    if(first == 0)
+    {
+        entities[0].model = &models->box;
+        entities[0].position = Vec3(0.0f, -2.0f, 0.0f);
+        entities[0].rotate = Quat();
+        entities[0].size = Vec3(2.0f * TEST_SPACE, 0.5f, 2.0f * TEST_SPACE);
+        entities[1].model = &models->pair;
+        entities[1].position = Vec3(0.0f, 0.0f, 5.0f);
+        entities[1].rotate = create_qrot(0.3f, Vec3(0.0f, 1.0f, 0.0f));
+        entities[1].size = Vec3(TEST_SPACE, 0.5f, 1.0f);
+    }
+}
+
+static int
+test_pair_compare(const void *a, const void *b)
+{
+    BroadphasePair *pa = (BroadphasePair *)a;
+    BroadphasePair *pb = (BroadphasePair *)b;
+    u32 ka[4] = { pa->entity_a, pa->mesh_a, pa->entity_b, pa->mesh_b };
+    u32 kb[4] = { pb->entity_a, pb->mesh_a, pb->entity_b, pb->mesh_b };
+    for(u32 i = 0; i < 4; i++)
+    {
+        if(ka[i] != kb[i])
+        {
+            return ka[i] < kb[i] ? -1 : 1;
+        }
+    }
+    
+    return 0;
+}
+
+// NOTE: Every pair of proxies with their boxes tested one at a time, touching counts
+static BroadphasePair *
+brute_force_pairs(Broadphase *bp, u32 *pairs_len)
+{
+    u32 capacity = 1024;
+    u32 len = 0;
+    BroadphasePair *pairs = (BroadphasePair *)malloc(capacity * sizeof(BroadphasePair));
+    BroadphaseBoxes *b = &bp->bounds;
+    for(u32 i = 0; i < bp->proxies_len; i++)
+    {
+        for(u32 j = i + 1; j < bp->proxies_len; j++)
+        {
+            bool overlap = b->min_x[i] <= b->max_x[j] && b->max_x[i] >= b->min_x[j] &&
+                b->min_y[i] <= b->max_y[j] && b->max_y[i] >= b->min_y[j] &&
+                b->min_z[i] <= b->max_z[j] && b->max_z[i] >= b->min_z[j];
+            if(!overlap || bp->proxy_entity[i] == bp->proxy_entity[j])
+            {
+                continue;
+            }
+            
+            if(len == capacity)
+            {
+                capacity *= 2;
+                pairs = (BroadphasePair *)realloc(pairs, capacity * sizeof(BroadphasePair));
+            }
+            u32 a = bp->proxy_entity[i] < bp->proxy_entity[j] ? i : j;
+            u32 c = a == i ? j : i;
+            BroadphasePair *pair = pairs + len++;
+            pair->entity_a = bp->proxy_entity[a];
+            pair->mesh_a = bp->proxy_mesh[a];
+            pair->entity_b = bp->proxy_entity[c];
+            pair->mesh_b = bp->proxy_mesh[c];
+        }
+    }
+    
+    qsort(pairs, len, sizeof(BroadphasePair), test_pair_compare);
+    *pairs_len = len;
+    return pairs;
+}
+
+// NOTE: Pairs in one list and not the other, a pair reported twice counts too
+static u32
+test_pairs_differ(Broadphase *bp, BroadphasePair *reference, u32 reference_len)
+{
+    BroadphasePair *pairs = (BroadphasePair *)malloc(MAX(bp->pairs_len, 1) * sizeof(BroadphasePair));
+    memcpy(pairs, bp->pairs, bp->pairs_len * sizeof(BroadphasePair));
+    qsort(pairs, bp->pairs_len, sizeof(BroadphasePair), test_pair_compare);
+    
+    u32 result = 0;
+    u32 a = 0;
+    u32 b = 0;
+    while(a < bp->pairs_len || b < reference_len)
+    {
+        int order = a == bp->pairs_len ? 1 : b == reference_len ? -1 :
+            test_pair_compare(pairs + a, reference + b);
+        if(order == 0)
+        {
+            a++;
+            b++;
+        }
+        else
+        {
+            result++;
+            a += order < 0;
+            b += order > 0;
+        }
+    }
+    
+    free(pairs);
+    return result;
+}
+
+static bool
+test_check(const char *label, Broadphase *sweep, Broadphase *hash, Entity *entities, u32 count, JobQueue *jobs)
+{
+    broadphase_update(sweep, entities, count, jobs);
+    broadphase_update(hash, entities, count, jobs);
+    
+    u32 reference_len = 0;
+    BroadphasePair *reference = brute_force_pairs(sweep, &reference_len);
+    u32 sweep_differ = test_pairs_differ(sweep, reference, reference_len);
+    u32 hash_differ = test_pairs_differ(hash, reference, reference_len);
+    printf("%-16s %u proxies, %u large, %u pairs, sort and sweep %u differ, spatial hash %u differ\n",
+           label, hash->proxies_len, hash->large_len, reference_len, sweep_differ, hash_differ);
+    
+    free(reference);
+    return sweep_differ == 0 && hash_differ == 0;
+}
+
+static void
+test_move(Broadphase *sweep, Broadphase *hash, Entity *entities, u32 count, RandomSeries *series)
+{
+    for(u32 i = 2; i < count; i++)
+    {
+        if(random_unilateral(series) > 0.1f)
+        {
+            continue;
+        }
+        
+        Entity *entity = entities + i;
+        if(random_unilateral(series) < 0.2f)
+        {
+            test_place(entity, series, TEST_SPACE);
+        }
+        else
+        {
+            entity->position = add(entity->position, test_random_vec3(series, 1.5f));
+            FLAG_SET(entity->flags, ENTITY_FLAGS_TRANSFORM_DIRTY);
+        }
+        broadphase_move(sweep, entities, i);
+        broadphase_move(hash, entities, i);
+    }
+}
+
+static bool
+test_broadphase(JobQueue *jobs)
+{
+    TestModels models = {};
+    test_models_init(&models);
+    u32 count = TEST_ENTITIES;
+    Entity *entities = (Entity *)calloc(TEST_ENTITIES + TEST_ADDED + 8, sizeof(Entity));
+    RandomSeries series = { 2024 };
+    test_entities(entities, 0, count, &models, &series);
+    
+    Broadphase sweep = broadphase_create(16);
+    sweep.backend = BroadphaseBackend_SortAndSweep;
+    Broadphase hash = broadphase_create(16);
+    hash.backend = BroadphaseBackend_SpatialHash;
+    
+    bool ok = test_check("first update", &sweep, &hash, entities, count, jobs);
+    for(u32 frame = 0; frame < TEST_FRAMES; frame++)
+    {
+        test_move(&sweep, &hash, entities, count, &series);
+        ok = test_check("moved", &sweep, &hash, entities, count, jobs) && ok;
+    }
+    
+    // NOTE: Many at once get merged into the sorted order, a few get insertion sorted
+    test_entities(entities, count, count + TEST_ADDED, &models, &series);
+    count += TEST_ADDED;
+    ok = test_check("added many", &sweep, &hash, entities, count, jobs) && ok;
+    test_entities(entities, count, count + 8, &models, &series);
+    count += 8;
+    ok = test_check("added few", &sweep, &hash, entities, count, jobs) && ok;
+    
+    // NOTE: Smaller cells push more proxies over the large limit, bigger ones fewer
+    f32 cell_sizes[] = { 1.0f, 16.0f, BROADPHASE_DEFAULT_CELL_SIZE };
+    for(u32 i = 0; i < ARRAY_LEN(cell_sizes); i++)
+    {
+        hash.cell_size = cell_sizes[i];
+        test_move(&sweep, &hash, entities, count, &series);
+        char label[32];
+        snprintf(label, sizeof(label), "cell size %g", cell_sizes[i]);
+        ok = test_check(label, &sweep, &hash, entities, count, jobs) && ok;
+    }
+    
+    // NOTE: The hash doesn't follow the moves while the other backend runs
+    hash.backend = BroadphaseBackend_SortAndSweep;
+    test_move(&sweep, &hash, entities, count, &series);
+    ok = test_check("switched", &sweep, &hash, entities, count, jobs) && ok;
+    hash.backend = BroadphaseBackend_SpatialHash;
+    test_move(&sweep, &hash, entities, count, &series);
+    ok = test_check("switched back", &sweep, &hash, entities, count, jobs) && ok;
+    
+    broadphase_destroy(&sweep);
+    broadphase_destroy(&hash);
+    free(entities);
+    return ok;
+}
+
+// NOTE: All boxes move a little every frame, the times are only broadphase_update
+static void
+bench(JobQueue *jobs)
+{
+    TestModels models = {};
+    test_models_init(&models);
+    Entity *entities = (Entity *)calloc(BENCH_ENTITIES, sizeof(Entity));
+    Vec3 *starts = (Vec3 *)malloc(BENCH_ENTITIES * sizeof(Vec3));
+    Vec3 *velocities = (Vec3 *)malloc(BENCH_ENTITIES * sizeof(Vec3));
+    RandomSeries series = { 7 };
+    for(u32 i = 0; i < BENCH_ENTITIES; i++)
+    {
+        Entity *entity = entities + i;
+        entity->model = &models.box;
+        f32 size = 0.5f + random_unilateral(&series) * 1.5f;
+        entity->size = Vec3(size, size, size);
+        test_place(entity, &series, BENCH_SPACE);
+        starts[i] = entity->position;
+        velocities[i] = test_random_vec3(&series, 0.05f);
+    }
+    
+    BroadphaseBackend backends[] = { BroadphaseBackend_SortAndSweep, BroadphaseBackend_SpatialHash };
+    const char *names[] = { "sort and sweep", "spatial hash" };
+    for(u32 b = 0; b < ARRAY_LEN(backends); b++)
+    {
+        // NOTE: Both start from the same spot and see the same frames
+        for(u32 i = 0; i < BENCH_ENTITIES; i++)
+        {
+            entities[i].position = starts[i];
+            FLAG_SET(entities[i].flags, ENTITY_FLAGS_TRANSFORM_DIRTY);
+        }
+        Broadphase bp = broadphase_create(BENCH_ENTITIES);
+        bp.backend = backends[b];
+        
+        f64 start = glfwGetTime();
+        broadphase_update(&bp, entities, BENCH_ENTITIES, jobs);
+        f64 first = glfwGetTime() - start;
+        
+        f64 moves = 0.0;
+        f64 updates = 0.0;
+        for(u32 frame = 0; frame < BENCH_FRAMES; frame++)
+        {
+            start = glfwGetTime();
+            for(u32 i = 0; i < BENCH_ENTITIES; i++)
+            {
+                entities[i].position = add(entities[i].position, velocities[i]);
+                FLAG_SET(entities[i].flags, ENTITY_FLAGS_TRANSFORM_DIRTY);
+                broadphase_move(&bp, entities, i);
+            }
+            moves += glfwGetTime() - start;
+            
+            broadphase_update(&bp, entities, BENCH_ENTITIES, jobs);
+            updates += bp.last_update_time;
+        }
+        
+        printf("%-16s first update %.2f ms, then %.2f ms per frame (+%.2f ms of broadphase_move), %u pairs\n",
+               names[b], first * 1e3, updates / BENCH_FRAMES * 1e3, moves / BENCH_FRAMES * 1e3, bp.pairs_len);
+        
+        if(b == 0)
+        {
+            start = glfwGetTime();
+            u32 reference_len = 0;
+            BroadphasePair *reference = brute_force_pairs(&bp, &reference_len);
+            f64 brute = glfwGetTime() - start;
+            printf("brute force      %.2f ms, %u pairs, %u differ\n", brute * 1e3, reference_len,
+                   test_pairs_differ(&bp, reference, reference_len));
+            free(reference);
+        }
+        broadphase_destroy(&bp);
+    }
+    
+    free(starts);
+    free(velocities);
+    free(entities);
+}
+
+int main(int argc, char **argv)
+{
+    bool run_bench = argc > 1 && strcmp(argv[1], "bench") == 0;
+    
+    JobQueue jobs;
+    jobs_init(&jobs, run_bench && argc > 2 ? atoi(argv[2]) : 0);
+    
+    bool ok = test_broadphase(&jobs);
+    if(run_bench)
+    {
+        printf("threads          %u\n", jobs.threads_count);
+        bench(&jobs);
+    }
+    
+    jobs_shutdown(&jobs);
+    printf("%s\n", ok ? "OK" : "FAILED");
+    return ok ? 0 : 1;
+}
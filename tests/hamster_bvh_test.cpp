@@ -0,0 +1,396 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <ctime>
+#include <cstdarg>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <x86intrin.h>
+
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+
+#include <libs/imgui/imgui.h>
+#include <libs/imgui/imgui_impl_glfw.h>
+#include <libs/imgui/imgui_impl_opengl3.h>
+
+#include "libs/stb/stb_image.h"
+
+// NOTE: The whole engine like hamster.cpp has it, minus main. Nothing in here
+// touches GL, the meshes are filled in by hand and never uploaded.
+#include "src/hamster_math.h"
+#include "src/hamster_util.h"
+#include "src/hamster_jobs.h"
+#include "src/hamster_transform.h"
+#include "src/hamster_graphics.h"
+#include "src/hamster_scene.h"
+#include "src/hamster_cull.h"
+#include "src/hamster_occlusion.h"
+#include "src/hamster_bvh.h"
+#include "src/hamster_broadphase.h"
+#include "src/hamster_bake.h"
+#include "src/hamster_render.h"
+#include "src/hamster.h"
+
+#include "src/hamster_math.cpp"
+#include "src/hamster_util.cpp"
+#include "src/hamster_jobs.cpp"
+#include "src/hamster_transform.cpp"
+#include "src/hamster_graphics.cpp"
+#include "src/hamster_scene.cpp"
+#include "src/hamster_cull.cpp"
+#include "src/hamster_occlusion.cpp"
+#include "src/hamster_bvh.cpp"
+#include "src/hamster_broadphase.cpp"
+#include "src/hamster_bake.cpp"
+#include "src/hamster_render.cpp"
+
+// NOTE: Checks mesh_bvh_intersect and ray_intersect_entity against every triangle
+// going through ray_intersect_triangle, built with `make test`. Pass "bench" to time
+// both on a 1M triangle mesh.
+
+#define TEST_GRID 256 // NOTE: Quads per side of the heightfield, two triangles each
+#define BENCH_GRID 708
+#define TEST_RAYS 500
+#define TEST_STRIP 1024
+#define BENCH_RAYS 200
+// NOTE: Both go through the same Möller–Trumbore, only the wide kernel can differ
+// in the last bits of t
+#define TEST_MAX_ERROR 1e-5f
+
+static f32
+test_height(f32 x, f32 z)
+{
+    return sinf(x * 0.37f) * cosf(z * 0.29f) * 4.0f + sinf(x * 2.1f + z * 1.7f) * 0.5f;
+}
+
+// NOTE: A bumpy heightfield around the origin, rows of quads split in two
+static Mesh
+test_heightfield(u32 grid)
+{
+    Mesh result = {};
+    u32 side = grid + 1;
+    result.vertices_len = side * side;
+    result.indices_len = grid * grid * 6;
+    result.vertices.positions = (Vec3 *)malloc(result.vertices_len * sizeof(Vec3));
+    result.indices = (u32 *)malloc(result.indices_len * sizeof(u32));
+    
+    f32 spacing = 64.0f / grid;
+    for(u32 z = 0; z < side; z++)
+    {
+        for(u32 x = 0; x < side; x++)
+        {
+            f32 px = x * spacing - 32.0f;
+            f32 pz = z * spacing - 32.0f;
+            result.vertices.positions[z * side + x] = Vec3(px, test_height(px, pz), pz);
+        }
+    }
+    
+    u32 *index = result.indices;
+    for(u32 z = 0; z < grid; z++)
+    {
+        for(u32 x = 0; x < grid; x++)
+        {
+            u32 corner = z * side + x;
+            *index++ = corner;
+            *index++ = corner + side;
+            *index++ = corner + 1;
+            *index++ = corner + 1;
+            *index++ = corner + side;
+            *index++ = corner + side + 1;
+        }
+    }
+    
+    return result;
+}
+
+// NOTE: Every eight triangles twice the size of the ones before, binned SAH can
+// only cut off the last few per level, so the tree ends up a lot deeper than the
+// triangle count would suggest.
+static Mesh
+test_strip(u32 count)
+{
+    Mesh result = {};
+    result.vertices_len = count * 3;
+    result.indices_len = count * 3;
+    result.vertices.positions = (Vec3 *)malloc(result.vertices_len * sizeof(Vec3));
+    result.indices = (u32 *)malloc(result.indices_len * sizeof(u32));
+    
+    for(u32 i = 0; i < count; i++)
+    {
+        f32 x = exp2f(i / 8.0f);
+        result.vertices.positions[3 * i + 0] = Vec3(x, 0.0f, 0.0f);
+        result.vertices.positions[3 * i + 1] = Vec3(x * 1.05f, 0.0f, 0.0f);
+        result.vertices.positions[3 * i + 2] = Vec3(x, 1.0f, 0.0f);
+        result.indices[3 * i + 0] = 3 * i + 0;
+        result.indices[3 * i + 1] = 3 * i + 1;
+        result.indices[3 * i + 2] = 3 * i + 2;
+    }
+    
+    return result;
+}
+
+static void
+test_mesh_free(Mesh *mesh)
+{
+    mesh_bvh_destroy(mesh->bvh);
+    free(mesh->vertices.positions);
+    free(mesh->indices);
+}
+
+static bool
+brute_force_intersect(Mesh *mesh, Vec3 ray_origin, Vec3 ray_direction, RayHit *hit)
+{
+    bool result = false;
+    for(u32 i = 0; i + 2 < mesh->indices_len; i += 3)
+    {
+        Vec3 v0 = mesh->vertices.positions[mesh->indices[i + 0]];
+        Vec3 v1 = mesh->vertices.positions[mesh->indices[i + 1]];
+        Vec3 v2 = mesh->vertices.positions[mesh->indices[i + 2]];
+        if(ray_intersect_triangle(ray_origin, ray_direction, v0, sub(v1, v0), sub(v2, v0), &hit->t, &hit->u, &hit->v))
+        {
+            hit->triangle = i / 3;
+            result = true;
+        }
+    }
+    
+    return result;
+}
+
+// NOTE: Different triangles with the same t are a ray going through a shared edge
+static bool
+test_hits_match(bool hit0, RayHit *a, bool hit1, RayHit *b)
+{
+    if(hit0 != hit1)
+    {
+        return false;
+    }
+    
+    return !hit0 || fabsf(a->t - b->t) <= TEST_MAX_ERROR * MAX(1.0f, b->t);
+}
+
+// NOTE: From somewhere above the heightfield at a random point on it, a few go
+// off into the sky and miss
+static void
+test_random_ray(RandomSeries *series, Vec3 *origin, Vec3 *direction)
+{
+    *origin = Vec3(random_bilateral(series) * 48.0f, 10.0f + random_unilateral(series) * 30.0f,
+                   random_bilateral(series) * 48.0f);
+    Vec3 target = Vec3(random_bilateral(series) * 32.0f, random_bilateral(series) * 8.0f - 2.0f,
+                       random_bilateral(series) * 32.0f);
+    *direction = noz(sub(target, *origin));
+}
+
+static bool
+test_mesh_bvh(Mesh *mesh)
+{
+    RandomSeries series = { 31337 };
+    u32 failed = 0;
+    u32 hits = 0;
+    for(u32 i = 0; i < TEST_RAYS; i++)
+    {
+        Vec3 origin, direction;
+        test_random_ray(&series, &origin, &direction);
+        
+        RayHit bvh_hit = {};
+        bvh_hit.t = F32MAX;
+        RayHit reference = {};
+        reference.t = F32MAX;
+        bool hit = mesh_bvh_intersect(mesh->bvh, origin, direction, &bvh_hit);
+        bool reference_hit = brute_force_intersect(mesh, origin, direction, &reference);
+        failed += !test_hits_match(hit, &bvh_hit, reference_hit, &reference);
+        hits += reference_hit;
+    }
+    
+    printf("mesh_bvh_intersect    %u triangles, depth %u, %u of %u rays hit, %u differ\n",
+           mesh->bvh->triangles_len, mesh->bvh->depth, hits, TEST_RAYS, failed);
+    return failed == 0;
+}
+
+// NOTE: Two meshes, the heightfield and a copy of it turned over and lifted, under
+// a rotated and scaled entity. The reference takes the ray into model space the same
+// way and goes through both meshes triangle by triangle.
+static bool
+test_entity(Mesh *heightfield)
+{
+    Mesh meshes[2] = {};
+    meshes[0] = *heightfield;
+    meshes[1] = test_heightfield(64);
+    for(u32 i = 0; i < meshes[1].vertices_len; i++)
+    {
+        Vec3 *p = meshes[1].vertices.positions + i;
+        *p = Vec3(p->x * 0.5f, 12.0f - p->y, p->z * 0.5f);
+    }
+    meshes[1].bvh = mesh_bvh_build(meshes + 1);
+    
+    Hitbox hitboxes[2];
+    for(u32 m = 0; m < 2; m++)
+    {
+        Vec3 min = Vec3(F32MAX, F32MAX, F32MAX);
+        Vec3 max = Vec3(-F32MAX, -F32MAX, -F32MAX);
+        for(u32 i = 0; i < meshes[m].vertices_len; i++)
+        {
+            for(u32 a = 0; a < 3; a++)
+            {
+                min.m[a] = MIN(min.m[a], meshes[m].vertices.positions[i].m[a]);
+                max.m[a] = MAX(max.m[a], meshes[m].vertices.positions[i].m[a]);
+            }
+        }
+        hitboxes[m].refpoint = min;
+        hitboxes[m].size = sub(max, min);
+    }
+    
+    Model model = {};
+    model.meshes = meshes;
+    model.meshes_len = 2;
+    model.hitboxes = hitboxes;
+    model.hitboxes_len = 2;
+    
+    Entity entity = {};
+    entity.position = Vec3(3.0f, -1.0f, 2.0f);
+    entity.size = Vec3(0.5f, 0.8f, 0.5f);
+    entity.rotate = create_qrot(to_radians(30.0f), noz(Vec3(0.2f, 1.0f, 0.1f)));
+    entity.model = &model;
+    entity.flags = ENTITY_FLAGS_TRANSFORM_DIRTY;
+    entity_transform_update(&entity);
+    
+    RandomSeries series = { 4242 };
+    u32 failed = 0;
+    u32 hits = 0;
+    for(u32 i = 0; i < TEST_RAYS; i++)
+    {
+        Vec3 origin, direction;
+        test_random_ray(&series, &origin, &direction);
+        
+        RayHit hit = {};
+        hit.t = F32MAX;
+        bool entity_hit = ray_intersect_entity(origin, direction, &entity, &hit);
+        
+        Vec3 local_origin = mul(entity.inversed, origin);
+        Vec4 local_direction = mul(entity.inversed, Vec4(direction, 0.0f));
+        RayHit reference = {};
+        reference.t = F32MAX;
+        bool reference_hit = false;
+        for(u32 m = 0; m < 2; m++)
+        {
+            if(brute_force_intersect(meshes + m, local_origin,
+                                     Vec3(local_direction.x, local_direction.y, local_direction.z), &reference))
+            {
+                reference.mesh = m;
+                reference_hit = true;
+            }
+        }
+        
+        bool match = test_hits_match(entity_hit, &hit, reference_hit, &reference);
+        failed += !match || (entity_hit && hit.mesh != reference.mesh);
+        hits += reference_hit;
+    }
+    
+    printf("ray_intersect_entity  %u of %u rays hit, %u differ\n", hits, TEST_RAYS, failed);
+    test_mesh_free(meshes + 1);
+    return failed == 0;
+}
+
+static bool
+test_deep_strip()
+{
+    Mesh strip = test_strip(TEST_STRIP);
+    strip.bvh = mesh_bvh_build(&strip);
+    bool ok = 3 * strip.bvh->depth + 1 <= MESH_BVH_STACK_SIZE;
+    
+    RandomSeries series = { 99 };
+    u32 failed = 0;
+    for(u32 i = 0; i < TEST_RAYS; i++)
+    {
+        // NOTE: Straight down onto a random triangle of the strip
+        u32 triangle = (u32)(random_unilateral(&series) * (TEST_STRIP - 1));
+        f32 x = exp2f(triangle / 8.0f) * (1.0f + random_unilateral(&series) * 0.02f);
+        Vec3 origin = Vec3(x, 0.2f, 1.0f);
+        Vec3 direction = Vec3(0.0f, 0.0f, -1.0f);
+        
+        RayHit hit = {};
+        hit.t = F32MAX;
+        RayHit reference = {};
+        reference.t = F32MAX;
+        bool bvh_hit = mesh_bvh_intersect(strip.bvh, origin, direction, &hit);
+        bool reference_hit = brute_force_intersect(&strip, origin, direction, &reference);
+        failed += !test_hits_match(bvh_hit, &hit, reference_hit, &reference);
+    }
+    
+    printf("deep strip            %u triangles, depth %u (stack %u), %u of %u rays differ\n",
+           strip.bvh->triangles_len, strip.bvh->depth, MESH_BVH_STACK_SIZE, failed, TEST_RAYS);
+    test_mesh_free(&strip);
+    return ok && failed == 0;
+}
+
+// NOTE: So the loops can't be thrown away
+static volatile u32 bench_sink;
+
+static void
+bench()
+{
+    Mesh mesh = test_heightfield(BENCH_GRID);
+    f64 start = glfwGetTime();
+    mesh.bvh = mesh_bvh_build(&mesh);
+    f64 build = glfwGetTime() - start;
+    
+    RandomSeries series = { 5 };
+    Vec3 origins[BENCH_RAYS];
+    Vec3 directions[BENCH_RAYS];
+    for(u32 i = 0; i < BENCH_RAYS; i++)
+    {
+        test_random_ray(&series, origins + i, directions + i);
+    }
+    
+    u32 sum = 0;
+    start = glfwGetTime();
+    for(u32 i = 0; i < BENCH_RAYS; i++)
+    {
+        RayHit hit = {};
+        hit.t = F32MAX;
+        mesh_bvh_intersect(mesh.bvh, origins[i], directions[i], &hit);
+        sum += hit.triangle;
+    }
+    f64 bvh = (glfwGetTime() - start) / BENCH_RAYS;
+    
+    start = glfwGetTime();
+    for(u32 i = 0; i < BENCH_RAYS; i++)
+    {
+        RayHit hit = {};
+        hit.t = F32MAX;
+        brute_force_intersect(&mesh, origins[i], directions[i], &hit);
+        sum -= hit.triangle;
+    }
+    f64 brute = (glfwGetTime() - start) / BENCH_RAYS;
+    
+    printf("bench                 %u triangles, build %.3f s\n", mesh.bvh->triangles_len, build);
+    printf("mesh_bvh_intersect    %.3f us per ray\n", bvh * 1e6);
+    printf("brute force           %.3f ms per ray\n", brute * 1e3);
+    bench_sink = sum;
+    test_mesh_free(&mesh);
+}
+
+int main(int argc, char **argv)
+{
+    Mesh heightfield = test_heightfield(TEST_GRID);
+    heightfield.bvh = mesh_bvh_build(&heightfield);
+    
+    bool ok = true;
+    ok = test_mesh_bvh(&heightfield) && ok;
+    ok = test_entity(&heightfield) && ok;
+    ok = test_deep_strip() && ok;
+    test_mesh_free(&heightfield);
+    
+    if(argc > 1 && strcmp(argv[1], "bench") == 0)
+    {
+        bench();
+    }
+    
+    printf("%s\n", ok ? "OK" : "FAILED");
+    return ok ? 0 : 1;
+}
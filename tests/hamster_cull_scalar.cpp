@@ -0,0 +1,60 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <ctime>
+#include <cstdarg>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <x86intrin.h>
+
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+
+#include <libs/imgui/imgui.h>
+#include <libs/imgui/imgui_impl_glfw.h>
+#include <libs/imgui/imgui_impl_opengl3.h>
+
+#include "libs/stb/stb_image.h"
+
+// NOTE: The whole engine like hamster.cpp has it, minus main
+#include "src/hamster_math.h"
+#include "src/hamster_util.h"
+#include "src/hamster_jobs.h"
+#include "src/hamster_transform.h"
+#include "src/hamster_graphics.h"
+#include "src/hamster_scene.h"
+#include "src/hamster_cull.h"
+#include "src/hamster_occlusion.h"
+#include "src/hamster_bvh.h"
+#include "src/hamster_broadphase.h"
+#include "src/hamster_bake.h"
+#include "src/hamster_render.h"
+#include "src/hamster.h"
+
+// NOTE: The engine once more with the AVX2 paths switched off, so the cull test
+// compares against the scalar code the engine falls back to and not a copy of it.
+#undef __AVX2__
+
+#include "src/hamster_math.cpp"
+#include "src/hamster_util.cpp"
+#include "src/hamster_jobs.cpp"
+#include "src/hamster_transform.cpp"
+#include "src/hamster_graphics.cpp"
+#include "src/hamster_scene.cpp"
+#include "src/hamster_cull.cpp"
+#include "src/hamster_occlusion.cpp"
+#include "src/hamster_bvh.cpp"
+#include "src/hamster_broadphase.cpp"
+#include "src/hamster_bake.cpp"
+#include "src/hamster_render.cpp"
+
+void
+scalar_cull_job(CullSet *set, u32 first, u32 one_past_last)
+{
+    cull_job(set, first, one_past_last);
+}
@@ -0,0 +1,246 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <ctime>
+#include <cstdarg>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <x86intrin.h>
+
+#include <GL/glew.h>
+#include <GLFW/glfw3.h>
+
+#include <libs/imgui/imgui.h>
+#include <libs/imgui/imgui_impl_glfw.h>
+#include <libs/imgui/imgui_impl_opengl3.h>
+
+#include "libs/stb/stb_image.h"
+
+// NOTE: The whole engine like hamster.cpp has it, minus main. Nothing in here
+// touches GL, the meshes are filled in by hand and never uploaded.
+#include "src/hamster_math.h"
+#include "src/hamster_util.h"
+#include "src/hamster_jobs.h"
+#include "src/hamster_transform.h"
+#include "src/hamster_graphics.h"
+#include "src/hamster_scene.h"
+#include "src/hamster_cull.h"
+#include "src/hamster_occlusion.h"
+#include "src/hamster_bvh.h"
+#include "src/hamster_broadphase.h"
+#include "src/hamster_bake.h"
+#include "src/hamster_render.h"
+#include "src/hamster.h"
+
+#include "src/hamster_math.cpp"
+#include "src/hamster_util.cpp"
+#include "src/hamster_jobs.cpp"
+#include "src/hamster_transform.cpp"
+#include "src/hamster_graphics.cpp"
+#include "src/hamster_scene.cpp"
+#include "src/hamster_cull.cpp"
+#include "src/hamster_occlusion.cpp"
+#include "src/hamster_bvh.cpp"
+#include "src/hamster_broadphase.cpp"
+#include "src/hamster_bake.cpp"
+#include "src/hamster_render.cpp"
+
+// NOTE: Checks mesh_bvh_intersect and ray_intersect_entity against every triangle
+// NOTE: Checks the AVX2 cull kernel against the scalar one from
+// tests/hamster_cull_scalar.cpp on random bounds, built with `make test`. Pass
+// "bench" (and optionally a thread count) to time both on 1M bounds.
+
+#define TEST_COUNT 100003 // NOTE: Not a multiple of CULL_LANES, so the padding gets tested too
+#define BENCH_COUNT 1000000
+#define BENCH_ROUNDS 20
+// NOTE: The kernels only differ in fused multiply adds, a bound this close to a
+// plane can come out on either side of it
+#define TEST_BORDERLINE 1e-4
+
+void scalar_cull_job(CullSet *set, u32 first, u32 one_past_last);
+
+static Vec3
+test_random_vec3(RandomSeries *series, f32 scale)
+{
+    return Vec3(random_bilateral(series) * scale, random_bilateral(series) * scale, random_bilateral(series) * scale);
+}
+
+// NOTE: Mostly oriented boxes with their sphere, some plain spheres and a few of the
+// unbounded meshes cull_push_model makes, all around a camera at the origin
+static void
+test_fill(CullSet *set, u32 count, RandomSeries *series)
+{
+    cull_reset(set);
+    cull_reserve(set, count);
+    for(u32 i = 0; i < count; i++)
+    {
+        Vec3 center = test_random_vec3(series, 120.0f);
+        u32 kind = i % 16;
+        if(kind == 0)
+        {
+            cull_push_sphere(set, center, 0.1f + random_unilateral(series) * 4.0f);
+        }
+        else if(kind == 1 && i % 1024 == 1)
+        {
+            cull_push_sphere(set, Vec3(0.0f, 0.0f, 0.0f), F32MAX);
+        }
+        else
+        {
+            Mat4 rotation = rotate_from_quat(create_qrot(random_bilateral(series) * 3.0f,
+                                                         noz(add(test_random_vec3(series, 1.0f), Vec3(0.0f, 0.0f, 1.5f)))));
+            Vec3 half_size = Vec3(0.1f + random_unilateral(series) * 3.0f, 0.1f + random_unilateral(series) * 0.5f,
+                                  0.1f + random_unilateral(series) * 6.0f);
+            Vec3 axes[3];
+            for(u32 a = 0; a < 3; a++)
+            {
+                Vec4 column = rotation.columns[a];
+                axes[a] = scale(Vec3(column.x, column.y, column.z), half_size.m[a]);
+            }
+            cull_push(set, center, len(half_size), axes);
+        }
+    }
+}
+
+static void
+test_planes(CullSet *set)
+{
+    Mat4 view = look_at(Vec3(0.3f, 0.1f, -1.0f), Vec3(0.0f, 0.0f, 0.0f), Vec3(0.0f, 1.0f, 0.0f));
+    frustum_planes_from_matrix(mul(create_perspective(16.0f / 9.0f, 90.0f, 0.1f, 100.0f), view),
+                               set->planes[CullView_Main]);
+    
+    Mat4 sun = look_at(Vec3(0.0f, 0.0f, 0.0f), Vec3(20.0f, 60.0f, 10.0f), Vec3(0.0f, 1.0f, 0.0f));
+    frustum_planes_from_matrix(mul(create_orthographic(-60.0f, 60.0f, -60.0f, 60.0f, 1.0f, 150.0f), sun),
+                               set->planes[CullView_Shadow]);
+}
+
+// NOTE: How far inside of the closest plane the sphere or box reaches, in doubles
+static f64
+test_margin(CullSet *set, CullView view, u32 i)
+{
+    f64 result = 1e30;
+    for(u32 p = 0; p < FrustumPlane_ElementCount; p++)
+    {
+        Plane *plane = set->planes[view] + p;
+        f64 distance = (f64)plane->normal.x * set->x[i] + (f64)plane->normal.y * set->y[i] +
+            (f64)plane->normal.z * set->z[i] + plane->d;
+        f64 reach = 0.0;
+        for(u32 a = 0; a < 3; a++)
+        {
+            reach += fabs((f64)plane->normal.x * set->axis_x[a][i] + (f64)plane->normal.y * set->axis_y[a][i] +
+                          (f64)plane->normal.z * set->axis_z[a][i]);
+        }
+        result = MIN(result, fabs(distance + set->radius[i]));
+        result = MIN(result, fabs(distance + reach));
+    }
+    
+    return result;
+}
+
+static bool
+test_cull(JobQueue *jobs)
+{
+    CullSet set = cull_create(16);
+    RandomSeries series = { 1 };
+    test_fill(&set, TEST_COUNT, &series);
+    test_planes(&set);
+    
+    cull_run(&set, jobs);
+    u32 blocks = (set.count + CULL_LANES - 1) / CULL_LANES;
+    u8 *wide[CullView_Count];
+    u32 wide_box_culled[CullView_Count];
+    for(u32 view = 0; view < CullView_Count; view++)
+    {
+        wide[view] = (u8 *)malloc(blocks);
+        memcpy(wide[view], set.masks[view], blocks);
+        wide_box_culled[view] = set.box_culled_counts[view];
+        set.box_culled_counts[view] = 0;
+    }
+    scalar_cull_job(&set, 0, blocks);
+    
+    bool ok = true;
+    const char *names[] = { "main", "shadow" };
+    for(u32 view = 0; view < CullView_Count; view++)
+    {
+        u32 differ = 0;
+        u32 borderline = 0;
+        u32 visible = 0;
+        for(u32 i = 0; i < blocks * CULL_LANES; i++)
+        {
+            u32 a = (wide[view][i / CULL_LANES] >> (i % CULL_LANES)) & 1;
+            u32 b = (set.masks[view][i / CULL_LANES] >> (i % CULL_LANES)) & 1;
+            visible += b;
+            if(a != b)
+            {
+                bool close = i < set.count && test_margin(&set, (CullView)view, i) < TEST_BORDERLINE;
+                borderline += close;
+                differ += !close;
+            }
+        }
+        
+        // NOTE: The padding never passes
+        for(u32 i = set.count; i < blocks * CULL_LANES; i++)
+        {
+            differ += (wide[view][i / CULL_LANES] >> (i % CULL_LANES)) & 1;
+        }
+        
+        printf("%-7s %u bounds, %u visible, %u box culled (scalar %u), %u differ, %u borderline\n", names[view],
+               set.count, visible, wide_box_culled[view], set.box_culled_counts[view], differ, borderline);
+        ok = ok && differ == 0 && wide_box_culled[view] + borderline >= set.box_culled_counts[view] &&
+            set.box_culled_counts[view] + borderline >= wide_box_culled[view] && visible < set.count;
+        free(wide[view]);
+    }
+    
+    cull_destroy(&set);
+    return ok;
+}
+
+static void
+bench(JobQueue *jobs)
+{
+    CullSet set = cull_create(16);
+    RandomSeries series = { 2 };
+    test_fill(&set, BENCH_COUNT, &series);
+    test_planes(&set);
+    
+    f64 wide = 1e9;
+    f64 scalar = 1e9;
+    u32 blocks = (set.count + CULL_LANES - 1) / CULL_LANES;
+    for(u32 round = 0; round < BENCH_ROUNDS; round++)
+    {
+        cull_run(&set, jobs);
+        wide = MIN(wide, set.last_run_time);
+        
+        f64 start = glfwGetTime();
+        scalar_cull_job(&set, 0, blocks);
+        scalar = MIN(scalar, glfwGetTime() - start);
+    }
+    
+    printf("bench   %u bounds, both views\n", set.count);
+    printf("cull_run          %.3f ms\n", wide * 1e3);
+    printf("scalar, 1 thread  %.3f ms\n", scalar * 1e3);
+    cull_destroy(&set);
+}
+
+int main(int argc, char **argv)
+{
+    bool run_bench = argc > 1 && strcmp(argv[1], "bench") == 0;
+    
+    JobQueue jobs;
+    jobs_init(&jobs, run_bench && argc > 2 ? atoi(argv[2]) : 0);
+    
+    bool ok = test_cull(&jobs);
+    if(run_bench)
+    {
+        printf("threads %u\n", jobs.threads_count);
+        bench(&jobs);
+    }
+    
+    jobs_shutdown(&jobs);
+    printf("%s\n", ok ? "OK" : "FAILED");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,26 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+
+#include <x86intrin.h>
+
+#include "src/hamster_math.h"
+
+// NOTE: hamster_math.cpp once more with the SIMD paths switched off, so the tests
+// compare against the scalar code the engine falls back to and not a copy of it.
+#undef __AVX__
+#undef __SSE2__
+#include "src/hamster_math.cpp"
+
+Mat4
+scalar_mul(Mat4 a, Mat4 b)
+{
+    return mul(a, b);
+}
+
+Mat4
+scalar_inverse(Mat4 a)
+{
+    return inverse(a);
+}
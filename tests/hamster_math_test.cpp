@@ -0,0 +1,204 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <ctime>
+
+#include <x86intrin.h>
+
+#include "src/hamster_math.h"
+
+#include "src/hamster_math.cpp"
+
+// NOTE: Checks the SIMD paths of hamster_math.cpp against its scalar ones, built
+// with `make test`. Pass "bench" to also time both per call.
+
+#define TEST_COUNT 100000
+#define BENCH_COUNT 1024
+#define BENCH_ROUNDS 2000
+
+Mat4 scalar_mul(Mat4 a, Mat4 b);
+Mat4 scalar_inverse(Mat4 a);
+
+// NOTE: The SIMD versions behind a call as well, so the benchmark doesn't compare
+// inlined code against calls into tests/hamster_math_scalar.cpp.
+static __attribute__((noinline)) Mat4
+simd_mul(Mat4 a, Mat4 b)
+{
+    return mul(a, b);
+}
+
+static __attribute__((noinline)) Mat4
+simd_inverse(Mat4 a)
+{
+    return inverse(a);
+}
+
+static f64
+test_time()
+{
+    timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static u32
+test_ulps(f32 a, f32 b)
+{
+    i32 ia, ib;
+    memcpy(&ia, &a, sizeof(ia));
+    memcpy(&ib, &b, sizeof(ib));
+    
+    // NOTE: Make the integers ordered like the floats, -0 and +0 end up the same
+    ia = ia < 0 ? (i32)(0x80000000u - (u32)ia) : ia;
+    ib = ib < 0 ? (i32)(0x80000000u - (u32)ib) : ib;
+    
+    i64 distance = (i64)ia - (i64)ib;
+    return (u32)(distance < 0 ? -distance : distance);
+}
+
+static bool
+test_identical(Mat4 a, Mat4 b)
+{
+    for(u32 i = 0; i < 16; i++)
+    {
+        if(test_ulps(a.a[i / 4][i % 4], b.a[i / 4][i % 4]) != 0)
+        {
+            return false;
+        }
+    }
+    
+    return true;
+}
+
+static Quat
+test_random_quat(RandomSeries *series)
+{
+    Quat result;
+    
+    result.w = random_bilateral(series);
+    result.v = Vec3(random_bilateral(series), random_bilateral(series), random_bilateral(series));
+    
+    return result;
+}
+
+static Mat4
+test_random_mat4(RandomSeries *series)
+{
+    Mat4 result;
+    
+    for(u32 i = 0; i < 16; i++)
+    {
+        result.a[i / 4][i % 4] = random_bilateral(series) * 10.0f;
+    }
+    
+    return result;
+}
+
+// NOTE: The kind of matrix entities end up with, translation times rotation times a
+// positive scale, so it is always invertible and reasonably conditioned.
+static Mat4
+test_random_transform(RandomSeries *series)
+{
+    Vec3 position = Vec3(random_bilateral(series), random_bilateral(series), random_bilateral(series));
+    Vec3 size = Vec3(0.5f + random_unilateral(series) * 1.5f, 0.5f + random_unilateral(series) * 1.5f,
+                     0.5f + random_unilateral(series) * 1.5f);
+    Quat rotate = test_random_quat(series);
+    
+    Mat4 result = rotate_from_quat(rotate);
+    result = mul(result, scale(Mat4(1.0f), size));
+    result = mul(translate(Mat4(1.0f), scale(position, 10.0f)), result);
+    
+    return result;
+}
+
+static bool
+test_mul()
+{
+    RandomSeries series = { 2137 };
+    u32 failed = 0;
+    
+    for(u32 i = 0; i < TEST_COUNT; i++)
+    {
+        Mat4 a = test_random_mat4(&series);
+        Mat4 b = test_random_mat4(&series);
+        failed += !test_identical(mul(a, b), scalar_mul(a, b));
+    }
+    
+    printf("mul(Mat4, Mat4)    %u of %u not bit identical\n", failed, TEST_COUNT);
+    return failed == 0;
+}
+
+static bool
+test_inverse()
+{
+    RandomSeries series = { 420 };
+    u32 failed = 0;
+    
+    for(u32 i = 0; i < TEST_COUNT; i++)
+    {
+        Mat4 m = test_random_transform(&series);
+        failed += !test_identical(inverse(m), scalar_inverse(m));
+    }
+    
+    printf("inverse            %u of %u not bit identical\n", failed, TEST_COUNT);
+    return failed == 0;
+}
+
+// NOTE: The results get summed into a volatile so the calls can't be thrown away
+static volatile f32 bench_sink;
+
+#define BENCH(name, call, scalar_call) \
+do \
+{ \
+    f64 times[2]; \
+    for(u32 pass = 0; pass < 2; pass++) \
+    { \
+        f32 sum = 0.0f; \
+        f64 start = test_time(); \
+        for(u32 round = 0; round < BENCH_ROUNDS; round++) \
+        { \
+            for(u32 i = 0; i < BENCH_COUNT; i++) \
+            { \
+                Mat4 r = pass ? scalar_call : call; \
+                sum += r.a[0][0]; \
+            } \
+        } \
+        times[pass] = (test_time() - start) * 1e9 / ((f64)BENCH_ROUNDS * BENCH_COUNT); \
+        bench_sink = sum; \
+    } \
+    printf("%-18s %6.2f ns  scalar %6.2f ns\n", name, times[0], times[1]); \
+} while(0)
+
+static void
+bench()
+{
+    RandomSeries series = { 7 };
+    Mat4 *matrices = (Mat4 *)malloc(sizeof(Mat4) * BENCH_COUNT);
+    for(u32 i = 0; i < BENCH_COUNT; i++)
+    {
+        matrices[i] = test_random_transform(&series);
+    }
+    
+    BENCH("mul(Mat4, Mat4)", simd_mul(matrices[i], matrices[(i + 1) % BENCH_COUNT]),
+          scalar_mul(matrices[i], matrices[(i + 1) % BENCH_COUNT]));
+    BENCH("inverse", simd_inverse(matrices[i]), scalar_inverse(matrices[i]));
+    
+    free(matrices);
+}
+
+int main(int argc, char **argv)
+{
+    bool ok = true;
+    
+    ok = test_mul() && ok;
+    ok = test_inverse() && ok;
+    
+    if(argc > 1 && strcmp(argv[1], "bench") == 0)
+    {
+        bench();
+    }
+    
+    printf("%s\n", ok ? "OK" : "FAILED");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,479 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <ctime>
+
+#include <unistd.h>
+#include <pthread.h>
+
+#include <x86intrin.h>
+
+// NOTE: The tree times its updates with this, no GLFW in here
+static double
+glfwGetTime()
+{
+    timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+#include "src/hamster_math.h"
+#include "src/hamster_jobs.h"
+#include "src/hamster_transform.h"
+
+#include "src/hamster_math.cpp"
+#include "src/hamster_jobs.cpp"
+#include "src/hamster_transform.cpp"
+
+// NOTE: Checks TransformTree against plain recursion over the same hierarchy and the
+// transform_* array functions against mul one point at a time, built with `make test`. Pass "bench" (and optionally a thread count) to time a full
+// update of the 101k node scene both ways, plus the partial and clean updates.
+
+#define TEST_ROOTS 1000
+#define TEST_CHILDREN 10
+#define TEST_GRANDCHILDREN 9
+#define TEST_NODES (TEST_ROOTS * (1 + TEST_CHILDREN * (1 + TEST_GRANDCHILDREN)))
+#define TEST_MAX_ERROR 1e-5f
+#define BENCH_ROUNDS 10
+// NOTE: Past TRANSFORM_MIN_BATCH so the *_batch versions go through the job queue
+#define TEST_BATCH_COUNT (2 * TRANSFORM_MIN_BATCH + 3)
+
+// NOTE: How a scene graph without the tree would do it, every node points at its
+// children and the update recurses from the roots.
+struct NaiveNode
+{
+    Vec3 position;
+    Quat rotation;
+    Vec3 size;
+    Mat4 world;
+    u32 *children;
+    u32 children_len;
+};
+
+struct NaiveScene
+{
+    NaiveNode *nodes; // NOTE: By tree node, 0 is the root
+    u32 *parent;
+    u32 count;
+};
+
+static void
+naive_update(NaiveScene *scene, u32 node, Mat4 parent_world)
+{
+    NaiveNode *n = scene->nodes + node;
+    n->world = mul(parent_world, transform_compose(n->position, n->rotation, n->size));
+    for(u32 i = 0; i < n->children_len; i++)
+    {
+        naive_update(scene, n->children[i], n->world);
+    }
+}
+
+static void
+naive_update_all(NaiveScene *scene)
+{
+    NaiveNode *root = scene->nodes + TRANSFORM_TREE_ROOT;
+    for(u32 i = 0; i < root->children_len; i++)
+    {
+        naive_update(scene, root->children[i], Mat4(1.0f));
+    }
+}
+
+static void
+naive_add_child(NaiveScene *scene, u32 parent, u32 node)
+{
+    NaiveNode *p = scene->nodes + parent;
+    p->children = (u32 *)realloc(p->children, (p->children_len + 1) * sizeof(u32));
+    p->children[p->children_len++] = node;
+    scene->parent[node] = parent;
+}
+
+static void
+naive_remove_child(NaiveScene *scene, u32 parent, u32 node)
+{
+    NaiveNode *p = scene->nodes + parent;
+    for(u32 i = 0; i < p->children_len; i++)
+    {
+        if(p->children[i] == node)
+        {
+            p->children[i] = p->children[--p->children_len];
+            return;
+        }
+    }
+    assert(false);
+}
+
+static Vec3
+test_random_vec3(RandomSeries *series)
+{
+    return Vec3(random_bilateral(series), random_bilateral(series), random_bilateral(series));
+}
+
+static u32
+test_add(TransformTree *tree, NaiveScene *scene, RandomSeries *series, u32 parent)
+{
+    Vec3 position = scale(test_random_vec3(series), 2.0f);
+    Quat rotation = create_qrot(random_bilateral(series) * 3.0f, noz(add(test_random_vec3(series), Vec3(0.0f, 2.0f, 0.0f))));
+    Vec3 size = add(Vec3(1.0f, 1.0f, 1.0f), scale(test_random_vec3(series), 0.1f));
+    
+    u32 node = transform_tree_add(tree, parent, position, rotation, size);
+    assert(node < scene->count);
+    
+    NaiveNode *n = scene->nodes + node;
+    n->position = position;
+    n->rotation = rotation;
+    n->size = size;
+    naive_add_child(scene, parent, node);
+    
+    return node;
+}
+
+// NOTE: Added depth first like a scene would be, so the tree has to sort it
+static void
+test_build(TransformTree *tree, NaiveScene *scene, u32 *roots)
+{
+    RandomSeries series = { 77 };
+    for(u32 r = 0; r < TEST_ROOTS; r++)
+    {
+        roots[r] = test_add(tree, scene, &series, TRANSFORM_TREE_ROOT);
+        for(u32 c = 0; c < TEST_CHILDREN; c++)
+        {
+            u32 child = test_add(tree, scene, &series, roots[r]);
+            for(u32 g = 0; g < TEST_GRANDCHILDREN; g++)
+            {
+                test_add(tree, scene, &series, child);
+            }
+        }
+    }
+}
+
+static f32
+test_max_error(TransformTree *tree, NaiveScene *scene)
+{
+    f32 result = 0.0f;
+    for(u32 node = 1; node < scene->count; node++)
+    {
+        Mat4 a = transform_tree_world(tree, node);
+        Mat4 b = scene->nodes[node].world;
+        for(u32 i = 0; i < 16; i++)
+        {
+            result = MAX(result, fabsf(a.a1d[i] - b.a1d[i]) / (1.0f + fabsf(b.a1d[i])));
+        }
+    }
+    
+    return result;
+}
+
+static bool
+test_tree(TransformTree *tree, NaiveScene *scene, u32 *roots, JobQueue *jobs)
+{
+    bool ok = true;
+    
+    transform_tree_update(tree, jobs);
+    naive_update_all(scene);
+    f32 error = test_max_error(tree, scene);
+    printf("build              %u nodes, %u levels, max relative error %g\n", tree->count, tree->levels_len, error);
+    ok = ok && error <= TEST_MAX_ERROR;
+    
+    // NOTE: Move a few grandchildren under other roots, which makes them children,
+    // and a root under a grandchild of another root, which makes its subtree deeper
+    RandomSeries series = { 1234 };
+    for(u32 i = 0; i < 64; i++)
+    {
+        u32 node = roots[i] + 2 + (u32)(random_unilateral(&series) * (TEST_GRANDCHILDREN - 1));
+        u32 parent = roots[TEST_ROOTS - 1 - i];
+        transform_tree_set_parent(tree, node, parent);
+        naive_remove_child(scene, scene->parent[node], node);
+        naive_add_child(scene, parent, node);
+    }
+    transform_tree_set_parent(tree, roots[1], roots[0] + 2);
+    naive_remove_child(scene, TRANSFORM_TREE_ROOT, roots[1]);
+    naive_add_child(scene, roots[0] + 2, roots[1]);
+    
+    for(u32 i = 0; i < 256; i++)
+    {
+        u32 node = 1 + (u32)(random_unilateral(&series) * (scene->count - 2));
+        NaiveNode *n = scene->nodes + node;
+        n->position = add(n->position, Vec3(0.5f, 0.0f, 0.0f));
+        transform_tree_set_local(tree, node, n->position, n->rotation, n->size);
+    }
+    
+    transform_tree_update(tree, jobs);
+    naive_update_all(scene);
+    
+    u32 bad = 0;
+    for(u32 slot = 1; slot < tree->count; slot++)
+    {
+        bad += tree->parent[slot] >= slot;
+        bad += tree->parent[slot] < tree->parent[slot - 1];
+        bad += slot - tree->children_first[tree->parent[slot]] >= tree->children_len[tree->parent[slot]];
+        bad += tree->depth[slot] != tree->depth[tree->parent[slot]] + 1;
+        bad += tree->slot_of[tree->node_of[slot]] != slot;
+        bad += tree->node_of[tree->parent[slot]] != scene->parent[tree->node_of[slot]];
+    }
+    error = test_max_error(tree, scene);
+    printf("reparent and move  %u levels, %u bad slots, max relative error %g\n", tree->levels_len, bad, error);
+    ok = ok && bad == 0 && error <= TEST_MAX_ERROR;
+    
+    // NOTE: Without reparenting the update only visits the moved subtrees, until a
+    // level has too many of them and the rest goes level by level. Every node under
+    // a moved one has to be flagged changed and nothing else.
+    u8 *moved = (u8 *)calloc(scene->count, sizeof(u8));
+    u32 moved_roots[] = { 100, 500 };
+    for(u32 round = 0; round < sizeof(moved_roots) / sizeof(moved_roots[0]); round++)
+    {
+        memset(moved, 0, scene->count * sizeof(u8));
+        for(u32 i = 0; i < moved_roots[round]; i++)
+        {
+            u32 node = roots[(i * 7) % TEST_ROOTS];
+            if(i % 10 == 9)
+            {
+                node += 2 + (u32)(random_unilateral(&series) * (TEST_GRANDCHILDREN - 1));
+            }
+            NaiveNode *n = scene->nodes + node;
+            n->rotation = mul(n->rotation, create_qrot(0.1f, Vec3(0.0f, 1.0f, 0.0f)));
+            transform_tree_set_local(tree, node, n->position, n->rotation, n->size);
+            moved[node] = 1;
+        }
+        
+        transform_tree_update(tree, jobs);
+        naive_update_all(scene);
+        
+        bad = 0;
+        u32 changed = 0;
+        for(u32 node = 1; node < scene->count; node++)
+        {
+            bool under_moved = false;
+            for(u32 at = node; at != TRANSFORM_TREE_ROOT && !under_moved; at = scene->parent[at])
+            {
+                under_moved = moved[at];
+            }
+            bad += under_moved != transform_tree_changed(tree, node);
+            changed += under_moved;
+        }
+        error = test_max_error(tree, scene);
+        printf("move %3u roots     %u changed, %u visited, %u wrong flags, max relative error %g\n",
+               moved_roots[round], changed, tree->last_visited, bad, error);
+        ok = ok && bad == 0 && error <= TEST_MAX_ERROR && tree->last_visited < tree->count;
+    }
+    free(moved);
+    
+    transform_tree_update(tree, jobs);
+    printf("clean              %u visited\n", tree->last_visited);
+    ok = ok && tree->last_visited == 0;
+    
+    return ok;
+}
+
+// NOTE: Relative to the size of the result, the wide paths use fused multiply adds
+static f32
+test_array_error(Vec3Array out, u32 index, Vec4 reference)
+{
+    f32 result = 0.0f;
+    for(u32 a = 0; a < 3; a++)
+    {
+        f32 *component = a == 0 ? out.x : a == 1 ? out.y : out.z;
+        result = MAX(result, fabsf(component[index] - reference.m[a]) / (1.0f + fabsf(reference.m[a])));
+    }
+    
+    return result;
+}
+
+// NOTE: Nothing past count may get written, the slots after it hold NaN
+static bool
+test_array_untouched(Vec3Array out, u32 count)
+{
+    bool result = true;
+    for(u32 i = count; i < count + TRANSFORM_LANES; i++)
+    {
+        result = result && out.x[i] != out.x[i] && out.y[i] != out.y[i] && out.z[i] != out.z[i];
+    }
+    
+    return result;
+}
+
+static void
+test_array_poison(Vec3Array out, u32 count)
+{
+    for(u32 i = 0; i < count + TRANSFORM_LANES; i++)
+    {
+        out.x[i] = out.y[i] = out.z[i] = NAN;
+    }
+}
+
+// NOTE: Every count is run through the AoS and SoA points and directions, the boxes
+// and both batch versions, with the counts around the eight lanes of the wide loop
+static bool
+test_transform_arrays(JobQueue *jobs)
+{
+    u32 counts[] = { 0, 1, 7, 9, 1000, TEST_BATCH_COUNT };
+    u32 capacity = TEST_BATCH_COUNT + TRANSFORM_LANES;
+    Vec3 *points = (Vec3 *)malloc(capacity * sizeof(Vec3));
+    Vec3Array soa = vec3_array_create(capacity);
+    Vec3Array soa_max = vec3_array_create(capacity);
+    Vec3Array out = vec3_array_create(capacity);
+    Vec3Array out_max = vec3_array_create(capacity);
+    
+    RandomSeries series = { 99 };
+    for(u32 i = 0; i < capacity; i++)
+    {
+        points[i] = scale(test_random_vec3(&series), 10.0f);
+        soa.x[i] = points[i].x;
+        soa.y[i] = points[i].y;
+        soa.z[i] = points[i].z;
+        Vec3 size = Vec3(0.1f + 3.0f * random_unilateral(&series), 0.1f + 3.0f * random_unilateral(&series),
+                         0.1f + 3.0f * random_unilateral(&series));
+        soa_max.x[i] = soa.x[i] + size.x;
+        soa_max.y[i] = soa.y[i] + size.y;
+        soa_max.z[i] = soa.z[i] + size.z;
+    }
+    Mat4 transform = transform_compose(Vec3(3.0f, -7.0f, 11.0f), create_qrot(1.1f, noz(Vec3(0.3f, 1.0f, -0.4f))),
+                                       Vec3(2.0f, 0.5f, -1.5f));
+    
+    bool ok = true;
+    for(u32 c = 0; c < sizeof(counts) / sizeof(counts[0]); c++)
+    {
+        u32 count = counts[c];
+        f32 errors[7] = {};
+        bool untouched = true;
+        for(u32 kind = 0; kind < 6; kind++)
+        {
+            test_array_poison(out, count);
+            f32 w = kind & 1 ? 0.0f : 1.0f;
+            switch(kind)
+            {
+                case 0: transform_points(transform, points, count, out); break;
+                case 1: transform_directions(transform, points, count, out); break;
+                case 2: transform_points(transform, soa, count, out); break;
+                case 3: transform_directions(transform, soa, count, out); break;
+                case 4: transform_points_batch(jobs, transform, points, count, out); break;
+                case 5: transform_directions_batch(jobs, transform, points, count, out); break;
+            }
+            for(u32 i = 0; i < count; i++)
+            {
+                errors[kind] = MAX(errors[kind], test_array_error(out, i, mul(transform, Vec4(points[i], w))));
+            }
+            untouched = untouched && test_array_untouched(out, count);
+        }
+        
+        // NOTE: The reference box is around all eight corners put through mul
+        test_array_poison(out, count);
+        test_array_poison(out_max, count);
+        transform_boxes(transform, soa, soa_max, count, out, out_max);
+        for(u32 i = 0; i < count; i++)
+        {
+            Vec4 min = Vec4(F32MAX, F32MAX, F32MAX, 1.0f);
+            Vec4 max = Vec4(-F32MAX, -F32MAX, -F32MAX, 1.0f);
+            for(u32 corner = 0; corner < 8; corner++)
+            {
+                Vec3 p = Vec3(corner & 1 ? soa_max.x[i] : soa.x[i], corner & 2 ? soa_max.y[i] : soa.y[i],
+                              corner & 4 ? soa_max.z[i] : soa.z[i]);
+                Vec4 world = mul(transform, Vec4(p, 1.0f));
+                for(u32 a = 0; a < 3; a++)
+                {
+                    min.m[a] = MIN(min.m[a], world.m[a]);
+                    max.m[a] = MAX(max.m[a], world.m[a]);
+                }
+            }
+            errors[6] = MAX(errors[6], MAX(test_array_error(out, i, min), test_array_error(out_max, i, max)));
+        }
+        untouched = untouched && test_array_untouched(out, count) && test_array_untouched(out_max, count);
+        
+        f32 error = 0.0f;
+        for(u32 kind = 0; kind < 7; kind++)
+        {
+            error = MAX(error, errors[kind]);
+        }
+        printf("arrays of %-8u points %g/%g, SoA %g/%g, batch %g/%g, boxes %g, %s\n", count, errors[0],
+               errors[1], errors[2], errors[3], errors[4], errors[5], errors[6],
+               untouched ? "nothing past the end" : "WROTE PAST THE END");
+        ok = ok && untouched && error <= TEST_MAX_ERROR;
+    }
+    
+    free(points);
+    vec3_array_destroy(&soa);
+    vec3_array_destroy(&soa_max);
+    vec3_array_destroy(&out);
+    vec3_array_destroy(&out_max);
+    return ok;
+}
+
+static void
+bench(TransformTree *tree, NaiveScene *scene, u32 *roots, JobQueue *jobs)
+{
+    f64 naive = 1e9;
+    f64 all = 1e9;
+    f64 some = 1e9;
+    f64 clean = 1e9;
+    u32 some_visited = 0;
+    
+    for(u32 round = 0; round < BENCH_ROUNDS; round++)
+    {
+        f64 start = glfwGetTime();
+        naive_update_all(scene);
+        naive = MIN(naive, glfwGetTime() - start);
+        
+        for(u32 node = 1; node < scene->count; node++)
+        {
+            NaiveNode *n = scene->nodes + node;
+            transform_tree_set_local(tree, node, n->position, n->rotation, n->size);
+        }
+        transform_tree_update(tree, jobs);
+        all = MIN(all, tree->last_update_time);
+        
+        for(u32 r = 0; r < TEST_ROOTS; r += 10)
+        {
+            NaiveNode *n = scene->nodes + roots[r];
+            transform_tree_set_local(tree, roots[r], n->position, n->rotation, n->size);
+        }
+        transform_tree_update(tree, jobs);
+        some = MIN(some, tree->last_update_time);
+        some_visited = tree->last_visited;
+        
+        transform_tree_update(tree, jobs);
+        clean = MIN(clean, tree->last_update_time);
+    }
+    
+    printf("naive recursion    %.3f ms\n", naive * 1e3);
+    printf("tree, all dirty    %.3f ms\n", all * 1e3);
+    printf("tree, 100 roots    %.3f ms (%u slots visited)\n", some * 1e3, some_visited);
+    printf("tree, clean        %.4f ms\n", clean * 1e3);
+}
+
+int main(int argc, char **argv)
+{
+    bool run_bench = argc > 1 && strcmp(argv[1], "bench") == 0;
+    
+    JobQueue jobs;
+    jobs_init(&jobs, run_bench && argc > 2 ? atoi(argv[2]) : 0);
+    
+    TransformTree tree = transform_tree_create(16);
+    NaiveScene scene = {};
+    scene.count = TEST_NODES + 1;
+    scene.nodes = (NaiveNode *)calloc(scene.count, sizeof(NaiveNode));
+    scene.parent = (u32 *)calloc(scene.count, sizeof(u32));
+    u32 *roots = (u32 *)malloc(TEST_ROOTS * sizeof(u32));
+    
+    test_build(&tree, &scene, roots);
+    bool ok = test_tree(&tree, &scene, roots, &jobs);
+    ok = test_transform_arrays(&jobs) && ok;
+    
+    if(run_bench)
+    {
+        printf("threads            %u\n", jobs.threads_count);
+        bench(&tree, &scene, roots, &jobs);
+    }
+    
+    for(u32 i = 0; i < scene.count; i++)
+    {
+        free(scene.nodes[i].children);
+    }
+    free(scene.nodes);
+    free(scene.parent);
+    free(roots);
+    transform_tree_destroy(&tree);
+    jobs_shutdown(&jobs);
+    
+    printf("%s\n", ok ? "OK" : "FAILED");
+    return ok ? 0 : 1;
+}